@@ -189,6 +189,9 @@ struct hir_stmt {
 	/* RHS */
 	struct hir_expr *rhs;
 
+	/* Is a return of a call? (tail call) */
+	bool is_tail_call;
+
 	/* Next item. */
 	struct hir_stmt *next;
 };
@@ -75,8 +75,69 @@ enum bytecode {
 
 	/* line number */
 	LOP_LINEINFO,		/* 0x26: setDebugLine(src) */
+
+	/* typed calc (dst = src1 op src2, the types are proven by the compiler) */
+	LOP_IADD,		/* 0x27: dst = src1 + src2, operands are integers */
+	LOP_ISUB,		/* 0x28: dst = src1 - src2, operands are integers */
+	LOP_IMUL,		/* 0x29: dst = src1 * src2, operands are integers */
+	LOP_ILT,		/* 0x2a: dst = src1 <  src2 [0 or 1], operands are integers */
+	LOP_ILTE,		/* 0x2b: dst = src1 <= src2 [0 or 1], operands are integers */
+	LOP_IGT,		/* 0x2c: dst = src1 >  src2 [0 or 1], operands are integers */
+	LOP_IGTE,		/* 0x2d: dst = src1 >= src2 [0 or 1], operands are integers */
+	LOP_IEQ,		/* 0x2e: dst = src1 == src2 [0 or 1], operands are integers */
+	LOP_INEQ,		/* 0x2f: dst = src1 != src2 [0 or 1], operands are integers */
+	LOP_FADD,		/* 0x30: dst = src1 + src2, operands are floats */
+	LOP_FSUB,		/* 0x31: dst = src1 - src2, operands are floats */
+	LOP_FMUL,		/* 0x32: dst = src1 * src2, operands are floats */
+	LOP_FDIV,		/* 0x33: dst = src1 / src2, operands are floats */
+	LOP_FLT,		/* 0x34: dst = src1 <  src2 [0 or 1], operands are floats */
+	LOP_FLTE,		/* 0x35: dst = src1 <= src2 [0 or 1], operands are floats */
+	LOP_FGT,		/* 0x36: dst = src1 >  src2 [0 or 1], operands are floats */
+	LOP_FGTE,		/* 0x37: dst = src1 >= src2 [0 or 1], operands are floats */
+	LOP_FEQ,		/* 0x38: dst = src1 == src2 [0 or 1], operands are floats */
+	LOP_FNEQ,		/* 0x39: dst = src1 != src2 [0 or 1], operands are floats */
+
+	/* Frame-owned Container */
+	LOP_LACONST,		/* 0x3a: dst = empty array freed with the frame */
+	LOP_LDCONST,		/* 0x3b: dst = empty dictionary freed with the frame */
+
+	/* Unchecked Load */
+	LOP_ULOADARRAY,		/* 0x3c: dst = src1[src2], src2 is in range */
+	LOP_UGETDICTVALBYINDEX,	/* 0x3d: dst = src1.valAt(src2), src2 is in range */
+
+	/* Tail Call */
+	LOP_TAILCALL,		/* 0x3e: dst = func(arg1, ...), reusing the frame */
+
+	/* Switch */
+	LOP_SWITCH,		/* 0x3f: dst = index of the case that src matches */
+
+	/* Linked Function */
+	LOP_LOADFUNC,		/* 0x40: dst = function bound by rt_link() (never emitted) */
+
+	/* Inline Guard */
+	LOP_CHKFUNC,		/* 0x41: dst = 1 if symbol is the function of this file, 0 otherwise */
 };
 
+/*
+ * SWITCH table
+ *  - A SWITCH is "dst, src, length, kind, count, body". The length
+ *    (imm16) is the bytes from src to the end, and dst gets the index
+ *    of the matched case (imm16), or count if no case matches.
+ *  - LIR_SWITCH_DENSE: min (imm32), range (imm16), and the case index
+ *    of each value in [min, min + range).
+ *  - LIR_SWITCH_INT: mask (imm16), and mask + 1 slots of a value
+ *    (imm32) and a case index, probed linearly from lir_hash_int().
+ *  - LIR_SWITCH_STRING: mask (imm16), mask + 1 slots of a hash (imm32),
+ *    a case index, and the offset of a string from src (imm16), probed
+ *    linearly from lir_hash_string(). The strings follow.
+ *  - A slot or a value without a case has LIR_SWITCH_EMPTY.
+ */
+#define LIR_SWITCH_DENSE	0
+#define LIR_SWITCH_INT		1
+#define LIR_SWITCH_STRING	2
+#define LIR_SWITCH_EMPTY	0xffff
+#define LIR_SWITCH_HEADER_SIZE	7
+
 struct hir_block;
 
 struct lir_func {
@@ -85,6 +146,7 @@ struct lir_func {
 	int param_count;
 	char *param_name[LIR_PARAM_SIZE];
 	int tmpvar_size;
+	int orig_tmpvar_size;	/* Before the tmpvar coalescing. */
 	int bytecode_size;
 	uint8_t *bytecode;
 };
@@ -107,4 +169,10 @@ const char *lir_get_error_message(void);
 /* Dump LIR. */
 void lir_dump(struct lir_func *func);
 
+/* Hash an integer key of a SWITCH table. */
+uint32_t lir_hash_int(int key);
+
+/* Hash a string key of a SWITCH table. */
+uint32_t lir_hash_string(const char *key);
+
 #endif
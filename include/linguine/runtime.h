@@ -30,6 +30,7 @@ struct rt_array;
 struct rt_dict;
 struct rt_bindglobal;
 struct rt_bindlocal;
+struct jit_code_cache;
 
 /* Value type. */
 enum rt_value_type {
@@ -82,6 +83,45 @@ enum rt_bytecode {
 	ROP_JMPIFFALSE,		/* 0x25: PC = src1 if src2 != 1 */
 	ROP_JMPIFEQ,		/* 0x25: PC = src1 if src2 indicates eq */
 	ROP_LINEINFO,		/* 0x26: setDebugLine(src) */
+	ROP_IADD,		/* 0x27: dst = src1 + src2, operands are integers */
+	ROP_ISUB,		/* 0x28: dst = src1 - src2, operands are integers */
+	ROP_IMUL,		/* 0x29: dst = src1 * src2, operands are integers */
+	ROP_ILT,		/* 0x2a: dst = src1 <  src2 [0 or 1], operands are integers */
+	ROP_ILTE,		/* 0x2b: dst = src1 <= src2 [0 or 1], operands are integers */
+	ROP_IGT,		/* 0x2c: dst = src1 >  src2 [0 or 1], operands are integers */
+	ROP_IGTE,		/* 0x2d: dst = src1 >= src2 [0 or 1], operands are integers */
+	ROP_IEQ,		/* 0x2e: dst = src1 == src2 [0 or 1], operands are integers */
+	ROP_INEQ,		/* 0x2f: dst = src1 != src2 [0 or 1], operands are integers */
+	ROP_FADD,		/* 0x30: dst = src1 + src2, operands are floats */
+	ROP_FSUB,		/* 0x31: dst = src1 - src2, operands are floats */
+	ROP_FMUL,		/* 0x32: dst = src1 * src2, operands are floats */
+	ROP_FDIV,		/* 0x33: dst = src1 / src2, operands are floats */
+	ROP_FLT,		/* 0x34: dst = src1 <  src2 [0 or 1], operands are floats */
+	ROP_FLTE,		/* 0x35: dst = src1 <= src2 [0 or 1], operands are floats */
+	ROP_FGT,		/* 0x36: dst = src1 >  src2 [0 or 1], operands are floats */
+	ROP_FGTE,		/* 0x37: dst = src1 >= src2 [0 or 1], operands are floats */
+	ROP_FEQ,		/* 0x38: dst = src1 == src2 [0 or 1], operands are floats */
+	ROP_FNEQ,		/* 0x39: dst = src1 != src2 [0 or 1], operands are floats */
+
+	/* Frame-owned Container */
+	ROP_LACONST,		/* 0x3a: dst = empty array freed with the frame */
+	ROP_LDCONST,		/* 0x3b: dst = empty dictionary freed with the frame */
+
+	/* Unchecked Load */
+	ROP_ULOADARRAY,		/* 0x3c: dst = src1[src2], src2 is in range */
+	ROP_UGETDICTVALBYINDEX,	/* 0x3d: dst = src1.valAt(src2), src2 is in range */
+
+	/* Tail Call */
+	ROP_TAILCALL,		/* 0x3e: dst = func(arg1, ...), reusing the frame */
+
+	/* Switch */
+	ROP_SWITCH,		/* 0x3f: dst = index of the case that src matches */
+
+	/* Linked Function */
+	ROP_LOADFUNC,		/* 0x40: dst = global bound by rt_link() */
+
+	/* Inline Guard */
+	ROP_CHKFUNC,		/* 0x41: dst = 1 if symbol is the function of this file, 0 otherwise */
 };
 
 /* Runtime environment. */
@@ -98,9 +138,27 @@ struct rt_env {
 	/* Function list. */
 	struct rt_func *func_list;
 
+	/* Are the functions prepared for JIT? (by rt_link() or the first call) */
+	bool jit_ready;
+
+	/* JIT code cache. (NULL until the first compilation) */
+	struct jit_code_cache *jit_cache;
+
+	/* Clock for LRU eviction of JIT code. */
+	uint64_t jit_clock;
+
+	/* Write perf map entries and register code to GDB. (Linux) */
+	bool jit_profile;
+
 	/* Heap usage in bytes. */
 	size_t heap_usage;
 
+	/* Number of arrays and dictionaries made in frames. */
+	int container_count;
+
+	/* Number of them freed by rt_leave_frame() without the GC. */
+	int frame_free_count;
+
 	/* Deep object list. */
 	struct rt_string *deep_str_list;
 	struct rt_array *deep_arr_list;
@@ -133,12 +191,21 @@ struct rt_env {
 #endif
 };
 
+/* Maximum registers that JIT code saves on a deoptimization. */
+#define RT_DEOPT_REG_MAX	8
+
 /* Calling frame. */
 struct rt_frame {
 	/* tmpvar (Do not move. JIT assumes the offset 0.) */
 	struct rt_value *tmpvar;
 	int tmpvar_size;
 
+	/* Deoptimization exit that JIT code took. (NULL if none) */
+	void *deopt_addr;
+
+	/* Registers that JIT code saved at the exit. */
+	int32_t deopt_reg[RT_DEOPT_REG_MAX];
+
 	/* function */
 	struct rt_func *func;
 
@@ -154,6 +221,9 @@ struct rt_frame {
 	/* Shallow dictionary list. */
 	struct rt_dict *shallow_dict_list;
 
+	/* Callee of a tail call to run next in this frame. (NULL if none) */
+	struct rt_func *tail_func;
+
 	/* Next frame. */
 	struct rt_frame *next;
 };
@@ -206,6 +276,9 @@ struct rt_array {
 	struct rt_array *next;
 	bool is_deep;
 
+	/* Is freed when the frame is left? (never escapes the frame) */
+	bool is_frame_owned;
+
 	/* Is marked? (for mark-and-sweep GC). */
 	bool is_marked;
 };
@@ -222,6 +295,9 @@ struct rt_dict {
 	struct rt_dict *next;
 	bool is_deep;
 
+	/* Is freed when the frame is left? (never escapes the frame) */
+	bool is_frame_owned;
+
 	/* Is marked? (for mark-and-sweep GC). */
 	bool is_marked;
 };
@@ -239,9 +315,29 @@ struct rt_func {
 	uint8_t *bytecode;
 	int tmpvar_size;
 
-	/* JIT-generated code. */
+	/* JIT-generated code. (atomic: the compiler thread may publish it) */
 	bool (*jit_code)(struct rt_env *env);
 
+	/* JIT-generated OSR entry that starts at a loop header. (optional, atomic) */
+	bool (*jit_osr_code)(struct rt_env *env, uint32_t lpc);
+
+	/* Call count and loop back-edge count for tiered compilation. */
+	int call_count;
+	int loop_count;
+
+	/* Background compilation state. (RT_JIT_*, atomic) */
+	int jit_state;
+
+	/* Clock of the last call to the JIT code. (for LRU eviction) */
+	uint64_t jit_last_use;
+
+	/* Type profile collected by the interpreter. (see below, NULL if JIT is disabled) */
+	uint8_t *profile;
+
+	/* Globals bound by rt_link(). (indexed by the LOADFUNC operand) */
+	struct rt_bindglobal **link_global;
+	int link_global_count;
+
 	/* Function pointer. (if a cfunc) */
 	bool (*cfunc)(struct rt_env *env);
 
@@ -249,6 +345,63 @@ struct rt_func {
 	struct rt_func *next;
 };
 
+/*
+ * Type profile
+ *  - rt_func.profile has a byte for each bytecode byte, and the
+ *    interpreter records the operands of an instruction at pc into
+ *    the bytes at pc + 1 and pc + 2.
+ *  - Arithmetic and comparison: RT_PROFILE_BIT() of src1 and src2.
+ *  - LOADARRAY: RT_PROFILE_BIT() of the container and the subscript.
+ *  - LOADDOT: RT_PROFILE_BIT() of the receiver, and the dictionary
+ *    slot of the field plus one. (RT_PROFILE_MANY_SLOTS if it varies)
+ *  - THISCALL: RT_PROFILE_BIT() of the receiver.
+ *  - JIT code is specialized for the observed types, and a guard
+ *    failure resumes the interpreter at the instruction.
+ */
+#define RT_PROFILE_BIT(type)	((uint8_t)(1 << (type)))
+#define RT_PROFILE_MANY_SLOTS	0xff
+
+/* Background compilation state of a function. */
+enum rt_jit_state {
+	RT_JIT_IDLE,		/* Not queued. */
+	RT_JIT_QUEUED,		/* Queued or being compiled on the compiler thread. */
+	RT_JIT_RETRY,		/* Needs a compilation on the calling thread to evict code. */
+};
+
+/* JIT code cache statistics. */
+struct rt_jit_stats {
+	/* Cache size in bytes. */
+	size_t cache_size;
+
+	/* Used bytes. */
+	size_t used_size;
+
+	/* Number of functions that have JIT code. */
+	int func_count;
+
+	/* Number of compilations. */
+	int compile_count;
+
+	/* Number of evictions back to the interpreter. */
+	int evict_count;
+
+	/* Number of compilations done on the compiler thread. */
+	int async_count;
+
+	/* Number of guard failures that resumed the interpreter. */
+	int deopt_count;
+
+	/* Number of functions loaded from and written to the disk cache. */
+	int disk_load_count;
+	int disk_store_count;
+
+	/* Number of functions that failed to compile and stay interpreted. */
+	int fail_count;
+
+	/* The last failure. ("" if none) */
+	const char *last_fail_message;
+};
+
 /* Global variable entry. */
 struct rt_bindglobal {
 	char *name;
@@ -327,6 +480,21 @@ rt_register_cfunc(
 	const char *param_name[],
 	bool (*cfunc)(struct rt_env *env));
 
+/*
+ * Link the registered functions.
+ *  - Call this after the registrations and before running. Call this
+ *    again to link the functions registered after it.
+ *  - A name of a global function that no function assigns is bound
+ *    to its global, and its LOADSYMBOL becomes a LOADFUNC. A LOADFUNC
+ *    reads the global when it runs, so it sees a function registered
+ *    later with the same name and a value set by rt_set_global().
+ *  - A name that is neither a global nor assigned anywhere is an
+ *    error. Set the globals that the sources read before this.
+ */
+bool
+rt_link(
+	struct rt_env *rt);
+
 /* Call a function. */
 bool
 rt_call(
@@ -386,6 +554,18 @@ rt_make_empty_dict(
 	struct rt_env *rt,
 	struct rt_value *val);
 
+/* Make an empty array value that is freed when the frame is left. */
+bool
+rt_make_frame_array(
+	struct rt_env *rt,
+	struct rt_value *val);
+
+/* Make an empty dictionary value that is freed when the frame is left. */
+bool
+rt_make_frame_dict(
+	struct rt_env *rt,
+	struct rt_value *val);
+
 /* Clone a value. */
 bool
 rt_copy_value(
@@ -553,6 +733,30 @@ rt_get_heap_usage(
 	struct rt_env *rt,
 	size_t *ret);
 
+/* Get the numbers of containers made in frames and freed with them. */
+bool
+rt_get_container_stats(
+	struct rt_env *rt,
+	int *container_count,
+	int *frame_free_count);
+
+/* Get JIT code cache statistics. */
+bool
+rt_get_jit_stats(
+	struct rt_env *rt,
+	struct rt_jit_stats *stats);
+
+/* Enable perf map and GDB JIT interface output for code compiled after this. */
+bool
+rt_set_jit_profile(
+	struct rt_env *rt,
+	bool enable);
+
+/* Print the type profiles of the functions. (for debug) */
+void
+rt_dump_type_profile(
+	struct rt_env *rt);
+
 /*
  * Execution helpers
  */
@@ -670,6 +874,18 @@ rt_gt_helper(
 	int src1,
 	int src2);
 
+bool
+rt_loadfunc_helper(
+	struct rt_env *rt,
+	int dst,
+	int index);
+
+bool
+rt_switch_helper(
+	struct rt_env *rt,
+	int dst,
+	const uint8_t *table);
+
 bool
 rt_storearray_helper(
 	struct rt_env *rt,
@@ -710,6 +926,12 @@ rt_loadsymbol_helper(
 	int dst,
 	const char *symbol);
 
+bool
+rt_chkfunc_helper(
+	struct rt_env *rt,
+	int dst,
+	const char *symbol);
+
 bool
 rt_storesymbol_helper(
 	struct rt_env *rt,
@@ -723,6 +945,20 @@ rt_loaddot_helper(
 	int dict,
 	const char *field);
 
+bool
+rt_loaddot_slot_helper(
+	struct rt_env *rt,
+	int dst,
+	int dict,
+	const char *field,
+	int slot);
+
+int
+rt_find_dict_slot(
+	struct rt_dict *dict,
+	const char *key,
+	int hint);
+
 bool
 rt_storedot_helper(
 	struct rt_env *rt,
@@ -738,6 +974,13 @@ rt_call_helper(
 	int arg_count,
 	int *arg);
 
+bool
+rt_tailcall_helper(
+	struct rt_env *rt,
+	int func,
+	int arg_count,
+	int *arg);
+
 bool
 rt_thiscall_helper(
 	struct rt_env *rt,
@@ -747,22 +990,73 @@ rt_thiscall_helper(
 	int arg_count,
 	int *arg);
 
+bool
+rt_enter_call_helper(
+	struct rt_env *rt,
+	struct rt_func *callee,
+	int arg_count,
+	int *arg);
+
+bool
+rt_leave_call_helper(
+	struct rt_env *rt,
+	int dst);
+
 /* Generate a JIT-compiled code for a function. */
 bool
 jit_build(
 	struct rt_env *rt,
 	struct rt_func *func);
 
+/* Compile a hot function now, or queue it to the compiler thread. */
+bool
+jit_request(
+	struct rt_env *rt,
+	struct rt_func *func);
+
 /* Free a JIT-compiled code for a function. */
 void
 jit_free(
 	struct rt_env *rt,
 	struct rt_func *func);
 
+/* Free the JIT code cache of an environment. */
+void
+jit_free_cache(
+	struct rt_env *rt);
+
+/* Rebuild the current frame after a deoptimization exit, and get the LIR-PC to resume. */
+bool
+jit_deoptimize(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *lpc);
+
+/* Load a function code from the JIT disk cache. (false if not cached) */
+bool
+jit_load_disk_code(
+	struct rt_env *rt,
+	struct rt_func *func);
+
+/* Print the type profile of a function. */
+void
+jit_dump_profile(
+	struct rt_func *func);
+
+/* Get JIT code cache statistics. */
+void
+jit_get_stats(
+	struct rt_env *rt,
+	struct rt_jit_stats *stats);
+
 /* Visit bytecode. */
 bool
 rt_visit_bytecode(struct rt_env *rt, struct rt_func *func);
 
+/* Visit bytecode from an instruction. (after a deoptimization) */
+bool
+rt_resume_bytecode(struct rt_env *rt, struct rt_func *func, int pc);
+
 /* Register intrinsics. */
 bool
 rt_register_intrinsics(
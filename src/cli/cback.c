@@ -626,6 +626,291 @@ cback_visit_neq_op(
 	return true;
 }
 
+/* Put a typed binary operation. (The compiler proved the source types.) */
+static bool
+cback_put_typed_op(
+	struct lir_func *func,
+	int *pc,
+	bool is_float,
+	bool is_compare,
+	const char *op)
+{
+	const char *src_field, *dst_field, *dst_type;
+	uint32_t dst;
+	uint32_t src1;
+	uint32_t src2;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2 + 2 + 2 > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	src1 = ((uint32_t)func->bytecode[*pc + 3] << 8) |
+		(uint32_t)func->bytecode[*pc + 4];
+	src2 = ((uint32_t)func->bytecode[*pc + 5] << 8) |
+		(uint32_t)func->bytecode[*pc + 6];
+	if (dst >= (uint32_t)func->tmpvar_size ||
+	    src1 >= (uint32_t)func->tmpvar_size ||
+	    src2 >= (uint32_t)func->tmpvar_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	/* The helper reports the error. */
+	if (func->bytecode[*pc] == LOP_FDIV) {
+		fprintf(fp, "    if (rt->frame->tmpvar[%d].val.f == 0) {\n", src2);
+		fprintf(fp, "        rt_div_helper(rt, %d, %d, %d);\n", dst, src1, src2);
+		fprintf(fp, "        return false;\n");
+		fprintf(fp, "    }\n");
+	}
+
+	*pc += 1 + 2 + 2 + 2;
+
+	/* A comparison makes 0 or 1. */
+	src_field = is_float ? "f" : "i";
+	dst_field = is_float && !is_compare ? "f" : "i";
+	dst_type = is_float && !is_compare ? "RT_VALUE_FLOAT" : "RT_VALUE_INT";
+	fprintf(fp, "    rt->frame->tmpvar[%d].val.%s = rt->frame->tmpvar[%d].val.%s %s rt->frame->tmpvar[%d].val.%s;\n",
+		dst, dst_field, src1, src_field, op, src2, src_field);
+	fprintf(fp, "    rt->frame->tmpvar[%d].type = %s;\n", dst, dst_type);
+
+	return true;
+}
+
+/* Visit a LOP_IADD instruction. */
+static INLINE bool
+cback_visit_iadd_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, false, "+");
+}
+
+/* Visit a LOP_ISUB instruction. */
+static INLINE bool
+cback_visit_isub_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, false, "-");
+}
+
+/* Visit a LOP_IMUL instruction. */
+static INLINE bool
+cback_visit_imul_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, false, "*");
+}
+
+/* Visit a LOP_ILT instruction. */
+static INLINE bool
+cback_visit_ilt_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, "<");
+}
+
+/* Visit a LOP_ILTE instruction. */
+static INLINE bool
+cback_visit_ilte_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, "<=");
+}
+
+/* Visit a LOP_IGT instruction. */
+static INLINE bool
+cback_visit_igt_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, ">");
+}
+
+/* Visit a LOP_IGTE instruction. */
+static INLINE bool
+cback_visit_igte_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, ">=");
+}
+
+/* Visit a LOP_IEQ instruction. */
+static INLINE bool
+cback_visit_ieq_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, "==");
+}
+
+/* Visit a LOP_INEQ instruction. */
+static INLINE bool
+cback_visit_ineq_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, false, true, "!=");
+}
+
+/* Visit a LOP_FADD instruction. */
+static INLINE bool
+cback_visit_fadd_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, false, "+");
+}
+
+/* Visit a LOP_FSUB instruction. */
+static INLINE bool
+cback_visit_fsub_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, false, "-");
+}
+
+/* Visit a LOP_FMUL instruction. */
+static INLINE bool
+cback_visit_fmul_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, false, "*");
+}
+
+/* Visit a LOP_FDIV instruction. */
+static INLINE bool
+cback_visit_fdiv_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, false, "/");
+}
+
+/* Visit a LOP_FLT instruction. */
+static INLINE bool
+cback_visit_flt_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, "<");
+}
+
+/* Visit a LOP_FLTE instruction. */
+static INLINE bool
+cback_visit_flte_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, "<=");
+}
+
+/* Visit a LOP_FGT instruction. */
+static INLINE bool
+cback_visit_fgt_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, ">");
+}
+
+/* Visit a LOP_FGTE instruction. */
+static INLINE bool
+cback_visit_fgte_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, ">=");
+}
+
+/* Visit a LOP_FEQ instruction. */
+static INLINE bool
+cback_visit_feq_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, "==");
+}
+
+/* Visit a LOP_FNEQ instruction. */
+static INLINE bool
+cback_visit_fneq_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_typed_op(func, pc, true, true, "!=");
+}
+
+/* Visit a LOP_LACONST instruction. */
+static INLINE bool
+cback_visit_laconst_op(
+	struct lir_func *func,
+	int *pc)
+{
+	uint32_t dst;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2  > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	if (dst >= (uint32_t)func->tmpvar_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	*pc += 1 + 2;
+
+	fprintf(fp, "    if (!rt_make_frame_array(rt, &rt->frame->tmpvar[%d]))\n", dst);
+	fprintf(fp, "        return false;\n");
+
+	return true;
+}
+
+/* Visit a LOP_LDCONST instruction. */
+static INLINE bool
+cback_visit_ldconst_op(
+	struct lir_func *func,
+	int *pc)
+{
+	uint32_t dst;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2  > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	if (dst >= (uint32_t)func->tmpvar_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	*pc += 1 + 2;
+
+	fprintf(fp, "    if (!rt_make_frame_dict(rt, &rt->frame->tmpvar[%d]))\n", dst);
+	fprintf(fp, "        return false;\n");
+
+	return true;
+}
+
 /* Visit a LOP_STOREARRAY instruction. */
 static INLINE bool
 cback_visit_storearray_op(
@@ -681,6 +966,68 @@ cback_visit_getdictvalbyindex_op(
 	return true;
 }
 
+/* Put an unchecked load. (ULOADARRAY and UGETDICTVALBYINDEX) */
+static bool
+cback_put_unchecked_load_op(
+	struct lir_func *func,
+	int *pc,
+	const char *col_type,
+	const char *elem,
+	const char *helper)
+{
+	uint32_t dst;
+	uint32_t src1;
+	uint32_t src2;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2 + 2 + 2 > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	src1 = ((uint32_t)func->bytecode[*pc + 3] << 8) |
+		(uint32_t)func->bytecode[*pc + 4];
+	src2 = ((uint32_t)func->bytecode[*pc + 5] << 8) |
+		(uint32_t)func->bytecode[*pc + 6];
+	if (dst >= (uint32_t)func->tmpvar_size ||
+	    src1 >= (uint32_t)func->tmpvar_size ||
+	    src2 >= (uint32_t)func->tmpvar_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	*pc += 1 + 2 + 2 + 2;
+
+	/* The subscript is in range. The helper reports a type error. */
+	fprintf(fp, "    if (rt->frame->tmpvar[%d].type == %s)\n", src1, col_type);
+	fprintf(fp, "        rt->frame->tmpvar[%d] = rt->frame->tmpvar[%d].val.%s[rt->frame->tmpvar[%d].val.i];\n",
+		dst, src1, elem, src2);
+	fprintf(fp, "    else if (!%s(rt, %d, %d, %d))\n", helper, dst, src1, src2);
+	fprintf(fp, "        return false;\n");
+
+	return true;
+}
+
+/* Visit a LOP_ULOADARRAY instruction. */
+static INLINE bool
+cback_visit_uloadarray_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_unchecked_load_op(func, pc, "RT_VALUE_ARRAY", "arr->table", "rt_loadarray_helper");
+}
+
+/* Visit a LOP_UGETDICTVALBYINDEX instruction. */
+static INLINE bool
+cback_visit_ugetdictvalbyindex_op(
+	struct lir_func *func,
+	int *pc)
+{
+	return cback_put_unchecked_load_op(func, pc, "RT_VALUE_DICT", "dict->value", "rt_getdictvalbyindex_helper");
+}
+
 /* Visit a LOP_LOADYMBOL instruction. */
 static INLINE bool
 cback_visit_loadsymbol_op(
@@ -715,6 +1062,80 @@ cback_visit_loadsymbol_op(
 	return true;
 }
 
+/* Visit a LOP_CHKFUNC instruction. */
+static INLINE bool
+cback_visit_chkfunc_op(
+	struct lir_func *func,
+	int *pc)
+{
+	int dst;
+	const char *symbol;
+	int len;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2 > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = (func->bytecode[*pc + 1] << 8) | (func->bytecode[*pc + 2]);
+
+	symbol = (const char *)&func->bytecode[*pc + 3];
+	len = (int)strlen(symbol);
+	if (*pc + 2 + len + 1 > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	*pc += 1 + 2 + len + 1;
+
+	fprintf(fp, "    if (!rt_chkfunc_helper(rt, %d, \"%s\"))\n", dst, symbol);
+	fprintf(fp, "        return false;\n");
+
+	return true;
+}
+
+/* Visit a LOP_SWITCH instruction. */
+static INLINE bool
+cback_visit_switch_op(
+	struct lir_func *func,
+	int *pc)
+{
+	int dst;
+	int len;
+	int i;
+
+	LABEL(*pc);
+
+	if (*pc + 1 + 2 + LIR_SWITCH_HEADER_SIZE > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = (func->bytecode[*pc + 1] << 8) | (func->bytecode[*pc + 2]);
+
+	/* The table length counts from the src operand. */
+	len = (func->bytecode[*pc + 5] << 8) | (func->bytecode[*pc + 6]);
+	if (*pc + 1 + 2 + len > func->bytecode_size) {
+		printf(BROKEN_BYTECODE);
+		return false;
+	}
+
+	fprintf(fp, "    {\n");
+	fprintf(fp, "        static const uint8_t table[%d] = {", len);
+	for (i = 0; i < len; i++)
+		fprintf(fp, "%s%d,", i % 16 == 0 ? "\n            " : " ", func->bytecode[*pc + 3 + i]);
+	fprintf(fp, "\n        };\n");
+	fprintf(fp, "        if (!rt_switch_helper(rt, %d, table))\n", dst);
+	fprintf(fp, "            return false;\n");
+	fprintf(fp, "    }\n");
+
+	*pc += 1 + 2 + len;
+
+	return true;
+}
+
 /* Visit a LOP_STORESYMBOL instruction. */
 static INLINE bool
 cback_visit_storesymbol_op(
@@ -1192,6 +1613,14 @@ cback_visit_op(
 		if (!cback_visit_loadsymbol_op(func, pc))
 			return false;
 		break;
+	case LOP_CHKFUNC:
+		if (!cback_visit_chkfunc_op(func, pc))
+			return false;
+		break;
+	case LOP_SWITCH:
+		if (!cback_visit_switch_op(func, pc))
+			return false;
+		break;
 	case LOP_STORESYMBOL:
 		if (!cback_visit_storesymbol_op(func, pc))
 			return false;
@@ -1229,6 +1658,98 @@ cback_visit_op(
 		if (!cback_visit_jmpiftrue_op(func, pc))
 			return false;
 		break;
+	case LOP_IADD:
+		if (!cback_visit_iadd_op(func, pc))
+			return false;
+		break;
+	case LOP_ISUB:
+		if (!cback_visit_isub_op(func, pc))
+			return false;
+		break;
+	case LOP_IMUL:
+		if (!cback_visit_imul_op(func, pc))
+			return false;
+		break;
+	case LOP_ILT:
+		if (!cback_visit_ilt_op(func, pc))
+			return false;
+		break;
+	case LOP_ILTE:
+		if (!cback_visit_ilte_op(func, pc))
+			return false;
+		break;
+	case LOP_IGT:
+		if (!cback_visit_igt_op(func, pc))
+			return false;
+		break;
+	case LOP_IGTE:
+		if (!cback_visit_igte_op(func, pc))
+			return false;
+		break;
+	case LOP_IEQ:
+		if (!cback_visit_ieq_op(func, pc))
+			return false;
+		break;
+	case LOP_INEQ:
+		if (!cback_visit_ineq_op(func, pc))
+			return false;
+		break;
+	case LOP_FADD:
+		if (!cback_visit_fadd_op(func, pc))
+			return false;
+		break;
+	case LOP_FSUB:
+		if (!cback_visit_fsub_op(func, pc))
+			return false;
+		break;
+	case LOP_FMUL:
+		if (!cback_visit_fmul_op(func, pc))
+			return false;
+		break;
+	case LOP_FDIV:
+		if (!cback_visit_fdiv_op(func, pc))
+			return false;
+		break;
+	case LOP_FLT:
+		if (!cback_visit_flt_op(func, pc))
+			return false;
+		break;
+	case LOP_FLTE:
+		if (!cback_visit_flte_op(func, pc))
+			return false;
+		break;
+	case LOP_FGT:
+		if (!cback_visit_fgt_op(func, pc))
+			return false;
+		break;
+	case LOP_FGTE:
+		if (!cback_visit_fgte_op(func, pc))
+			return false;
+		break;
+	case LOP_FEQ:
+		if (!cback_visit_feq_op(func, pc))
+			return false;
+		break;
+	case LOP_FNEQ:
+		if (!cback_visit_fneq_op(func, pc))
+			return false;
+		break;
+	case LOP_LACONST:
+		if (!cback_visit_laconst_op(func, pc))
+			return false;
+		break;
+	case LOP_LDCONST:
+		if (!cback_visit_ldconst_op(func, pc))
+			return false;
+		break;
+	case LOP_ULOADARRAY:
+		if (!cback_visit_uloadarray_op(func, pc))
+			return false;
+		break;
+	case LOP_UGETDICTVALBYINDEX:
+		if (!cback_visit_ugetdictvalbyindex_op(func, pc))
+			return false;
+		break;
 	default:
 		printf("Unknow opcode.");
 		return false;
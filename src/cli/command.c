@@ -56,12 +56,31 @@ bool opt_compile_to_app;
 /* Is compilation to DLL .c file? */
 bool opt_compile_to_dll;
 
+/* Print JIT statistics at exit? */
+bool opt_jit_stats;
+
+/* Print type profiles at exit? */
+bool opt_dump_type_profile;
+
+/* Print container statistics at exit? */
+bool opt_alloc_stats;
+
 /*
  * Config (extern)
  */
 
 extern bool linguine_conf_use_jit;
 extern int linguine_conf_optimize;
+extern int linguine_conf_jit_threshold;
+extern size_t linguine_conf_jit_cache_size;
+extern bool linguine_conf_jit_dual_map;
+extern bool linguine_conf_jit_async;
+extern bool linguine_conf_jit_profile;
+extern bool linguine_conf_jit_deopt_stress;
+extern const char *linguine_conf_jit_disk_cache;
+extern bool linguine_conf_dump_lir;
+extern bool linguine_conf_dump_frame_size;
+extern bool linguine_conf_tail_call;
 
 /*
  * Temporary
@@ -146,6 +165,110 @@ static void parse_options(int argc, char *argv[])
 			continue;
 		}
 
+		/* --jit-threshold */
+		if (strcmp(argv[index], "--jit-threshold") == 0) {
+			if (index + 1 >= argc) {
+				wide_printf(_("Usage: linguine <source file>\n"));
+				exit(1);
+			}
+
+			linguine_conf_jit_threshold = atoi(argv[index + 1]);
+
+			index += 2;
+			continue;
+		}
+
+		/* --jit-cache-size */
+		if (strcmp(argv[index], "--jit-cache-size") == 0) {
+			if (index + 1 >= argc || atoi(argv[index + 1]) <= 0) {
+				wide_printf(_("Usage: linguine <source file>\n"));
+				exit(1);
+			}
+
+			/* In KiB. */
+			linguine_conf_jit_cache_size = (size_t)atoi(argv[index + 1]) * 1024;
+
+			index += 2;
+			continue;
+		}
+
+		/* --disable-jit-dual-map */
+		if (strcmp(argv[index], "--disable-jit-dual-map") == 0) {
+			linguine_conf_jit_dual_map = false;
+			index++;
+			continue;
+		}
+
+		/* --jit-async */
+		if (strcmp(argv[index], "--jit-async") == 0) {
+			linguine_conf_jit_async = true;
+			index++;
+			continue;
+		}
+
+		/* --jit-profile */
+		if (strcmp(argv[index], "--jit-profile") == 0) {
+			linguine_conf_jit_profile = true;
+			index++;
+			continue;
+		}
+
+		/* --jit-deopt-stress */
+		if (strcmp(argv[index], "--jit-deopt-stress") == 0) {
+			linguine_conf_jit_deopt_stress = true;
+			index++;
+			continue;
+		}
+
+		/* --jit-disk-cache */
+		if (strcmp(argv[index], "--jit-disk-cache") == 0) {
+			if (index + 1 >= argc) {
+				wide_printf(_("Usage: linguine <source file>\n"));
+				exit(1);
+			}
+
+			/* Directory of cached code. */
+			linguine_conf_jit_disk_cache = argv[index + 1];
+
+			index += 2;
+			continue;
+		}
+
+		/* --jit-stats */
+		if (strcmp(argv[index], "--jit-stats") == 0) {
+			opt_jit_stats = true;
+			index++;
+			continue;
+		}
+
+		/* --alloc-stats */
+		if (strcmp(argv[index], "--alloc-stats") == 0) {
+			opt_alloc_stats = true;
+			index++;
+			continue;
+		}
+
+		/* --dump-lir */
+		if (strcmp(argv[index], "--dump-lir") == 0) {
+			linguine_conf_dump_lir = true;
+			index++;
+			continue;
+		}
+
+		/* --dump-frame-size */
+		if (strcmp(argv[index], "--dump-frame-size") == 0) {
+			linguine_conf_dump_frame_size = true;
+			index++;
+			continue;
+		}
+
+		/* --dump-type-profile */
+		if (strcmp(argv[index], "--dump-type-profile") == 0) {
+			opt_dump_type_profile = true;
+			index++;
+			continue;
+		}
+
 		/* -O */
 		if (strcmp(argv[index], "-O") == 0) {
 			linguine_conf_optimize = 1;
@@ -250,12 +373,63 @@ static bool run_interpreter(int argc, char *argv[])
 		}
 	}
 
+	/* Bind the function names. */
+	if (!rt_link(rt)) {
+		print_error(rt);
+		return false;
+	}
+
 	/* Run the "main()" function. */
 	if (!rt_call_with_name(rt, "main", NULL, 0, NULL, &ret)) {
 		print_error(rt);
 		return false;
 	}
 
+	/* Print JIT statistics. */
+	if (opt_jit_stats) {
+		struct rt_jit_stats stats;
+
+		rt_get_jit_stats(rt, &stats);
+		wide_printf(_("JIT cache: %zu/%zu bytes, %d functions, %d compilations, %d evictions\n"),
+			    stats.used_size,
+			    stats.cache_size,
+			    stats.func_count,
+			    stats.compile_count,
+			    stats.evict_count);
+		if (stats.async_count > 0) {
+			wide_printf(_("JIT background compilations: %d\n"),
+				    stats.async_count);
+		}
+		if (stats.deopt_count > 0) {
+			wide_printf(_("JIT deoptimizations: %d\n"),
+				    stats.deopt_count);
+		}
+		if (stats.disk_load_count > 0 || stats.disk_store_count > 0) {
+			wide_printf(_("JIT disk cache: %d loaded, %d stored\n"),
+				    stats.disk_load_count,
+				    stats.disk_store_count);
+		}
+		if (stats.fail_count > 0) {
+			wide_printf(_("JIT failures: %d (last: %s)\n"),
+				    stats.fail_count,
+				    stats.last_fail_message);
+		}
+	}
+
+	/* Print container statistics. */
+	if (opt_alloc_stats) {
+		int container_count, frame_free_count;
+
+		rt_get_container_stats(rt, &container_count, &frame_free_count);
+		wide_printf(_("Containers: %d made in frames, %d freed with their frames\n"),
+			    container_count,
+			    frame_free_count);
+	}
+
+	/* Print type profiles. */
+	if (opt_dump_type_profile)
+		rt_dump_type_profile(rt);
+
 	/* Destroy a runtime. */
 	if (!rt_destroy(rt))
 		return false;
@@ -377,6 +551,9 @@ static bool run_source_compiler(int argc, char *argv[])
 {
 	int i, j;
 
+	/* The tmpvars of a C function are on the C stack and cannot be handed over. */
+	linguine_conf_tail_call = false;
+
 	/* Initialize the C backend. */
 	if (!cback_init(opt_output))
 		return false;
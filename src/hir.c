@@ -38,6 +38,11 @@
 		}					\
 	} while (0);
 
+/*
+ * Config
+ */
+extern int linguine_conf_optimize;
+
 /*
  * Constructed HIR.
  */
@@ -71,6 +76,20 @@ static char *hir_anon_func_name[ANON_FUNC_SIZE];
 static struct ast_param_list *hir_anon_func_param_list[ANON_FUNC_SIZE];
 static struct ast_stmt_list *hir_anon_func_stmt_list[ANON_FUNC_SIZE];
 
+/*
+ * Constant folding. (-O)
+ */
+
+/* Maximum constant locals tracked in a basic block. */
+#define HIR_FOLD_LOCAL_MAX	64
+
+struct hir_fold_state {
+	/* Locals that hold a literal, and the literal terms. */
+	int count;
+	const char *symbol[HIR_FOLD_LOCAL_MAX];
+	struct hir_term *term[HIR_FOLD_LOCAL_MAX];
+};
+
 /* Forward Declaration */
 static bool hir_visit_func(struct ast_func *afunc);
 static bool hir_visit_stmt_list(struct hir_block **cur_block, struct hir_block **prev_block, struct hir_block *parent_block, struct ast_stmt_list *stmt_list);
@@ -97,6 +116,16 @@ static bool hir_visit_func_expr(struct hir_expr **hexpr, struct ast_expr *aexpr)
 static bool hir_visit_term(struct hir_term **hterm, struct ast_term *aterm);
 static bool hir_visit_param_list(struct hir_block *hfunc,struct ast_func *afunc);
 static bool hir_defer_anon_func(struct ast_expr *aexpr, char **symbol);
+static struct hir_term *hir_find_const_local(struct hir_fold_state *st, const char *symbol);
+static bool hir_is_local_symbol(struct hir_block *func, const char *symbol);
+static void hir_set_const_local(struct hir_fold_state *st, const char *symbol, struct hir_term *term);
+static struct hir_term *hir_get_const_term(struct hir_expr *e);
+static bool hir_replace_with_term(struct hir_expr **expr, struct hir_term *term);
+static bool hir_make_string_term(struct hir_term *result, bool *is_folded, const char *fmt, ...);
+static bool hir_eval_binary(int type, struct hir_term *a, struct hir_term *b, struct hir_term *result, bool *is_folded);
+static bool hir_fold_expr(struct hir_expr **expr, struct hir_fold_state *st);
+static bool hir_fold_stmt_list(struct hir_block *func, struct hir_stmt *stmt);
+static bool hir_fold_block(struct hir_block *func, struct hir_block *b);
 static void hir_free_block(struct hir_block *b);
 static void hir_free_stmt(struct hir_stmt *s);
 static void hir_free_expr(struct hir_expr *e);
@@ -245,6 +274,10 @@ hir_visit_func(
 		/* Parse the parameters. */
 		hir_visit_param_list(func_block, afunc);
 
+		/* Reserve the return value slot next to the parameters. */
+		if (!hir_add_local(func_block, "$return"))
+			break;
+
 		/* Alloc an end block. */
 		end_block = malloc(sizeof(struct hir_block));
 		if (end_block == NULL) {
@@ -285,6 +318,12 @@ hir_visit_func(
 				func_block->val.func.inner = NULL;
 		}
 
+		/* Fold constants. */
+		if (linguine_conf_optimize > 0) {
+			if (!hir_fold_block(func_block, func_block->val.func.inner))
+				break;
+		}
+
 		/* Store func_block to the table. */
 		hir_func_tbl[hir_func_count] = func_block;
 		hir_func_count++;
@@ -737,6 +776,8 @@ hir_visit_if_stmt(
 			hir_out_of_memory();
 			return false;
 		}
+		memset(if_block, 0, sizeof(struct hir_block));
+		if_block->id = block_id_top++;
 		if_block->type = HIR_BLOCK_IF;
 		(*cur_block)->succ = if_block;
 	}
@@ -839,6 +880,7 @@ hir_visit_elif_stmt(
 		hir_out_of_memory();
 		return false;
 	}
+	memset(elif_block, 0, sizeof(struct hir_block));
 	elif_block->id = block_id_top++;
 	elif_block->type = HIR_BLOCK_IF;
 	elif_block->succ = NULL;
@@ -1014,6 +1056,7 @@ hir_visit_while_stmt(
 			hir_out_of_memory();
 			return false;
 		}
+		memset(while_block, 0, sizeof(struct hir_block));
 		while_block->id = block_id_top++;
 		while_block->type = HIR_BLOCK_WHILE;
 		while_block->parent = parent_block;
@@ -1265,6 +1308,10 @@ hir_visit_return_stmt(
 		return false;
 	}
 
+	/* A returned call is in a tail position. */
+	if (hstmt->rhs->type == HIR_EXPR_CALL)
+		hstmt->is_tail_call = true;
+
 	/* Add hstmt to the end of the block. */
 	HIR_ADD_TO_LAST(struct hir_stmt, (*cur_block)->val.basic.stmt_list, hstmt);
 
@@ -1600,12 +1647,12 @@ hir_visit_thiscall_expr(
 	if (aexpr->val.thiscall.arg_list != NULL) {
 		arg = aexpr->val.thiscall.arg_list->list;
 		while (arg != NULL) {
-			if (!hir_visit_expr(&e->val.thiscall.arg[e->val.call.arg_count], arg)) {
+			if (!hir_visit_expr(&e->val.thiscall.arg[e->val.thiscall.arg_count], arg)) {
 				hir_free_expr(e);
 				return false;
 			}
 			arg = arg->next;
-			e->val.call.arg_count++;
+			e->val.thiscall.arg_count++;
 		}
 	}
 
@@ -1891,6 +1938,489 @@ hir_defer_anon_func(
 	return true;
 }
 
+/*
+ * Constant folding and propagation (-O)
+ *  - Literal arithmetic, comparisons and parentheses are evaluated at
+ *    compile time with the same rules as the runtime helpers.
+ *  - An operation that would raise a runtime error (e.g., division by
+ *    zero or a type mismatch) is left to the runtime.
+ *  - A local variable assigned a literal is replaced by the literal
+ *    until the next assignment to it in the same basic block.
+ */
+
+/* Look up a constant local. */
+static struct hir_term *
+hir_find_const_local(
+	struct hir_fold_state *st,
+	const char *symbol)
+{
+	int i;
+
+	for (i = 0; i < st->count; i++) {
+		if (strcmp(st->symbol[i], symbol) == 0)
+			return st->term[i];
+	}
+
+	return NULL;
+}
+
+/* Is a symbol a local variable of the function? */
+static bool
+hir_is_local_symbol(
+	struct hir_block *func,
+	const char *symbol)
+{
+	struct hir_local *local;
+
+	for (local = func->val.func.local; local != NULL; local = local->next) {
+		if (strcmp(local->symbol, symbol) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* Record an assignment to a local. (term is NULL if not a constant) */
+static void
+hir_set_const_local(
+	struct hir_fold_state *st,
+	const char *symbol,
+	struct hir_term *term)
+{
+	int i;
+
+	/* Forget the old value. */
+	for (i = 0; i < st->count; i++) {
+		if (strcmp(st->symbol[i], symbol) == 0) {
+			st->count--;
+			st->symbol[i] = st->symbol[st->count];
+			st->term[i] = st->term[st->count];
+			break;
+		}
+	}
+
+	if (term == NULL || st->count == HIR_FOLD_LOCAL_MAX)
+		return;
+
+	st->symbol[st->count] = symbol;
+	st->term[st->count] = term;
+	st->count++;
+}
+
+/* Get a literal term of an expression. (NULL if not a literal) */
+static struct hir_term *
+hir_get_const_term(
+	struct hir_expr *e)
+{
+	if (e->type != HIR_EXPR_TERM)
+		return NULL;
+
+	switch (e->val.term.term->type) {
+	case HIR_TERM_INT:
+	case HIR_TERM_FLOAT:
+	case HIR_TERM_STRING:
+		return e->val.term.term;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+/* Replace an expression with a term expression. (takes the term) */
+static bool
+hir_replace_with_term(
+	struct hir_expr **expr,
+	struct hir_term *term)
+{
+	struct hir_expr *e;
+	struct hir_term *t;
+
+	e = malloc(sizeof(struct hir_expr));
+	t = malloc(sizeof(struct hir_term));
+	if (e == NULL || t == NULL) {
+		free(e);
+		free(t);
+		if (term->type == HIR_TERM_STRING)
+			free(term->val.s);
+		hir_out_of_memory();
+		return false;
+	}
+	memset(e, 0, sizeof(struct hir_expr));
+	*t = *term;
+	e->type = HIR_EXPR_TERM;
+	e->val.term.term = t;
+
+	hir_free_expr(*expr);
+	*expr = e;
+
+	return true;
+}
+
+/* Make a string term in the format of rt_make_string_format(). */
+static bool
+hir_make_string_term(
+	struct hir_term *result,
+	bool *is_folded,
+	const char *fmt,
+	...)
+{
+	va_list ap;
+	char *s;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	/* The runtime truncates a long result. Leave it to the runtime. */
+	if (len < 0 || len >= 65536)
+		return true;
+
+	s = malloc((size_t)len + 1);
+	if (s == NULL) {
+		hir_out_of_memory();
+		return false;
+	}
+	va_start(ap, fmt);
+	vsnprintf(s, (size_t)len + 1, fmt, ap);
+	va_end(ap);
+
+	result->type = HIR_TERM_STRING;
+	result->val.s = s;
+	*is_folded = true;
+
+	return true;
+}
+
+/* Evaluate a binary operation of two literals. */
+static bool
+hir_eval_binary(
+	int type,
+	struct hir_term *a,
+	struct hir_term *b,
+	struct hir_term *result,
+	bool *is_folded)
+{
+	float fa, fb;
+	int cmp;
+
+	*is_folded = false;
+
+	/* String concatenation. */
+	if (type == HIR_EXPR_PLUS &&
+	    (a->type == HIR_TERM_STRING || b->type == HIR_TERM_STRING)) {
+		if (a->type == HIR_TERM_INT)
+			return hir_make_string_term(result, is_folded, "%d%s", a->val.i, b->val.s);
+		if (a->type == HIR_TERM_FLOAT)
+			return hir_make_string_term(result, is_folded, "%f%s", a->val.f, b->val.s);
+		if (b->type == HIR_TERM_INT)
+			return hir_make_string_term(result, is_folded, "%s%d", a->val.s, b->val.i);
+		if (b->type == HIR_TERM_FLOAT)
+			return hir_make_string_term(result, is_folded, "%s%f", a->val.s, b->val.f);
+		return hir_make_string_term(result, is_folded, "%s%s", a->val.s, b->val.s);
+	}
+
+	/* String comparison. */
+	if (a->type == HIR_TERM_STRING || b->type == HIR_TERM_STRING) {
+		if (a->type != HIR_TERM_STRING || b->type != HIR_TERM_STRING)
+			return true;
+		cmp = strcmp(a->val.s, b->val.s);
+		result->type = HIR_TERM_INT;
+		switch (type) {
+		case HIR_EXPR_LT:  result->val.i = cmp < 0 ? 1 : 0; break;
+		case HIR_EXPR_LTE: result->val.i = cmp <= 0 ? 1 : 0; break;
+		case HIR_EXPR_GT:  result->val.i = cmp > 0 ? 1 : 0; break;
+		case HIR_EXPR_GTE: result->val.i = cmp >= 0 ? 1 : 0; break;
+		case HIR_EXPR_EQ:  result->val.i = cmp == 0 ? 1 : 0; break;
+		case HIR_EXPR_NEQ: result->val.i = cmp != 0 ? 1 : 0; break;
+		default:
+			return true;
+		}
+		*is_folded = true;
+		return true;
+	}
+
+	/* Integer operation. (wraps around like the runtime) */
+	if (a->type == HIR_TERM_INT && b->type == HIR_TERM_INT) {
+		result->type = HIR_TERM_INT;
+		switch (type) {
+		case HIR_EXPR_PLUS:  result->val.i = (int)((uint32_t)a->val.i + (uint32_t)b->val.i); break;
+		case HIR_EXPR_MINUS: result->val.i = (int)((uint32_t)a->val.i - (uint32_t)b->val.i); break;
+		case HIR_EXPR_MUL:   result->val.i = (int)((uint32_t)a->val.i * (uint32_t)b->val.i); break;
+		case HIR_EXPR_DIV:
+		case HIR_EXPR_MOD:
+			/* Leave the error and the overflow to the runtime. */
+			if (b->val.i == 0 || (a->val.i == INT32_MIN && b->val.i == -1))
+				return true;
+			result->val.i = type == HIR_EXPR_DIV ? a->val.i / b->val.i : a->val.i % b->val.i;
+			break;
+		case HIR_EXPR_AND: result->val.i = a->val.i & b->val.i; break;
+		case HIR_EXPR_OR:  result->val.i = a->val.i | b->val.i; break;
+		case HIR_EXPR_LT:  result->val.i = a->val.i < b->val.i ? 1 : 0; break;
+		case HIR_EXPR_LTE: result->val.i = a->val.i <= b->val.i ? 1 : 0; break;
+		case HIR_EXPR_GT:  result->val.i = a->val.i > b->val.i ? 1 : 0; break;
+		case HIR_EXPR_GTE: result->val.i = a->val.i >= b->val.i ? 1 : 0; break;
+		case HIR_EXPR_EQ:  result->val.i = a->val.i == b->val.i ? 1 : 0; break;
+		case HIR_EXPR_NEQ: result->val.i = a->val.i != b->val.i ? 1 : 0; break;
+		default:
+			return true;
+		}
+		*is_folded = true;
+		return true;
+	}
+
+	/* Floating-point operation. (MOD, AND and OR are integer only) */
+	fa = a->type == HIR_TERM_INT ? (float)a->val.i : a->val.f;
+	fb = b->type == HIR_TERM_INT ? (float)b->val.i : b->val.f;
+	switch (type) {
+	case HIR_EXPR_PLUS:  result->type = HIR_TERM_FLOAT; result->val.f = fa + fb; break;
+	case HIR_EXPR_MINUS: result->type = HIR_TERM_FLOAT; result->val.f = fa - fb; break;
+	case HIR_EXPR_MUL:   result->type = HIR_TERM_FLOAT; result->val.f = fa * fb; break;
+	case HIR_EXPR_DIV:
+		if (fb == 0)
+			return true;
+		result->type = HIR_TERM_FLOAT;
+		result->val.f = fa / fb;
+		break;
+	case HIR_EXPR_LT:  result->type = HIR_TERM_INT; result->val.i = fa < fb ? 1 : 0; break;
+	case HIR_EXPR_LTE: result->type = HIR_TERM_INT; result->val.i = fa <= fb ? 1 : 0; break;
+	case HIR_EXPR_GT:  result->type = HIR_TERM_INT; result->val.i = fa > fb ? 1 : 0; break;
+	case HIR_EXPR_GTE: result->type = HIR_TERM_INT; result->val.i = fa >= fb ? 1 : 0; break;
+	case HIR_EXPR_EQ:  result->type = HIR_TERM_INT; result->val.i = fa == fb ? 1 : 0; break;
+	case HIR_EXPR_NEQ: result->type = HIR_TERM_INT; result->val.i = fa != fb ? 1 : 0; break;
+	default:
+		return true;
+	}
+	*is_folded = true;
+
+	return true;
+}
+
+/* Fold an expression in place. */
+static bool
+hir_fold_expr(
+	struct hir_expr **expr,
+	struct hir_fold_state *st)
+{
+	struct hir_expr *e, *inner;
+	struct hir_term *a, *b, result;
+	bool is_folded;
+	int i;
+
+	e = *expr;
+	switch (e->type) {
+	case HIR_EXPR_TERM:
+		/* Propagate a constant local. */
+		if (e->val.term.term->type != HIR_TERM_SYMBOL)
+			break;
+		a = hir_find_const_local(st, e->val.term.term->val.symbol);
+		if (a == NULL)
+			break;
+		result = *a;
+		if (a->type == HIR_TERM_STRING) {
+			result.val.s = strdup(a->val.s);
+			if (result.val.s == NULL) {
+				hir_out_of_memory();
+				return false;
+			}
+		}
+		return hir_replace_with_term(expr, &result);
+	case HIR_EXPR_LT:
+	case HIR_EXPR_LTE:
+	case HIR_EXPR_GT:
+	case HIR_EXPR_GTE:
+	case HIR_EXPR_EQ:
+	case HIR_EXPR_NEQ:
+	case HIR_EXPR_PLUS:
+	case HIR_EXPR_MINUS:
+	case HIR_EXPR_MUL:
+	case HIR_EXPR_DIV:
+	case HIR_EXPR_MOD:
+	case HIR_EXPR_AND:
+	case HIR_EXPR_OR:
+		if (!hir_fold_expr(&e->val.binary.expr[0], st))
+			return false;
+		if (!hir_fold_expr(&e->val.binary.expr[1], st))
+			return false;
+		a = hir_get_const_term(e->val.binary.expr[0]);
+		b = hir_get_const_term(e->val.binary.expr[1]);
+		if (a == NULL || b == NULL)
+			break;
+		if (!hir_eval_binary(e->type, a, b, &result, &is_folded))
+			return false;
+		if (is_folded)
+			return hir_replace_with_term(expr, &result);
+		break;
+	case HIR_EXPR_SUBSCR:
+		if (!hir_fold_expr(&e->val.binary.expr[0], st))
+			return false;
+		if (!hir_fold_expr(&e->val.binary.expr[1], st))
+			return false;
+		break;
+	case HIR_EXPR_NEG:
+		if (!hir_fold_expr(&e->val.unary.expr, st))
+			return false;
+		a = hir_get_const_term(e->val.unary.expr);
+		if (a == NULL || a->type != HIR_TERM_INT)
+			break;
+		result.type = HIR_TERM_INT;
+		result.val.i = ~a->val.i;
+		return hir_replace_with_term(expr, &result);
+	case HIR_EXPR_PAR:
+		if (!hir_fold_expr(&e->val.unary.expr, st))
+			return false;
+		if (hir_get_const_term(e->val.unary.expr) == NULL)
+			break;
+
+		/* Drop the parentheses around a literal. */
+		inner = e->val.unary.expr;
+		e->val.unary.expr = NULL;
+		hir_free_expr(e);
+		*expr = inner;
+		break;
+	case HIR_EXPR_DOT:
+		if (!hir_fold_expr(&e->val.dot.obj, st))
+			return false;
+		break;
+	case HIR_EXPR_CALL:
+		for (i = 0; i < e->val.call.arg_count; i++) {
+			if (!hir_fold_expr(&e->val.call.arg[i], st))
+				return false;
+		}
+		break;
+	case HIR_EXPR_THISCALL:
+		if (!hir_fold_expr(&e->val.thiscall.obj, st))
+			return false;
+		for (i = 0; i < e->val.thiscall.arg_count; i++) {
+			if (!hir_fold_expr(&e->val.thiscall.arg[i], st))
+				return false;
+		}
+		break;
+	case HIR_EXPR_ARRAY:
+		for (i = 0; i < e->val.array.elem_count; i++) {
+			if (!hir_fold_expr(&e->val.array.elem[i], st))
+				return false;
+		}
+		break;
+	case HIR_EXPR_DICT:
+		for (i = 0; i < e->val.dict.kv_count; i++) {
+			if (!hir_fold_expr(&e->val.dict.value[i], st))
+				return false;
+		}
+		break;
+	default:
+		assert(NEVER_COME_HERE);
+		break;
+	}
+
+	return true;
+}
+
+/* Fold the statements of a basic block. */
+static bool
+hir_fold_stmt_list(
+	struct hir_block *func,
+	struct hir_stmt *stmt)
+{
+	struct hir_fold_state st;
+	struct hir_expr *lhs;
+	const char *symbol;
+
+	st.count = 0;
+	for (; stmt != NULL; stmt = stmt->next) {
+		/* The RHS sees the values before the assignment. */
+		if (!hir_fold_expr(&stmt->rhs, &st))
+			return false;
+
+		lhs = stmt->lhs;
+		if (lhs == NULL)
+			continue;
+
+		/* Fold the subscript and the object of an element store. */
+		if (lhs->type == HIR_EXPR_SUBSCR) {
+			if (!hir_fold_expr(&lhs->val.binary.expr[1], &st))
+				return false;
+			continue;
+		}
+		if (lhs->type != HIR_EXPR_TERM)
+			continue;
+
+		/* Track an assignment to a local. */
+		symbol = lhs->val.term.term->val.symbol;
+		if (hir_is_local_symbol(func, symbol))
+			hir_set_const_local(&st, symbol, hir_get_const_term(stmt->rhs));
+	}
+
+	return true;
+}
+
+/* Fold the expressions of a block, its inner blocks and its successors. */
+static bool
+hir_fold_block(
+	struct hir_block *func,
+	struct hir_block *b)
+{
+	struct hir_fold_state st;
+
+	/* Conditions see no propagated locals. */
+	st.count = 0;
+
+	for (; b != NULL; b = b->succ) {
+		switch (b->type) {
+		case HIR_BLOCK_BASIC:
+			if (!hir_fold_stmt_list(func, b->val.basic.stmt_list))
+				return false;
+			break;
+		case HIR_BLOCK_IF:
+			if (b->val.if_.cond != NULL) {
+				if (!hir_fold_expr(&b->val.if_.cond, &st))
+					return false;
+			}
+			if (!hir_fold_block(func, b->val.if_.inner))
+				return false;
+			if (!hir_fold_block(func, b->val.if_.chain_next))
+				return false;
+			break;
+		case HIR_BLOCK_FOR:
+			if (b->val.for_.start != NULL) {
+				if (!hir_fold_expr(&b->val.for_.start, &st))
+					return false;
+			}
+			if (b->val.for_.stop != NULL) {
+				if (!hir_fold_expr(&b->val.for_.stop, &st))
+					return false;
+			}
+			if (b->val.for_.collection != NULL) {
+				if (!hir_fold_expr(&b->val.for_.collection, &st))
+					return false;
+			}
+			if (!hir_fold_block(func, b->val.for_.inner))
+				return false;
+			break;
+		case HIR_BLOCK_WHILE:
+			if (b->val.while_.cond != NULL) {
+				if (!hir_fold_expr(&b->val.while_.cond, &st))
+					return false;
+			}
+			if (!hir_fold_block(func, b->val.while_.inner))
+				return false;
+			break;
+		case HIR_BLOCK_END:
+			break;
+		default:
+			assert(NEVER_COME_HERE);
+			break;
+		}
+
+		/* (b->succ == b) is a loop. */
+		if (b->stop)
+			break;
+	}
+
+	return true;
+}
+
 /* Free a block and its siblings. */
 static void
 hir_free_block(
@@ -2144,6 +2674,7 @@ hir_free_term(
 		assert(NEVER_COME_HERE);
 		break;
 	}
+	free(t);
 }
 
 /* Free a local variable list. */
@@ -10,6 +10,7 @@
  */
 
 #include "linguine/runtime.h"
+#include "linguine/lir.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -39,6 +40,10 @@ bool dbg_error_hook(struct rt_env *rt);
 /* Message. */
 #define BROKEN_BYTECODE		"Broken bytecode."
 
+/* Config. */
+extern bool linguine_conf_use_jit;
+extern int linguine_conf_jit_loop_threshold;
+
 /* Unary OP macro */
 #define UNARY_OP(helper)									\
 	uint32_t dst;										\
@@ -63,8 +68,8 @@ bool dbg_error_hook(struct rt_env *rt);
 	*pc += 1 + 2 + 2;									\
 	return true
 
-/* Binary OP macro */
-#define BINARY_OP(helper)								\
+/* Binary OP macro (profiled: record the source types) */
+#define BINARY_OP_EX(helper, profiled)							\
 	uint32_t dst;									\
 	uint32_t src1;									\
 	uint32_t src2;									\
@@ -88,11 +93,99 @@ bool dbg_error_hook(struct rt_env *rt);
 		rt_error(rt, BROKEN_BYTECODE);						\
 		return false;								\
 	}										\
+	if (profiled)									\
+		rt_profile_operands(rt, func, *pc, (int)src1, (int)src2);		\
 	if (!helper(rt, (int)dst, (int)src1, (int)src2))				\
 		return false;								\
 	*pc += 1 + 2 + 2 + 2;								\
 	return true
 
+#define BINARY_OP(helper)		BINARY_OP_EX(helper, false)
+#define PROFILED_BINARY_OP(helper)	BINARY_OP_EX(helper, true)
+
+/* Typed binary OP macro (the compiler proved the source types, so no tag switch) */
+#define TYPED_BINARY_OP_EX(src_type, dst_type, dst_field, expr, div_by_zero)		\
+	struct rt_value *a;								\
+	struct rt_value *b;								\
+	uint32_t dst;									\
+	uint32_t src1;									\
+	uint32_t src2;									\
+											\
+	if (*pc + 1 + 2 + 2 + 2 > func->bytecode_size) {				\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) | func->bytecode[*pc + 2];	\
+	src1 = ((uint32_t)func->bytecode[*pc + 3] << 8) | func->bytecode[*pc + 4]; 	\
+	src2 = ((uint32_t)func->bytecode[*pc + 5] << 8) | func->bytecode[*pc + 6]; 	\
+	if (dst >= (uint32_t)func->tmpvar_size ||					\
+	    src1 >= (uint32_t)func->tmpvar_size ||					\
+	    src2 >= (uint32_t)func->tmpvar_size) {					\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	a = &rt->frame->tmpvar[src1];							\
+	b = &rt->frame->tmpvar[src2];							\
+	if (a->type != src_type || b->type != src_type) {				\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	if (div_by_zero) {								\
+		rt_error(rt, _("Division by zero."));					\
+		return false;								\
+	}										\
+	rt->frame->tmpvar[dst].val.dst_field = (expr);					\
+	rt->frame->tmpvar[dst].type = dst_type;						\
+	*pc += 1 + 2 + 2 + 2;								\
+	return true
+
+#define TYPED_BINARY_OP(src_type, dst_type, dst_field, expr)				\
+	TYPED_BINARY_OP_EX(src_type, dst_type, dst_field, expr, false)
+#define INT_BINARY_OP(expr)		TYPED_BINARY_OP(RT_VALUE_INT, RT_VALUE_INT, i, expr)
+#define INT_COMPARE_OP(expr)		TYPED_BINARY_OP(RT_VALUE_INT, RT_VALUE_INT, i, (expr) ? 1 : 0)
+#define FLOAT_BINARY_OP(expr)		TYPED_BINARY_OP(RT_VALUE_FLOAT, RT_VALUE_FLOAT, f, expr)
+#define FLOAT_COMPARE_OP(expr)		TYPED_BINARY_OP(RT_VALUE_FLOAT, RT_VALUE_INT, i, (expr) ? 1 : 0)
+
+/* Unchecked load OP macro (the compiler proved the subscript in range) */
+#define UNCHECKED_LOAD_OP(col_type, col_field, elem, helper)				\
+	struct rt_value *col;								\
+	struct rt_value *subscr;							\
+	uint32_t dst;									\
+	uint32_t src1;									\
+	uint32_t src2;									\
+											\
+	if (*pc + 1 + 2 + 2 + 2 > func->bytecode_size) {				\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) | func->bytecode[*pc + 2];	\
+	src1 = ((uint32_t)func->bytecode[*pc + 3] << 8) | func->bytecode[*pc + 4]; 	\
+	src2 = ((uint32_t)func->bytecode[*pc + 5] << 8) | func->bytecode[*pc + 6]; 	\
+	if (dst >= (uint32_t)func->tmpvar_size ||					\
+	    src1 >= (uint32_t)func->tmpvar_size ||					\
+	    src2 >= (uint32_t)func->tmpvar_size) {					\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	col = &rt->frame->tmpvar[src1];							\
+	subscr = &rt->frame->tmpvar[src2];						\
+	if (col->type != col_type) {							\
+		/* Let the helper report the type error. */				\
+		if (!helper(rt, (int)dst, (int)src1, (int)src2))			\
+			return false;							\
+		*pc += 1 + 2 + 2 + 2;							\
+		return true;								\
+	}										\
+	if (subscr->type != RT_VALUE_INT ||						\
+	    subscr->val.i < 0 ||							\
+	    subscr->val.i >= col->val.col_field->size) {				\
+		rt_error(rt, BROKEN_BYTECODE);						\
+		return false;								\
+	}										\
+	rt->frame->tmpvar[dst] = col->val.col_field->elem[subscr->val.i];		\
+	*pc += 1 + 2 + 2 + 2;								\
+	return true
+
 static bool rt_visit_op(struct rt_env *rt, struct rt_func *func, int *pc);
 
 /*
@@ -103,9 +196,18 @@ rt_visit_bytecode(
 	struct rt_env *rt,
 	struct rt_func *func)
 {
-	int pc;
+	return rt_resume_bytecode(rt, func, 0);
+}
 
-	pc = 0;
+/*
+ * Visit a bytecode array from an instruction.
+ */
+bool
+rt_resume_bytecode(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int pc)
+{
 	while (pc < func->bytecode_size) {
 		dbg_pre_hook(rt);
 
@@ -118,6 +220,59 @@ rt_visit_bytecode(
 	return true;
 }
 
+/*
+ * Type profile
+ *  - The bytes are read by the compiler thread, so that they are
+ *    accessed atomically. A relaxed load and store are plain moves.
+ */
+
+/* Add a type to a profile byte. */
+static INLINE void
+rt_profile_type(
+	struct rt_func *func,
+	int index,
+	int type)
+{
+	uint8_t old;
+
+	old = __atomic_load_n(&func->profile[index], __ATOMIC_RELAXED);
+	if ((old & RT_PROFILE_BIT(type)) == 0)
+		__atomic_store_n(&func->profile[index], (uint8_t)(old | RT_PROFILE_BIT(type)), __ATOMIC_RELAXED);
+}
+
+/* Record the types of two operands of an instruction at pc. */
+static INLINE void
+rt_profile_operands(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int pc,
+	int src1,
+	int src2)
+{
+	if (func->profile == NULL)
+		return;
+
+	rt_profile_type(func, pc + 1, rt->frame->tmpvar[src1].type);
+	rt_profile_type(func, pc + 2, rt->frame->tmpvar[src2].type);
+}
+
+/* Record a dictionary slot of a LOADDOT at pc. */
+static INLINE void
+rt_profile_slot(
+	struct rt_func *func,
+	int pc,
+	int slot)
+{
+	uint8_t old, val;
+
+	val = slot + 1 < RT_PROFILE_MANY_SLOTS ? (uint8_t)(slot + 1) : RT_PROFILE_MANY_SLOTS;
+	old = __atomic_load_n(&func->profile[pc + 2], __ATOMIC_RELAXED);
+	if (old == 0)
+		__atomic_store_n(&func->profile[pc + 2], val, __ATOMIC_RELAXED);
+	else if (old != val && old != RT_PROFILE_MANY_SLOTS)
+		__atomic_store_n(&func->profile[pc + 2], RT_PROFILE_MANY_SLOTS, __ATOMIC_RELAXED);
+}
+
 /* Visit a ROP_LINEINFO instruction. */
 static inline bool
 rt_visit_lineinfo_op(
@@ -404,7 +559,7 @@ rt_visit_add_op(
 {
 	DEBUG_TRACE(*pc, "ADD");
 
-	BINARY_OP(rt_add_helper);
+	PROFILED_BINARY_OP(rt_add_helper);
 }
 
 /* Visit a ROP_SUB instruction. */
@@ -416,7 +571,7 @@ rt_visit_sub_op(
 {
 	DEBUG_TRACE(*pc, "SUB");
 
-	BINARY_OP(rt_sub_helper);
+	PROFILED_BINARY_OP(rt_sub_helper);
 }
 
 /* Visit a ROP_MUL instruction. */
@@ -428,7 +583,7 @@ rt_visit_mul_op(
 {
 	DEBUG_TRACE(*pc, "MUL");
 
-	BINARY_OP(rt_mul_helper);
+	PROFILED_BINARY_OP(rt_mul_helper);
 }
 
 /* Visit a ROP_DIV instruction. */
@@ -512,7 +667,7 @@ rt_visit_lt_op(
 {
 	DEBUG_TRACE(*pc, "LT");
 
-	BINARY_OP(rt_lt_helper);
+	PROFILED_BINARY_OP(rt_lt_helper);
 }
 
 /* Visit a ROP_LTE instruction. */
@@ -524,7 +679,7 @@ rt_visit_lte_op(
 {
 	DEBUG_TRACE(*pc, "LTE");
 
-	BINARY_OP(rt_lte_helper);
+	PROFILED_BINARY_OP(rt_lte_helper);
 }
 
 /* Visit a ROP_GT instruction. */
@@ -536,7 +691,7 @@ rt_visit_gt_op(
 {
 	DEBUG_TRACE(*pc, "GT");
 
-	BINARY_OP(rt_gt_helper);
+	PROFILED_BINARY_OP(rt_gt_helper);
 }
 
 /* Visit a ROP_GTE instruction. */
@@ -548,7 +703,7 @@ rt_visit_gte_op(
 {
 	DEBUG_TRACE(*pc, "GTE");
 
-	BINARY_OP(rt_gte_helper);
+	PROFILED_BINARY_OP(rt_gte_helper);
 }
 
 /* Visit a ROP_EQ instruction. */
@@ -560,7 +715,7 @@ rt_visit_eq_op(
 {
 	DEBUG_TRACE(*pc, "EQ");
 
-	BINARY_OP(rt_eq_helper);
+	PROFILED_BINARY_OP(rt_eq_helper);
 }
 
 /* Visit a ROP_NEQ instruction. */
@@ -572,7 +727,297 @@ rt_visit_neq_op(
 {
 	DEBUG_TRACE(*pc, "NEQ");
 
-	BINARY_OP(rt_neq_helper);
+	PROFILED_BINARY_OP(rt_neq_helper);
+}
+
+/* Visit a ROP_IADD instruction. */
+static inline bool
+rt_visit_iadd_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "IADD");
+
+	INT_BINARY_OP(a->val.i + b->val.i);
+}
+
+/* Visit a ROP_ISUB instruction. */
+static inline bool
+rt_visit_isub_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "ISUB");
+
+	INT_BINARY_OP(a->val.i - b->val.i);
+}
+
+/* Visit a ROP_IMUL instruction. */
+static inline bool
+rt_visit_imul_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "IMUL");
+
+	INT_BINARY_OP(a->val.i * b->val.i);
+}
+
+/* Visit a ROP_ILT instruction. */
+static inline bool
+rt_visit_ilt_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "ILT");
+
+	INT_COMPARE_OP(a->val.i < b->val.i);
+}
+
+/* Visit a ROP_ILTE instruction. */
+static inline bool
+rt_visit_ilte_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "ILTE");
+
+	INT_COMPARE_OP(a->val.i <= b->val.i);
+}
+
+/* Visit a ROP_IGT instruction. */
+static inline bool
+rt_visit_igt_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "IGT");
+
+	INT_COMPARE_OP(a->val.i > b->val.i);
+}
+
+/* Visit a ROP_IGTE instruction. */
+static inline bool
+rt_visit_igte_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "IGTE");
+
+	INT_COMPARE_OP(a->val.i >= b->val.i);
+}
+
+/* Visit a ROP_IEQ instruction. */
+static inline bool
+rt_visit_ieq_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "IEQ");
+
+	INT_COMPARE_OP(a->val.i == b->val.i);
+}
+
+/* Visit a ROP_INEQ instruction. */
+static inline bool
+rt_visit_ineq_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "INEQ");
+
+	INT_COMPARE_OP(a->val.i != b->val.i);
+}
+
+/* Visit a ROP_FADD instruction. */
+static inline bool
+rt_visit_fadd_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FADD");
+
+	FLOAT_BINARY_OP(a->val.f + b->val.f);
+}
+
+/* Visit a ROP_FSUB instruction. */
+static inline bool
+rt_visit_fsub_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FSUB");
+
+	FLOAT_BINARY_OP(a->val.f - b->val.f);
+}
+
+/* Visit a ROP_FMUL instruction. */
+static inline bool
+rt_visit_fmul_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FMUL");
+
+	FLOAT_BINARY_OP(a->val.f * b->val.f);
+}
+
+/* Visit a ROP_FDIV instruction. */
+static inline bool
+rt_visit_fdiv_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FDIV");
+
+	TYPED_BINARY_OP_EX(RT_VALUE_FLOAT, RT_VALUE_FLOAT, f, a->val.f / b->val.f, b->val.f == 0);
+}
+
+/* Visit a ROP_FLT instruction. */
+static inline bool
+rt_visit_flt_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FLT");
+
+	FLOAT_COMPARE_OP(a->val.f < b->val.f);
+}
+
+/* Visit a ROP_FLTE instruction. */
+static inline bool
+rt_visit_flte_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FLTE");
+
+	FLOAT_COMPARE_OP(a->val.f <= b->val.f);
+}
+
+/* Visit a ROP_FGT instruction. */
+static inline bool
+rt_visit_fgt_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FGT");
+
+	FLOAT_COMPARE_OP(a->val.f > b->val.f);
+}
+
+/* Visit a ROP_FGTE instruction. */
+static inline bool
+rt_visit_fgte_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FGTE");
+
+	FLOAT_COMPARE_OP(a->val.f >= b->val.f);
+}
+
+/* Visit a ROP_FEQ instruction. */
+static inline bool
+rt_visit_feq_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FEQ");
+
+	FLOAT_COMPARE_OP(a->val.f == b->val.f);
+}
+
+/* Visit a ROP_FNEQ instruction. */
+static inline bool
+rt_visit_fneq_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "FNEQ");
+
+	FLOAT_COMPARE_OP(a->val.f != b->val.f);
+}
+
+/* Visit a ROP_LACONST instruction. */
+static inline bool
+rt_visit_laconst_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	uint32_t dst;
+
+	DEBUG_TRACE(*pc, "LACONST");
+
+	if (*pc + 1 + 2  > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	if (dst >= (uint32_t)func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	if (!rt_make_frame_array(rt, &rt->frame->tmpvar[dst]))
+		return false;
+
+	*pc += 1 + 2;
+
+	return true;
+}
+
+/* Visit a ROP_LDCONST instruction. */
+static inline bool
+rt_visit_ldconst_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	uint32_t dst;
+
+	DEBUG_TRACE(*pc, "LDCONST");
+
+	if (*pc + 1 + 2  > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = ((uint32_t)func->bytecode[*pc + 1] << 8) |
+		(uint32_t)func->bytecode[*pc + 2];
+	if (dst >= (uint32_t)func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	if (!rt_make_frame_dict(rt, &rt->frame->tmpvar[dst]))
+		return false;
+
+	*pc += 1 + 2;
+
+	return true;
 }
 
 /* Visit a ROP_STOREARRAY instruction. */
@@ -596,7 +1041,7 @@ rt_visit_loadarray_op(
 {
 	DEBUG_TRACE(*pc, "LOADARRAY");
 
-	BINARY_OP(rt_loadarray_helper);
+	PROFILED_BINARY_OP(rt_loadarray_helper);
 }
 
 /* Visit a ROP_LEN instruction. */
@@ -635,6 +1080,30 @@ rt_visit_getdictvalbyindex_op(
 	BINARY_OP(rt_getdictvalbyindex_helper);
 }
 
+/* Visit a ROP_ULOADARRAY instruction. */
+static inline bool
+rt_visit_uloadarray_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "ULOADARRAY");
+
+	UNCHECKED_LOAD_OP(RT_VALUE_ARRAY, arr, table, rt_loadarray_helper);
+}
+
+/* Visit a ROP_UGETDICTVALBYINDEX instruction. */
+static inline bool
+rt_visit_ugetdictvalbyindex_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	DEBUG_TRACE(*pc, "UGETDICTVALBYINDEX");
+
+	UNCHECKED_LOAD_OP(RT_VALUE_DICT, dict, value, rt_getdictvalbyindex_helper);
+}
+
 /* Visit a ROP_LOADYMBOL instruction. */
 static inline bool
 rt_visit_loadsymbol_op(
@@ -670,6 +1139,41 @@ rt_visit_loadsymbol_op(
 	return true;
 }
 
+/* Visit a ROP_CHKFUNC instruction. */
+static inline bool
+rt_visit_chkfunc_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	int dst;
+	const char *symbol;
+	int len;
+
+	DEBUG_TRACE(*pc, "CHKFUNC");
+
+	if (*pc + 1 + 2 > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = (func->bytecode[*pc + 1] << 8) | (func->bytecode[*pc + 2]);
+
+	symbol = (const char *)&func->bytecode[*pc + 3];
+	len = (int)strlen(symbol);
+	if (*pc + 2 + len + 1 > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	if (!rt_chkfunc_helper(rt, dst, symbol))
+		return false;
+
+	*pc += 1 + 2 + len + 1;
+
+	return true;
+}
+
 /* Visit a ROP_STORESYMBOL instruction. */
 static inline bool
 rt_visit_storesymbol_op(
@@ -712,6 +1216,7 @@ rt_visit_loaddot_op(
 	uint32_t dict;
 	const char *field;
 	int len;
+	int slot;
 
 	DEBUG_TRACE(*pc, "LOADDOT");
 
@@ -741,6 +1246,22 @@ rt_visit_loaddot_op(
 		return false;
 	}
 
+	/* Record the receiver, and look up the field from the last slot. */
+	if (func->profile != NULL) {
+		rt_profile_type(func, *pc + 1, rt->frame->tmpvar[dict].type);
+		if (rt->frame->tmpvar[dict].type == RT_VALUE_DICT) {
+			slot = rt_find_dict_slot(rt->frame->tmpvar[dict].val.dict,
+						 field,
+						 __atomic_load_n(&func->profile[*pc + 2], __ATOMIC_RELAXED) - 1);
+			if (slot >= 0) {
+				rt_profile_slot(func, *pc, slot);
+				rt->frame->tmpvar[dst] = rt->frame->tmpvar[dict].val.dict->value[slot];
+				*pc += 1 + 2 + 2 + len + 1;
+				return true;
+			}
+		}
+	}
+
 	if (!rt_loaddot_helper(rt, (int)dst, (int)dict, field))
 		return false;
 
@@ -840,6 +1361,125 @@ rt_visit_call_op(
 	return true;
 }
 
+/* Visit a ROP_SWITCH instruction. */
+static inline bool
+rt_visit_switch_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	int dst;
+	int len;
+
+	DEBUG_TRACE(*pc, "SWITCH");
+
+	if (*pc + 1 + 2 + LIR_SWITCH_HEADER_SIZE > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = (func->bytecode[*pc + 1] << 8) | func->bytecode[*pc + 2];
+	if (dst >= func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	/* The table length counts from the src operand. */
+	len = (func->bytecode[*pc + 5] << 8) | func->bytecode[*pc + 6];
+	if (*pc + 1 + 2 + len > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	if (!rt_switch_helper(rt, dst, &func->bytecode[*pc + 3]))
+		return false;
+
+	*pc += 1 + 2 + len;
+
+	return true;
+}
+
+/* Visit a ROP_LOADFUNC instruction. */
+static inline bool
+rt_visit_loadfunc_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	int dst;
+	int index;
+
+	DEBUG_TRACE(*pc, "LOADFUNC");
+
+	if (*pc + 1 + 2 + 2 > func->bytecode_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	dst = (func->bytecode[*pc + 1] << 8) | func->bytecode[*pc + 2];
+	if (dst >= func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	index = (func->bytecode[*pc + 3] << 8) | func->bytecode[*pc + 4];
+
+	if (!rt_loadfunc_helper(rt, dst, index))
+		return false;
+
+	*pc += 1 + 2 + 2;
+
+	/* Skip the padding left by rt_link(). */
+	while (*pc < func->bytecode_size && func->bytecode[*pc] == ROP_NOP)
+		(*pc)++;
+
+	return true;
+}
+
+/* Visit a ROP_TAILCALL instruction. */
+static inline bool
+rt_visit_tailcall_op(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *pc)
+{
+	int dst_tmpvar;
+	int func_tmpvar;
+	int arg_count;
+	int arg_tmpvar;
+	int arg[RT_ARG_MAX];
+	int i;
+
+	DEBUG_TRACE(*pc, "TAILCALL");
+
+	dst_tmpvar = (func->bytecode[*pc + 1] << 8) | func->bytecode[*pc + 2];
+	if (dst_tmpvar >= func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	func_tmpvar = (func->bytecode[*pc + 3] << 8) | func->bytecode[*pc + 4];
+	if (func_tmpvar >= func->tmpvar_size) {
+		rt_error(rt, BROKEN_BYTECODE);
+		return false;
+	}
+
+	arg_count = func->bytecode[*pc + 5];
+	for (i = 0; i < arg_count; i++) {
+		arg_tmpvar = (func->bytecode[*pc + 6 + i * 2] << 8 ) | 
+			     func->bytecode[*pc + 6 + i * 2 + 1];
+		arg[i] = arg_tmpvar;
+	}
+
+	/* The frame now belongs to the callee. Return to rt_run_frame(). */
+	if (!rt_tailcall_helper(rt, func_tmpvar, arg_count, arg))
+		return false;
+
+	*pc = func->bytecode_size;
+
+	return true;
+}
+
 /* Visit a ROP_THISCALL instruction. */
 static inline bool
 rt_visit_thiscall_op(
@@ -889,6 +1529,9 @@ rt_visit_thiscall_op(
 		arg[i] = arg_tmpvar;
 	}
 
+	if (func->profile != NULL)
+		rt_profile_type(func, *pc + 1, rt->frame->tmpvar[obj_tmpvar].type);
+
 	if (!rt_thiscall_helper(rt, dst_tmpvar, obj_tmpvar, name, arg_count, arg))
 		return false;
 
@@ -904,6 +1547,7 @@ rt_visit_jmp_op(
 	struct rt_func *func,
 	int *pc)
 {
+	bool (*osr_code)(struct rt_env *, uint32_t);
 	uint32_t target;
 
 	DEBUG_TRACE(*pc, "JMP");
@@ -922,6 +1566,30 @@ rt_visit_jmp_op(
 		return false;
 	}
 
+	/* Count a back-edge, and compile the function if it got hot. */
+	if (target <= (uint32_t)*pc && linguine_conf_use_jit) {
+		if (__atomic_load_n(&func->jit_code, __ATOMIC_ACQUIRE) == NULL &&
+		    (++func->loop_count == linguine_conf_jit_loop_threshold ||
+		     __atomic_load_n(&func->jit_state, __ATOMIC_ACQUIRE) == RT_JIT_RETRY)) {
+			if (!jit_request(rt, func))
+				return false;
+		}
+
+		/* Do on-stack replacement: run the rest on JIT code with this frame. */
+		osr_code = __atomic_load_n(&func->jit_osr_code, __ATOMIC_ACQUIRE);
+		if (osr_code != NULL) {
+			if (!osr_code(rt, target))
+				return false;
+
+			/* If a type guard failed, continue from the instruction. */
+			if (rt->frame->deopt_addr != NULL)
+				return jit_deoptimize(rt, func, pc);
+
+			*pc = func->bytecode_size;
+			return true;
+		}
+	}
+
 	*pc = (int)target;
 
 	return true;
@@ -1152,6 +1820,10 @@ rt_visit_op(
 		if (!rt_visit_loadsymbol_op(rt, func, pc))
 			return false;
 		break;
+	case ROP_CHKFUNC:
+		if (!rt_visit_chkfunc_op(rt, func, pc))
+			return false;
+		break;
 	case ROP_STORESYMBOL:
 		if (!rt_visit_storesymbol_op(rt, func, pc))
 			return false;
@@ -1172,6 +1844,18 @@ rt_visit_op(
 		if (!rt_visit_thiscall_op(rt, func, pc))
 			return false;
 		break;
+	case ROP_TAILCALL:
+		if (!rt_visit_tailcall_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_SWITCH:
+		if (!rt_visit_switch_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_LOADFUNC:
+		if (!rt_visit_loadfunc_op(rt, func, pc))
+			return false;
+		break;
 	case ROP_JMP:
 		if (!rt_visit_jmp_op(rt, func, pc))
 			return false;
@@ -1189,6 +1873,98 @@ rt_visit_op(
 		if (!rt_visit_jmpiftrue_op(rt, func, pc))
 			return false;
 		break;
+	case ROP_IADD:
+		if (!rt_visit_iadd_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_ISUB:
+		if (!rt_visit_isub_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_IMUL:
+		if (!rt_visit_imul_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_ILT:
+		if (!rt_visit_ilt_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_ILTE:
+		if (!rt_visit_ilte_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_IGT:
+		if (!rt_visit_igt_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_IGTE:
+		if (!rt_visit_igte_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_IEQ:
+		if (!rt_visit_ieq_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_INEQ:
+		if (!rt_visit_ineq_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FADD:
+		if (!rt_visit_fadd_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FSUB:
+		if (!rt_visit_fsub_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FMUL:
+		if (!rt_visit_fmul_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FDIV:
+		if (!rt_visit_fdiv_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FLT:
+		if (!rt_visit_flt_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FLTE:
+		if (!rt_visit_flte_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FGT:
+		if (!rt_visit_fgt_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FGTE:
+		if (!rt_visit_fgte_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FEQ:
+		if (!rt_visit_feq_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_FNEQ:
+		if (!rt_visit_fneq_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_LACONST:
+		if (!rt_visit_laconst_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_LDCONST:
+		if (!rt_visit_ldconst_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_ULOADARRAY:
+		if (!rt_visit_uloadarray_op(rt, func, pc))
+			return false;
+		break;
+	case ROP_UGETDICTVALBYINDEX:
+		if (!rt_visit_ugetdictvalbyindex_op(rt, func, pc))
+			return false;
+		break;
 	default:
 		rt_error(rt, "Unknown opcode %d at pc=%d.", func->bytecode[*pc], *pc);
 		return false;
@@ -13,6 +13,8 @@
 
 #include "linguine/runtime.h"
 
+#include <string.h>
+
 /*
  * Generate a JIT-compiled code for a function.
  */
@@ -28,6 +30,21 @@ jit_build(
 	return true;
 }
 
+/*
+ * Compile a hot function now, or queue it to the compiler thread.
+ */
+bool
+jit_request(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	UNUSED_PARAMETER(rt);
+	UNUSED_PARAMETER(func);
+
+	/* stub */
+	return true;
+}
+
 /*
  * Free a JIT-compiled code for a function.
  */
@@ -42,9 +59,78 @@ jit_free(
 	/* stub */
 }
 
+/*
+ * Free the JIT code cache of an environment.
+ */
+void
+jit_free_cache(
+	struct rt_env *rt)
+{
+	UNUSED_PARAMETER(rt);
+
+	/* stub */
+}
+
+/*
+ * Get JIT code cache statistics.
+ */
+void
+jit_get_stats(
+	struct rt_env *rt,
+	struct rt_jit_stats *stats)
+{
+	UNUSED_PARAMETER(rt);
+
+	memset(stats, 0, sizeof(struct rt_jit_stats));
+	stats->last_fail_message = "";
+}
+
+/*
+ * Rebuild the current frame after a deoptimization exit.
+ */
+bool
+jit_deoptimize(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *lpc)
+{
+	/* stub */
+	rt->frame->deopt_addr = NULL;
+	*lpc = func->bytecode_size;
+	return true;
+}
+
+/*
+ * Load a function code from the disk cache.
+ */
+bool
+jit_load_disk_code(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	UNUSED_PARAMETER(rt);
+	UNUSED_PARAMETER(func);
+
+	/* stub */
+	return false;
+}
+
+/*
+ * Print the type profile of a function.
+ */
+void
+jit_dump_profile(
+	struct rt_func *func)
+{
+	UNUSED_PARAMETER(func);
+
+	/* stub */
+}
+
 #else
 
 #include "linguine/runtime.h"
+#include "jit.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -56,6 +142,26 @@ jit_free(
 #else
 #include <sys/mman.h>		/* mmap(), mprotect(), munmap() */
 #endif
+#if defined(JIT_DUAL_MAP)
+#include <unistd.h>		/* syscall(), ftruncate(), close() */
+#include <sys/syscall.h>	/* SYS_memfd_create */
+#endif
+#if defined(JIT_PROFILE)
+#include <unistd.h>		/* getpid() */
+#include <elf.h>		/* Elf64_Ehdr, ... */
+#endif
+#if defined(JIT_DISK_CACHE)
+#include <unistd.h>		/* getpid(), close() */
+#include <fcntl.h>		/* open() */
+#include <sys/stat.h>		/* fstat(), mkdir() */
+#endif
+
+/* Config */
+extern size_t linguine_conf_jit_cache_size;
+extern bool linguine_conf_jit_dual_map;
+extern bool linguine_conf_jit_async;
+extern bool linguine_conf_jit_deopt_stress;
+extern const char *linguine_conf_jit_disk_cache;
 
 /*
  * Map a memory region for the generated code.
@@ -69,6 +175,8 @@ jit_map_memory_region(
 	*region = VirtualAlloc(NULL, size, MEM_COMMIT, PAGE_READWRITE);
 #else
 	*region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (*region == MAP_FAILED)
+		*region = NULL;
 #endif
 	if (*region == NULL)
 		return false;
@@ -78,6 +186,65 @@ jit_map_memory_region(
 	return true;
 }
 
+#if defined(JIT_DUAL_MAP)
+/*
+ * Map a memfd region twice: a writable view and an executable view.
+ */
+static bool
+jit_map_dual_region(
+	uint8_t **xregion,
+	uint8_t **wregion,
+	size_t size)
+{
+	void *x, *w;
+	int fd;
+
+	fd = (int)syscall(SYS_memfd_create, "linguine-jit", 1 /* MFD_CLOEXEC */);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return false;
+	}
+
+	w = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (w == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	x = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	if (x == MAP_FAILED) {
+		munmap(w, size);
+		close(fd);
+		return false;
+	}
+
+	/* The mappings keep the memfd alive. */
+	close(fd);
+
+	*xregion = x;
+	*wregion = w;
+
+	return true;
+}
+#endif
+
+/*
+ * Unmap a region.
+ */
+void
+jit_unmap_memory_region(
+	void *region,
+	size_t size)
+{
+#if defined(TARGET_WINDOWS)
+	UNUSED_PARAMETER(size);
+	VirtualFree(region, 0, MEM_RELEASE);
+#else
+	munmap(region, size);
+#endif
+}
+
 /*
  * Make a region writable and non-executable.
  */
@@ -112,4 +279,2813 @@ jit_map_executable(
 #endif
 }
 
+/*
+ * Profiler support
+ */
+
+#if defined(JIT_PROFILE)
+
+/* GDB JIT compilation interface. (The names and the layout are fixed by GDB.) */
+enum {
+	JIT_NOACTION = 0,
+	JIT_REGISTER_FN,
+	JIT_UNREGISTER_FN
+};
+
+struct jit_code_entry {
+	struct jit_code_entry *next_entry;
+	struct jit_code_entry *prev_entry;
+	const char *symfile_addr;
+	uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+	uint32_t version;
+	uint32_t action_flag;
+	struct jit_code_entry *relevant_entry;
+	struct jit_code_entry *first_entry;
+};
+
+void __jit_debug_register_code(void) __attribute__((noinline));
+struct jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, NULL, NULL };
+
+/* GDB sets a breakpoint here to read __jit_debug_descriptor. */
+void
+__jit_debug_register_code(void)
+{
+	__asm__ __volatile__("");
+}
+
+/* ELF class and machine of the host. */
+#if defined(ARCH_X86_64) || defined(ARCH_ARM64) || defined(ARCH_PPC64) || defined(ARCH_MIPS64)
+#define JIT_ELF(t)		Elf64_##t
+#define JIT_ELF_CLASS		ELFCLASS64
+#define JIT_ELF_ST_INFO(b, t)	ELF64_ST_INFO(b, t)
+#else
+#define JIT_ELF(t)		Elf32_##t
+#define JIT_ELF_CLASS		ELFCLASS32
+#define JIT_ELF_ST_INFO(b, t)	ELF32_ST_INFO(b, t)
+#endif
+#if defined(ARCH_X86_64)
+#define JIT_ELF_MACHINE		EM_X86_64
+#elif defined(ARCH_X86)
+#define JIT_ELF_MACHINE		EM_386
+#elif defined(ARCH_ARM64)
+#define JIT_ELF_MACHINE		EM_AARCH64
+#elif defined(ARCH_ARM32)
+#define JIT_ELF_MACHINE		EM_ARM
+#elif defined(ARCH_PPC64)
+#define JIT_ELF_MACHINE		EM_PPC64
+#elif defined(ARCH_PPC32)
+#define JIT_ELF_MACHINE		EM_PPC
+#else
+#define JIT_ELF_MACHINE		EM_MIPS
+#endif
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define JIT_ELF_DATA		ELFDATA2MSB
+#else
+#define JIT_ELF_DATA		ELFDATA2LSB
+#endif
+
+/* Sections of a symbol file. */
+enum {
+	JIT_SECT_NULL,
+	JIT_SECT_TEXT,
+	JIT_SECT_EH_FRAME,
+	JIT_SECT_SHSTRTAB,
+	JIT_SECT_STRTAB,
+	JIT_SECT_SYMTAB,
+	JIT_SECT_COUNT
+};
+
+/* Section names. (offsets in jit_elf_shstrtab) */
+static const char jit_elf_shstrtab[] =
+	"\0.text\0.eh_frame\0.shstrtab\0.strtab\0.symtab";
+static const uint32_t jit_elf_shname[JIT_SECT_COUNT] = { 0, 1, 7, 17, 27, 35 };
+
+/* Symbol file for a function. (strtab follows) */
+struct jit_elf {
+	JIT_ELF(Ehdr) ehdr;
+	JIT_ELF(Shdr) shdr[JIT_SECT_COUNT];
+	JIT_ELF(Sym) sym[3];
+	uint8_t eh_frame[160];
+	char shstrtab[sizeof(jit_elf_shstrtab)];
+	char strtab[];
+};
+
+/* Lock for the perf map and the GDB list. (shared by all environments) */
+#if defined(JIT_ASYNC)
+static pthread_mutex_t jit_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#define JIT_PROFILE_LOCK()	pthread_mutex_lock(&jit_profile_lock)
+#define JIT_PROFILE_UNLOCK()	pthread_mutex_unlock(&jit_profile_lock)
+#else
+#define JIT_PROFILE_LOCK()
+#define JIT_PROFILE_UNLOCK()
+#endif
+
+/* perf map file. (NULL until the first write) */
+static FILE *jit_perf_map;
+
+#if defined(ARCH_X86_64)
+/* Put an unsigned LEB128. */
+static uint8_t *
+jit_put_uleb128(
+	uint8_t *p,
+	uint32_t v)
+{
+	do {
+		*p = (uint8_t)(v & 0x7f);
+		v >>= 7;
+		if (v != 0)
+			*p |= 0x80;
+		p++;
+	} while (v != 0);
+
+	return p;
+}
+
+/* Put a u32. */
+static uint8_t *
+jit_put_u32(
+	uint8_t *p,
+	uint32_t v)
+{
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+/*
+ * Put an .eh_frame that describes jit-x86_64.c code.
+ *  - The prologue pushes 11 registers and leaves rsp unchanged until
+ *    the epilogue, so the CFA is rsp + 96 in the body.
+ */
+static size_t
+jit_put_eh_frame(
+	uint8_t *buf,
+	size_t code_size)
+{
+	/* Push size and DWARF register number, in the prologue order. */
+	static const uint8_t push[][2] = {
+		{1, 0}, {1, 3}, {1, 2}, {1, 1}, {1, 5}, {1, 4},		/* rax rbx rcx rdx rdi rsi */
+		{2, 13}, {2, 14}, {2, 15}, {1, 6}, {2, 12},		/* r13 r14 r15 rbp r12 */
+	};
+	uint8_t *p, *len;
+	uint32_t cfa;
+	size_t i;
+
+	p = buf;
+
+	/* CIE */
+	len = p;
+	p = jit_put_u32(p, 0);			/* length */
+	p = jit_put_u32(p, 0);			/* CIE id */
+	*p++ = 1;				/* version */
+	*p++ = 'z'; *p++ = 'R'; *p++ = 0;	/* augmentation */
+	*p++ = 1;				/* code alignment */
+	*p++ = 0x78;				/* data alignment (-8) */
+	*p++ = 16;				/* return address (rip) */
+	*p++ = 1;				/* augmentation length */
+	*p++ = 0x20 | 0x03;			/* DW_EH_PE_textrel | DW_EH_PE_udata4 */
+	*p++ = 0x0c; *p++ = 7; *p++ = 8;	/* DW_CFA_def_cfa rsp, 8 */
+	*p++ = 0x80 | 16; *p++ = 1;		/* DW_CFA_offset rip, cfa-8 */
+	while ((p - buf) % 8 != 0)
+		*p++ = 0;			/* DW_CFA_nop */
+	jit_put_u32(len, (uint32_t)(p - len - 4));
+
+	/* FDE */
+	len = p;
+	p = jit_put_u32(p, 0);			/* length */
+	p = jit_put_u32(p, (uint32_t)(p - buf));	/* CIE pointer */
+	p = jit_put_u32(p, 0);			/* code offset in .text */
+	p = jit_put_u32(p, (uint32_t)code_size);	/* code size */
+	*p++ = 0;				/* augmentation length */
+	cfa = 8;
+	for (i = 0; i < sizeof(push) / sizeof(push[0]); i++) {
+		cfa += 8;
+		*p++ = (uint8_t)(0x40 | push[i][0]);	/* DW_CFA_advance_loc */
+		*p++ = 0x0e;				/* DW_CFA_def_cfa_offset */
+		p = jit_put_uleb128(p, cfa);
+		*p++ = (uint8_t)(0x80 | push[i][1]);	/* DW_CFA_offset */
+		p = jit_put_uleb128(p, cfa / 8);
+	}
+	while ((p - buf) % 8 != 0)
+		*p++ = 0;			/* DW_CFA_nop */
+	jit_put_u32(len, (uint32_t)(p - len - 4));
+
+	/* Terminator */
+	p = jit_put_u32(p, 0);
+
+	return (size_t)(p - buf);
+}
+#endif
+
+/* Make a symbol file of a code block. */
+static struct jit_elf *
+jit_make_elf(
+	struct jit_code_block *block,
+	const char *name,
+	const char *file_name,
+	size_t *elf_size)
+{
+	struct jit_elf *elf;
+	JIT_ELF(Shdr) *sh;
+	size_t name_len, file_len, eh_frame_size;
+
+	name_len = strlen(name);
+	file_len = strlen(file_name);
+	*elf_size = sizeof(struct jit_elf) + 1 + file_len + 1 + name_len + 1;
+
+	elf = malloc(*elf_size);
+	if (elf == NULL)
+		return NULL;
+	memset(elf, 0, *elf_size);
+
+	/* Header */
+	memcpy(elf->ehdr.e_ident, ELFMAG, SELFMAG);
+	elf->ehdr.e_ident[EI_CLASS] = JIT_ELF_CLASS;
+	elf->ehdr.e_ident[EI_DATA] = JIT_ELF_DATA;
+	elf->ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	elf->ehdr.e_type = ET_REL;
+	elf->ehdr.e_machine = JIT_ELF_MACHINE;
+	elf->ehdr.e_version = EV_CURRENT;
+	elf->ehdr.e_shoff = offsetof(struct jit_elf, shdr);
+	elf->ehdr.e_ehsize = sizeof(elf->ehdr);
+	elf->ehdr.e_shentsize = sizeof(elf->shdr[0]);
+	elf->ehdr.e_shnum = JIT_SECT_COUNT;
+	elf->ehdr.e_shstrndx = JIT_SECT_SHSTRTAB;
+
+	/* Strings: "\0" file "\0" name "\0" */
+	memcpy(elf->shstrtab, jit_elf_shstrtab, sizeof(jit_elf_shstrtab));
+	memcpy(elf->strtab + 1, file_name, file_len);
+	memcpy(elf->strtab + 1 + file_len + 1, name, name_len);
+
+	/* Symbols: a file and a function. */
+	elf->sym[1].st_name = 1;
+	elf->sym[1].st_info = JIT_ELF_ST_INFO(STB_LOCAL, STT_FILE);
+	elf->sym[1].st_shndx = SHN_ABS;
+	elf->sym[2].st_name = (uint32_t)(1 + file_len + 1);
+	elf->sym[2].st_info = JIT_ELF_ST_INFO(STB_GLOBAL, STT_FUNC);
+	elf->sym[2].st_shndx = JIT_SECT_TEXT;
+	elf->sym[2].st_value = 0;
+	elf->sym[2].st_size = (JIT_ELF(Off))block->size;
+
+	/* Unwind information. */
+#if defined(ARCH_X86_64)
+	eh_frame_size = jit_put_eh_frame(elf->eh_frame, block->size);
+#else
+	eh_frame_size = 0;
+#endif
+
+	/* Sections */
+	sh = &elf->shdr[JIT_SECT_TEXT];
+	sh->sh_name = jit_elf_shname[JIT_SECT_TEXT];
+	sh->sh_type = SHT_NOBITS;
+	sh->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	sh->sh_addr = (JIT_ELF(Addr))(uintptr_t)block->code;
+	sh->sh_size = (JIT_ELF(Off))block->size;
+	sh->sh_addralign = JIT_CODE_ALIGN;
+
+	sh = &elf->shdr[JIT_SECT_EH_FRAME];
+	sh->sh_name = jit_elf_shname[JIT_SECT_EH_FRAME];
+	sh->sh_type = SHT_PROGBITS;
+	sh->sh_flags = SHF_ALLOC;
+	sh->sh_offset = offsetof(struct jit_elf, eh_frame);
+	sh->sh_size = (JIT_ELF(Off))eh_frame_size;
+	sh->sh_addralign = 8;
+
+	sh = &elf->shdr[JIT_SECT_SHSTRTAB];
+	sh->sh_name = jit_elf_shname[JIT_SECT_SHSTRTAB];
+	sh->sh_type = SHT_STRTAB;
+	sh->sh_offset = offsetof(struct jit_elf, shstrtab);
+	sh->sh_size = sizeof(jit_elf_shstrtab);
+	sh->sh_addralign = 1;
+
+	sh = &elf->shdr[JIT_SECT_STRTAB];
+	sh->sh_name = jit_elf_shname[JIT_SECT_STRTAB];
+	sh->sh_type = SHT_STRTAB;
+	sh->sh_offset = offsetof(struct jit_elf, strtab);
+	sh->sh_size = (JIT_ELF(Off))(1 + file_len + 1 + name_len + 1);
+	sh->sh_addralign = 1;
+
+	sh = &elf->shdr[JIT_SECT_SYMTAB];
+	sh->sh_name = jit_elf_shname[JIT_SECT_SYMTAB];
+	sh->sh_type = SHT_SYMTAB;
+	sh->sh_offset = offsetof(struct jit_elf, sym);
+	sh->sh_size = sizeof(elf->sym);
+	sh->sh_link = JIT_SECT_STRTAB;
+	sh->sh_info = 2;	/* The first global symbol. */
+	sh->sh_addralign = sizeof(void *);
+	sh->sh_entsize = sizeof(elf->sym[0]);
+
+	return elf;
+}
+
+/* Write a perf map entry and register a symbol file to GDB. (locked) */
+static void
+jit_register_profile(
+	struct jit_code_block *block)
+{
+	struct jit_code_entry *entry;
+	struct jit_elf *elf;
+	size_t elf_size;
+	char path[64];
+
+	JIT_PROFILE_LOCK();
+
+	/* perf: /tmp/perf-<pid>.map */
+	if (jit_perf_map == NULL) {
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+		jit_perf_map = fopen(path, "w");
+	}
+	if (jit_perf_map != NULL) {
+		fprintf(jit_perf_map, "%lx %lx %s (%s)\n",
+			(unsigned long)(uintptr_t)block->code,
+			(unsigned long)block->size,
+			block->func->name,
+			block->func->file_name);
+		fflush(jit_perf_map);
+	}
+
+	/* GDB */
+	elf = jit_make_elf(block, block->func->name, block->func->file_name, &elf_size);
+	entry = malloc(sizeof(struct jit_code_entry));
+	if (elf == NULL || entry == NULL) {
+		free(elf);
+		free(entry);
+		JIT_PROFILE_UNLOCK();
+		return;
+	}
+	entry->symfile_addr = (const char *)elf;
+	entry->symfile_size = elf_size;
+	entry->prev_entry = NULL;
+	entry->next_entry = __jit_debug_descriptor.first_entry;
+	if (entry->next_entry != NULL)
+		entry->next_entry->prev_entry = entry;
+	__jit_debug_descriptor.first_entry = entry;
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+	__jit_debug_register_code();
+	__jit_debug_descriptor.action_flag = JIT_NOACTION;
+	block->debug_entry = entry;
+
+	JIT_PROFILE_UNLOCK();
+}
+
+/* Unregister a symbol file from GDB. (locked) */
+static void
+jit_unregister_profile(
+	struct jit_code_block *block)
+{
+	struct jit_code_entry *entry;
+
+	entry = block->debug_entry;
+	if (entry == NULL)
+		return;
+
+	JIT_PROFILE_LOCK();
+	if (entry->prev_entry != NULL)
+		entry->prev_entry->next_entry = entry->next_entry;
+	else
+		__jit_debug_descriptor.first_entry = entry->next_entry;
+	if (entry->next_entry != NULL)
+		entry->next_entry->prev_entry = entry->prev_entry;
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+	__jit_debug_register_code();
+	__jit_debug_descriptor.relevant_entry = NULL;
+	__jit_debug_descriptor.action_flag = JIT_NOACTION;
+	JIT_PROFILE_UNLOCK();
+
+	free((void *)entry->symfile_addr);
+	free(entry);
+	block->debug_entry = NULL;
+}
+
+#endif /* defined(JIT_PROFILE) */
+
+/*
+ * Code cache
+ */
+
+#if defined(JIT_ASYNC)
+#define JIT_LOCK(cache)		pthread_mutex_lock(&(cache)->lock)
+#define JIT_UNLOCK(cache)	pthread_mutex_unlock(&(cache)->lock)
+#else
+#define JIT_LOCK(cache)
+#define JIT_UNLOCK(cache)
+#endif
+
+/* Check whether a function has a calling frame. */
+static bool
+jit_is_func_active(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	struct rt_frame *frame;
+
+	for (frame = rt->frame; frame != NULL; frame = frame->next) {
+		if (frame->func == func)
+			return true;
+	}
+
+	return false;
+}
+
+/* Find the largest free gap. */
+static size_t
+jit_find_largest_gap(
+	struct jit_code_cache *cache,
+	uint8_t **gap)
+{
+	struct jit_code_block *b;
+	uint8_t *top;
+	size_t max;
+
+	*gap = NULL;
+	max = 0;
+	top = cache->region;
+	for (b = cache->block_list; b != NULL; b = b->next) {
+		if ((size_t)(b->code - top) > max) {
+			max = (size_t)(b->code - top);
+			*gap = top;
+		}
+		top = b->code + b->size;
+	}
+	if ((size_t)(cache->region + cache->region_size - top) > max) {
+		max = (size_t)(cache->region + cache->region_size - top);
+		*gap = top;
+	}
+
+	return max;
+}
+
+/* Insert a block in the address order. (locked) */
+static void
+jit_insert_block(
+	struct jit_code_cache *cache,
+	struct jit_code_block *block)
+{
+	struct jit_code_block **pp;
+
+	pp = &cache->block_list;
+	while (*pp != NULL && (*pp)->code < block->code)
+		pp = &(*pp)->next;
+	block->next = *pp;
+	*pp = block;
+}
+
+/* Remove the committed block of a function. (locked) */
+static void
+jit_remove_block(
+	struct jit_code_cache *cache,
+	struct rt_func *func)
+{
+	struct jit_code_block *block, **pp;
+
+	func->jit_code = NULL;
+	func->jit_osr_code = NULL;
+
+	pp = &cache->block_list;
+	while (*pp != NULL) {
+		block = *pp;
+		if (block->func == func && !block->is_pending) {
+#if defined(JIT_PROFILE)
+			jit_unregister_profile(block);
+#endif
+			*pp = block->next;
+			cache->used_size -= block->size;
+			cache->func_count--;
+			free(block->deopt_point);
+			free(block);
+			return;
+		}
+		pp = &block->next;
+	}
+}
+
+/* Evict the least recently called function. (locked) */
+static bool
+jit_evict_lru(
+	struct rt_env *rt)
+{
+	struct jit_code_block *b, *victim;
+	struct rt_func *func;
+
+	victim = NULL;
+	for (b = rt->jit_cache->block_list; b != NULL; b = b->next) {
+		if (b->is_pending)
+			continue;
+		if (jit_is_func_active(rt, b->func))
+			continue;
+		if (victim == NULL || b->func->jit_last_use < victim->func->jit_last_use)
+			victim = b;
+	}
+	if (victim == NULL)
+		return false;
+
+	func = victim->func;
+	jit_remove_block(rt->jit_cache, func);
+
+	/* Let the function get hot again. */
+	func->call_count = 0;
+	func->loop_count = 0;
+
+	rt->jit_cache->evict_count++;
+
+	return true;
+}
+
+/* Map the code cache of an environment if not yet. */
+static bool
+jit_init_cache(
+	struct rt_env *rt)
+{
+	struct jit_code_cache *cache;
+
+	if (rt->jit_cache != NULL) {
+		if (rt->jit_cache->region == NULL) {
+			rt_error(rt, _("Memory mapping failed."));
+			return false;
+		}
+		return true;
+	}
+
+	cache = malloc(sizeof(struct jit_code_cache));
+	if (cache == NULL) {
+		rt_out_of_memory(rt);
+		return false;
+	}
+	memset(cache, 0, sizeof(struct jit_code_cache));
+#if defined(JIT_ASYNC)
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	rt->jit_cache = cache;
+	cache->region_size = linguine_conf_jit_cache_size;
+#if defined(JIT_DUAL_MAP)
+	if (!linguine_conf_jit_dual_map ||
+	    !jit_map_dual_region(&cache->region, &cache->wregion, cache->region_size))
+#endif
+	{
+		/* Fallback: a single view that flips permissions. */
+		if (!jit_map_memory_region((void **)&cache->region, cache->region_size)) {
+			/* Keep the empty cache for the diagnostics. */
+			cache->region = NULL;
+			cache->region_size = 0;
+			rt_error(rt, _("Memory mapping failed."));
+			return false;
+		}
+		cache->wregion = cache->region;
+	}
+
+	return true;
+}
+
+#if defined(JIT_ASYNC)
+/* Compile job. */
+struct jit_job {
+	struct rt_func *func;
+	struct jit_job *next;
+};
+
+/* Compiler thread. */
+struct jit_worker {
+	pthread_t thread;
+
+	/* Signaled on a new job or a stop request. (with cache->lock) */
+	pthread_cond_t cond;
+
+	/* Job queue. */
+	struct jit_job *head;
+	struct jit_job *tail;
+
+	/* Stop request. */
+	bool stop;
+
+	/*
+	 * Environment that the compiler thread passes to jit_build().
+	 * It receives error messages in place of the owner, and shares
+	 * the owner's code cache. It has no frames and runs no code.
+	 */
+	struct rt_env rt;
+};
+
+/* Check whether a context runs on the compiler thread. */
+static bool
+jit_is_worker_context(
+	struct jit_context *ctx)
+{
+	struct jit_worker *worker;
+
+	worker = ctx->rt->jit_cache->worker;
+
+	return worker != NULL && ctx->rt == &worker->rt;
+}
+
+/* Main loop of the compiler thread. */
+static void *
+jit_worker_main(
+	void *arg)
+{
+	struct jit_code_cache *cache;
+	struct jit_worker *worker;
+	struct jit_job *job;
+	struct rt_func *func;
+	int state;
+
+	cache = arg;
+	worker = cache->worker;
+
+	JIT_LOCK(cache);
+	while (true) {
+		while (!worker->stop && worker->head == NULL)
+			pthread_cond_wait(&worker->cond, &cache->lock);
+		if (worker->stop)
+			break;
+
+		/* Dequeue. */
+		job = worker->head;
+		worker->head = job->next;
+		if (worker->head == NULL)
+			worker->tail = NULL;
+		JIT_UNLOCK(cache);
+
+		/* Compile and publish. (jit_build() never fails here) */
+		func = job->func;
+		free(job);
+		jit_build(&worker->rt, func);
+
+		/* Done, unless the function waits for a retry. */
+		state = RT_JIT_QUEUED;
+		__atomic_compare_exchange_n(&func->jit_state, &state, RT_JIT_IDLE,
+					    false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+		JIT_LOCK(cache);
+	}
+	JIT_UNLOCK(cache);
+
+	return NULL;
+}
+
+/* Start the compiler thread. */
+static bool
+jit_start_worker(
+	struct rt_env *rt)
+{
+	struct jit_code_cache *cache;
+	struct jit_worker *worker;
+
+	cache = rt->jit_cache;
+	if (cache->worker != NULL)
+		return true;
+
+	worker = malloc(sizeof(struct jit_worker));
+	if (worker == NULL)
+		return false;
+	memset(worker, 0, sizeof(struct jit_worker));
+	worker->rt.jit_cache = cache;
+	worker->rt.jit_profile = rt->jit_profile;
+	pthread_cond_init(&worker->cond, NULL);
+
+	cache->worker = worker;
+	if (pthread_create(&worker->thread, NULL, jit_worker_main, cache) != 0) {
+		cache->worker = NULL;
+		pthread_cond_destroy(&worker->cond);
+		free(worker);
+		return false;
+	}
+
+	return true;
+}
+
+/* Stop the compiler thread and drop the queued jobs. */
+static void
+jit_stop_worker(
+	struct rt_env *rt)
+{
+	struct jit_code_cache *cache;
+	struct jit_worker *worker;
+	struct jit_job *job, *next;
+
+	cache = rt->jit_cache;
+	worker = cache->worker;
+	if (worker == NULL)
+		return;
+
+	JIT_LOCK(cache);
+	worker->stop = true;
+	pthread_cond_signal(&worker->cond);
+	JIT_UNLOCK(cache);
+
+	pthread_join(worker->thread, NULL);
+
+	job = worker->head;
+	while (job != NULL) {
+		next = job->next;
+		job->func->jit_state = RT_JIT_IDLE;
+		free(job);
+		job = next;
+	}
+
+	cache->worker = NULL;
+	pthread_cond_destroy(&worker->cond);
+	free(worker);
+}
+
+/* Queue a function to the compiler thread. */
+static bool
+jit_enqueue(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	struct jit_code_cache *cache;
+	struct jit_worker *worker;
+	struct jit_job *job;
+
+	job = malloc(sizeof(struct jit_job));
+	if (job == NULL)
+		return false;
+	job->func = func;
+	job->next = NULL;
+
+	cache = rt->jit_cache;
+	worker = cache->worker;
+
+	JIT_LOCK(cache);
+	__atomic_store_n(&func->jit_state, RT_JIT_QUEUED, __ATOMIC_RELEASE);
+	if (worker->tail == NULL)
+		worker->head = job;
+	else
+		worker->tail->next = job;
+	worker->tail = job;
+	pthread_cond_signal(&worker->cond);
+	JIT_UNLOCK(cache);
+
+	return true;
+}
+#endif
+
+/*
+ * Compile a hot function now, or queue it to the compiler thread.
+ */
+bool
+jit_request(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+#if defined(JIT_ASYNC)
+	int state;
+
+	if (linguine_conf_jit_async) {
+		state = __atomic_load_n(&func->jit_state, __ATOMIC_ACQUIRE);
+
+		/* Being compiled in background. */
+		if (state == RT_JIT_QUEUED)
+			return true;
+
+		/* Only the calling thread can evict code for a retry. */
+		if (state == RT_JIT_RETRY) {
+			__atomic_store_n(&func->jit_state, RT_JIT_IDLE, __ATOMIC_RELEASE);
+			return jit_build(rt, func);
+		}
+
+		/* Queue if the cache is dual-mapped. Otherwise, compile now. */
+		if (jit_init_cache(rt) &&
+		    rt->jit_cache->wregion != rt->jit_cache->region &&
+		    jit_start_worker(rt) &&
+		    jit_enqueue(rt, func))
+			return true;
+		rt->error_message[0] = '\0';
+	}
+#endif
+
+	return jit_build(rt, func);
+}
+
+/*
+ * Take a free code area and make it writable.
+ */
+bool
+jit_alloc_code(
+	struct jit_context *ctx)
+{
+	struct jit_code_cache *cache;
+	struct jit_code_block *block;
+	uint8_t *gap;
+	size_t need, size;
+
+	/* If the first call, map a memory region for the generated code. */
+	if (!jit_init_cache(ctx->rt))
+		return false;
+	cache = ctx->rt->jit_cache;
+	ctx->exec_offset = cache->region - cache->wregion;
+
+	block = malloc(sizeof(struct jit_code_block));
+	if (block == NULL) {
+		rt_out_of_memory(ctx->rt);
+		return false;
+	}
+
+	JIT_LOCK(cache);
+
+	/* Evict cold functions until an expected code size fits. */
+	need = (size_t)ctx->func->bytecode_size * JIT_CODE_RATIO + JIT_CODE_MARGIN;
+	while (jit_find_largest_gap(cache, &gap) < need) {
+#if defined(JIT_ASYNC)
+		if (jit_is_worker_context(ctx)) {
+			/* Leave eviction to the calling thread. */
+			__atomic_store_n(&ctx->func->jit_state, RT_JIT_RETRY, __ATOMIC_RELEASE);
+			JIT_UNLOCK(cache);
+			free(block);
+			rt_error(ctx->rt, _("JIT code cache is full."));
+			return false;
+		}
+#endif
+		if (!jit_evict_lru(ctx->rt)) {
+			JIT_UNLOCK(cache);
+			free(block);
+			rt_error(ctx->rt, _("JIT code cache is full."));
+			return false;
+		}
+	}
+	size = jit_find_largest_gap(cache, &gap);
+
+	/* Reserve the whole gap until the commit. */
+	block->code = gap;
+	block->size = size;
+	block->func = ctx->func;
+	block->is_pending = true;
+	block->debug_entry = NULL;
+	block->deopt_point = NULL;
+	block->deopt_point_count = 0;
+	jit_insert_block(cache, block);
+
+	JIT_UNLOCK(cache);
+
+	/* Generate code through the writable view. */
+	ctx->block = block;
+	ctx->code_top = gap - ctx->exec_offset;
+	ctx->code_end = (uint8_t *)ctx->code_top + size;
+	ctx->code = ctx->code_top;
+
+	/* Make code writable and non-executable. */
+	if (cache->wregion == cache->region)
+		jit_map_writable(cache->region, cache->region_size);
+
+	return true;
+}
+
+/*
+ * Register the generated code, make it executable, and publish it.
+ */
+bool
+jit_commit_code(
+	struct jit_context *ctx)
+{
+	struct jit_code_cache *cache;
+	bool (*code)(struct rt_env *);
+	bool (*osr_code)(struct rt_env *, uint32_t);
+	size_t size;
+
+	cache = ctx->rt->jit_cache;
+
+	size = (size_t)((uint8_t *)ctx->code - (uint8_t *)ctx->code_top);
+	size = (size + JIT_CODE_ALIGN - 1) & ~(size_t)(JIT_CODE_ALIGN - 1);
+
+	/* Make code executable and non-writable. */
+	if (cache->wregion == cache->region) {
+		jit_map_executable(cache->region, cache->region_size);
+	} else {
+		__builtin___clear_cache((char *)jit_get_exec_addr(ctx, ctx->code_top),
+					(char *)jit_get_exec_addr(ctx, ctx->code));
+	}
+
+	code = (bool (*)(struct rt_env *))jit_get_exec_addr(ctx, ctx->code_top);
+	osr_code = NULL;
+	if (ctx->osr_code != NULL)
+		osr_code = (bool (*)(struct rt_env *, uint32_t))jit_get_exec_addr(ctx, ctx->osr_code);
+
+	JIT_LOCK(cache);
+
+	/* Shrink the reserved block to the code. */
+	ctx->block->size = size;
+	ctx->block->is_pending = false;
+
+	/* Move the deopt points to the block. */
+	ctx->block->deopt_point = ctx->deopt_point;
+	ctx->block->deopt_point_count = ctx->deopt_point_count;
+	ctx->deopt_point = NULL;
+	ctx->deopt_point_count = 0;
+	ctx->deopt_point_size = 0;
+
+	cache->used_size += size;
+	cache->func_count++;
+	if (ctx->is_loaded)
+		cache->disk_load_count++;
+	else
+		cache->compile_count++;
+
+	/* Publish. (The OSR entry first, then the entry that callers check.) */
+#if defined(JIT_ASYNC)
+	if (jit_is_worker_context(ctx))
+		cache->async_count++;
+	__atomic_store_n(&ctx->func->jit_osr_code, osr_code, __ATOMIC_RELEASE);
+	__atomic_store_n(&ctx->func->jit_code, code, __ATOMIC_RELEASE);
+#else
+	ctx->func->jit_osr_code = osr_code;
+	ctx->func->jit_code = code;
+#endif
+
+#if defined(JIT_PROFILE)
+	/* Tell perf and GDB. */
+	if (ctx->rt->jit_profile)
+		jit_register_profile(ctx->block);
+#endif
+
+	JIT_UNLOCK(cache);
+
+	ctx->block = NULL;
+
+	return true;
+}
+
+/*
+ * Discard the generated code and make the region executable.
+ */
+void
+jit_cancel_code(
+	struct jit_context *ctx)
+{
+	struct jit_code_cache *cache;
+	struct jit_code_block **pp;
+
+	cache = ctx->rt->jit_cache;
+	if (cache->wregion == cache->region)
+		jit_map_executable(cache->region, cache->region_size);
+
+	/* Release the reserved block. */
+	JIT_LOCK(cache);
+	pp = &cache->block_list;
+	while (*pp != NULL) {
+		if (*pp == ctx->block) {
+			*pp = ctx->block->next;
+			break;
+		}
+		pp = &(*pp)->next;
+	}
+	JIT_UNLOCK(cache);
+
+	free(ctx->block);
+	ctx->block = NULL;
+}
+
+/*
+ * Add a PC entry.
+ */
+bool
+jit_add_pc_entry(
+	struct jit_context *ctx,
+	uint32_t lpc,
+	void *code)
+{
+	struct pc_entry *new_table;
+	int new_size;
+
+	if (ctx->pc_entry_count == ctx->pc_entry_size) {
+		new_size = ctx->pc_entry_size == 0 ? JIT_TABLE_INIT_SIZE : ctx->pc_entry_size * 2;
+		new_table = realloc(ctx->pc_entry, sizeof(struct pc_entry) * (size_t)new_size);
+		if (new_table == NULL) {
+			rt_out_of_memory(ctx->rt);
+			return false;
+		}
+		ctx->pc_entry = new_table;
+		ctx->pc_entry_size = new_size;
+	}
+
+	ctx->pc_entry[ctx->pc_entry_count].lpc = lpc;
+	ctx->pc_entry[ctx->pc_entry_count].code = code;
+	ctx->pc_entry_count++;
+
+	return true;
+}
+
+/*
+ * Add a branch patch entry.
+ */
+bool
+jit_add_branch_patch(
+	struct jit_context *ctx,
+	void *code,
+	uint32_t lpc,
+	int type)
+{
+	struct branch_patch *new_table;
+	int new_size;
+
+	if (ctx->branch_patch_count == ctx->branch_patch_size) {
+		new_size = ctx->branch_patch_size == 0 ? JIT_TABLE_INIT_SIZE : ctx->branch_patch_size * 2;
+		new_table = realloc(ctx->branch_patch, sizeof(struct branch_patch) * (size_t)new_size);
+		if (new_table == NULL) {
+			rt_out_of_memory(ctx->rt);
+			return false;
+		}
+		ctx->branch_patch = new_table;
+		ctx->branch_patch_size = new_size;
+	}
+
+	ctx->branch_patch[ctx->branch_patch_count].code = code;
+	ctx->branch_patch[ctx->branch_patch_count].lpc = lpc;
+	ctx->branch_patch[ctx->branch_patch_count].type = type;
+	ctx->branch_patch_count++;
+
+	return true;
+}
+
+/*
+ * Add a deopt point for an exit at code.
+ */
+bool
+jit_add_deopt_point(
+	struct jit_context *ctx,
+	void *code,
+	uint32_t lpc,
+	const int *tmpvar)
+{
+	struct jit_deopt_point *new_table;
+	int new_size;
+
+	if (ctx->deopt_point_count == ctx->deopt_point_size) {
+		new_size = ctx->deopt_point_size == 0 ? JIT_TABLE_INIT_SIZE : ctx->deopt_point_size * 2;
+		new_table = realloc(ctx->deopt_point, sizeof(struct jit_deopt_point) * (size_t)new_size);
+		if (new_table == NULL) {
+			rt_out_of_memory(ctx->rt);
+			return false;
+		}
+		ctx->deopt_point = new_table;
+		ctx->deopt_point_size = new_size;
+	}
+
+	ctx->deopt_point[ctx->deopt_point_count].offset = (uint32_t)((uint8_t *)code - (uint8_t *)ctx->code_top);
+	ctx->deopt_point[ctx->deopt_point_count].lpc = lpc;
+	memcpy(ctx->deopt_point[ctx->deopt_point_count].tmpvar, tmpvar, sizeof(int) * JIT_LOOP_REG_MAX);
+	ctx->deopt_point_count++;
+
+	return true;
+}
+
+/*
+ * Find a code address of an lpc.
+ */
+void *
+jit_find_pc_entry(
+	struct jit_context *ctx,
+	uint32_t lpc)
+{
+	int lo, hi, mid;
+
+	/* Binary search. (The entries are added in the lpc order.) */
+	lo = 0;
+	hi = ctx->pc_entry_count - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ctx->pc_entry[mid].lpc == lpc)
+			return ctx->pc_entry[mid].code;
+		if (ctx->pc_entry[mid].lpc < lpc)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Record a failure, discard the code, and keep the function interpreted.
+ */
+bool
+jit_fail(
+	struct jit_context *ctx)
+{
+	struct jit_code_cache *cache;
+
+	cache = ctx->rt->jit_cache;
+	if (cache != NULL) {
+		/* Discard the code. (nothing is published before the commit) */
+		if (ctx->block != NULL)
+			jit_cancel_code(ctx);
+
+		/* Record the failure, unless the calling thread retries it. */
+		JIT_LOCK(cache);
+		if (__atomic_load_n(&ctx->func->jit_state, __ATOMIC_ACQUIRE) != RT_JIT_RETRY) {
+			cache->fail_count++;
+			snprintf(cache->last_fail_message,
+				 sizeof(cache->last_fail_message),
+				 "%s: %s",
+				 ctx->func->name,
+				 rt_get_error_message(ctx->rt));
+		}
+		JIT_UNLOCK(cache);
+	}
+
+	/* The function is not compiled, and it is not an error. */
+	ctx->rt->error_message[0] = '\0';
+
+	jit_free_context(ctx);
+
+	return true;
+}
+
+/*
+ * Free the tables of a context.
+ */
+void
+jit_free_context(
+	struct jit_context *ctx)
+{
+	free(ctx->pc_entry);
+	ctx->pc_entry = NULL;
+	ctx->pc_entry_count = 0;
+	ctx->pc_entry_size = 0;
+
+	free(ctx->branch_patch);
+	ctx->branch_patch = NULL;
+	ctx->branch_patch_count = 0;
+	ctx->branch_patch_size = 0;
+
+	free(ctx->deopt_point);
+	ctx->deopt_point = NULL;
+	ctx->deopt_point_count = 0;
+	ctx->deopt_point_size = 0;
+
+	free(ctx->reloc);
+	ctx->reloc = NULL;
+	ctx->reloc_count = 0;
+	ctx->reloc_size = 0;
+
+	free(ctx->ir);
+	ctx->ir = NULL;
+	ctx->ir_count = 0;
+	ctx->cur_ir = NULL;
+}
+
+/*
+ * Free a JIT-compiled code for a function.
+ */
+void
+jit_free(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	struct jit_code_cache *cache;
+
+	cache = rt->jit_cache;
+	if (cache == NULL) {
+		func->jit_code = NULL;
+		func->jit_osr_code = NULL;
+		return;
+	}
+
+	JIT_LOCK(cache);
+	jit_remove_block(cache, func);
+	JIT_UNLOCK(cache);
+}
+
+/*
+ * Free the JIT code cache of an environment.
+ */
+void
+jit_free_cache(
+	struct rt_env *rt)
+{
+	struct jit_code_cache *cache;
+	struct jit_code_block *block, *next;
+
+	cache = rt->jit_cache;
+	if (cache == NULL)
+		return;
+
+#if defined(JIT_ASYNC)
+	/* No compilation runs after this. */
+	jit_stop_worker(rt);
+#endif
+
+	block = cache->block_list;
+	while (block != NULL) {
+		next = block->next;
+		block->func->jit_code = NULL;
+		block->func->jit_osr_code = NULL;
+#if defined(JIT_PROFILE)
+		jit_unregister_profile(block);
+#endif
+		free(block->deopt_point);
+		free(block);
+		block = next;
+	}
+
+	if (cache->region != NULL) {
+		jit_unmap_memory_region(cache->region, cache->region_size);
+		if (cache->wregion != cache->region)
+			jit_unmap_memory_region(cache->wregion, cache->region_size);
+	}
+#if defined(JIT_ASYNC)
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free(cache);
+	rt->jit_cache = NULL;
+}
+
+/*
+ * Get JIT code cache statistics.
+ */
+void
+jit_get_stats(
+	struct rt_env *rt,
+	struct rt_jit_stats *stats)
+{
+	struct jit_code_cache *cache;
+
+	memset(stats, 0, sizeof(struct rt_jit_stats));
+	stats->cache_size = linguine_conf_jit_cache_size;
+	stats->last_fail_message = "";
+
+	cache = rt->jit_cache;
+	if (cache == NULL)
+		return;
+
+	JIT_LOCK(cache);
+	stats->cache_size = cache->region_size;
+	stats->used_size = cache->used_size;
+	stats->func_count = cache->func_count;
+	stats->compile_count = cache->compile_count;
+	stats->evict_count = cache->evict_count;
+	stats->async_count = cache->async_count;
+	stats->deopt_count = cache->deopt_count;
+	stats->disk_load_count = cache->disk_load_count;
+	stats->disk_store_count = cache->disk_store_count;
+	stats->fail_count = cache->fail_count;
+	stats->last_fail_message = cache->last_fail_message;
+	JIT_UNLOCK(cache);
+}
+
+/*
+ * Disk cache
+ */
+
+/* Helpers that a backend calls through an absolute address. (JIT_RELOC_HELPER) */
+static void *const jit_helper_table[] = {
+	(void *)rt_add_helper,
+	(void *)rt_sub_helper,
+	(void *)rt_mul_helper,
+	(void *)rt_div_helper,
+	(void *)rt_mod_helper,
+	(void *)rt_and_helper,
+	(void *)rt_or_helper,
+	(void *)rt_xor_helper,
+	(void *)rt_neg_helper,
+	(void *)rt_lt_helper,
+	(void *)rt_lte_helper,
+	(void *)rt_eq_helper,
+	(void *)rt_neq_helper,
+	(void *)rt_gte_helper,
+	(void *)rt_gt_helper,
+	(void *)rt_storearray_helper,
+	(void *)rt_loadarray_helper,
+	(void *)rt_len_helper,
+	(void *)rt_getdictkeybyindex_helper,
+	(void *)rt_getdictvalbyindex_helper,
+	(void *)rt_loadsymbol_helper,
+	(void *)rt_storesymbol_helper,
+	(void *)rt_loaddot_helper,
+	(void *)rt_loaddot_slot_helper,
+	(void *)rt_storedot_helper,
+	(void *)rt_call_helper,
+	(void *)rt_thiscall_helper,
+	(void *)rt_enter_call_helper,
+	(void *)rt_leave_call_helper,
+	(void *)rt_make_string,
+	(void *)rt_make_empty_array,
+	(void *)rt_make_empty_dict,
+	(void *)rt_make_frame_array,
+	(void *)rt_make_frame_dict,
+	(void *)rt_tailcall_helper,
+	(void *)rt_switch_helper,
+	(void *)rt_loadfunc_helper,
+	(void *)rt_chkfunc_helper,
+};
+
+#define JIT_HELPER_COUNT	((int)(sizeof(jit_helper_table) / sizeof(jit_helper_table[0])))
+
+/*
+ * Add a relocation for a 64-bit address at code.
+ *  - A value that cannot be expressed as a relocation marks the code
+ *    as not relocatable, and the code is not written to the disk cache.
+ */
+bool
+jit_add_reloc(
+	struct jit_context *ctx,
+	int type,
+	uint64_t value)
+{
+	struct jit_reloc *new_table;
+	uint64_t base, limit;
+	uint32_t addend;
+	int new_size, i;
+
+	switch (type) {
+	case JIT_RELOC_HELPER:
+		for (i = 0; i < JIT_HELPER_COUNT; i++) {
+			if ((uint64_t)(uintptr_t)jit_helper_table[i] == value)
+				break;
+		}
+		if (i == JIT_HELPER_COUNT) {
+			ctx->is_not_relocatable = true;
+			return true;
+		}
+		addend = (uint32_t)i;
+		break;
+	case JIT_RELOC_BYTECODE:
+	case JIT_RELOC_CODE:
+		/* No argument area. */
+		if (type == JIT_RELOC_CODE && value == 0)
+			return true;
+
+		if (type == JIT_RELOC_BYTECODE) {
+			base = (uint64_t)(uintptr_t)ctx->func->bytecode;
+			limit = base + (uint64_t)ctx->func->bytecode_size;
+		} else {
+			base = (uint64_t)(uintptr_t)jit_get_exec_addr(ctx, ctx->code_top);
+			limit = (uint64_t)(uintptr_t)jit_get_exec_addr(ctx, ctx->code_end);
+		}
+		if (value < base || value >= limit) {
+			ctx->is_not_relocatable = true;
+			return true;
+		}
+		addend = (uint32_t)(value - base);
+		break;
+	default:
+		assert(0);
+		return false;
+	}
+
+	if (ctx->reloc_count == ctx->reloc_size) {
+		new_size = ctx->reloc_size == 0 ? JIT_TABLE_INIT_SIZE : ctx->reloc_size * 2;
+		new_table = realloc(ctx->reloc, sizeof(struct jit_reloc) * (size_t)new_size);
+		if (new_table == NULL) {
+			rt_out_of_memory(ctx->rt);
+			return false;
+		}
+		ctx->reloc = new_table;
+		ctx->reloc_size = new_size;
+	}
+
+	ctx->reloc[ctx->reloc_count].offset = (uint32_t)((uint8_t *)ctx->code - (uint8_t *)ctx->code_top);
+	ctx->reloc[ctx->reloc_count].type = (uint32_t)type;
+	ctx->reloc[ctx->reloc_count].addend = addend;
+	ctx->reloc_count++;
+
+	return true;
+}
+
+#if defined(JIT_DISK_CACHE)
+
+/* Architecture name in the key. */
+#if defined(ARCH_X86_64)
+#define JIT_DISK_ARCH		"x86_64"
+#elif defined(ARCH_X86)
+#define JIT_DISK_ARCH		"x86"
+#elif defined(ARCH_ARM64)
+#define JIT_DISK_ARCH		"arm64"
+#elif defined(ARCH_ARM32)
+#define JIT_DISK_ARCH		"arm32"
+#elif defined(ARCH_PPC64)
+#define JIT_DISK_ARCH		"ppc64"
+#elif defined(ARCH_PPC32)
+#define JIT_DISK_ARCH		"ppc32"
+#elif defined(ARCH_MIPS64)
+#define JIT_DISK_ARCH		"mips64"
+#elif defined(ARCH_MIPS32)
+#define JIT_DISK_ARCH		"mips32"
+#else
+#define JIT_DISK_ARCH		"unknown"
+#endif
+
+/* File magic. */
+#define JIT_DISK_MAGIC		"LGJT"
+
+/* osr_offset if no OSR entry. */
+#define JIT_DISK_NO_OSR		UINT32_MAX
+
+/*
+ * File header
+ *  - Followed by the code, the relocations and the deopt points.
+ */
+struct jit_disk_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint32_t bytecode_size;
+	uint32_t code_size;
+	uint32_t osr_offset;
+	uint32_t reloc_count;
+	uint32_t deopt_point_count;
+	uint32_t reserved;
+
+	/* Hash of the payload. */
+	uint64_t checksum;
+};
+
+/* FNV-1a hash. */
+#define JIT_HASH_INIT		0xcbf29ce484222325ULL
+
+static uint64_t
+jit_hash(
+	uint64_t h,
+	const void *data,
+	size_t size)
+{
+	const uint8_t *p;
+	size_t i;
+
+	p = data;
+	for (i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* Get a cache key of a function. */
+static uint64_t
+jit_disk_key(
+	struct rt_func *func)
+{
+	uint32_t layout[] = {
+		JIT_DISK_VERSION,
+		__BYTE_ORDER__,
+		(uint32_t)sizeof(void *),
+		(uint32_t)sizeof(struct rt_value),
+		(uint32_t)sizeof(struct rt_env),
+		(uint32_t)sizeof(struct rt_frame),
+		(uint32_t)sizeof(struct rt_func),
+		(uint32_t)sizeof(struct rt_string),
+		(uint32_t)sizeof(struct rt_array),
+		(uint32_t)sizeof(struct rt_dict),
+		(uint32_t)offsetof(struct rt_frame, deopt_addr),
+		(uint32_t)offsetof(struct rt_frame, deopt_reg),
+		(uint32_t)offsetof(struct rt_func, jit_code),
+		(uint32_t)JIT_HELPER_COUNT,
+		(uint32_t)func->param_count,
+		(uint32_t)func->tmpvar_size,
+		(uint32_t)linguine_conf_jit_deopt_stress,
+	};
+	uint64_t h;
+
+	h = jit_hash(JIT_HASH_INIT, JIT_DISK_ARCH, strlen(JIT_DISK_ARCH));
+	h = jit_hash(h, layout, sizeof(layout));
+	h = jit_hash(h, func->bytecode, (size_t)func->bytecode_size);
+
+	return h;
+}
+
+/* Get a cache file path of a key. */
+static bool
+jit_disk_path(
+	char *buf,
+	size_t size,
+	uint64_t key)
+{
+	int len;
+
+	len = snprintf(buf, size, "%s/%016llx.jit", linguine_conf_jit_disk_cache, (unsigned long long)key);
+	return len > 0 && (size_t)len < size;
+}
+
+/* Get a checksum of a payload. */
+static uint64_t
+jit_disk_checksum(
+	const void *code,
+	size_t code_size,
+	const struct jit_reloc *reloc,
+	int reloc_count,
+	const struct jit_deopt_point *deopt_point,
+	int deopt_point_count)
+{
+	uint64_t h;
+
+	h = jit_hash(JIT_HASH_INIT, code, code_size);
+	h = jit_hash(h, reloc, sizeof(struct jit_reloc) * (size_t)reloc_count);
+	h = jit_hash(h, deopt_point, sizeof(struct jit_deopt_point) * (size_t)deopt_point_count);
+
+	return h;
+}
+
+/*
+ * Write the generated code to the disk cache.
+ *  - Called after branch patching and before the commit.
+ *  - Failures are ignored. The file is written to a temporary name and
+ *    renamed, so that a reader never sees a partial file.
+ */
+static void
+jit_store_disk_code(
+	struct jit_context *ctx)
+{
+	struct jit_disk_header hdr;
+	char path[1024], tmp_path[1100];
+	FILE *fp;
+	size_t code_size;
+	bool ok;
+
+	if (linguine_conf_jit_disk_cache == NULL ||
+	    !jit_backend.relocatable ||
+	    ctx->is_not_relocatable)
+		return;
+
+	code_size = (size_t)((uint8_t *)ctx->code - (uint8_t *)ctx->code_top);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JIT_DISK_MAGIC, sizeof(hdr.magic));
+	hdr.version = JIT_DISK_VERSION;
+	hdr.key = jit_disk_key(ctx->func);
+	hdr.bytecode_size = (uint32_t)ctx->func->bytecode_size;
+	hdr.code_size = (uint32_t)code_size;
+	hdr.osr_offset = JIT_DISK_NO_OSR;
+	if (ctx->osr_code != NULL)
+		hdr.osr_offset = (uint32_t)((uint8_t *)ctx->osr_code - (uint8_t *)ctx->code_top);
+	hdr.reloc_count = (uint32_t)ctx->reloc_count;
+	hdr.deopt_point_count = (uint32_t)ctx->deopt_point_count;
+	hdr.checksum = jit_disk_checksum(ctx->code_top, code_size,
+					 ctx->reloc, ctx->reloc_count,
+					 ctx->deopt_point, ctx->deopt_point_count);
+
+	if (!jit_disk_path(path, sizeof(path), hdr.key))
+		return;
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%lx", path, (long)getpid(), (unsigned long)(uintptr_t)ctx);
+
+	/* Create the directory if it does not exist. */
+	mkdir(linguine_conf_jit_disk_cache, 0755);
+
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL)
+		return;
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	if (ok && code_size > 0)
+		ok = fwrite(ctx->code_top, code_size, 1, fp) == 1;
+	if (ok && ctx->reloc_count > 0)
+		ok = fwrite(ctx->reloc, sizeof(struct jit_reloc), (size_t)ctx->reloc_count, fp) == (size_t)ctx->reloc_count;
+	if (ok && ctx->deopt_point_count > 0)
+		ok = fwrite(ctx->deopt_point, sizeof(struct jit_deopt_point), (size_t)ctx->deopt_point_count, fp) == (size_t)ctx->deopt_point_count;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok || rename(tmp_path, path) != 0) {
+		remove(tmp_path);
+		return;
+	}
+
+	JIT_LOCK(ctx->rt->jit_cache);
+	ctx->rt->jit_cache->disk_store_count++;
+	JIT_UNLOCK(ctx->rt->jit_cache);
+}
+
+/* Check a mapped cache file. */
+static bool
+jit_check_disk_file(
+	const uint8_t *file,
+	size_t file_size,
+	struct rt_func *func,
+	uint64_t key)
+{
+	struct jit_disk_header hdr;
+	const uint8_t *code;
+	const struct jit_reloc *reloc;
+	const struct jit_deopt_point *deopt_point;
+	uint64_t size;
+	uint32_t i;
+
+	if (file_size < sizeof(hdr))
+		return false;
+	memcpy(&hdr, file, sizeof(hdr));
+
+	/* Stale or foreign file. */
+	if (memcmp(hdr.magic, JIT_DISK_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != JIT_DISK_VERSION ||
+	    hdr.key != key ||
+	    hdr.bytecode_size != (uint32_t)func->bytecode_size)
+		return false;
+
+	/* Truncated or overlong file. */
+	size = sizeof(hdr) +
+		(uint64_t)hdr.code_size +
+		(uint64_t)hdr.reloc_count * sizeof(struct jit_reloc) +
+		(uint64_t)hdr.deopt_point_count * sizeof(struct jit_deopt_point);
+	if (size != (uint64_t)file_size || hdr.code_size == 0)
+		return false;
+
+	/* Corrupt payload. */
+	code = file + sizeof(hdr);
+	reloc = (const struct jit_reloc *)(code + hdr.code_size);
+	deopt_point = (const struct jit_deopt_point *)(reloc + hdr.reloc_count);
+	if (jit_disk_checksum(code, hdr.code_size,
+			      reloc, (int)hdr.reloc_count,
+			      deopt_point, (int)hdr.deopt_point_count) != hdr.checksum)
+		return false;
+
+	/* Out-of-range offsets. */
+	if (hdr.osr_offset != JIT_DISK_NO_OSR && hdr.osr_offset >= hdr.code_size)
+		return false;
+	for (i = 0; i < hdr.reloc_count; i++) {
+		if (reloc[i].offset > hdr.code_size - 8)
+			return false;
+		switch (reloc[i].type) {
+		case JIT_RELOC_HELPER:
+			if (reloc[i].addend >= (uint32_t)JIT_HELPER_COUNT)
+				return false;
+			break;
+		case JIT_RELOC_BYTECODE:
+			if (reloc[i].addend >= hdr.bytecode_size)
+				return false;
+			break;
+		case JIT_RELOC_CODE:
+			if (reloc[i].addend >= hdr.code_size)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	for (i = 0; i < hdr.deopt_point_count; i++) {
+		if (deopt_point[i].offset >= hdr.code_size ||
+		    deopt_point[i].lpc > hdr.bytecode_size)
+			return false;
+	}
+
+	return true;
+}
+
+/* Copy the code of a checked cache file and publish it. */
+static bool
+jit_install_disk_code(
+	struct rt_env *rt,
+	struct rt_func *func,
+	const uint8_t *file)
+{
+	struct jit_context ctx;
+	struct jit_disk_header hdr;
+	const struct jit_reloc *reloc;
+	uint64_t value;
+	uint32_t i;
+
+	memcpy(&hdr, file, sizeof(hdr));
+	reloc = (const struct jit_reloc *)(file + sizeof(hdr) + hdr.code_size);
+
+	memset(&ctx, 0, sizeof(struct jit_context));
+	ctx.rt = rt;
+	ctx.func = func;
+	ctx.cur_loop = -1;
+	ctx.is_loaded = true;
+
+	/* Take a free area of the code cache. */
+	if (!jit_alloc_code(&ctx))
+		goto fail;
+	if ((size_t)((uint8_t *)ctx.code_end - (uint8_t *)ctx.code_top) < hdr.code_size)
+		goto fail;
+
+	/* Copy the code and apply the relocations. */
+	memcpy(ctx.code_top, file + sizeof(hdr), hdr.code_size);
+	for (i = 0; i < hdr.reloc_count; i++) {
+		switch (reloc[i].type) {
+		case JIT_RELOC_HELPER:
+			value = (uint64_t)(uintptr_t)jit_helper_table[reloc[i].addend];
+			break;
+		case JIT_RELOC_BYTECODE:
+			value = (uint64_t)(uintptr_t)func->bytecode + reloc[i].addend;
+			break;
+		case JIT_RELOC_CODE:
+			value = (uint64_t)(uintptr_t)jit_get_exec_addr(&ctx, ctx.code_top) + reloc[i].addend;
+			break;
+		default:
+			/* Checked by jit_check_disk_file(). */
+			goto fail;
+		}
+		memcpy((uint8_t *)ctx.code_top + reloc[i].offset, &value, sizeof(value));
+	}
+	ctx.code = (uint8_t *)ctx.code_top + hdr.code_size;
+	if (hdr.osr_offset != JIT_DISK_NO_OSR)
+		ctx.osr_code = (uint8_t *)ctx.code_top + hdr.osr_offset;
+
+	/* Restore the deopt points. */
+	if (hdr.deopt_point_count > 0) {
+		ctx.deopt_point = malloc(sizeof(struct jit_deopt_point) * hdr.deopt_point_count);
+		if (ctx.deopt_point == NULL) {
+			rt_out_of_memory(rt);
+			goto fail;
+		}
+		memcpy(ctx.deopt_point,
+		       (const struct jit_deopt_point *)(reloc + hdr.reloc_count),
+		       sizeof(struct jit_deopt_point) * hdr.deopt_point_count);
+		ctx.deopt_point_count = (int)hdr.deopt_point_count;
+		ctx.deopt_point_size = (int)hdr.deopt_point_count;
+	}
+
+	/* Register the code, make it executable, and publish it. */
+	if (!jit_commit_code(&ctx))
+		goto fail;
+
+	jit_free_context(&ctx);
+
+	return true;
+
+fail:
+	/* Fall back to the compiler. */
+	if (ctx.block != NULL)
+		jit_cancel_code(&ctx);
+	jit_free_context(&ctx);
+	rt->error_message[0] = '\0';
+	return false;
+}
+
+/*
+ * Load a function code from the disk cache.
+ *  - Returns false if the cache is disabled, or the file does not
+ *    exist or is stale or corrupt, leaving the function uncompiled.
+ */
+bool
+jit_load_disk_code(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	char path[1024];
+	struct stat st;
+	void *file;
+	size_t file_size;
+	uint64_t key;
+	bool loaded;
+	int fd;
+
+	if (linguine_conf_jit_disk_cache == NULL || !jit_backend.relocatable)
+		return false;
+
+	key = jit_disk_key(func);
+	if (!jit_disk_path(path, sizeof(path), key))
+		return false;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	file_size = (size_t)st.st_size;
+	file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED)
+		return false;
+
+	loaded = false;
+	if (jit_check_disk_file(file, file_size, func, key))
+		loaded = jit_install_disk_code(rt, func, file);
+
+	munmap(file, file_size);
+
+	return loaded;
+}
+
+#else
+
+/*
+ * Load a function code from the disk cache.
+ */
+bool
+jit_load_disk_code(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	UNUSED_PARAMETER(rt);
+	UNUSED_PARAMETER(func);
+
+	/* stub */
+	return false;
+}
+
+#endif /* defined(JIT_DISK_CACHE) */
+
+/*
+ * Deoptimization
+ */
+
+/* Find the deopt point of an exit address. (locked, NULL if not found) */
+static struct jit_deopt_point *
+jit_find_deopt_point(
+	struct jit_code_cache *cache,
+	struct rt_func *func,
+	void *addr)
+{
+	struct jit_code_block *block;
+	uint32_t offset;
+	int lo, hi, mid;
+
+	for (block = cache->block_list; block != NULL; block = block->next) {
+		if (block->func == func && !block->is_pending)
+			break;
+	}
+	if (block == NULL ||
+	    (uint8_t *)addr < block->code ||
+	    (uint8_t *)addr >= block->code + block->size)
+		return NULL;
+
+	/* Binary search. (The points are added in the code order.) */
+	offset = (uint32_t)((uint8_t *)addr - block->code);
+	lo = 0;
+	hi = block->deopt_point_count - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (block->deopt_point[mid].offset == offset)
+			return &block->deopt_point[mid];
+		if (block->deopt_point[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Rebuild the current frame after a deoptimization exit.
+ *  - The frame gets the loop registers that the exit saved, so that
+ *    the tmpvars are what the interpreter would have at the LIR-PC.
+ *  - The code is discarded so that the function gets hot again and is
+ *    compiled with the new types. It is kept if an outer frame of the
+ *    same function may return to it.
+ */
+bool
+jit_deoptimize(
+	struct rt_env *rt,
+	struct rt_func *func,
+	int *lpc)
+{
+	struct jit_code_cache *cache;
+	struct jit_deopt_point *point;
+	struct rt_frame *frame;
+	int i;
+
+	cache = rt->jit_cache;
+	assert(cache != NULL);
+
+	for (frame = rt->frame->next; frame != NULL; frame = frame->next) {
+		if (frame->func == func)
+			break;
+	}
+
+	JIT_LOCK(cache);
+
+	point = jit_find_deopt_point(cache, func, rt->frame->deopt_addr);
+	rt->frame->deopt_addr = NULL;
+	if (point == NULL) {
+		JIT_UNLOCK(cache);
+		rt_error(rt, _("Unknown JIT deoptimization exit."));
+		return false;
+	}
+
+	/* Write back the saved registers. */
+	for (i = 0; i < JIT_LOOP_REG_MAX; i++) {
+		if (point->tmpvar[i] < 0)
+			continue;
+		rt->frame->tmpvar[point->tmpvar[i]].type = RT_VALUE_INT;
+		rt->frame->tmpvar[point->tmpvar[i]].val.i = rt->frame->deopt_reg[i];
+	}
+	*lpc = (int)point->lpc;
+
+	cache->deopt_count++;
+	if (frame == NULL) {
+		jit_remove_block(cache, func);
+		func->call_count = 0;
+		func->loop_count = 0;
+	}
+
+	JIT_UNLOCK(cache);
+
+	return true;
+}
+
+/* Print type bits. */
+static void
+jit_print_profile_types(
+	uint8_t bits)
+{
+	static const char *name[] = {"int", "float", "string", "array", "dict", "func"};
+	const char *sep;
+	int i;
+
+	if (bits == 0) {
+		printf("-");
+		return;
+	}
+
+	sep = "";
+	for (i = 0; i < (int)(sizeof(name) / sizeof(name[0])); i++) {
+		if (bits & RT_PROFILE_BIT(i)) {
+			printf("%s%s", sep, name[i]);
+			sep = "|";
+		}
+	}
+}
+
+/*
+ * Print the type profile of a function.
+ */
+void
+jit_dump_profile(
+	struct rt_func *func)
+{
+	static const char *op_name[] = {
+		[ROP_ADD] = "ADD", [ROP_SUB] = "SUB", [ROP_MUL] = "MUL",
+		[ROP_DIV] = "DIV", [ROP_MOD] = "MOD", [ROP_AND] = "AND",
+		[ROP_OR] = "OR", [ROP_XOR] = "XOR", [ROP_LT] = "LT",
+		[ROP_LTE] = "LTE", [ROP_GT] = "GT", [ROP_GTE] = "GTE",
+		[ROP_EQ] = "EQ", [ROP_NEQ] = "NEQ", [ROP_EQI] = "EQI",
+		[ROP_LOADARRAY] = "LOADARRAY", [ROP_LOADDOT] = "LOADDOT",
+		[ROP_THISCALL] = "THISCALL",
+	};
+	struct jit_op_info info;
+	uint8_t p1, p2;
+	int lpc;
+
+	printf("Type profile: %s (%s)\n", func->name, func->file_name);
+
+	for (lpc = 0; lpc < func->bytecode_size; lpc += info.size) {
+		if (!jit_get_op_info(func, lpc, &info))
+			break;
+		if (info.opcode >= sizeof(op_name) / sizeof(op_name[0]) ||
+		    op_name[info.opcode] == NULL)
+			continue;
+
+		p1 = __atomic_load_n(&func->profile[lpc + 1], __ATOMIC_RELAXED);
+		p2 = __atomic_load_n(&func->profile[lpc + 2], __ATOMIC_RELAXED);
+		if (p1 == 0)
+			continue;
+
+		printf("%04d: %s(", lpc, op_name[info.opcode]);
+		jit_print_profile_types(p1);
+		switch (info.opcode) {
+		case ROP_LOADDOT:
+			if (p2 == RT_PROFILE_MANY_SLOTS)
+				printf(", slot:many");
+			else if (p2 != 0)
+				printf(", slot:%d", p2 - 1);
+			break;
+		case ROP_THISCALL:
+			break;
+		default:
+			printf(", ");
+			jit_print_profile_types(p2);
+			break;
+		}
+		printf(")\n");
+	}
+}
+
+/*
+ * Loop register assignment
+ */
+
+/* Read a u16 tmpvar operand. */
+static bool
+jit_read_tmpvar(
+	struct rt_func *func,
+	int *lpc,
+	int *tmpvar)
+{
+	if (*lpc + 2 > func->bytecode_size)
+		return false;
+
+	*tmpvar = (func->bytecode[*lpc] << 8) | func->bytecode[*lpc + 1];
+	if (*tmpvar >= func->tmpvar_size)
+		return false;
+
+	*lpc += 2;
+
+	return true;
+}
+
+/* Skip a NUL-terminated string operand. */
+static bool
+jit_skip_string(
+	struct rt_func *func,
+	int *lpc)
+{
+	while (*lpc < func->bytecode_size) {
+		if (func->bytecode[*lpc] == '\0') {
+			(*lpc)++;
+			return true;
+		}
+		(*lpc)++;
+	}
+
+	return false;
+}
+
+/*
+ * Decode an instruction at lpc.
+ */
+bool
+jit_get_op_info(
+	struct rt_func *func,
+	int lpc,
+	struct jit_op_info *info)
+{
+	int pc;
+	int tmp;
+	int count;
+	int i;
+
+	if (lpc >= func->bytecode_size)
+		return false;
+
+	memset(info, 0, sizeof(struct jit_op_info));
+	info->opcode = func->bytecode[lpc];
+	info->dst = -1;
+	info->target = -1;
+
+	pc = lpc + 1;
+	switch (info->opcode) {
+	case ROP_NOP:
+		break;
+	case ROP_LINEINFO:
+		pc += 4;
+		break;
+	case ROP_ICONST:
+	case ROP_FCONST:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		pc += 4;
+		break;
+	case ROP_SCONST:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_skip_string(func, &pc))
+			return false;
+		break;
+	case ROP_ACONST:
+	case ROP_DCONST:
+	case ROP_LACONST:
+	case ROP_LDCONST:
+	case ROP_INC:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		break;
+	case ROP_ASSIGN:
+	case ROP_NEG:
+	case ROP_LEN:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		break;
+	case ROP_ADD:
+	case ROP_SUB:
+	case ROP_MUL:
+	case ROP_DIV:
+	case ROP_MOD:
+	case ROP_AND:
+	case ROP_OR:
+	case ROP_XOR:
+	case ROP_LT:
+	case ROP_LTE:
+	case ROP_GT:
+	case ROP_GTE:
+	case ROP_EQ:
+	case ROP_NEQ:
+	case ROP_EQI:
+	case ROP_IADD:
+	case ROP_ISUB:
+	case ROP_IMUL:
+	case ROP_ILT:
+	case ROP_ILTE:
+	case ROP_IGT:
+	case ROP_IGTE:
+	case ROP_IEQ:
+	case ROP_INEQ:
+	case ROP_FADD:
+	case ROP_FSUB:
+	case ROP_FMUL:
+	case ROP_FDIV:
+	case ROP_FLT:
+	case ROP_FLTE:
+	case ROP_FGT:
+	case ROP_FGTE:
+	case ROP_FEQ:
+	case ROP_FNEQ:
+	case ROP_LOADARRAY:
+	case ROP_GETDICTKEYBYINDEX:
+	case ROP_GETDICTVALBYINDEX:
+	case ROP_ULOADARRAY:
+	case ROP_UGETDICTVALBYINDEX:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		break;
+	case ROP_STOREARRAY:
+		/* The array itself is not overwritten. */
+		for (i = 0; i < 3; i++) {
+			if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+				return false;
+		}
+		break;
+	case ROP_STOREDOT:
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		if (!jit_skip_string(func, &pc))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		break;
+	case ROP_LOADDOT:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		if (!jit_skip_string(func, &pc))
+			return false;
+		break;
+	case ROP_STORESYMBOL:
+		if (!jit_skip_string(func, &pc))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		break;
+	case ROP_LOADSYMBOL:
+	case ROP_CHKFUNC:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_skip_string(func, &pc))
+			return false;
+		break;
+	case ROP_LOADFUNC:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		pc += 2;
+		break;
+	case ROP_SWITCH:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (pc + 4 > func->bytecode_size)
+			return false;
+		tmp = (func->bytecode[pc + 2] << 8) | func->bytecode[pc + 3];
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		if (tmp < 4)
+			return false;
+		pc += tmp - 2;
+		break;
+	case ROP_CALL:
+	case ROP_THISCALL:
+	case ROP_TAILCALL:
+		if (!jit_read_tmpvar(func, &pc, &info->dst))
+			return false;
+		if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+			return false;
+		if (info->opcode == ROP_THISCALL) {
+			if (!jit_skip_string(func, &pc))
+				return false;
+		}
+		if (pc + 1 > func->bytecode_size)
+			return false;
+		count = func->bytecode[pc++];
+		if (count > RT_ARG_MAX)
+			return false;
+		for (i = 0; i < count; i++) {
+			if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+				return false;
+		}
+		break;
+	case ROP_JMP:
+	case ROP_JMPIFTRUE:
+	case ROP_JMPIFFALSE:
+	case ROP_JMPIFEQ:
+		if (info->opcode != ROP_JMP) {
+			if (!jit_read_tmpvar(func, &pc, &info->src[info->src_count++]))
+				return false;
+		}
+		if (pc + 4 > func->bytecode_size)
+			return false;
+		tmp = (func->bytecode[pc] << 24) |
+		      (func->bytecode[pc + 1] << 16) |
+		      (func->bytecode[pc + 2] << 8) |
+		      func->bytecode[pc + 3];
+		if (tmp < 0 || tmp > func->bytecode_size)
+			return false;
+		info->target = tmp;
+		pc += 4;
+		break;
+	default:
+		return false;
+	}
+	if (pc > func->bytecode_size)
+		return false;
+
+	info->size = pc - lpc;
+
+	return true;
+}
+
+#if defined(JIT_SHARED_EMIT)
+
+/* Check if a loop contains another loop or crosses it. */
+static bool
+jit_is_innermost_loop(
+	struct jit_context *ctx,
+	int index)
+{
+	struct jit_loop *a, *b;
+	int i;
+
+	a = &ctx->loop[index];
+	for (i = 0; i < ctx->loop_count; i++) {
+		if (i == index)
+			continue;
+		b = &ctx->loop[i];
+
+		/* Disjoint. */
+		if (b->end_lpc <= a->start_lpc || a->end_lpc <= b->start_lpc)
+			continue;
+
+		/* b strictly contains a. */
+		if (b->start_lpc <= a->start_lpc && a->end_lpc <= b->end_lpc &&
+		    (b->start_lpc != a->start_lpc || b->end_lpc != a->end_lpc))
+			continue;
+
+		/* The same region twice: keep the first one. */
+		if (b->start_lpc == a->start_lpc && b->end_lpc == a->end_lpc && index < i)
+			continue;
+
+		return false;
+	}
+
+	return true;
+}
+
+/* Check if a loop is entered only at its header. */
+static bool
+jit_is_single_entry_loop(
+	struct jit_context *ctx,
+	struct jit_loop *loop)
+{
+	struct jit_ir *ir;
+	int i;
+
+	for (i = 0; i < ctx->ir_count; i++) {
+		ir = &ctx->ir[i];
+		if (ir->info.target != -1 &&
+		    (ir->lpc < loop->start_lpc || ir->lpc >= loop->end_lpc) &&
+		    (uint32_t)ir->info.target > loop->start_lpc &&
+		    (uint32_t)ir->info.target < loop->end_lpc)
+			return false;
+	}
+
+	return true;
+}
+
+/* Candidate table size. */
+#define JIT_LOOP_CAND_MAX	(JIT_LOOP_REG_MAX * 4)
+
+/* Register candidate. */
+struct jit_loop_cand {
+	int tmpvar;
+	int use;
+	bool is_written;
+	bool is_bad;
+};
+
+/* Count a use of a register candidate. */
+static void
+jit_add_loop_cand(
+	struct jit_loop_cand *cand,
+	int *count,
+	int tmpvar,
+	bool is_written)
+{
+	int i;
+
+	for (i = 0; i < *count; i++) {
+		if (cand[i].tmpvar == tmpvar)
+			break;
+	}
+	if (i == *count) {
+		if (*count == JIT_LOOP_CAND_MAX)
+			return;
+		cand[i].tmpvar = tmpvar;
+		cand[i].use = 0;
+		cand[i].is_written = false;
+		cand[i].is_bad = false;
+		(*count)++;
+	}
+
+	cand[i].use++;
+	if (is_written)
+		cand[i].is_written = true;
+}
+
+/* Assign registers to the counters and the bounds of a loop. */
+static void
+jit_assign_loop_regs(
+	struct jit_context *ctx,
+	struct jit_loop *loop,
+	int reg_count)
+{
+	struct jit_loop_cand cand[JIT_LOOP_CAND_MAX];
+	struct jit_op_info *info;
+	int count;
+	int i, j, best;
+
+	/* Collect INC and EQI operands. */
+	count = 0;
+	for (i = 0; i < ctx->ir_count; i++) {
+		if (ctx->ir[i].lpc < loop->start_lpc || ctx->ir[i].lpc >= loop->end_lpc)
+			continue;
+		info = &ctx->ir[i].info;
+		if (info->opcode == ROP_INC) {
+			jit_add_loop_cand(cand, &count, info->dst, true);
+		} else if (info->opcode == ROP_EQI) {
+			jit_add_loop_cand(cand, &count, info->src[0], false);
+			jit_add_loop_cand(cand, &count, info->src[1], false);
+		}
+	}
+
+	/* Exclude tmpvars that are written by other instructions. */
+	for (i = 0; i < ctx->ir_count; i++) {
+		if (ctx->ir[i].lpc < loop->start_lpc || ctx->ir[i].lpc >= loop->end_lpc)
+			continue;
+		info = &ctx->ir[i].info;
+		if (info->dst != -1 && info->opcode != ROP_INC) {
+			for (j = 0; j < count; j++) {
+				if (cand[j].tmpvar == info->dst)
+					cand[j].is_bad = true;
+			}
+		}
+	}
+
+	/* Pick the most used ones. */
+	loop->reg_count = 0;
+	while (loop->reg_count < reg_count) {
+		best = -1;
+		for (i = 0; i < count; i++) {
+			if (cand[i].is_bad)
+				continue;
+			if (best == -1 || cand[i].use > cand[best].use)
+				best = i;
+		}
+		if (best == -1)
+			break;
+		loop->tmpvar[loop->reg_count] = cand[best].tmpvar;
+		loop->is_written[loop->reg_count] = cand[best].is_written;
+		loop->reg_count++;
+		cand[best].is_bad = true;
+	}
+}
+
+/*
+ * Assign up to reg_count registers to the counters and the bounds of each
+ * innermost loop.
+ */
+static void
+jit_regalloc(
+	struct jit_context *ctx,
+	int reg_count)
+{
+	struct jit_ir *ir;
+	int i, n;
+
+	assert(reg_count <= JIT_LOOP_REG_MAX);
+
+	ctx->loop_count = 0;
+	ctx->cur_loop = -1;
+
+	/* Find back-edges. */
+	for (i = 0; i < ctx->ir_count; i++) {
+		ir = &ctx->ir[i];
+		if (ir->info.opcode == ROP_JMP &&
+		    (uint32_t)ir->info.target <= ir->lpc &&
+		    ctx->loop_count < JIT_LOOP_MAX) {
+			memset(&ctx->loop[ctx->loop_count], 0, sizeof(struct jit_loop));
+			ctx->loop[ctx->loop_count].start_lpc = (uint32_t)ir->info.target;
+			ctx->loop[ctx->loop_count].end_lpc = ir->lpc + (uint32_t)ir->info.size;
+			ctx->loop_count++;
+		}
+	}
+
+	/* Keep single-entry innermost loops. */
+	n = 0;
+	for (i = 0; i < ctx->loop_count; i++) {
+		if (!jit_is_innermost_loop(ctx, i))
+			continue;
+		if (!jit_is_single_entry_loop(ctx, &ctx->loop[i]))
+			continue;
+		ctx->loop[i].reg_count = -1;	/* Mark as kept. */
+	}
+	for (i = 0; i < ctx->loop_count; i++) {
+		if (ctx->loop[i].reg_count != -1)
+			continue;
+		ctx->loop[n] = ctx->loop[i];
+		jit_assign_loop_regs(ctx, &ctx->loop[n], reg_count);
+		if (ctx->loop[n].reg_count > 0)
+			n++;
+	}
+	ctx->loop_count = n;
+}
+
+/*
+ * Code generation driver
+ */
+
+/* Check if a backend with loop registers emits an opcode without storing them. */
+static bool
+jit_is_loop_reg_aware(
+	uint8_t opcode)
+{
+	switch (opcode) {
+	case ROP_LINEINFO:
+	case ROP_ASSIGN:
+	case ROP_LOADSYMBOL:	/* Writes dst only. */
+	case ROP_ICONST:
+	case ROP_FCONST:
+	case ROP_INC:
+	case ROP_EQI:
+	case ROP_ADD:		/* Stores on the generic path. */
+	case ROP_SUB:
+	case ROP_MUL:
+	case ROP_LT:
+	case ROP_LTE:
+	case ROP_GT:
+	case ROP_GTE:
+	case ROP_EQ:
+	case ROP_NEQ:
+	case ROP_JMP:
+	case ROP_JMPIFTRUE:
+	case ROP_JMPIFFALSE:
+	case ROP_JMPIFEQ:
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * Map a typed opcode to its generic opcode and the proven type.
+ *  - The backends emit the generic instruction. An integer one takes
+ *    the integer path, and a backend may omit its guards.
+ */
+static void
+jit_lower_typed_op(
+	struct jit_ir *ir)
+{
+	static const uint8_t generic_op[][3] = {
+		{ROP_IADD, ROP_ADD, JIT_TYPED_INT}, {ROP_ISUB, ROP_SUB, JIT_TYPED_INT},
+		{ROP_IMUL, ROP_MUL, JIT_TYPED_INT}, {ROP_ILT, ROP_LT, JIT_TYPED_INT},
+		{ROP_ILTE, ROP_LTE, JIT_TYPED_INT}, {ROP_IGT, ROP_GT, JIT_TYPED_INT},
+		{ROP_IGTE, ROP_GTE, JIT_TYPED_INT}, {ROP_IEQ, ROP_EQ, JIT_TYPED_INT},
+		{ROP_INEQ, ROP_NEQ, JIT_TYPED_INT}, {ROP_FADD, ROP_ADD, JIT_TYPED_FLOAT},
+		{ROP_FSUB, ROP_SUB, JIT_TYPED_FLOAT}, {ROP_FMUL, ROP_MUL, JIT_TYPED_FLOAT},
+		{ROP_FDIV, ROP_DIV, JIT_TYPED_FLOAT}, {ROP_FLT, ROP_LT, JIT_TYPED_FLOAT},
+		{ROP_FLTE, ROP_LTE, JIT_TYPED_FLOAT}, {ROP_FGT, ROP_GT, JIT_TYPED_FLOAT},
+		{ROP_FGTE, ROP_GTE, JIT_TYPED_FLOAT}, {ROP_FEQ, ROP_EQ, JIT_TYPED_FLOAT},
+		{ROP_FNEQ, ROP_NEQ, JIT_TYPED_FLOAT},
+	};
+	size_t i;
+
+	ir->typed = JIT_TYPED_NONE;
+	for (i = 0; i < sizeof(generic_op) / sizeof(generic_op[0]); i++) {
+		if (generic_op[i][0] == ir->info.opcode) {
+			ir->info.opcode = generic_op[i][1];
+			ir->typed = generic_op[i][2];
+			break;
+		}
+	}
+}
+
+/*
+ * Map a frame-owned container to ACONST or DCONST.
+ *  - A backend that ignores frame_owned makes an ordinary container,
+ *    which is left to the GC.
+ */
+static void
+jit_lower_frame_op(
+	struct jit_ir *ir)
+{
+	ir->frame_owned = false;
+	if (ir->info.opcode == ROP_LACONST) {
+		ir->info.opcode = ROP_ACONST;
+		ir->frame_owned = true;
+	} else if (ir->info.opcode == ROP_LDCONST) {
+		ir->info.opcode = ROP_DCONST;
+		ir->frame_owned = true;
+	}
+}
+
+/*
+ * Map an unchecked load to LOADARRAY or GETDICTVALBYINDEX.
+ *  - A backend that ignores in_range keeps the checks of the helper.
+ */
+static void
+jit_lower_unchecked_op(
+	struct jit_ir *ir)
+{
+	ir->in_range = false;
+	if (ir->info.opcode == ROP_ULOADARRAY) {
+		ir->info.opcode = ROP_LOADARRAY;
+		ir->in_range = true;
+	} else if (ir->info.opcode == ROP_UGETDICTVALBYINDEX) {
+		ir->info.opcode = ROP_GETDICTVALBYINDEX;
+		ir->in_range = true;
+	}
+}
+
+/*
+ * Map a tail call to CALL.
+ *  - A backend that ignores tail makes a normal call, and the return
+ *    slot gets the result as before.
+ */
+static void
+jit_lower_tail_op(
+	struct jit_ir *ir)
+{
+	ir->tail = false;
+	if (ir->info.opcode == ROP_TAILCALL) {
+		ir->info.opcode = ROP_CALL;
+		ir->tail = true;
+	}
+}
+
+/* Choose a type guard of an instruction from the profile. */
+static void
+jit_choose_guard(
+	struct jit_context *ctx,
+	struct jit_ir *ir)
+{
+	uint8_t p1, p2;
+
+	ir->guard = JIT_GUARD_NONE;
+
+	/* A typed opcode needs no profile. */
+	if (ir->typed == JIT_TYPED_INT) {
+		ir->guard = JIT_GUARD_INT;
+		return;
+	}
+	if (ir->typed == JIT_TYPED_FLOAT)
+		return;
+
+	p1 = jit_get_profile(ctx, (int)ir->lpc, 1);
+	p2 = jit_get_profile(ctx, (int)ir->lpc, 2);
+
+	switch (ir->info.opcode) {
+	case ROP_ADD:
+	case ROP_SUB:
+	case ROP_MUL:
+	case ROP_LT:
+	case ROP_LTE:
+	case ROP_GT:
+	case ROP_GTE:
+	case ROP_EQ:
+	case ROP_NEQ:
+		if (p1 == RT_PROFILE_BIT(RT_VALUE_INT) && p2 == RT_PROFILE_BIT(RT_VALUE_INT))
+			ir->guard = JIT_GUARD_INT;
+		break;
+	case ROP_LOADARRAY:
+		if (p1 == RT_PROFILE_BIT(RT_VALUE_ARRAY) && p2 == RT_PROFILE_BIT(RT_VALUE_INT))
+			ir->guard = JIT_GUARD_ARRAY;
+		break;
+	case ROP_LOADDOT:
+		if (p1 == RT_PROFILE_BIT(RT_VALUE_DICT)) {
+			ir->guard = JIT_GUARD_DICT;
+			ir->slot = p2;
+		}
+		break;
+	case ROP_THISCALL:
+		if (p1 == RT_PROFILE_BIT(RT_VALUE_DICT))
+			ir->guard = JIT_GUARD_DICT;
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Decode the bytecode into the IR.
+ *  - The profile is read once here, so that a compilation sees a
+ *    consistent snapshot even if the interpreter updates it.
+ */
+static bool
+jit_lower(
+	struct jit_context *ctx)
+{
+	struct jit_op_info info;
+	struct jit_ir *ir;
+	int lpc, count;
+
+	/* Count the instructions. */
+	count = 0;
+	lpc = 0;
+	while (lpc < ctx->func->bytecode_size) {
+		if (!jit_get_op_info(ctx->func, lpc, &info)) {
+			rt_error(ctx->rt, BROKEN_BYTECODE);
+			return false;
+		}
+		count++;
+		lpc += info.size;
+	}
+
+	ctx->ir = malloc(sizeof(struct jit_ir) * (size_t)(count > 0 ? count : 1));
+	if (ctx->ir == NULL) {
+		rt_out_of_memory(ctx->rt);
+		return false;
+	}
+	ctx->ir_count = count;
+
+	/* Decode. */
+	lpc = 0;
+	for (ir = ctx->ir; ir < ctx->ir + count; ir++) {
+		memset(ir, 0, sizeof(struct jit_ir));
+		ir->lpc = (uint32_t)lpc;
+		jit_get_op_info(ctx->func, lpc, &ir->info);
+		jit_lower_typed_op(ir);
+		jit_lower_frame_op(ir);
+		jit_lower_unchecked_op(ir);
+		jit_lower_tail_op(ir);
+		ir->keeps_loop_regs = jit_is_loop_reg_aware(ir->info.opcode);
+		jit_choose_guard(ctx, ir);
+		lpc += ir->info.size;
+	}
+
+	return true;
+}
+
+/* Enter or leave a loop at the current lpc. */
+static bool
+jit_update_loop(
+	struct jit_context *ctx)
+{
+	struct jit_loop *loop;
+	int i;
+
+	/* Leave a loop. */
+	if (ctx->cur_loop >= 0 &&
+	    (uint32_t)ctx->lpc == ctx->loop[ctx->cur_loop].end_lpc)
+		ctx->cur_loop = -1;
+
+	/* Enter a loop. */
+	for (i = 0; i < ctx->loop_count; i++) {
+		if ((uint32_t)ctx->lpc == ctx->loop[i].start_lpc)
+			break;
+	}
+	if (i == ctx->loop_count)
+		return true;
+	ctx->cur_loop = i;
+	loop = &ctx->loop[i];
+
+	/* Load the registers. Back-edges jump to the body after this. */
+	if (!jit_backend.put_loop_loads(ctx, loop))
+		return false;
+	loop->body_code = ctx->code;
+
+	/* Back-edges may come with dirty registers. */
+	for (i = 0; i < loop->reg_count; i++)
+		loop->is_dirty[i] = loop->is_written[i];
+
+	return true;
+}
+
+/* Walk the IR and call the emitters of the backend. */
+static bool
+jit_emit(
+	struct jit_context *ctx)
+{
+	struct jit_ir *ir;
+	uint8_t opcode;
+	int i;
+
+	/* Put a prologue. */
+	if (!jit_backend.put_prologue(ctx))
+		return false;
+
+	/* Put a body. */
+	for (i = 0; i < ctx->ir_count; i++) {
+		ir = &ctx->ir[i];
+		ctx->cur_ir = ir;
+		ctx->lpc = (int)ir->lpc;
+
+		/* Save LPC and addr. */
+		if (!jit_add_pc_entry(ctx, ir->lpc, ctx->code))
+			return false;
+
+		/* Skip the padding that rt_link() left after a LOADFUNC. */
+		if (ir->info.opcode == ROP_NOP)
+			continue;
+
+		/* Load the registers if this is a loop header. */
+		if (!jit_update_loop(ctx))
+			return false;
+
+		/* Store the loop registers before reading the tmpvars from memory. */
+		if (ctx->cur_loop >= 0 && !ir->keeps_loop_regs) {
+			if (!jit_backend.put_loop_stores(ctx, false))
+				return false;
+		}
+
+		/* Dispatch by opcode. (A typed opcode is lowered to the generic one.) */
+		CONSUME_OPCODE(opcode);
+		opcode = ir->info.opcode;
+		if (jit_backend.visit_op[opcode] == NULL) {
+			rt_error(ctx->rt, _("Instruction 0x%02x is not supported by the JIT."), opcode);
+			return false;
+		}
+		if (!jit_backend.visit_op[opcode](ctx))
+			return false;
+
+		/* The emitter must consume the operands that the IR has. */
+		if (ctx->lpc != (int)ir->lpc + ir->info.size) {
+			rt_error(ctx->rt, BROKEN_BYTECODE);
+			return false;
+		}
+	}
+	ctx->cur_ir = NULL;
+
+	/* Add the tail PC to the table. */
+	if (!jit_add_pc_entry(ctx, (uint32_t)ctx->lpc, ctx->code))
+		return false;
+
+	/* Put an epilogue. */
+	if (!jit_backend.put_epilogue(ctx))
+		return false;
+
+	return true;
+}
+
+/*
+ * Generate a JIT-compiled code for a function.
+ */
+bool
+jit_build(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	struct jit_context ctx;
+	void *tail;
+	int i;
+
+	/* Make a context. */
+	memset(&ctx, 0, sizeof(struct jit_context));
+	ctx.rt = rt;
+	ctx.func = func;
+	ctx.cur_loop = -1;
+
+	/*
+	 * On a failure, the function stays interpreted and the failure is
+	 * recorded in the cache statistics.
+	 */
+
+	/* Decode the bytecode. */
+	if (!jit_lower(&ctx))
+		return jit_fail(&ctx);
+
+	/* Assign registers to loop tmpvars. */
+	if (jit_backend.loop_reg_count > 0)
+		jit_regalloc(&ctx, jit_backend.loop_reg_count);
+
+	/* Take a free area of the code cache. (writable and non-executable) */
+	if (!jit_alloc_code(&ctx))
+		return jit_fail(&ctx);
+
+	/* Emit the code. */
+	if (!jit_emit(&ctx))
+		return jit_fail(&ctx);
+
+	/* Patch branches. (This moves the cursor, so keep the code end.) */
+	tail = ctx.code;
+	for (i = 0; i < ctx.branch_patch_count; i++) {
+		if (!jit_backend.patch_branch(&ctx, i))
+			return jit_fail(&ctx);
+	}
+	ctx.code = tail;
+
+#if defined(JIT_DISK_CACHE)
+	/* Keep a copy for the next process. */
+	jit_store_disk_code(&ctx);
+#endif
+
+	/* Register the code, make it executable, and publish it. */
+	if (!jit_commit_code(&ctx))
+		return jit_fail(&ctx);
+
+	jit_free_context(&ctx);
+
+	return true;
+}
+
+#endif /* defined(JIT_SHARED_EMIT) */
+
 #endif /* defined(USE_JIT) */
@@ -25,22 +25,11 @@
 #define JIT_OP_NOT_IMPLEMENTED	0
 #define NEVER_COME_HERE		0
 
-/* PC entry size. */
-#define PC_ENTRY_MAX		2048
-
-/* Branch pathch size. */
-#define BRANCH_PATCH_MAX	2048
-
 /* Branch patch type */
 #define PATCH_BAL		0
 #define PATCH_BEQ		1
 #define PATCH_BNE		2
 
-/* Generated code. */
-static uint32_t *jit_code_region;
-static uint32_t *jit_code_region_cur;
-static uint32_t *jit_code_region_tail;
-
 /* Forward declaration */
 static bool jit_visit_bytecode(struct jit_context *ctx);
 static bool jit_patch_branch(struct jit_context *ctx, int patch_index);
@@ -54,63 +43,44 @@ jit_build(
 	  struct rt_func *func)
 {
 	struct jit_context ctx;
+	void *tail;
 	int i;
 
-	/* If the first call, map a memory region for the generated code. */
-	if (jit_code_region == NULL) {
-		if (!jit_map_memory_region((void **)&jit_code_region, JIT_CODE_MAX)) {
-			rt_error(rt, _("Memory mapping failed."));
-			return false;
-		}
-		jit_code_region_cur = jit_code_region;
-		jit_code_region_tail = jit_code_region + JIT_CODE_MAX / 4;
-	}
-
 	/* Make a context. */
 	memset(&ctx, 0, sizeof(struct jit_context));
-	ctx.code_top = jit_code_region_cur;
-	ctx.code_end = jit_code_region_tail;
-	ctx.code = ctx.code_top;
 	ctx.rt = rt;
 	ctx.func = func;
 
-	/* Make code writable and non-executable. */
-	jit_map_writable(jit_code_region, JIT_CODE_MAX);
+	/*
+	 * On a failure, the function stays interpreted and the failure is
+	 * recorded in the cache statistics.
+	 */
+
+	/* Take a free area of the code cache. (writable and non-executable) */
+	if (!jit_alloc_code(&ctx))
+		return jit_fail(&ctx);
 
 	/* Visit over the bytecode. */
 	if (!jit_visit_bytecode(&ctx))
-		return false;
+		return jit_fail(&ctx);
 
-	jit_code_region_cur = ctx.code;
-
-	/* Patch branches. */
+	/* Patch branches. (This moves the cursor, so keep the code end.) */
+	tail = ctx.code;
 	for (i = 0; i < ctx.branch_patch_count; i++) {
 		if (!jit_patch_branch(&ctx, i))
-			return false;
+			return jit_fail(&ctx);
 	}
+	ctx.code = tail;
 
-	/* Make code executable and non-writable. */
-	jit_map_executable(jit_code_region, JIT_CODE_MAX);
+	/* Register the code, make it executable, and publish it. */
+	if (!jit_commit_code(&ctx))
+		return jit_fail(&ctx);
 
-	func->jit_code = (bool (*)(struct rt_env *))ctx.code_top;
+	jit_free_context(&ctx);
 
 	return true;
 }
 
-/*
- * Free a JIT-compiled code for a function.
- */
-void
-jit_free(
-	 struct rt_env *rt,
-	 struct rt_func *func)
-{
-	UNUSED_PARAMETER(rt);
-	UNUSED_PARAMETER(func);
-
-	/* XXX: */
-}
-
 /*
  * Assembler output functions
  */
@@ -706,7 +676,7 @@ jit_visit_neg_op(
 	CONSUME_TMPVAR(src);
 
 	/* if (!rt_neg_helper(rt, dst, src)) return false; */
-	ASM_UNARY_OP(rt_xor_helper);
+	ASM_UNARY_OP(rt_neg_helper);
 
 	return true;
 }
@@ -1004,6 +974,117 @@ jit_visit_loadsymbol_op(
 	return true;
 }
 
+/* Visit a ROP_CHKFUNC instruction. */
+static INLINE bool
+jit_visit_chkfunc_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	const char *src_s;
+	uint32_t src;
+	uint32_t f;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_STRING(src_s);
+
+	src = (uint32_t)(intptr_t)src_s;
+	f = (uint32_t)rt_chkfunc_helper;
+
+	/* if (!jit_chkfunc_helper(rt, dst, src)) return false; */
+	ASM {
+		/* $s0: rt */
+		/* $s1: &rt->frame->tmpvar[0] */
+
+		/* Arg1 $a0 = rt */
+		/* move $a0, $s0 */		IW(0x02002025);
+
+		/* Arg2 $a1 = dst */
+		/* li $a1, dst */		IW(0x24050000 | tvar16(dst));
+
+		/* Arg3 $a2 = src */
+		/* lui $a2, src@h */		IW(0x3c060000 | hi16(src));
+		/* ori $a2, src@l */		IW(0x34c60000 | lo16(src));
+
+		/* Call rt_chkfunc_helper(). */
+		/* lui  $t0, f@h */		IW(0x3c080000 | hi16(f));
+		/* ori  $t0, $t0, f@l */	IW(0x35080000 | lo16(f));
+		/* move $s2, $ra */		IW(0x03e09025);
+		/* jalr $t0 */			IW(0x0100f809);
+		/* nop */			IW(0x00000000);
+		/* move $ra, $s2 */		IW(0x0240f825);
+
+		/* If failed: */
+		/* beqz $v0, $zero, exc */	IW(0x10400000 | EXC());
+		/* nop */			IW(0x00000000);
+	}
+
+	return true;
+}
+
+/* Visit a ROP_SWITCH instruction. */
+static INLINE bool
+jit_visit_switch_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	const uint8_t *table;
+	uint32_t src;
+	uint32_t f;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_TABLE(table);
+
+	src = (uint32_t)(intptr_t)table;
+	f = (uint32_t)rt_switch_helper;
+
+	/* if (!jit_switch_helper(rt, dst, src)) return false; */
+	ASM {
+		/* $s0: rt */
+		/* $s1: &rt->frame->tmpvar[0] */
+
+		/* Arg1 $a0 = rt */
+		/* move $a0, $s0 */		IW(0x02002025);
+
+		/* Arg2 $a1 = dst */
+		/* li $a1, dst */		IW(0x24050000 | tvar16(dst));
+
+		/* Arg3 $a2 = src */
+		/* lui $a2, src@h */		IW(0x3c060000 | hi16(src));
+		/* ori $a2, src@l */		IW(0x34c60000 | lo16(src));
+
+		/* Call rt_switch_helper(). */
+		/* lui  $t0, f@h */		IW(0x3c080000 | hi16(f));
+		/* ori  $t0, $t0, f@l */	IW(0x35080000 | lo16(f));
+		/* move $s2, $ra */		IW(0x03e09025);
+		/* jalr $t0 */			IW(0x0100f809);
+		/* nop */			IW(0x00000000);
+		/* move $ra, $s2 */		IW(0x0240f825);
+
+		/* If failed: */
+		/* beqz $v0, $zero, exc */	IW(0x10400000 | EXC());
+		/* nop */			IW(0x00000000);
+	}
+
+	return true;
+}
+
+/* Visit a ROP_LOADFUNC instruction. */
+static INLINE bool
+jit_visit_loadfunc_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	int src;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_IMM16(src);
+
+	/* if (!rt_loadfunc_helper(rt, dst, src)) return false; */
+	ASM_UNARY_OP(rt_loadfunc_helper);
+
+	return true;
+}
+
 /* Visit a ROP_STORESYMBOL instruction. */
 static INLINE bool
 jit_visit_storesymbol_op(
@@ -1187,8 +1268,7 @@ jit_visit_call_op(
 		}
 		arg_addr = (uint32_t)(intptr_t)ctx->code;
 		for (i = 0; i < arg_count; i++) {
-			*(uint32_t *)ctx->code = (uint32_t)arg[i];
-			ctx->code = (uint32_t *)ctx->code + 1;
+			IW((uint32_t)arg[i]);
 		}
 	} else {
 		arg_addr = 0;
@@ -1270,8 +1350,7 @@ jit_visit_thiscall_op(
 		}
 		arg_addr = (uint32_t)(intptr_t)ctx->code;
 		for (i = 0; i < arg_count; i++) {
-			*(uint32_t *)ctx->code = (uint32_t)arg[i];
-			ctx->code = (uint32_t *)ctx->code + 1;
+			IW((uint32_t)arg[i]);
 		}
 	} else {
 		arg_addr = 0;
@@ -1334,10 +1413,8 @@ jit_visit_jmp_op(
 	}
 
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_BAL;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_BAL))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1376,10 +1453,8 @@ jit_visit_jmpiftrue_op(
 	}
 
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_BNE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_BNE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1418,10 +1493,8 @@ jit_visit_jmpiffalse_op(
 	}
 	
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_BEQ;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_BEQ))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1448,10 +1521,8 @@ jit_visit_jmpifeq_op(
 	}
 
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_BEQ;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_BEQ))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1520,17 +1591,15 @@ jit_visit_bytecode(
 	/* Put a body. */
 	while (ctx->lpc < ctx->func->bytecode_size) {
 		/* Save LPC and addr. */
-		if (ctx->pc_entry_count >= PC_ENTRY_MAX) {
-			rt_error(ctx->rt, _("Code too big."));
+		if (!jit_add_pc_entry(ctx, (uint32_t)ctx->lpc, ctx->code))
 			return false;
-		}
-		ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-		ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-		ctx->pc_entry_count++;
 
 		/* Dispatch by opcode. */
 		CONSUME_OPCODE(opcode);
 		switch (opcode) {
+		case ROP_NOP:
+			/* Padding that rt_link() left after a LOADFUNC. */
+			break;
 		case ROP_LINEINFO:
 			if (!jit_visit_lineinfo_op(ctx))
 				return false;
@@ -1552,10 +1621,12 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_ACONST:
+		case ROP_LACONST:
 			if (!jit_visit_aconst_op(ctx))
 				return false;
 			break;
 		case ROP_DCONST:
+		case ROP_LDCONST:
 			if (!jit_visit_dconst_op(ctx))
 				return false;
 			break;
@@ -1564,18 +1635,25 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_ADD:
+		case ROP_IADD:
+		case ROP_FADD:
 			if (!jit_visit_add_op(ctx))
 				return false;
 			break;
 		case ROP_SUB:
+		case ROP_ISUB:
+		case ROP_FSUB:
 			if (!jit_visit_sub_op(ctx))
 				return false;
 			break;
 		case ROP_MUL:
+		case ROP_IMUL:
+		case ROP_FMUL:
 			if (!jit_visit_mul_op(ctx))
 				return false;
 			break;
 		case ROP_DIV:
+		case ROP_FDIV:
 			if (!jit_visit_div_op(ctx))
 				return false;
 			break;
@@ -1600,26 +1678,38 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_LT:
+		case ROP_ILT:
+		case ROP_FLT:
 			if (!jit_visit_lt_op(ctx))
 				return false;
 			break;
 		case ROP_LTE:
+		case ROP_ILTE:
+		case ROP_FLTE:
 			if (!jit_visit_lte_op(ctx))
 				return false;
 			break;
 		case ROP_EQ:
+		case ROP_IEQ:
+		case ROP_FEQ:
 			if (!jit_visit_eq_op(ctx))
 				return false;
 			break;
 		case ROP_NEQ:
+		case ROP_INEQ:
+		case ROP_FNEQ:
 			if (!jit_visit_neq_op(ctx))
 				return false;
 			break;
 		case ROP_GTE:
+		case ROP_IGTE:
+		case ROP_FGTE:
 			if (!jit_visit_gte_op(ctx))
 				return false;
 			break;
 		case ROP_GT:
+		case ROP_IGT:
+		case ROP_FGT:
 			if (!jit_visit_gt_op(ctx))
 				return false;
 			break;
@@ -1628,6 +1718,7 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_LOADARRAY:
+		case ROP_ULOADARRAY:
 			if (!jit_visit_loadarray_op(ctx))
 				return false;
 			break;
@@ -1644,6 +1735,7 @@ jit_visit_bytecode(
 			return false;
 			break;
 		case ROP_GETDICTVALBYINDEX:
+		case ROP_UGETDICTVALBYINDEX:
 			if (!jit_visit_getdictvalbyindex_op(ctx))
 				return false;
 			break;
@@ -1651,6 +1743,18 @@ jit_visit_bytecode(
 			if (!jit_visit_loadsymbol_op(ctx))
 				return false;
 			break;
+		case ROP_LOADFUNC:
+			if (!jit_visit_loadfunc_op(ctx))
+				return false;
+			break;
+		case ROP_CHKFUNC:
+			if (!jit_visit_chkfunc_op(ctx))
+				return false;
+			break;
+		case ROP_SWITCH:
+			if (!jit_visit_switch_op(ctx))
+				return false;
+			break;
 		case ROP_STORESYMBOL:
 			if (!jit_visit_storesymbol_op(ctx))
 				return false;
@@ -1688,15 +1792,15 @@ jit_visit_bytecode(
 				return false;
 			break;
 		default:
-			assert(JIT_OP_NOT_IMPLEMENTED);
-			break;
+			/* Not supported, so the function stays interpreted. */
+			rt_error(ctx->rt, _("Instruction 0x%02x is not supported by the JIT."), opcode);
+			return false;
 		}
 	}
 
 	/* Add the tail PC to the table. */
-	ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-	ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-	ctx->pc_entry_count++;
+	if (!jit_add_pc_entry(ctx, (uint32_t)ctx->lpc, ctx->code))
+		return false;
 
 	/* Put an epilogue. */
 	ASM {
@@ -1725,20 +1829,13 @@ jit_patch_branch(
 {
 	uint32_t *target_code;
 	int offset;
-	int i;
 
 	if (ctx->pc_entry_count == 0)
 		return true;
 
 	/* Search a code addr at lpc. */
 	target_code = NULL;
-	for (i = 0; i < ctx->pc_entry_count; i++) {
-		if (ctx->pc_entry[i].lpc == ctx->branch_patch[patch_index].lpc) {
-			target_code = ctx->pc_entry[i].code;
-			break;
-		}
-			
-	}
+	target_code = jit_find_pc_entry(ctx, ctx->branch_patch[patch_index].lpc);
 	if (target_code == NULL) {
 		rt_error(ctx->rt, _("Branch target not found."));
 		return false;
@@ -25,22 +25,11 @@
 #define JIT_OP_NOT_IMPLEMENTED	0
 #define NEVER_COME_HERE		0
 
-/* PC entry size. */
-#define PC_ENTRY_MAX		2048
-
-/* Branch pathch size. */
-#define BRANCH_PATCH_MAX	2048
-
 /* Branch patch type */
 #define PATCH_JMP		0
 #define PATCH_JE		1
 #define PATCH_JNE		2
 
-/* Generated code. */
-static uint8_t *jit_code_region;
-static uint8_t *jit_code_region_cur;
-static uint8_t *jit_code_region_tail;
-
 /* Forward declaration */
 static bool jit_visit_bytecode(struct jit_context *ctx);
 static bool jit_patch_branch(struct jit_context *ctx, int patch_index);
@@ -54,63 +43,44 @@ jit_build(
 	  struct rt_func *func)
 {
 	struct jit_context ctx;
+	void *tail;
 	int i;
 
-	/* If the first call, map a memory region for the generated code. */
-	if (jit_code_region == NULL) {
-		if (!jit_map_memory_region((void **)&jit_code_region, JIT_CODE_MAX)) {
-			rt_error(rt, "Memory mapping failed.");
-			return false;
-		}
-		jit_code_region_cur = jit_code_region;
-		jit_code_region_tail = jit_code_region + JIT_CODE_MAX;
-	}
-
 	/* Make a context. */
 	memset(&ctx, 0, sizeof(struct jit_context));
-	ctx.code_top = jit_code_region_cur;
-	ctx.code_end = jit_code_region_tail;
-	ctx.code = ctx.code_top;
 	ctx.rt = rt;
 	ctx.func = func;
 
-	/* Make code writable and non-executable. */
-	jit_map_writable(jit_code_region, JIT_CODE_MAX);
+	/*
+	 * On a failure, the function stays interpreted and the failure is
+	 * recorded in the cache statistics.
+	 */
+
+	/* Take a free area of the code cache. (writable and non-executable) */
+	if (!jit_alloc_code(&ctx))
+		return jit_fail(&ctx);
 
 	/* Visit over the bytecode. */
 	if (!jit_visit_bytecode(&ctx))
-		return false;
+		return jit_fail(&ctx);
 
-	jit_code_region_cur = ctx.code;
-
-	/* Patch branches. */
+	/* Patch branches. (This moves the cursor, so keep the code end.) */
+	tail = ctx.code;
 	for (i = 0; i < ctx.branch_patch_count; i++) {
 		if (!jit_patch_branch(&ctx, i))
-			return false;
+			return jit_fail(&ctx);
 	}
+	ctx.code = tail;
 
-	/* Make code executable and non-writable. */
-	jit_map_executable(jit_code_region, JIT_CODE_MAX);
+	/* Register the code, make it executable, and publish it. */
+	if (!jit_commit_code(&ctx))
+		return jit_fail(&ctx);
 
-	func->jit_code = (bool (*)(struct rt_env *))ctx.code_top;
+	jit_free_context(&ctx);
 
 	return true;
 }
 
-/*
- * Free a JIT-compiled code for a function.
- */
-void
-jit_free(
-	 struct rt_env *rt,
-	 struct rt_func *func)
-{
-	UNUSED_PARAMETER(rt);
-	UNUSED_PARAMETER(func);
-
-	/* XXX: */
-}
-
 /*
  * Assembler output functions
  */
@@ -659,8 +629,8 @@ jit_visit_neg_op(
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src);
 
-	/* if (!jit_neg_helper(rt, dst, src)) return false; */
-	ASM_UNARY_OP(rt_xor_helper);
+	/* if (!rt_neg_helper(rt, dst, src)) return false; */
+	ASM_UNARY_OP(rt_neg_helper);
 
 	return true;
 }
@@ -944,6 +914,95 @@ jit_visit_loadsymbol_op(
 	return true;
 }
 
+/* Visit a ROP_CHKFUNC instruction. */
+static INLINE bool
+jit_visit_chkfunc_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	const char *src;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_STRING(src);
+
+	/* if (!rt_chkfunc_helper(rt, dst, src)) return false; */
+	ASM {
+		/* ebp-4: &rt->frame->tmpvar[0] */
+		/* ebp-8: rt */
+		/* ebp-12: exception_handler */
+
+		/* movl $src, %eax */			IB(0xb8); ID((uint32_t)src);
+		/* push %eax */				IB(0x50);
+		/* movl $dst, %eax */			IB(0xb8); ID((uint32_t)dst);
+		/* pushl %eax */			IB(0x50);
+		/* movl -8(%ebp), %eax */		IB(0x8b); IB(0x45); IB(0xf8);
+		/* pushl %eax */			IB(0x50);
+		/* movl $rt_chkfunc_helper, %eax */	IB(0xb8); ID((uint32_t)rt_chkfunc_helper);
+		/* call *%eax */			IB(0xff); IB(0xd0);
+		/* addl $12, %esp */			IB(0x83); IB(0xc4); IB(12);
+
+		/* cmpl $0, %eax */		IB(0x83); IB(0xf8); IB(0x00);					\
+		/* jne next */			IB(0x75); IB(0x03);						\
+		/* jmp 8(%ebp) */		IB(0xff); IB(0x65); IB(0x08);					\
+		/* next:*/											\
+	}
+
+	return true;
+}
+
+/* Visit a ROP_SWITCH instruction. */
+static INLINE bool
+jit_visit_switch_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	const uint8_t *src;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_TABLE(src);
+
+	/* if (!rt_switch_helper(rt, dst, src)) return false; */
+	ASM {
+		/* ebp-4: &rt->frame->tmpvar[0] */
+		/* ebp-8: rt */
+		/* ebp-12: exception_handler */
+
+		/* movl $src, %eax */			IB(0xb8); ID((uint32_t)src);
+		/* push %eax */				IB(0x50);
+		/* movl $dst, %eax */			IB(0xb8); ID((uint32_t)dst);
+		/* pushl %eax */			IB(0x50);
+		/* movl -8(%ebp), %eax */		IB(0x8b); IB(0x45); IB(0xf8);
+		/* pushl %eax */			IB(0x50);
+		/* movl $rt_switch_helper, %eax */	IB(0xb8); ID((uint32_t)rt_switch_helper);
+		/* call *%eax */			IB(0xff); IB(0xd0);
+		/* addl $12, %esp */			IB(0x83); IB(0xc4); IB(12);
+
+		/* cmpl $0, %eax */		IB(0x83); IB(0xf8); IB(0x00);					\
+		/* jne next */			IB(0x75); IB(0x03);						\
+		/* jmp 8(%ebp) */		IB(0xff); IB(0x65); IB(0x08);					\
+		/* next:*/											\
+	}
+
+	return true;
+}
+
+/* Visit a ROP_LOADFUNC instruction. */
+static INLINE bool
+jit_visit_loadfunc_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	int src;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_IMM16(src);
+
+	/* if (!rt_loadfunc_helper(rt, dst, src)) return false; */
+	ASM_UNARY_OP(rt_loadfunc_helper);
+
+	return true;
+}
+
 /* Visit a ROP_STORESYMBOL instruction. */
 static INLINE bool
 jit_visit_storesymbol_op(
@@ -1090,8 +1149,7 @@ jit_visit_call_op(
 		}
 		arg_addr = (uint32_t)(intptr_t)ctx->code;
 		for (i = 0; i < arg_count; i++) {
-			*(int *)ctx->code = arg[i];
-			ctx->code = (uint8_t *)ctx->code + 4;
+			ID((uint32_t)arg[i]);
 		}
 	} else {
 		arg_addr = 0;
@@ -1157,8 +1215,7 @@ jit_visit_thiscall_op(
 	}
 	arg_addr = (uint32_t)(intptr_t)ctx->code;
 	for (i = 0; i < arg_count; i++) {
-		*(int *)ctx->code = arg[i];
-		ctx->code = (uint8_t *)ctx->code + 4;
+		ID((uint32_t)arg[i]);
 	}
 
 	/* if (!rt_thiscall_helper(rt, dst, obj, symbol, arg_count, arg)) return false; */
@@ -1206,10 +1263,8 @@ jit_visit_jmp_op(
 	}
 
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JMP;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JMP))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1249,10 +1304,8 @@ jit_visit_jmpiftrue_op(
 	}
 	
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JNE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JNE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1292,10 +1345,8 @@ jit_visit_jmpiffalse_op(
 	}
 	
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1321,10 +1372,8 @@ jit_visit_jmpifeq_op(
 	}
 
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1365,7 +1414,7 @@ jit_visit_bytecode(
 		/* movl %eax, -4(%ebp) */		IB(0x89); IB(0x45); IB(0xfc);
 
 		/* (ebp-12): exception_handler */
-		/* movl $(ctx->code + 10), -12(%ebp) */	IB(0xc7); IB(0x45); IB(0xf4); ID((uint32_t)(ctx->code + 10));
+		/* movl $(ctx->code + 10), -12(%ebp) */	IB(0xc7); IB(0x45); IB(0xf4); ID((uint32_t)jit_get_exec_addr(ctx, ctx->code + 10));
 
 		/* Skip an exception handler. */
 		/* jmp exception_handler_end */		IB(0xeb); IB(0x0f);
@@ -1390,17 +1439,15 @@ jit_visit_bytecode(
 	/* Put a body. */
 	while (ctx->lpc < ctx->func->bytecode_size) {
 		/* Save LPC and addr. */
-		if (ctx->pc_entry_count >= PC_ENTRY_MAX) {
-			rt_error(ctx->rt, "Too big code.");
+		if (!jit_add_pc_entry(ctx, (uint32_t)ctx->lpc, ctx->code))
 			return false;
-		}
-		ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-		ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-		ctx->pc_entry_count++;
 
 		/* Dispatch by opcode. */
 		CONSUME_OPCODE(opcode);
 		switch (opcode) {
+		case ROP_NOP:
+			/* Padding that rt_link() left after a LOADFUNC. */
+			break;
 		case ROP_LINEINFO:
 			if (!jit_visit_lineinfo_op(ctx))
 				return false;
@@ -1422,10 +1469,12 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_ACONST:
+		case ROP_LACONST:
 			if (!jit_visit_aconst_op(ctx))
 				return false;
 			break;
 		case ROP_DCONST:
+		case ROP_LDCONST:
 			if (!jit_visit_dconst_op(ctx))
 				return false;
 			break;
@@ -1434,18 +1483,25 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_ADD:
+		case ROP_IADD:
+		case ROP_FADD:
 			if (!jit_visit_add_op(ctx))
 				return false;
 			break;
 		case ROP_SUB:
+		case ROP_ISUB:
+		case ROP_FSUB:
 			if (!jit_visit_sub_op(ctx))
 				return false;
 			break;
 		case ROP_MUL:
+		case ROP_IMUL:
+		case ROP_FMUL:
 			if (!jit_visit_mul_op(ctx))
 				return false;
 			break;
 		case ROP_DIV:
+		case ROP_FDIV:
 			if (!jit_visit_div_op(ctx))
 				return false;
 			break;
@@ -1470,26 +1526,38 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_LT:
+		case ROP_ILT:
+		case ROP_FLT:
 			if (!jit_visit_lt_op(ctx))
 				return false;
 			break;
 		case ROP_LTE:
+		case ROP_ILTE:
+		case ROP_FLTE:
 			if (!jit_visit_lte_op(ctx))
 				return false;
 			break;
 		case ROP_EQ:
+		case ROP_IEQ:
+		case ROP_FEQ:
 			if (!jit_visit_eq_op(ctx))
 				return false;
 			break;
 		case ROP_NEQ:
+		case ROP_INEQ:
+		case ROP_FNEQ:
 			if (!jit_visit_neq_op(ctx))
 				return false;
 			break;
 		case ROP_GTE:
+		case ROP_IGTE:
+		case ROP_FGTE:
 			if (!jit_visit_gte_op(ctx))
 				return false;
 			break;
 		case ROP_GT:
+		case ROP_IGT:
+		case ROP_FGT:
 			if (!jit_visit_gt_op(ctx))
 				return false;
 			break;
@@ -1498,6 +1566,7 @@ jit_visit_bytecode(
 				return false;
 			break;
 		case ROP_LOADARRAY:
+		case ROP_ULOADARRAY:
 			if (!jit_visit_loadarray_op(ctx))
 				return false;
 			break;
@@ -1514,6 +1583,7 @@ jit_visit_bytecode(
 			return false;
 			break;
 		case ROP_GETDICTVALBYINDEX:
+		case ROP_UGETDICTVALBYINDEX:
 			if (!jit_visit_getdictvalbyindex_op(ctx))
 				return false;
 			break;
@@ -1521,6 +1591,18 @@ jit_visit_bytecode(
 			if (!jit_visit_loadsymbol_op(ctx))
 				return false;
 			break;
+		case ROP_LOADFUNC:
+			if (!jit_visit_loadfunc_op(ctx))
+				return false;
+			break;
+		case ROP_CHKFUNC:
+			if (!jit_visit_chkfunc_op(ctx))
+				return false;
+			break;
+		case ROP_SWITCH:
+			if (!jit_visit_switch_op(ctx))
+				return false;
+			break;
 		case ROP_STORESYMBOL:
 			if (!jit_visit_storesymbol_op(ctx))
 				return false;
@@ -1558,15 +1640,15 @@ jit_visit_bytecode(
 				return false;
 			break;
 		default:
-			assert(JIT_OP_NOT_IMPLEMENTED);
-			break;
+			/* Not supported, so the function stays interpreted. */
+			rt_error(ctx->rt, _("Instruction 0x%02x is not supported by the JIT."), opcode);
+			return false;
 		}
 	}
 
 	/* Add the tail PC to the table. */
-	ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-	ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-	ctx->pc_entry_count++;
+	if (!jit_add_pc_entry(ctx, (uint32_t)ctx->lpc, ctx->code))
+		return false;
 
 	/* Put an epilogue. */
 	ASM {
@@ -1592,17 +1674,10 @@ jit_patch_branch(
 {
 	uint8_t *target_code;
 	int offset;
-	int i;
 
 	/* Search a code addr at lpc. */
 	target_code = NULL;
-	for (i = 0; i < ctx->pc_entry_count; i++) {
-		if (ctx->pc_entry[i].lpc == ctx->branch_patch[patch_index].lpc) {
-			target_code = (uint8_t *)ctx->pc_entry[i].code;
-			break;
-		}
-			
-	}
+	target_code = (uint8_t *)jit_find_pc_entry(ctx, ctx->branch_patch[patch_index].lpc);
 	if (target_code == NULL) {
 		rt_error(ctx->rt, "Branch target not found.");
 		return false;
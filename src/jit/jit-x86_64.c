@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 
@@ -25,91 +26,18 @@
 #define JIT_OP_NOT_IMPLEMENTED	0
 #define NEVER_COME_HERE		0
 
-/* PC entry size. */
-#define PC_ENTRY_MAX		2048
-
-/* Branch pathch size. */
-#define BRANCH_PATCH_MAX	2048
-
 /* Branch patch type */
 #define PATCH_JMP		0
 #define PATCH_JE		1
 #define PATCH_JNE		2
 
-/* Generated code. */
-static uint8_t *jit_code_region;
-static uint8_t *jit_code_region_cur;
-static uint8_t *jit_code_region_tail;
+/* Registers for loop tmpvars. (rbx, rbp, r12: callee-saved) */
+#define LOOP_REG_COUNT		3
+static const int loop_reg[LOOP_REG_COUNT] = { 3, 5, 12 };
 
 /* Forward declaration */
-static bool jit_visit_bytecode(struct jit_context *ctx);
-static bool jit_patch_branch(struct jit_context *ctx, int patch_index);
-
-/*
- * Generate a JIT-compiled code for a function.
- */
-bool
-jit_build(
-	  struct rt_env *rt,
-	  struct rt_func *func)
-{
-	struct jit_context ctx;
-	int i;
-
-	/* If the first call, map a memory region for the generated code. */
-	if (jit_code_region == NULL) {
-		if (!jit_map_memory_region((void **)&jit_code_region, JIT_CODE_MAX)) {
-			rt_error(rt, "Memory mapping failed.");
-			return false;
-		}
-		jit_code_region_cur = jit_code_region;
-		jit_code_region_tail = jit_code_region + JIT_CODE_MAX;
-	}
-
-	/* Make a context. */
-	memset(&ctx, 0, sizeof(struct jit_context));
-	ctx.code_top = jit_code_region_cur;
-	ctx.code_end = jit_code_region_tail;
-	ctx.code = ctx.code_top;
-	ctx.rt = rt;
-	ctx.func = func;
-
-	/* Make code writable and non-executable. */
-	jit_map_writable(jit_code_region, JIT_CODE_MAX);
-
-	/* Visit over the bytecode. */
-	if (!jit_visit_bytecode(&ctx))
-		return false;
-
-	jit_code_region_cur = ctx.code;
-
-	/* Patch branches. */
-	for (i = 0; i < ctx.branch_patch_count; i++) {
-		if (!jit_patch_branch(&ctx, i))
-			return false;
-	}
-
-	/* Make code executable and non-writable. */
-	jit_map_executable(jit_code_region, JIT_CODE_MAX);
-
-	func->jit_code = (bool (*)(struct rt_env *))ctx.code_top;
-
-	return true;
-}
-
-/*
- * Free a JIT-compiled code for a function.
- */
-void
-jit_free(
-	 struct rt_env *rt,
-	 struct rt_func *func)
-{
-	UNUSED_PARAMETER(rt);
-	UNUSED_PARAMETER(func);
-
-	/* XXX: */
-}
+static bool jit_put_loop_stores(struct jit_context *ctx, bool all_written);
+static bool jit_put_osr_entry(struct jit_context *ctx);
 
 /*
  * Assembler output functions
@@ -160,6 +88,9 @@ jit_put_dword(
 	return true;
 }
 
+/* Put an address word that the disk cache relocates. (see jit_add_reloc()) */
+#define IQR(t, q)		if (!jit_add_reloc(ctx, t, q)) return false; IQ(q)
+
 /* Put a instruction word. */
 #define IQ(q)			if (!jit_put_qword(ctx, q)) return false
 static INLINE bool
@@ -207,7 +138,7 @@ jit_put_qword(
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst); 	\
 		/* movq src1, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src1);	\
 		/* movq src2, %rcx */			IB(0x48); IB(0xc7); IB(0xc1); ID((uint32_t)src2);	\
-		/* movabs f, %r8 */			IB(0x49); IB(0xb8); IQ((uint64_t)f);			\
+		/* movabs f, %r8 */			IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)f);	\
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);				\
 														\
 		/* cmpl $0, %eax */	IB(0x83); IB(0xf8); IB(0x00);						\
@@ -226,7 +157,7 @@ jit_put_qword(
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);				\
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst); 	\
 		/* movq src, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);	\
-		/* movabs f, %r8 */			IB(0x49); IB(0xb8); IQ((uint64_t)f);			\
+		/* movabs f, %r8 */			IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)f);	\
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);				\
 														\
 		/* cmpl $0, %eax */	IB(0x83); IB(0xf8); IB(0x00);						\
@@ -235,6 +166,477 @@ jit_put_qword(
 		/* next:*/											\
 	}
 
+/*
+ * Loop registers
+ */
+
+/* movl disp32(%r15), %reg32 */
+static INLINE bool
+jit_put_loop_load(
+	struct jit_context *ctx,
+	int reg,
+	int tmpvar)
+{
+	int disp;
+
+	disp = tmpvar * (int)sizeof(struct rt_value) + 8;
+
+	ASM {
+		/* REX.B(+R) */		IB((uint8_t)(0x41 | ((reg >> 3) << 2)));
+		/* movl */		IB(0x8b);
+		/* modrm */		IB((uint8_t)(0x80 | ((reg & 7) << 3) | 7));
+		/* disp32 */		ID((uint32_t)disp);
+	}
+
+	return true;
+}
+
+/* movl %reg32, disp32(%r15) */
+static INLINE bool
+jit_put_loop_store(
+	struct jit_context *ctx,
+	int reg,
+	int tmpvar)
+{
+	int disp;
+
+	disp = tmpvar * (int)sizeof(struct rt_value) + 8;
+
+	ASM {
+		/* REX.B(+R) */		IB((uint8_t)(0x41 | ((reg >> 3) << 2)));
+		/* movl */		IB(0x89);
+		/* modrm */		IB((uint8_t)(0x80 | ((reg & 7) << 3) | 7));
+		/* disp32 */		ID((uint32_t)disp);
+	}
+
+	return true;
+}
+
+/* Size of jit_put_loop_store(). */
+#define LOOP_STORE_SIZE		7
+
+/* movl %reg32, %eax (dst=0) or %edx (dst=2) */
+static INLINE bool
+jit_put_loop_move(
+	struct jit_context *ctx,
+	int reg,
+	int dst)
+{
+	ASM {
+		if (reg >= 8) {
+			/* REX.R */	IB(0x44);
+		}
+		/* movl */		IB(0x89);
+		/* modrm */		IB((uint8_t)(0xc0 | ((reg & 7) << 3) | dst));
+	}
+
+	return true;
+}
+
+/* Store dirty loop registers, or all written ones, to the tmpvars. */
+static bool
+jit_put_loop_stores(
+	struct jit_context *ctx,
+	bool all_written)
+{
+	struct jit_loop *loop;
+	int i;
+
+	if (ctx->cur_loop < 0)
+		return true;
+
+	loop = &ctx->loop[ctx->cur_loop];
+	for (i = 0; i < loop->reg_count; i++) {
+		if (!loop->is_written[i])
+			continue;
+		if (!all_written && !loop->is_dirty[i])
+			continue;
+		if (!jit_put_loop_store(ctx, loop_reg[i], loop->tmpvar[i]))
+			return false;
+		if (!all_written)
+			loop->is_dirty[i] = false;
+	}
+
+	return true;
+}
+
+/* Count loop registers that may need stores on exits. */
+static int
+jit_count_loop_written(
+	struct jit_context *ctx)
+{
+	struct jit_loop *loop;
+	int i, n;
+
+	if (ctx->cur_loop < 0)
+		return 0;
+
+	loop = &ctx->loop[ctx->cur_loop];
+	n = 0;
+	for (i = 0; i < loop->reg_count; i++) {
+		if (loop->is_written[i])
+			n++;
+	}
+
+	return n;
+}
+
+/* Load the registers of a loop at its header. */
+static bool
+jit_put_loop_loads(
+	struct jit_context *ctx,
+	struct jit_loop *loop)
+{
+	int i;
+
+	for (i = 0; i < loop->reg_count; i++) {
+		if (!jit_put_loop_load(ctx, loop_reg[i], loop->tmpvar[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/* Check if a branch target is outside the current loop. */
+static INLINE bool
+jit_is_loop_exit(
+	struct jit_context *ctx,
+	uint32_t target_lpc)
+{
+	struct jit_loop *loop;
+
+	if (ctx->cur_loop < 0)
+		return false;
+
+	loop = &ctx->loop[ctx->cur_loop];
+	return target_lpc < loop->start_lpc || target_lpc >= loop->end_lpc;
+}
+
+/* Put a conditional loop exit: store the registers only if taken. */
+static bool
+jit_put_loop_exit(
+	struct jit_context *ctx,
+	uint8_t skip_jcc,
+	uint32_t target_lpc)
+{
+	int stub_size;
+
+	stub_size = jit_count_loop_written(ctx) * LOOP_STORE_SIZE + 5;
+
+	ASM {
+		/* j<!cc> skip */	IB(skip_jcc); IB((uint8_t)stub_size);
+	}
+
+	if (!jit_put_loop_stores(ctx, true))
+		return false;
+
+	/* Patch later. */
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JMP))
+		return false;
+
+	ASM {
+		/* Patched later. */
+		/* jmp 5 */	IB(0xe9); ID(0);
+	/* skip: */
+	}
+
+	return true;
+}
+
+/*
+ * Type guards
+ */
+
+/* Force every guard to fail. (for testing) */
+extern bool linguine_conf_jit_deopt_stress;
+
+/* Size of a deopt exit without the register saves. */
+#define DEOPT_EXIT_SIZE		19
+
+/*
+ * Put a deoptimization exit that is skipped if skip_jcc is taken.
+ *  - The exit saves the dirty loop registers to rt->frame->deopt_reg[]
+ *    and records a deopt point to write them back. (see jit.h)
+ */
+static bool
+jit_put_deopt_exit(
+	struct jit_context *ctx,
+	uint8_t skip_jcc,
+	uint32_t lpc)
+{
+	int tmpvar[JIT_LOOP_REG_MAX];
+	int i, size;
+
+	/* Get the registers to save. */
+	jit_get_deopt_regs(ctx, tmpvar);
+	size = DEOPT_EXIT_SIZE;
+	for (i = 0; i < LOOP_REG_COUNT; i++) {
+		if (tmpvar[i] >= 0)
+			size += loop_reg[i] >= 8 ? 4 : 3;
+	}
+
+	ASM {
+		if (!linguine_conf_jit_deopt_stress) {
+			/* j<cc> skip */	IB(skip_jcc); IB((uint8_t)size);
+		}
+
+		/* rt->frame->deopt_addr = exit */
+		/* movq (%r14), %rax */		IB(0x49); IB(0x8b); IB(0x06);
+		/* leaq 0(%rip), %rcx */	IB(0x48); IB(0x8d); IB(0x0d); ID(0);
+	}
+
+	/* The exit address is here. */
+	if (!jit_add_deopt_point(ctx, ctx->code, lpc, tmpvar))
+		return false;
+
+	ASM {
+		/* movq %rcx, ofs(%rax) */	IB(0x48); IB(0x89); IB(0x48); IB((uint8_t)offsetof(struct rt_frame, deopt_addr));
+
+		/* rt->frame->deopt_reg[i] = reg */
+		for (i = 0; i < LOOP_REG_COUNT; i++) {
+			if (tmpvar[i] < 0)
+				continue;
+			if (loop_reg[i] >= 8) {
+				/* REX.R */	IB(0x44);
+			}
+			/* movl %reg32, ofs(%rax) */
+			IB(0x89);
+			IB((uint8_t)(0x40 | ((loop_reg[i] & 7) << 3)));
+			IB((uint8_t)(offsetof(struct rt_frame, deopt_reg) + sizeof(int32_t) * (size_t)i));
+		}
+	}
+
+	/* Return through the epilogue. */
+	if (!jit_add_branch_patch(ctx, ctx->code, (uint32_t)ctx->func->bytecode_size, PATCH_JMP))
+		return false;
+
+	ASM {
+		/* Patched later. */
+		/* jmp epilogue */		IB(0xe9); ID(0);
+	/* skip: */
+	}
+
+	return true;
+}
+
+/* Guard a tmpvar type, or deoptimize. */
+static bool
+jit_put_type_guard(
+	struct jit_context *ctx,
+	int tmpvar,
+	int type,
+	uint32_t lpc)
+{
+	tmpvar *= (int)sizeof(struct rt_value);
+
+	ASM {
+		/* cmpl type, tmpvar(%r15) */	IB(0x41); IB(0x81); IB(0xbf); ID((uint32_t)tmpvar); ID((uint32_t)type);
+	}
+
+	return jit_put_deopt_exit(ctx, 0x74, lpc);	/* je skip */
+}
+
+/* Guard two integer tmpvars, or deoptimize. */
+static bool
+jit_put_int_guards(
+	struct jit_context *ctx,
+	int src1,
+	int src2,
+	uint32_t lpc)
+{
+	src1 *= (int)sizeof(struct rt_value);
+	src2 *= (int)sizeof(struct rt_value);
+
+	/* RT_VALUE_INT is zero. */
+	ASM {
+		/* movl src1(%r15), %eax */	IB(0x41); IB(0x8b); IB(0x87); ID((uint32_t)src1);
+		/* orl src2(%r15), %eax */	IB(0x41); IB(0x0b); IB(0x87); ID((uint32_t)src2);
+	}
+
+	return jit_put_deopt_exit(ctx, 0x74, lpc);	/* je skip */
+}
+
+/* Load an integer tmpvar to %eax (dst=0) or %edx (dst=2) from its loop register or the memory. */
+static bool
+jit_put_int_load(
+	struct jit_context *ctx,
+	int tmpvar,
+	int dst)
+{
+	int reg;
+
+	reg = jit_get_loop_reg(ctx, tmpvar);
+	if (reg != -1)
+		return jit_put_loop_move(ctx, loop_reg[reg], dst);
+
+	ASM {
+		/* movl tmpvar+8(%r15), %e[ad]x */	IB(0x41); IB(0x8b); IB((uint8_t)(0x87 | (dst << 3))); ID((uint32_t)(tmpvar * (int)sizeof(struct rt_value) + 8));
+	}
+
+	return true;
+}
+
+/* Integer ADD, SUB or MUL after the guards. */
+static bool
+jit_put_int_arith(
+	struct jit_context *ctx,
+	uint8_t opcode,
+	int dst,
+	int src1,
+	int src2)
+{
+	if (!jit_put_int_load(ctx, src1, 0))
+		return false;
+	if (!jit_put_int_load(ctx, src2, 2))
+		return false;
+
+	dst *= (int)sizeof(struct rt_value);
+
+	ASM {
+		if (opcode == ROP_ADD) {
+			/* addl %edx, %eax */		IB(0x01); IB(0xd0);
+		} else if (opcode == ROP_SUB) {
+			/* subl %edx, %eax */		IB(0x29); IB(0xd0);
+		} else {
+			/* imull %edx, %eax */		IB(0x0f); IB(0xaf); IB(0xc2);
+		}
+		/* movl $0, dst(%r15) */		IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(0);
+		/* movl %eax, dst+8(%r15) */		IB(0x41); IB(0x89); IB(0x87); ID((uint32_t)(dst + 8));
+	}
+
+	return true;
+}
+
+/* Integer comparison after the guards. (setcc: 0x9c for setl, ...) */
+static bool
+jit_put_int_compare(
+	struct jit_context *ctx,
+	uint8_t setcc,
+	int dst,
+	int src1,
+	int src2)
+{
+	if (!jit_put_int_load(ctx, src1, 0))
+		return false;
+	if (!jit_put_int_load(ctx, src2, 2))
+		return false;
+
+	dst *= (int)sizeof(struct rt_value);
+
+	ASM {
+		/* cmpl %edx, %eax */		IB(0x39); IB(0xd0);
+		/* set<cc> %al */		IB(0x0f); IB(setcc); IB(0xc0);
+		/* movzbl %al, %eax */		IB(0x0f); IB(0xb6); IB(0xc0);
+		/* movl $0, dst(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(0);
+		/* movl %eax, dst+8(%r15) */	IB(0x41); IB(0x89); IB(0x87); ID((uint32_t)(dst + 8));
+	}
+
+	return true;
+}
+
+/* Load a float tmpvar to %xmm0 (xmm=0) or %xmm1 (xmm=1). */
+static bool
+jit_put_float_load(
+	struct jit_context *ctx,
+	int tmpvar,
+	int xmm)
+{
+	ASM {
+		/* movss tmpvar+8(%r15), %xmm[01] */	IB(0xf3); IB(0x41); IB(0x0f); IB(0x10); IB((uint8_t)(0x87 | (xmm << 3))); ID((uint32_t)(tmpvar * (int)sizeof(struct rt_value) + 8));
+	}
+
+	return true;
+}
+
+/* Float ADD, SUB or MUL on the proven types. */
+static bool
+jit_put_float_arith(
+	struct jit_context *ctx,
+	uint8_t opcode,
+	int dst,
+	int src1,
+	int src2)
+{
+	if (!jit_put_float_load(ctx, src1, 0))
+		return false;
+	if (!jit_put_float_load(ctx, src2, 1))
+		return false;
+
+	dst *= (int)sizeof(struct rt_value);
+
+	ASM {
+		if (opcode == ROP_ADD) {
+			/* addss %xmm1, %xmm0 */	IB(0xf3); IB(0x0f); IB(0x58); IB(0xc1);
+		} else if (opcode == ROP_SUB) {
+			/* subss %xmm1, %xmm0 */	IB(0xf3); IB(0x0f); IB(0x5c); IB(0xc1);
+		} else {
+			/* mulss %xmm1, %xmm0 */	IB(0xf3); IB(0x0f); IB(0x59); IB(0xc1);
+		}
+		/* movl $RT_VALUE_FLOAT, dst(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(RT_VALUE_FLOAT);
+		/* movss %xmm0, dst+8(%r15) */		IB(0xf3); IB(0x41); IB(0x0f); IB(0x11); IB(0x87); ID((uint32_t)(dst + 8));
+	}
+
+	return true;
+}
+
+/*
+ * Float comparison on the proven types. (setcc: 0x97 for seta, 0x93 for setae)
+ *  - Only "above" conditions are false on NaN, so that LT and LTE swap
+ *    the operands.
+ */
+static bool
+jit_put_float_compare(
+	struct jit_context *ctx,
+	uint8_t setcc,
+	int dst,
+	int src1,
+	int src2)
+{
+	if (!jit_put_float_load(ctx, src1, 0))
+		return false;
+	if (!jit_put_float_load(ctx, src2, 1))
+		return false;
+
+	dst *= (int)sizeof(struct rt_value);
+
+	ASM {
+		/* ucomiss %xmm1, %xmm0 */		IB(0x0f); IB(0x2e); IB(0xc1);
+		/* set<cc> %al */			IB(0x0f); IB(setcc); IB(0xc0);
+		/* movzbl %al, %eax */			IB(0x0f); IB(0xb6); IB(0xc0);
+		/* movl $0, dst(%r15) */		IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(0);
+		/* movl %eax, dst+8(%r15) */		IB(0x41); IB(0x89); IB(0x87); ID((uint32_t)(dst + 8));
+	}
+
+	return true;
+}
+
+/*
+ * Put an integer-specialized binary instruction if the profile says so.
+ *  - It reads the loop registers, so that they are stored only for the
+ *    generic code. (see jit_is_loop_reg_aware())
+ *  - A typed opcode needs no guards.
+ */
+#define INT_BINARY_OP(put)									\
+	if (ctx->cur_ir->guard == JIT_GUARD_INT) {						\
+		if (ctx->cur_ir->typed != JIT_TYPED_INT &&					\
+		    !jit_put_int_guards(ctx, src1, src2, (uint32_t)lpc))			\
+			return false;								\
+		return put;									\
+	}											\
+	if (!jit_put_loop_stores(ctx, false))							\
+		return false;
+
+/*
+ * Put a float instruction of a typed opcode.
+ *  - The loop registers hold integers, but the operands are checked so
+ *    that a register is never bypassed.
+ */
+#define FLOAT_BINARY_OP(put)									\
+	if (ctx->cur_ir->typed == JIT_TYPED_FLOAT &&						\
+	    jit_get_loop_reg(ctx, src1) == -1 &&						\
+	    jit_get_loop_reg(ctx, src2) == -1)							\
+		return put;
+
 /*
  * Bytecode visitors
  */
@@ -266,10 +668,27 @@ jit_visit_assign_op(
 {
 	int dst;
 	int src;
+	int reg;
 
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src);
 
+	/* Copy a loop register without storing it. (dst never has one) */
+	reg = jit_get_loop_reg(ctx, src);
+	if (reg != -1) {
+		if (!jit_put_loop_move(ctx, loop_reg[reg], 0))
+			return false;
+
+		dst *= (int)sizeof(struct rt_value);
+
+		ASM {
+			/* movl $0, dst(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(0);
+			/* movl %eax, dst+8(%r15) */	IB(0x41); IB(0x89); IB(0x87); ID((uint32_t)(dst + 8));
+		}
+
+		return true;
+	}
+
 	dst *= (int)sizeof(struct rt_value);
 	src *= (int)sizeof(struct rt_value);
 
@@ -277,14 +696,10 @@ jit_visit_assign_op(
 	ASM {
 		/* r15 = &rt->frame->tmpvar[0] */
 
-		/* movq dst, %rax */		IB(0x48); IB(0xc7); IB(0xc0); ID((uint32_t)dst);
-		/* movq src, %rbx */		IB(0x48); IB(0xc7); IB(0xc3); ID((uint32_t)src);
-		/* addq %r15, %rax */		IB(0x4c); IB(0x01); IB(0xf8);
-		/* addq %r15, %rbx */		IB(0x4c); IB(0x01); IB(0xfb);
-		/* movq (%rbx), %rcx */		IB(0x48); IB(0x8b); IB(0x0b);
-		/* movq 8(%rbx), %rdx */	IB(0x48); IB(0x8b); IB(0x53); IB(0x08);
-		/* movq %rcx, (%rax) */		IB(0x48); IB(0x89); IB(0x08);
-		/* movq %rdx, 8(%rax) */	IB(0x48); IB(0x89); IB(0x50); IB(0x08);
+		/* movq src(%r15), %rcx */	IB(0x49); IB(0x8b); IB(0x8f); ID((uint32_t)src);
+		/* movq src+8(%r15), %rdx */	IB(0x49); IB(0x8b); IB(0x97); ID((uint32_t)(src + 8));
+		/* movq %rcx, dst(%r15) */	IB(0x49); IB(0x89); IB(0x8f); ID((uint32_t)dst);
+		/* movq %rdx, dst+8(%r15) */	IB(0x49); IB(0x89); IB(0x97); ID((uint32_t)(dst + 8));
 	}
 
 	return true;
@@ -308,10 +723,8 @@ jit_visit_iconst_op(
 	ASM {
 		/* r15 = &rt->frame->tmpvar[0] */
 
-		/* movq dst, %rax */		IB(0x48); IB(0xc7); IB(0xc0); ID((uint32_t)dst);
-		/* addq %r15, %rax */		IB(0x4c); IB(0x01); IB(0xf8);
-		/* movl $0, (%rax) */		IB(0xc7); IB(0x00); ID(0);
-		/* movl val, 8(%rax) */		IB(0xc7); IB(0x40); IB(0x08); ID((uint32_t)val);
+		/* movl $0, dst(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(0);
+		/* movl val, dst+8(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)(dst + 8)); ID((uint32_t)val);
 	}
 
 	return true;
@@ -330,15 +743,13 @@ jit_visit_fconst_op(
 
 	dst *= (int)sizeof(struct rt_value);
 
-	/* &rt->frame->tmpvar[dst].type = RT_VALUE_INT; */
-	/* &rt->frame->tmpvar[dst].val.i = val; */
+	/* &rt->frame->tmpvar[dst].type = RT_VALUE_FLOAT; */
+	/* &rt->frame->tmpvar[dst].val.f = val; */
 	ASM {
 		/* r15 = &rt->frame->tmpvar[0] */
 
-		/* movq dst, %rax */		IB(0x48); IB(0xc7); IB(0xc0); ID((uint32_t)dst);
-		/* addq %r15, %rax */		IB(0x4c); IB(0x01); IB(0xf8);
-		/* movl $1, (%rax) */		IB(0xc7); IB(0x00); ID(1);
-		/* movl val, 8(%rax) */		IB(0xc7); IB(0x40); IB(0x08); ID(val);
+		/* movl $1, dst(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)dst); ID(1);
+		/* movl val, dst+8(%r15) */	IB(0x41); IB(0xc7); IB(0x87); ID((uint32_t)(dst + 8)); ID(val);
 	}
 
 	return true;
@@ -366,8 +777,8 @@ jit_visit_sconst_op(
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* addq %r15, %rsi */			IB(0x4c); IB(0x01); IB(0xfe);
-		/* movabs val, %rdx */			IB(0x48); IB(0xba); IQ((uint64_t)val);
-		/* movabs rt_make_string, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_make_string);
+		/* movabs val, %rdx */			IB(0x48); IB(0xba); IQR(JIT_RELOC_BYTECODE, (uint64_t)val);
+		/* movabs rt_make_string, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_make_string);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -384,18 +795,22 @@ static INLINE bool
 jit_visit_aconst_op(
 	struct jit_context *ctx)
 {
+	uint64_t helper;
 	int dst;
 
 	CONSUME_TMPVAR(dst);
 
 	dst *= (int)sizeof(struct rt_value);
 
+	/* A frame-owned one is freed by rt_leave_frame(). */
+	helper = ctx->cur_ir->frame_owned ? (uint64_t)rt_make_frame_array : (uint64_t)rt_make_empty_array;
+
 	/* rt_make_empty_array(rt, &rt->frame->tmpvar[dst]); */
 	ASM {
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* addq %r15, %rsi */			IB(0x4c); IB(0x01); IB(0xfe);
-		/* movabs rt_make_empty_array, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_make_empty_array);
+		/* movabs helper, %r8 */		IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -412,18 +827,22 @@ static INLINE bool
 jit_visit_dconst_op(
 	struct jit_context *ctx)
 {
+	uint64_t helper;
 	int dst;
 
 	CONSUME_TMPVAR(dst);
 
 	dst *= (int)sizeof(struct rt_value);
 
+	/* A frame-owned one is freed by rt_leave_frame(). */
+	helper = ctx->cur_ir->frame_owned ? (uint64_t)rt_make_frame_dict : (uint64_t)rt_make_empty_dict;
+
 	/* rt_make_empty_dict(rt, &rt->frame->tmpvar[dst]); */
 	ASM {
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* addq %r15, %rsi */			IB(0x4c); IB(0x01); IB(0xfe);
-		/* movabs rt_make_empty_dict, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_make_empty_dict);
+		/* movabs helper, %r8 */		IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -441,18 +860,30 @@ jit_visit_inc_op(
 	struct jit_context *ctx)
 {
 	int dst;
+	int reg;
 
 	CONSUME_TMPVAR(dst);
 
+	/* If dst is on a loop register. */
+	reg = jit_get_loop_reg(ctx, dst);
+	if (reg != -1) {
+		ASM {
+			if (loop_reg[reg] >= 8) {
+				/* REX.B */	IB(0x41);
+			}
+			/* incl %reg32 */	IB(0xff); IB((uint8_t)(0xc0 | (loop_reg[reg] & 7)));
+		}
+		ctx->loop[ctx->cur_loop].is_dirty[reg] = true;
+		return true;
+	}
+
 	dst *= (int)sizeof(struct rt_value);
 
 	/* &rt->frame->tmpvar[dst].val.i++ */
 	ASM {
 		/* r15 = &rt->frame->tmpvar[0] */
 
-		/* movq dst, %rax */			IB(0x48); IB(0xc7); IB(0xc0); ID((uint32_t)dst);
-		/* addq %r15, %rax */			IB(0x4c); IB(0x01); IB(0xf8);
-		/* incq 8(%rax) */			IB(0x48); IB(0xff); IB(0x40); IB(0x08);
+		/* incq dst+8(%r15) */			IB(0x49); IB(0xff); IB(0x87); ID((uint32_t)(dst + 8));
 	}
 
 	return true;
@@ -463,14 +894,22 @@ static INLINE bool
 jit_visit_add_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_arith(ctx, ROP_ADD, dst, src1, src2));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_arith(ctx, ROP_ADD, dst, src1, src2));
+
 	/* if (!jit_add_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_add_helper);
 
@@ -482,14 +921,22 @@ static INLINE bool
 jit_visit_sub_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_arith(ctx, ROP_SUB, dst, src1, src2));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_arith(ctx, ROP_SUB, dst, src1, src2));
+
 	/* if (!jit_sub_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_sub_helper);
 
@@ -501,14 +948,22 @@ static INLINE bool
 jit_visit_mul_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_arith(ctx, ROP_MUL, dst, src1, src2));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_arith(ctx, ROP_MUL, dst, src1, src2));
+
 	/* if (!jit_mul_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_mul_helper);
 
@@ -621,8 +1076,8 @@ jit_visit_neg_op(
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src);
 
-	/* if (!jit_neg_helper(rt, dst, src)) return false; */
-	ASM_UNARY_OP(rt_xor_helper);
+	/* if (!rt_neg_helper(rt, dst, src)) return false; */
+	ASM_UNARY_OP(rt_neg_helper);
 
 	return true;
 }
@@ -632,14 +1087,22 @@ static INLINE bool
 jit_visit_lt_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_compare(ctx, 0x97, dst, src2, src1));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x9c, dst, src1, src2));
+
 	/* if (!jit_lt_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_lt_helper);
 
@@ -651,14 +1114,22 @@ static INLINE bool
 jit_visit_lte_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_compare(ctx, 0x93, dst, src2, src1));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x9e, dst, src1, src2));
+
 	/* if (!jit_lte_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_lte_helper);
 
@@ -670,14 +1141,19 @@ static INLINE bool
 jit_visit_eq_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x94, dst, src1, src2));
+
 	/* if (!jit_eq_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_eq_helper);
 
@@ -689,14 +1165,19 @@ static INLINE bool
 jit_visit_neq_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x95, dst, src1, src2));
+
 	/* if (!jit_neq_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_neq_helper);
 
@@ -708,14 +1189,22 @@ static INLINE bool
 jit_visit_gte_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_compare(ctx, 0x93, dst, src1, src2));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x9d, dst, src1, src2));
+
 	/* if (!jit_gte_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_gte_helper);
 
@@ -731,27 +1220,40 @@ jit_visit_eqi_op(
 	int src1;
 	int src2;
 
+	int reg;
+
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
-	dst *= (int)sizeof(struct rt_value);
-	src1 *= (int)sizeof(struct rt_value);
-	src2 *= (int)sizeof(struct rt_value);
+	UNUSED_PARAMETER(dst);
 
-	/* src1 - src2 */
-	ASM {
-		/* movq dst, %rax */		IB(0x48); IB(0xc7); IB(0xc0); ID((uint32_t)dst);
-		/* addq %r15, %rax */		IB(0x4c); IB(0x01); IB(0xf8);
+	/* eax = src1.val.i */
+	reg = jit_get_loop_reg(ctx, src1);
+	if (reg != -1) {
+		if (!jit_put_loop_move(ctx, loop_reg[reg], 0))
+			return false;
+	} else {
+		src1 *= (int)sizeof(struct rt_value);
+		ASM {
+			/* movl src1+8(%r15), %eax */	IB(0x41); IB(0x8b); IB(0x87); ID((uint32_t)(src1 + 8));
+		}
+	}
 
-		/* movq src1, %rbx */		IB(0x48); IB(0xc7); IB(0xc3); ID((uint32_t)src1);
-		/* addq %r15, %rbx */		IB(0x4c); IB(0x01); IB(0xfb);
-		
-		/* movq src2, %rcx */		IB(0x48); IB(0xc7); IB(0xc1); ID((uint32_t)src2);
-		/* addq %r15, %rcx */		IB(0x4c); IB(0x01); IB(0xf9);
+	/* edx = src2.val.i */
+	reg = jit_get_loop_reg(ctx, src2);
+	if (reg != -1) {
+		if (!jit_put_loop_move(ctx, loop_reg[reg], 2))
+			return false;
+	} else {
+		src2 *= (int)sizeof(struct rt_value);
+		ASM {
+			/* movl src2+8(%r15), %edx */	IB(0x41); IB(0x8b); IB(0x97); ID((uint32_t)(src2 + 8));
+		}
+	}
 
-		/* movq 8(%rbx), %rax */	IB(0x48); IB(0x8b); IB(0x43); IB(0x08);
-		/* movq 8(%rcx), %rdx */	IB(0x48); IB(0x8b); IB(0x51); IB(0x08);
+	/* src1 - src2 */
+	ASM {
 		/* cmpl %eax, %edx */		IB(0x39); IB(0xc2);
 	}
 
@@ -763,14 +1265,22 @@ static INLINE bool
 jit_visit_gt_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
+	/* Use SSE if the compiler proved floats. */
+	FLOAT_BINARY_OP(jit_put_float_compare(ctx, 0x97, dst, src1, src2));
+
+	/* Specialize for integers if only integers were observed. */
+	INT_BINARY_OP(jit_put_int_compare(ctx, 0x9f, dst, src1, src2));
+
 	/* if (!jit_gt_helper(rt, dst, src1, src2)) return false; */
 	ASM_BINARY_OP(rt_gt_helper);
 
@@ -782,16 +1292,85 @@ static INLINE bool
 jit_visit_loadarray_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int src1;
 	int src2;
+	uint8_t *type_jcc;
+	uint8_t *slow_jcc;
+	uint8_t *done_jmp;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(src1);
 	CONSUME_TMPVAR(src2);
 
-	/* if (!jit_loadarray_helper(rt, dst, src1, src2)) return false; */
+	/* Generic if not only integer subscripts of arrays were observed. */
+	if (ctx->cur_ir->guard != JIT_GUARD_ARRAY && !ctx->cur_ir->in_range) {
+		/* if (!jit_loadarray_helper(rt, dst, src1, src2)) return false; */
+		ASM_BINARY_OP(rt_loadarray_helper);
+		return true;
+	}
+
+	type_jcc = NULL;
+	if (ctx->cur_ir->guard == JIT_GUARD_ARRAY) {
+		if (!jit_put_type_guard(ctx, src1, RT_VALUE_ARRAY, (uint32_t)lpc))
+			return false;
+	} else {
+		/* Not profiled: a non-array goes to the helper. */
+		ASM {
+			/* cmpl $ARRAY, src1(%r15) */	IB(0x41); IB(0x81); IB(0xbf); ID((uint32_t)(src1 * (int)sizeof(struct rt_value))); ID((uint32_t)RT_VALUE_ARRAY);
+		}
+		type_jcc = ctx->code;
+		ASM {
+			/* jne slow */			IB(0x75); IB(0);
+		}
+	}
+
+	/* The compiler proved an in-range integer subscript. */
+	if (!ctx->cur_ir->in_range) {
+		if (!jit_put_type_guard(ctx, src2, RT_VALUE_INT, (uint32_t)lpc))
+			return false;
+	}
+
+	/* rt->frame->tmpvar[dst] = arr->table[subscr] if in range. */
+	ASM {
+		/* movq src1+8(%r15), %rcx */	IB(0x49); IB(0x8b); IB(0x8f); ID((uint32_t)(src1 * (int)sizeof(struct rt_value) + 8));
+		/* movl src2+8(%r15), %eax */	IB(0x41); IB(0x8b); IB(0x87); ID((uint32_t)(src2 * (int)sizeof(struct rt_value) + 8));
+	}
+	slow_jcc = NULL;
+	if (!ctx->cur_ir->in_range) {
+		ASM {
+			/* cmpl size(%rcx), %eax */	IB(0x3b); IB(0x41); IB((uint8_t)offsetof(struct rt_array, size));
+		}
+		slow_jcc = ctx->code;
+		ASM {
+			/* jae slow */			IB(0x73); IB(0);
+		}
+	}
+	ASM {
+		/* movq table(%rcx), %rcx */	IB(0x48); IB(0x8b); IB(0x49); IB((uint8_t)offsetof(struct rt_array, table));
+		/* shlq $4, %rax */		IB(0x48); IB(0xc1); IB(0xe0); IB(0x04);
+		/* addq %rax, %rcx */		IB(0x48); IB(0x01); IB(0xc1);
+		/* movq (%rcx), %rdx */		IB(0x48); IB(0x8b); IB(0x11);
+		/* movq 8(%rcx), %rax */	IB(0x48); IB(0x8b); IB(0x41); IB(0x08);
+		/* movq %rdx, dst(%r15) */	IB(0x49); IB(0x89); IB(0x97); ID((uint32_t)(dst * (int)sizeof(struct rt_value)));
+		/* movq %rax, dst+8(%r15) */	IB(0x49); IB(0x89); IB(0x87); ID((uint32_t)(dst * (int)sizeof(struct rt_value) + 8));
+	}
+	if (slow_jcc == NULL && type_jcc == NULL)
+		return true;
+	done_jmp = ctx->code;
+	ASM {
+		/* jmp done */			IB(0xeb); IB(0);
+	}
+
+	/* Out of range or not an array: let the helper raise an error. */
+	if (slow_jcc != NULL)
+		slow_jcc[1] = (uint8_t)((uint8_t *)ctx->code - (slow_jcc + 2));
+	if (type_jcc != NULL)
+		type_jcc[1] = (uint8_t)((uint8_t *)ctx->code - (type_jcc + 2));
 	ASM_BINARY_OP(rt_loadarray_helper);
+	done_jmp[1] = (uint8_t)((uint8_t *)ctx->code - (done_jmp + 2));
 
 	return true;
 }
@@ -832,58 +1411,158 @@ jit_visit_len_op(
 	return true;
 }
 
-/* Visit a ROP_GETDICTKEYBYINDEX instruction. */
+/* Visit a ROP_GETDICTKEYBYINDEX instruction. */
+static INLINE bool
+jit_visit_getdictkeybyindex_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	int src1;
+	int src2;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_TMPVAR(src1);
+	CONSUME_TMPVAR(src2);
+
+	/* if (!jit_getdictkeybyindex_helper(rt, dst, src1, src2)) return false; */
+	ASM_BINARY_OP(rt_getdictkeybyindex_helper);
+
+	return true;
+}
+
+/* Visit a ROP_GETDICTVALBYINDEX instruction. */
+static INLINE bool
+jit_visit_getdictvalbyindex_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	int src1;
+	int src2;
+	uint8_t *type_jcc;
+	uint8_t *done_jmp;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_TMPVAR(src1);
+	CONSUME_TMPVAR(src2);
+
+	if (!ctx->cur_ir->in_range) {
+		/* if (!jit_getdictvalbyindex_helper(rt, dst, src1, src2)) return false; */
+		ASM_BINARY_OP(rt_getdictvalbyindex_helper);
+		return true;
+	}
+
+	/* The compiler proved an in-range integer index. A non-dictionary goes to the helper. */
+	ASM {
+		/* cmpl $DICT, src1(%r15) */	IB(0x41); IB(0x81); IB(0xbf); ID((uint32_t)(src1 * (int)sizeof(struct rt_value))); ID((uint32_t)RT_VALUE_DICT);
+	}
+	type_jcc = ctx->code;
+	ASM {
+		/* jne slow */			IB(0x75); IB(0);
+		/* movq src1+8(%r15), %rcx */	IB(0x49); IB(0x8b); IB(0x8f); ID((uint32_t)(src1 * (int)sizeof(struct rt_value) + 8));
+		/* movl src2+8(%r15), %eax */	IB(0x41); IB(0x8b); IB(0x87); ID((uint32_t)(src2 * (int)sizeof(struct rt_value) + 8));
+		/* movq value(%rcx), %rcx */	IB(0x48); IB(0x8b); IB(0x49); IB((uint8_t)offsetof(struct rt_dict, value));
+		/* shlq $4, %rax */		IB(0x48); IB(0xc1); IB(0xe0); IB(0x04);
+		/* addq %rax, %rcx */		IB(0x48); IB(0x01); IB(0xc1);
+		/* movq (%rcx), %rdx */		IB(0x48); IB(0x8b); IB(0x11);
+		/* movq 8(%rcx), %rax */	IB(0x48); IB(0x8b); IB(0x41); IB(0x08);
+		/* movq %rdx, dst(%r15) */	IB(0x49); IB(0x89); IB(0x97); ID((uint32_t)(dst * (int)sizeof(struct rt_value)));
+		/* movq %rax, dst+8(%r15) */	IB(0x49); IB(0x89); IB(0x87); ID((uint32_t)(dst * (int)sizeof(struct rt_value) + 8));
+	}
+	done_jmp = ctx->code;
+	ASM {
+		/* jmp done */			IB(0xeb); IB(0);
+	}
+
+	/* Not a dictionary: let the helper raise an error. */
+	type_jcc[1] = (uint8_t)((uint8_t *)ctx->code - (type_jcc + 2));
+	ASM_BINARY_OP(rt_getdictvalbyindex_helper);
+	done_jmp[1] = (uint8_t)((uint8_t *)ctx->code - (done_jmp + 2));
+
+	return true;
+}
+
+/* Visit a ROP_LOADSYMBOL instruction. */
 static INLINE bool
-jit_visit_getdictkeybyindex_op(
+jit_visit_loadsymbol_op(
 	struct jit_context *ctx)
 {
 	int dst;
-	int src1;
-	int src2;
+	const char *src_s;
+	uint64_t src;
 
 	CONSUME_TMPVAR(dst);
-	CONSUME_TMPVAR(src1);
-	CONSUME_TMPVAR(src2);
+	CONSUME_STRING(src_s);
+	src = (uint64_t)(intptr_t)src_s;
 
-	/* if (!jit_getdictkeybyindex_helper(rt, dst, src1, src2)) return false; */
-	ASM_BINARY_OP(rt_getdictkeybyindex_helper);
+	/* if (!rt_loadsymbol_helper(rt, dst, src)) return false; */
+	ASM {
+		/* r13: exception_handler */
+		/* r14: rt */
+		/* r14: &rt->frame->tmpvar[0] */
+
+		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
+		/* movabs src, %rdx */			IB(0x48); IB(0xba); IQR(JIT_RELOC_BYTECODE, src);
+		/* movabs rt_loadsymbol_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_loadsymbol_helper);
+		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
+
+		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+		/* jne 8 <next> */			IB(0x75); IB(0x03);
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+		/* next:*/
+	}
 
 	return true;
 }
 
-/* Visit a ROP_GETDICTVALBYINDEX instruction. */
+/* Visit a ROP_CHKFUNC instruction. */
 static INLINE bool
-jit_visit_getdictvalbyindex_op(
+jit_visit_chkfunc_op(
 	struct jit_context *ctx)
 {
 	int dst;
-	int src1;
-	int src2;
+	const char *src_s;
+	uint64_t src;
 
 	CONSUME_TMPVAR(dst);
-	CONSUME_TMPVAR(src1);
-	CONSUME_TMPVAR(src2);
+	CONSUME_STRING(src_s);
+	src = (uint64_t)(intptr_t)src_s;
 
-	/* if (!jit_getdictvalbyindex_helper(rt, dst, src1, src2)) return false; */
-	ASM_BINARY_OP(rt_getdictvalbyindex_helper);
+	/* if (!rt_chkfunc_helper(rt, dst, src)) return false; */
+	ASM {
+		/* r13: exception_handler */
+		/* r14: rt */
+		/* r14: &rt->frame->tmpvar[0] */
+
+		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
+		/* movabs src, %rdx */			IB(0x48); IB(0xba); IQR(JIT_RELOC_BYTECODE, src);
+		/* movabs rt_chkfunc_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_chkfunc_helper);
+		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
+
+		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+		/* jne 8 <next> */			IB(0x75); IB(0x03);
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+		/* next:*/
+	}
 
 	return true;
 }
 
-/* Visit a ROP_LOADSYMBOL instruction. */
+/* Visit a ROP_SWITCH instruction. */
 static INLINE bool
-jit_visit_loadsymbol_op(
+jit_visit_switch_op(
 	struct jit_context *ctx)
 {
 	int dst;
-	const char *src_s;
+	const uint8_t *table;
 	uint64_t src;
 
 	CONSUME_TMPVAR(dst);
-	CONSUME_STRING(src_s);
-	src = (uint64_t)(intptr_t)src_s;
+	CONSUME_TABLE(table);
+	src = (uint64_t)(intptr_t)table;
 
-	/* if (!rt_loadsymbol_helper(rt, dst, src)) return false; */
+	/* if (!rt_switch_helper(rt, dst, src)) return false; */
 	ASM {
 		/* r13: exception_handler */
 		/* r14: rt */
@@ -891,8 +1570,8 @@ jit_visit_loadsymbol_op(
 
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
-		/* movabs src, %rdx */			IB(0x48); IB(0xba); IQ(src);
-		/* movabs rt_loadsymbol_helper, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_loadsymbol_helper);
+		/* movabs src, %rdx */			IB(0x48); IB(0xba); IQR(JIT_RELOC_BYTECODE, src);
+		/* movabs rt_switch_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_switch_helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -904,6 +1583,23 @@ jit_visit_loadsymbol_op(
 	return true;
 }
 
+/* Visit a ROP_LOADFUNC instruction. */
+static INLINE bool
+jit_visit_loadfunc_op(
+	struct jit_context *ctx)
+{
+	int dst;
+	int src;
+
+	CONSUME_TMPVAR(dst);
+	CONSUME_IMM16(src);
+
+	/* if (!rt_loadfunc_helper(rt, dst, src)) return false; */
+	ASM_UNARY_OP(rt_loadfunc_helper);
+
+	return true;
+}
+
 /* Visit a ROP_STORESYMBOL instruction. */
 static INLINE bool
 jit_visit_storesymbol_op(
@@ -924,9 +1620,9 @@ jit_visit_storesymbol_op(
 		/* r14: &rt->frame->tmpvar[0] */
 
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
-		/* movabs dst, %rsi */			IB(0x48); IB(0xbe); IQ(dst);
+		/* movabs dst, %rsi */			IB(0x48); IB(0xbe); IQR(JIT_RELOC_BYTECODE, dst);
 		/* movq src, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);
-		/* movabs rt_storesymbol_helper, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_storesymbol_helper);
+		/* movabs rt_storesymbol_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_storesymbol_helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -943,16 +1639,45 @@ static INLINE bool
 jit_visit_loaddot_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int dict;
 	const char *field_s;
 	uint64_t field;
+	uint8_t slot;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(dict);
 	CONSUME_STRING(field_s);
 	field = (uint64_t)(intptr_t)field_s;
 
+	/* Look up the observed slot first if only dictionaries were observed. */
+	if (ctx->cur_ir->guard == JIT_GUARD_DICT) {
+		if (!jit_put_type_guard(ctx, dict, RT_VALUE_DICT, (uint32_t)lpc))
+			return false;
+
+		slot = ctx->cur_ir->slot;
+
+		/* if (!rt_loaddot_slot_helper(rt, dst, dict, field, slot)) return false; */
+		ASM {
+			/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+			/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
+			/* movq dict, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)dict);
+			/* movabs field, %rcx */		IB(0x48); IB(0xb9); IQR(JIT_RELOC_BYTECODE, field);
+			/* movq slot, %r8 */			IB(0x49); IB(0xc7); IB(0xc0); ID((uint32_t)(slot == RT_PROFILE_MANY_SLOTS ? -1 : slot - 1));
+			/* movabs rt_loaddot_slot_helper, %r9 */ IB(0x49); IB(0xb9); IQR(JIT_RELOC_HELPER, (uint64_t)rt_loaddot_slot_helper);
+			/* call *%r9 */				IB(0x41); IB(0xff); IB(0xd1);
+
+			/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+			/* jne 8 <next> */			IB(0x75); IB(0x03);
+			/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+			/* next:*/
+		}
+
+		return true;
+	}
+
 	/* if (!rt_loaddot_helper(rt, dst, dict, field)) return false; */
 	ASM {
 		/* r13: exception_handler */
@@ -962,8 +1687,8 @@ jit_visit_loaddot_op(
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* movq dict, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)dict);
-		/* movabs field, %rcx */		IB(0x48); IB(0xb9); IQ(field);
-		/* movabs rt_loaddot_helper, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_loaddot_helper);
+		/* movabs field, %rcx */		IB(0x48); IB(0xb9); IQR(JIT_RELOC_BYTECODE, field);
+		/* movabs rt_loaddot_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_loaddot_helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -998,9 +1723,9 @@ jit_visit_storedot_op(
 
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dict, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dict);
-		/* movabs field, %rdx */		IB(0x48); IB(0xba); IQ(field);
+		/* movabs field, %rdx */		IB(0x48); IB(0xba); IQR(JIT_RELOC_BYTECODE, field);
 		/* movq src, %rcx */			IB(0x48); IB(0xc7); IB(0xc1); ID((uint32_t)src);
-		/* movabs rt_storedot_helper, %r8 */	IB(0x49); IB(0xb8); IQ((uint64_t)rt_storedot_helper);
+		/* movabs rt_storedot_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_storedot_helper);
 		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -1023,6 +1748,8 @@ jit_visit_call_op(
 	int arg_tmp;
 	int arg[RT_ARG_MAX];
 	uint64_t arg_addr;
+	uint8_t *slow_jcc[2];
+	uint8_t *done_jmp;
 	int i;
 
 	CONSUME_TMPVAR(dst);
@@ -1040,15 +1767,97 @@ jit_visit_call_op(
 			IB(0xe9);
 			ID((uint32_t)(4 * arg_count));
 		}
-		arg_addr = (uint64_t)(intptr_t)ctx->code;
+		arg_addr = (uint64_t)(intptr_t)jit_get_exec_addr(ctx, ctx->code);
 		for (i = 0; i < arg_count; i++) {
-			*(int *)ctx->code = arg[i];
-			ctx->code = (uint8_t *)ctx->code + 4;
+			ID((uint32_t)arg[i]);
 		}
 	} else {
 		arg_addr = 0;
 	}
 
+	/*
+	 * Tail call: hand the frame to the callee, and return.
+	 *  if (!rt_tailcall_helper(rt, func, arg_count, arg)) return false;
+	 *  return true;
+	 */
+	if (ctx->cur_ir->tail) {
+		ASM {
+			/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+			/* movq func, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)func);
+			/* movq arg_count, %rdx */		IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)arg_count);
+			/* movabs arg_addr, %rcx */		IB(0x48); IB(0xb9); IQR(JIT_RELOC_CODE, arg_addr);
+			/* movabs rt_tailcall_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_tailcall_helper);
+			/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
+			/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+			/* jne 8 <next> */			IB(0x75); IB(0x03);
+			/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+		}
+
+		/* Return through the epilogue. */
+		if (!jit_add_branch_patch(ctx, ctx->code, (uint32_t)ctx->func->bytecode_size, PATCH_JMP))
+			return false;
+		ASM {
+			/* Patched later. */
+			/* jmp epilogue */			IB(0xe9); ID(0);
+		}
+
+		return true;
+	}
+
+	/*
+	 * Direct call if the callee is compiled. (rebinding is checked here)
+	 *  if (tmpvar[func].type == RT_VALUE_FUNC && tmpvar[func].val.func->jit_code != NULL) {
+	 *      if (!rt_enter_call_helper(rt, callee, arg_count, arg)) return false;
+	 *      if (!callee->jit_code(rt)) return false;
+	 *      if (!rt_leave_call_helper(rt, dst)) return false;
+	 *  }
+	 */
+	ASM {
+		/* cmpl $RT_VALUE_FUNC, func(%r15) */	IB(0x41); IB(0x81); IB(0xbf); ID((uint32_t)(func * (int)sizeof(struct rt_value))); ID(RT_VALUE_FUNC);
+		/* jne slow */				IB(0x0f); IB(0x85); ID(0);
+	}
+	slow_jcc[0] = ctx->code;
+	ASM {
+		/* movq func+8(%r15), %rsi */		IB(0x49); IB(0x8b); IB(0xb7); ID((uint32_t)(func * (int)sizeof(struct rt_value) + 8));
+		/* movq jit_code(%rsi), %rax */		IB(0x48); IB(0x8b); IB(0x86); ID((uint32_t)offsetof(struct rt_func, jit_code));
+		/* testq %rax, %rax */			IB(0x48); IB(0x85); IB(0xc0);
+		/* je slow */				IB(0x0f); IB(0x84); ID(0);
+	}
+	slow_jcc[1] = ctx->code;
+	ASM {
+		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+		/* movq arg_count, %rdx */		IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)arg_count);
+		/* movabs arg_addr, %rcx */		IB(0x48); IB(0xb9); IQR(JIT_RELOC_CODE, arg_addr);
+		/* movabs rt_enter_call_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_enter_call_helper);
+		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
+		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+		/* jne 8 <next> */			IB(0x75); IB(0x03);
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+
+		/* movq func+8(%r15), %rax */		IB(0x49); IB(0x8b); IB(0x87); ID((uint32_t)(func * (int)sizeof(struct rt_value) + 8));
+		/* movq jit_code(%rax), %rax */		IB(0x48); IB(0x8b); IB(0x80); ID((uint32_t)offsetof(struct rt_func, jit_code));
+		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+		/* call *%rax */			IB(0xff); IB(0xd0);
+		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+		/* jne 8 <next> */			IB(0x75); IB(0x03);
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+
+		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
+		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
+		/* movabs rt_leave_call_helper, %r8 */	IB(0x49); IB(0xb8); IQR(JIT_RELOC_HELPER, (uint64_t)rt_leave_call_helper);
+		/* call *%r8 */				IB(0x41); IB(0xff); IB(0xd0);
+		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
+		/* jne 8 <next> */			IB(0x75); IB(0x03);
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+
+		/* jmp done */				IB(0xe9); ID(0);
+	}
+	done_jmp = ctx->code;
+
+	/* slow: */
+	for (i = 0; i < 2; i++)
+		*(uint32_t *)(slow_jcc[i] - 4) = (uint32_t)((uint8_t *)ctx->code - slow_jcc[i]);
+
 	/* if (!rt_call_helper(rt, dst, func, arg_count, arg)) return false; */
 	ASM {
 		/* r13: exception_handler */
@@ -1059,8 +1868,8 @@ jit_visit_call_op(
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* movq func, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)func);
 		/* movq arg_count, %rcx */		IB(0x48); IB(0xc7); IB(0xc1); ID((uint32_t)arg_count);
-		/* movabs arg_addr, %r8 */		IB(0x49); IB(0xb8); IQ(arg_addr);
-		/* movabs rt_call_helper, %r9 */	IB(0x49); IB(0xb9); IQ((uint64_t)rt_call_helper);
+		/* movabs arg_addr, %r8 */		IB(0x49); IB(0xb8); IQR(JIT_RELOC_CODE, arg_addr);
+		/* movabs rt_call_helper, %r9 */	IB(0x49); IB(0xb9); IQR(JIT_RELOC_HELPER, (uint64_t)rt_call_helper);
 		/* call *%r9 */				IB(0x41); IB(0xff); IB(0xd1);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -1068,7 +1877,10 @@ jit_visit_call_op(
 		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
 		/* next:*/
 	}
-	
+
+	/* done: */
+	*(uint32_t *)(done_jmp - 4) = (uint32_t)((uint8_t *)ctx->code - done_jmp);
+
 	return true;
 }
 
@@ -1077,6 +1889,7 @@ static inline bool
 jit_visit_thiscall_op(
 	struct jit_context *ctx)
 {
+	int lpc;
 	int dst;
 	int obj;
 	const char *symbol;
@@ -1086,6 +1899,7 @@ jit_visit_thiscall_op(
 	uint64_t arg_addr;
 	int i;
 
+	lpc = ctx->lpc - 1;
 	CONSUME_TMPVAR(dst);
 	CONSUME_TMPVAR(obj);
 	CONSUME_STRING(symbol);
@@ -1095,16 +1909,21 @@ jit_visit_thiscall_op(
 		arg[i] = arg_tmp;
 	}
 
+	/* Guard the receiver if only dictionaries were observed. */
+	if (ctx->cur_ir->guard == JIT_GUARD_DICT) {
+		if (!jit_put_type_guard(ctx, obj, RT_VALUE_DICT, (uint32_t)lpc))
+			return false;
+	}
+
 	/* Embed arguments to the code. */
 	ASM {
 		/* jmp (5 + arg_count * 4) */
 		IB(0xe9);
 		ID((uint32_t)(4 * arg_count));
 	}
-	arg_addr = (uint64_t)(intptr_t)ctx->code;
+	arg_addr = (uint64_t)(intptr_t)jit_get_exec_addr(ctx, ctx->code);
 	for (i = 0; i < arg_count; i++) {
-		*(int *)ctx->code = arg[i];
-		ctx->code = (uint8_t *)ctx->code + 4;
+		ID((uint32_t)arg[i]);
 	}
 
 	/* if (!rt_thiscall_helper(rt, dst, obj, symbol, arg_count, arg)) return false; */
@@ -1116,10 +1935,10 @@ jit_visit_thiscall_op(
 		/* movq %r14, %rdi */			IB(0x4c); IB(0x89); IB(0xf7);
 		/* movq dst, %rsi */			IB(0x48); IB(0xc7); IB(0xc6); ID((uint32_t)dst);
 		/* movq obj, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)obj);
-		/* movabs symbol, %rcx */		IB(0x48); IB(0x89); IQ((uint64_t)symbol);
+		/* movabs symbol, %rcx */		IB(0x48); IB(0xb9); IQR(JIT_RELOC_BYTECODE, (uint64_t)symbol);
 		/* movq arg_count, %r8 */		IB(0x49); IB(0xc7); IB(0xc0); ID((uint32_t)arg_count);
-		/* movabs arg_addr, %r9 */		IB(0x49); IB(0xb9); IQ(arg_addr);
-		/* movabs rt_call_helper, %r10 */	IB(0x49); IB(0xba); IQ((uint64_t)rt_call_helper);
+		/* movabs arg_addr, %r9 */		IB(0x49); IB(0xb9); IQR(JIT_RELOC_CODE, arg_addr);
+		/* movabs rt_thiscall_helper, %r10 */	IB(0x49); IB(0xba); IQR(JIT_RELOC_HELPER, (uint64_t)rt_thiscall_helper);
 		/* call *%r10 */			IB(0x41); IB(0xff); IB(0xd2);
 
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
@@ -1137,6 +1956,7 @@ jit_visit_jmp_op(
 	struct jit_context *ctx)
 {
 	uint32_t target_lpc;
+	int offset;
 
 	CONSUME_IMM32(target_lpc);
 	if (target_lpc >= (uint32_t)(ctx->func->bytecode_size + 1)) {
@@ -1144,11 +1964,23 @@ jit_visit_jmp_op(
 		return false;
 	}
 
+	/* A back-edge keeps the loop registers. */
+	if (ctx->cur_loop >= 0 &&
+	    target_lpc == ctx->loop[ctx->cur_loop].start_lpc) {
+		offset = (int)((intptr_t)ctx->loop[ctx->cur_loop].body_code - (intptr_t)ctx->code) - 5;
+		ASM {
+			/* jmp body */	IB(0xe9); ID((uint32_t)offset);
+		}
+		return true;
+	}
+
+	/* Other jumps see the registers in the tmpvars. */
+	if (!jit_put_loop_stores(ctx, jit_is_loop_exit(ctx, target_lpc)))
+		return false;
+
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JMP;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JMP))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1165,6 +1997,7 @@ jit_visit_jmpiftrue_op(
 {
 	int src;
 	uint32_t target_lpc;
+	int reg;
 
 	CONSUME_TMPVAR(src);
 	CONSUME_IMM32(target_lpc);
@@ -1173,23 +2006,36 @@ jit_visit_jmpiftrue_op(
 		return false;
 	}
 
-	ASM {
-		/* rdx = &rt->frame->tmpvar[src] */
-		/* movq %r14, %rcx */			IB(0x4c); IB(0x89); IB(0xf1);
-		/* movq src, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);
-		/* shlq $4, %rdx */			IB(0x48); IB(0xc1); IB(0xe2); IB(0x04);
-		/* addq %r15, %rdx */			IB(0x4c); IB(0x01); IB(0xfa);
-		/* movl 8(%rdx), %eax */		IB(0x8b); IB(0x42); IB(0x08);
+	/* eax = rt->frame->tmpvar[src].val.i */
+	reg = jit_get_loop_reg(ctx, src);
+	if (reg != -1) {
+		if (!jit_put_loop_move(ctx, loop_reg[reg], 0))
+			return false;
+	} else {
+		ASM {
+			/* rdx = &rt->frame->tmpvar[src] */
+			/* movq %r14, %rcx */		IB(0x4c); IB(0x89); IB(0xf1);
+			/* movq src, %rdx */		IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);
+			/* shlq $4, %rdx */		IB(0x48); IB(0xc1); IB(0xe2); IB(0x04);
+			/* addq %r15, %rdx */		IB(0x4c); IB(0x01); IB(0xfa);
+			/* movl 8(%rdx), %eax */	IB(0x8b); IB(0x42); IB(0x08);
+		}
+	}
 
+	ASM {
 		/* Compare: rt->frame->tmpvar[dst].val.i == 1 */
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
 	}
-	
+
+	/* A loop exit stores the loop registers only when taken. */
+	if (jit_is_loop_exit(ctx, target_lpc) && jit_count_loop_written(ctx) > 0)
+		return jit_put_loop_exit(ctx, 0x74, target_lpc);	/* je skip */
+	if (!jit_put_loop_stores(ctx, false))
+		return false;
+
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JNE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JNE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1206,6 +2052,7 @@ jit_visit_jmpiffalse_op(
 {
 	int src;
 	uint32_t target_lpc;
+	int reg;
 
 	CONSUME_TMPVAR(src);
 	CONSUME_IMM32(target_lpc);
@@ -1214,23 +2061,36 @@ jit_visit_jmpiffalse_op(
 		return false;
 	}
 
-	ASM {
-		/* rdx = &rt->frame->tmpvar[src] */
-		/* movq %r14, %rcx */			IB(0x4c); IB(0x89); IB(0xf1);
-		/* movq src, %rdx */			IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);
-		/* shlq $4, %rdx */			IB(0x48); IB(0xc1); IB(0xe2); IB(0x04);
-		/* addq %r15, %rdx */			IB(0x4c); IB(0x01); IB(0xfa);
-		/* movl 8(%rdx), %eax */		IB(0x8b); IB(0x42); IB(0x08);
+	/* eax = rt->frame->tmpvar[src].val.i */
+	reg = jit_get_loop_reg(ctx, src);
+	if (reg != -1) {
+		if (!jit_put_loop_move(ctx, loop_reg[reg], 0))
+			return false;
+	} else {
+		ASM {
+			/* rdx = &rt->frame->tmpvar[src] */
+			/* movq %r14, %rcx */		IB(0x4c); IB(0x89); IB(0xf1);
+			/* movq src, %rdx */		IB(0x48); IB(0xc7); IB(0xc2); ID((uint32_t)src);
+			/* shlq $4, %rdx */		IB(0x48); IB(0xc1); IB(0xe2); IB(0x04);
+			/* addq %r15, %rdx */		IB(0x4c); IB(0x01); IB(0xfa);
+			/* movl 8(%rdx), %eax */	IB(0x8b); IB(0x42); IB(0x08);
+		}
+	}
 
+	ASM {
 		/* Compare: rt->frame->tmpvar[dst].val.i == 1 */
 		/* cmpl $0, %eax */			IB(0x83); IB(0xf8); IB(0x00);
 	}
-	
+
+	/* A loop exit stores the loop registers only when taken. */
+	if (jit_is_loop_exit(ctx, target_lpc) && jit_count_loop_written(ctx) > 0)
+		return jit_put_loop_exit(ctx, 0x75, target_lpc);	/* jne skip */
+	if (!jit_put_loop_stores(ctx, false))
+		return false;
+
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1255,11 +2115,15 @@ jit_visit_jmpifeq_op(
 		return false;
 	}
 
+	/* A loop exit stores the loop registers only when taken. */
+	if (jit_is_loop_exit(ctx, target_lpc) && jit_count_loop_written(ctx) > 0)
+		return jit_put_loop_exit(ctx, 0x75, target_lpc);	/* jne skip */
+	if (!jit_put_loop_stores(ctx, false))
+		return false;
+
 	/* Patch later. */
-	ctx->branch_patch[ctx->branch_patch_count].code = ctx->code;
-	ctx->branch_patch[ctx->branch_patch_count].lpc = target_lpc;
-	ctx->branch_patch[ctx->branch_patch_count].type = PATCH_JE;
-	ctx->branch_patch_count++;
+	if (!jit_add_branch_patch(ctx, ctx->code, target_lpc, PATCH_JE))
+		return false;
 
 	ASM {
 		/* Patched later. */
@@ -1269,14 +2133,11 @@ jit_visit_jmpifeq_op(
 	return true;
 }
 
-/* Visit a bytecode of a function. */
-bool
-jit_visit_bytecode(
+/* Put a prologue and an exception handler. */
+static bool
+jit_put_prologue(
 	struct jit_context *ctx)
 {
-	uint8_t opcode;
-
-	/* Put a prologue. */
 	ASM {
 	/* prologue: */
 		/* pushq %rax */			IB(0x50);
@@ -1288,6 +2149,8 @@ jit_visit_bytecode(
 		/* pushq %r13 */			IB(0x41); IB(0x55);
 		/* pushq %r14 */			IB(0x41); IB(0x56);
 		/* pushq %r15 */			IB(0x41); IB(0x57);
+		/* pushq %rbp */			IB(0x55);
+		/* pushq %r12 */			IB(0x41); IB(0x54);
 
 		/* r14 = rt */
 		/* movq %rdi, %r14 */			IB(0x49); IB(0x89); IB(0xfe);
@@ -1297,16 +2160,18 @@ jit_visit_bytecode(
 		/* movq (%rax), %r15 */			IB(0x4c); IB(0x8b); IB(0x38);
 
 		/* r13 = exception_handler */
-		/* movabs (ctx->code + 12), %r13 */	IB(0x49); IB(0xbd); IQ((uint64_t)(intptr_t)(ctx->code + 10));
+		/* movabs (ctx->code + 12), %r13 */	IB(0x49); IB(0xbd); IQR(JIT_RELOC_CODE, (uint64_t)(intptr_t)jit_get_exec_addr(ctx, ctx->code + 10));
 
 		/* Skip an exception handler. */
-		/* jmp exception_handler_end */		IB(0xeb); IB(0x14);
+		/* jmp exception_handler_end */		IB(0xeb); IB(0x17);
 	}
 
 	/* Put an exception handler. */
 	ctx->exception_code = ctx->code;
 	ASM {
 	/* exception_handler: */
+		/* popq %r12 */ 	IB(0x41); IB(0x5c);
+		/* popq %rbp */ 	IB(0x5d);
 		/* popq %r15 */ 	IB(0x41); IB(0x5f);
 		/* popq %r14 */ 	IB(0x41); IB(0x5e);
 		/* popq %r13 */ 	IB(0x41); IB(0x5d);
@@ -1321,190 +2186,18 @@ jit_visit_bytecode(
 	/* exception_handler_end: */
 	}
 
-	/* Put a body. */
-	while (ctx->lpc < ctx->func->bytecode_size) {
-		/* Save LPC and addr. */
-		if (ctx->pc_entry_count >= PC_ENTRY_MAX) {
-			rt_error(ctx->rt, "Too big code.");
-			return false;
-		}
-		ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-		ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-		ctx->pc_entry_count++;
-
-		/* Dispatch by opcode. */
-		CONSUME_OPCODE(opcode);
-		switch (opcode) {
-		case ROP_LINEINFO:
-			if (!jit_visit_lineinfo_op(ctx))
-				return false;
-			break;
-		case ROP_ASSIGN:
-			if (!jit_visit_assign_op(ctx))
-				return false;
-			break;
-		case ROP_ICONST:
-			if (!jit_visit_iconst_op(ctx))
-				return false;
-			break;
-		case ROP_FCONST:
-			if (!jit_visit_fconst_op(ctx))
-				return false;
-			break;
-		case ROP_SCONST:
-			if (!jit_visit_sconst_op(ctx))
-				return false;
-			break;
-		case ROP_ACONST:
-			if (!jit_visit_aconst_op(ctx))
-				return false;
-			break;
-		case ROP_DCONST:
-			if (!jit_visit_dconst_op(ctx))
-				return false;
-			break;
-		case ROP_INC:
-			if (!jit_visit_inc_op(ctx))
-				return false;
-			break;
-		case ROP_ADD:
-			if (!jit_visit_add_op(ctx))
-				return false;
-			break;
-		case ROP_SUB:
-			if (!jit_visit_sub_op(ctx))
-				return false;
-			break;
-		case ROP_MUL:
-			if (!jit_visit_mul_op(ctx))
-				return false;
-			break;
-		case ROP_DIV:
-			if (!jit_visit_div_op(ctx))
-				return false;
-			break;
-		case ROP_MOD:
-			if (!jit_visit_mod_op(ctx))
-				return false;
-			break;
-		case ROP_AND:
-			if (!jit_visit_and_op(ctx))
-				return false;
-			break;
-		case ROP_OR:
-			if (!jit_visit_or_op(ctx))
-				return false;
-			break;
-		case ROP_XOR:
-			if (!jit_visit_xor_op(ctx))
-				return false;
-			break;
-		case ROP_NEG:
-			if (!jit_visit_neg_op(ctx))
-				return false;
-			break;
-		case ROP_LT:
-			if (!jit_visit_lt_op(ctx))
-				return false;
-			break;
-		case ROP_LTE:
-			if (!jit_visit_lte_op(ctx))
-				return false;
-			break;
-		case ROP_EQ:
-			if (!jit_visit_eq_op(ctx))
-				return false;
-			break;
-		case ROP_NEQ:
-			if (!jit_visit_neq_op(ctx))
-				return false;
-			break;
-		case ROP_GTE:
-			if (!jit_visit_gte_op(ctx))
-				return false;
-			break;
-		case ROP_GT:
-			if (!jit_visit_gt_op(ctx))
-				return false;
-			break;
-		case ROP_EQI:
-			if (!jit_visit_eqi_op(ctx))
-				return false;
-			break;
-		case ROP_LOADARRAY:
-			if (!jit_visit_loadarray_op(ctx))
-				return false;
-			break;
-		case ROP_STOREARRAY:
-			if (!jit_visit_storearray_op(ctx))
-				return false;
-			break;
-		case ROP_LEN:
-			if (!jit_visit_len_op(ctx))
-			return false;
-			break;
-		case ROP_GETDICTKEYBYINDEX:
-			if (!jit_visit_getdictkeybyindex_op(ctx))
-			return false;
-			break;
-		case ROP_GETDICTVALBYINDEX:
-			if (!jit_visit_getdictvalbyindex_op(ctx))
-				return false;
-			break;
-		case ROP_LOADSYMBOL:
-			if (!jit_visit_loadsymbol_op(ctx))
-				return false;
-			break;
-		case ROP_STORESYMBOL:
-			if (!jit_visit_storesymbol_op(ctx))
-				return false;
-			break;
-		case ROP_LOADDOT:
-			if (!jit_visit_loaddot_op(ctx))
-				return false;
-			break;
-		case ROP_STOREDOT:
-			if (!jit_visit_storedot_op(ctx))
-				return false;
-			break;
-		case ROP_CALL:
-			if (!jit_visit_call_op(ctx))
-				return false;
-			break;
-		case ROP_THISCALL:
-			if (!jit_visit_thiscall_op(ctx))
-				return false;
-			break;
-		case ROP_JMP:
-			if (!jit_visit_jmp_op(ctx))
-				return false;
-			break;
-		case ROP_JMPIFTRUE:
-			if (!jit_visit_jmpiftrue_op(ctx))
-				return false;
-			break;
-		case ROP_JMPIFFALSE:
-			if (!jit_visit_jmpiffalse_op(ctx))
-				return false;
-			break;
-		case ROP_JMPIFEQ:
-			if (!jit_visit_jmpifeq_op(ctx))
-				return false;
-			break;
-		default:
-			assert(JIT_OP_NOT_IMPLEMENTED);
-			break;
-		}
-	}
-
-	/* Add the tail PC to the table. */
-	ctx->pc_entry[ctx->pc_entry_count].lpc = (uint32_t)ctx->lpc;
-	ctx->pc_entry[ctx->pc_entry_count].code = ctx->code;
-	ctx->pc_entry_count++;
+	return true;
+}
 
-	/* Put an epilogue. */
+/* Put an epilogue. */
+static bool
+jit_put_epilogue(
+	struct jit_context *ctx)
+{
 	ASM {
 	/* epilogue: */
+		/* popq %r12 */ 	IB(0x41); IB(0x5c);
+		/* popq %rbp */ 	IB(0x5d);
 		/* popq %r15 */ 	IB(0x41); IB(0x5f);
 		/* popq %r14 */ 	IB(0x41); IB(0x5e);
 		/* popq %r13 */ 	IB(0x41); IB(0x5d);
@@ -1518,6 +2211,72 @@ jit_visit_bytecode(
 		/* ret */		IB(0xc3);
 	}
 
+	/* Put an OSR entry. */
+	if (!jit_put_osr_entry(ctx))
+		return false;
+
+	return true;
+}
+
+/* Put an OSR entry: bool osr_entry(struct rt_env *rt, uint32_t lpc) */
+static bool
+jit_put_osr_entry(
+	struct jit_context *ctx)
+{
+	struct jit_ir *ir;
+	int i;
+
+	ctx->osr_code = ctx->code;
+
+	/* Put the same prologue as the function entry. */
+	ASM {
+		/* pushq %rax */			IB(0x50);
+		/* pushq %rbx */			IB(0x53);
+		/* pushq %rcx */			IB(0x51);
+		/* pushq %rdx */			IB(0x52);
+		/* pushq %rdi */			IB(0x57);
+		/* pushq %rsi */			IB(0x56);
+		/* pushq %r13 */			IB(0x41); IB(0x55);
+		/* pushq %r14 */			IB(0x41); IB(0x56);
+		/* pushq %r15 */			IB(0x41); IB(0x57);
+		/* pushq %rbp */			IB(0x55);
+		/* pushq %r12 */			IB(0x41); IB(0x54);
+
+		/* r14 = rt */
+		/* movq %rdi, %r14 */			IB(0x49); IB(0x89); IB(0xfe);
+
+		/* r15 = *&rt->frame->tmpvar[0] */
+		/* movq (%r14), %rax */			IB(0x49); IB(0x8b); IB(0x06);
+		/* movq (%rax), %r15 */			IB(0x4c); IB(0x8b); IB(0x38);
+
+		/* r13 = exception_handler */
+		/* movabs exception_code, %r13 */	IB(0x49); IB(0xbd); IQR(JIT_RELOC_CODE, (uint64_t)(intptr_t)jit_get_exec_addr(ctx, ctx->exception_code));
+	}
+
+	/* Dispatch to a loop header. (The tmpvars are already in the frame.) */
+	for (i = 0; i < ctx->ir_count; i++) {
+		ir = &ctx->ir[i];
+		if (ir->info.opcode == ROP_JMP && (uint32_t)ir->info.target <= ir->lpc) {
+			ASM {
+				/* cmpl target, %esi */	IB(0x81); IB(0xfe); ID((uint32_t)ir->info.target);
+			}
+
+			/* Patch later. */
+			if (!jit_add_branch_patch(ctx, ctx->code, (uint32_t)ir->info.target, PATCH_JE))
+				return false;
+
+			ASM {
+				/* Patched later. */
+				/* je 6 */		IB(0x0f); IB(0x84); ID(0);
+			}
+		}
+	}
+
+	/* Not a loop header. */
+	ASM {
+		/* jmp *%r13 */				IB(0x41); IB(0xff); IB(0xe5);
+	}
+
 	return true;
 }
 
@@ -1528,17 +2287,10 @@ jit_patch_branch(
 {
 	uint8_t *target_code;
 	int offset;
-	int i;
 
 	/* Search a code addr at lpc. */
 	target_code = NULL;
-	for (i = 0; i < ctx->pc_entry_count; i++) {
-		if (ctx->pc_entry[i].lpc == ctx->branch_patch[patch_index].lpc) {
-			target_code = (uint8_t *)ctx->pc_entry[i].code;
-			break;
-		}
-			
-	}
+	target_code = (uint8_t *)jit_find_pc_entry(ctx, ctx->branch_patch[patch_index].lpc);
 	if (target_code == NULL) {
 		rt_error(ctx->rt, "Branch target not found.");
 		return false;
@@ -1579,4 +2331,62 @@ jit_patch_branch(
 	return true;
 }
 
+/*
+ * Backend
+ */
+
+const struct jit_backend jit_backend = {
+	.loop_reg_count = LOOP_REG_COUNT,
+	.relocatable = true,
+	.put_prologue = jit_put_prologue,
+	.put_epilogue = jit_put_epilogue,
+	.put_loop_loads = jit_put_loop_loads,
+	.put_loop_stores = jit_put_loop_stores,
+	.visit_op = {
+		[ROP_LINEINFO] = jit_visit_lineinfo_op,
+		[ROP_ASSIGN] = jit_visit_assign_op,
+		[ROP_ICONST] = jit_visit_iconst_op,
+		[ROP_FCONST] = jit_visit_fconst_op,
+		[ROP_SCONST] = jit_visit_sconst_op,
+		[ROP_ACONST] = jit_visit_aconst_op,
+		[ROP_DCONST] = jit_visit_dconst_op,
+		[ROP_INC] = jit_visit_inc_op,
+		[ROP_ADD] = jit_visit_add_op,
+		[ROP_SUB] = jit_visit_sub_op,
+		[ROP_MUL] = jit_visit_mul_op,
+		[ROP_DIV] = jit_visit_div_op,
+		[ROP_MOD] = jit_visit_mod_op,
+		[ROP_AND] = jit_visit_and_op,
+		[ROP_OR] = jit_visit_or_op,
+		[ROP_XOR] = jit_visit_xor_op,
+		[ROP_NEG] = jit_visit_neg_op,
+		[ROP_LT] = jit_visit_lt_op,
+		[ROP_LTE] = jit_visit_lte_op,
+		[ROP_EQ] = jit_visit_eq_op,
+		[ROP_NEQ] = jit_visit_neq_op,
+		[ROP_GTE] = jit_visit_gte_op,
+		[ROP_GT] = jit_visit_gt_op,
+		[ROP_EQI] = jit_visit_eqi_op,
+		[ROP_LOADARRAY] = jit_visit_loadarray_op,
+		[ROP_STOREARRAY] = jit_visit_storearray_op,
+		[ROP_LEN] = jit_visit_len_op,
+		[ROP_GETDICTKEYBYINDEX] = jit_visit_getdictkeybyindex_op,
+		[ROP_GETDICTVALBYINDEX] = jit_visit_getdictvalbyindex_op,
+		[ROP_LOADSYMBOL] = jit_visit_loadsymbol_op,
+		[ROP_CHKFUNC] = jit_visit_chkfunc_op,
+		[ROP_SWITCH] = jit_visit_switch_op,
+		[ROP_LOADFUNC] = jit_visit_loadfunc_op,
+		[ROP_STORESYMBOL] = jit_visit_storesymbol_op,
+		[ROP_LOADDOT] = jit_visit_loaddot_op,
+		[ROP_STOREDOT] = jit_visit_storedot_op,
+		[ROP_CALL] = jit_visit_call_op,
+		[ROP_THISCALL] = jit_visit_thiscall_op,
+		[ROP_JMP] = jit_visit_jmp_op,
+		[ROP_JMPIFTRUE] = jit_visit_jmpiftrue_op,
+		[ROP_JMPIFFALSE] = jit_visit_jmpiffalse_op,
+		[ROP_JMPIFEQ] = jit_visit_jmpifeq_op,
+	},
+	.patch_branch = jit_patch_branch,
+};
+
 #endif /* defined(ARCH_X86_64) && defined(USE_JIT) */
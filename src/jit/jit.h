@@ -21,14 +21,378 @@
 /* Error message */
 #define BROKEN_BYTECODE		_("Broken bytecode.")
 
-/* Code size. */
-#define JIT_CODE_MAX	(16 * 1024 * 1024)
+/* Expected code bytes per bytecode byte. (to reserve a free area) */
+#define JIT_CODE_RATIO		16
 
-/* PC entry size. */
-#define PC_ENTRY_MAX		2048
+/* Expected code bytes of a prologue and an epilogue. */
+#define JIT_CODE_MARGIN		256
 
-/* Branch pathch size. */
-#define BRANCH_PATCH_MAX	2048
+/* Alignment of a function code. */
+#define JIT_CODE_ALIGN		16
+
+/*
+ * Dual mapping of the code cache (Linux)
+ *  - The region is a memfd mapped twice: a writable view and an
+ *    executable view, so that a compilation needs no mprotect().
+ *  - A backend writes through ctx->code (writable view) and must
+ *    use jit_get_exec_addr() for absolute code addresses.
+ *  - Only backends that have no absolute in-region jumps opt in.
+ */
+#if defined(TARGET_LINUX) && (defined(ARCH_X86_64) || defined(ARCH_X86))
+#define JIT_DUAL_MAP
+#endif
+
+/*
+ * Background compilation
+ *  - With --jit-async, hot functions are queued to a compiler thread
+ *    and keep running on the interpreter until their code is published.
+ *  - A compilation reserves its gap with a pending block, so that the
+ *    calling thread and the compiler thread never share a gap.
+ *  - It needs the dual-mapped cache, because the single view makes the
+ *    whole region non-executable during a compilation.
+ *  - The compiler thread never evicts code. If the cache has no room,
+ *    the function is marked RT_JIT_RETRY and compiled on the next call.
+ */
+#if defined(JIT_DUAL_MAP)
+#define JIT_ASYNC
+#include <pthread.h>
+#endif
+
+/*
+ * Profiler support (Linux)
+ *  - If rt_env.jit_profile is set, a commit appends "<addr> <size> <name>"
+ *    to /tmp/perf-<pid>.map for perf, and registers an in-memory ELF
+ *    object through the GDB JIT compilation interface.
+ *  - The ELF object has the code range as a NOBITS .text and a function
+ *    symbol. On x86_64, an .eh_frame describes the fixed prologue so
+ *    that GDB can unwind through JIT frames.
+ */
+#if defined(TARGET_LINUX)
+#define JIT_PROFILE
+#endif
+
+/*
+ * Shared emit loop
+ *  - On x86_64, jit_build() in jit-common.c decodes the bytecode and
+ *    drives the backend through struct jit_backend. (see below)
+ *  - The other backends have their own jit_build() that walks the
+ *    bytecode and dispatches by opcode. They move to the shared loop
+ *    once they have been run on their hardware or under qemu-user.
+ */
+#if defined(ARCH_X86_64)
+#define JIT_SHARED_EMIT
+#endif
+
+/*
+ * Disk cache
+ *  - With --jit-disk-cache <dir>, a compiled function is also written
+ *    to <dir>/<key>.jit, and a registered function whose file exists
+ *    gets the code from it instead of being compiled.
+ *  - The key is a hash of the bytecode, the format version, the
+ *    architecture and the runtime structure layout. A file with a bad
+ *    header, size or checksum is ignored and rewritten on a compile.
+ *  - A backend records a relocation for every absolute address it
+ *    embeds (jit_add_reloc()), and the loader patches them for the
+ *    current process. Only backends with jit_backend.relocatable set
+ *    use the cache.
+ */
+#if !defined(TARGET_WINDOWS) && defined(JIT_SHARED_EMIT)
+#define JIT_DISK_CACHE
+#endif
+
+/* Disk cache format version. (bump on any code generation change) */
+#define JIT_DISK_VERSION	1
+
+/* Relocation type. */
+enum jit_reloc_type {
+	/* Helper function. (addend: index of the helper table) */
+	JIT_RELOC_HELPER,
+
+	/* Pointer into the bytecode. (addend: offset) */
+	JIT_RELOC_BYTECODE,
+
+	/* Executable code address. (addend: offset from the code top) */
+	JIT_RELOC_CODE,
+};
+
+/* Relocation of a 64-bit absolute address. */
+struct jit_reloc {
+	/* Offset of the address from the code top. */
+	uint32_t offset;
+
+	/* Relocation type. (enum jit_reloc_type) */
+	uint32_t type;
+
+	/* Value by type. */
+	uint32_t addend;
+};
+
+/* Initial sizes of the PC entry table and the branch patch table. */
+#define JIT_TABLE_INIT_SIZE	256
+
+/* Maximum loops that get registers. */
+#define JIT_LOOP_MAX		64
+
+/* Maximum registers per loop. (A deoptimization exit saves them to the frame.) */
+#define JIT_LOOP_REG_MAX	RT_DEOPT_REG_MAX
+
+/*
+ * Loop register assignment
+ *  - A loop is a region [start_lpc, end_lpc) closed by a back-edge JMP.
+ *  - Only innermost loops that are entered at start_lpc get registers.
+ *  - A tmpvar gets a register if it is used by INC or EQI in the loop
+ *    and it is never written in the loop except by INC.
+ *  - A backend loads the registers at start_lpc and lets back-edges
+ *    jump to body_code, after the loads.
+ *  - A backend stores the written registers before any instruction
+ *    that reads tmpvars from memory (helpers) and on loop exits.
+ */
+struct jit_loop {
+	/* LIR-PC of the loop header, i.e., the back-edge target. */
+	uint32_t start_lpc;
+
+	/* LIR-PC next to the back-edge JMP. */
+	uint32_t end_lpc;
+
+	/* Assigned tmpvars. (reg[i] holds tmpvar[i]) */
+	int reg_count;
+	int tmpvar[JIT_LOOP_REG_MAX];
+
+	/* Is tmpvar[i] written by INC in the loop? */
+	bool is_written[JIT_LOOP_REG_MAX];
+
+	/* Is reg[i] newer than the memory? (codegen state) */
+	bool is_dirty[JIT_LOOP_REG_MAX];
+
+	/* Code address after the register loads. */
+	void *body_code;
+};
+
+/*
+ * Deoptimization
+ *  - A guard branches to an exit if an operand does not have the
+ *    profiled type. The exit stores its native address to
+ *    rt_frame.deopt_addr, saves the loop registers that are newer than
+ *    the tmpvars to rt_frame.deopt_reg[], and returns.
+ *  - A deopt point maps the exit to the LIR-PC of the guarded
+ *    instruction and to the tmpvars that the saved registers hold.
+ *  - jit_deoptimize() writes the registers back to the tmpvars and the
+ *    interpreter resumes at the LIR-PC. The instruction has not
+ *    changed the frame before its guards.
+ */
+struct jit_deopt_point {
+	/* Exit address, offset from the block top. */
+	uint32_t offset;
+
+	/* LIR-PC to resume. */
+	uint32_t lpc;
+
+	/* Tmpvar held by deopt_reg[i]. (-1 if the tmpvar is up to date) */
+	int tmpvar[JIT_LOOP_REG_MAX];
+};
+
+/*
+ * Code cache
+ *  - Each rt_env owns a region of linguine_conf_jit_cache_size bytes.
+ *  - The region holds code blocks sorted by address, and the gaps
+ *    between them are free.
+ *  - A compilation takes the largest gap, and evicts the least
+ *    recently called functions to the interpreter if the gap is
+ *    smaller than an expected code size.
+ *  - A function that has a calling frame is never evicted.
+ */
+struct jit_code_block {
+	/* Code address. */
+	uint8_t *code;
+
+	/* Code size in bytes. (aligned) */
+	size_t size;
+
+	/* Owner function. */
+	struct rt_func *func;
+
+	/* Is the block reserved by a running compilation? */
+	bool is_pending;
+
+	/* GDB JIT interface entry. (NULL if not registered) */
+	void *debug_entry;
+
+	/* Deopt points sorted by offset. */
+	struct jit_deopt_point *deopt_point;
+	int deopt_point_count;
+
+	/* Next block in the address order. */
+	struct jit_code_block *next;
+};
+
+struct jit_code_cache {
+	/* Mapped region. (executable view) */
+	uint8_t *region;
+	size_t region_size;
+
+	/* Writable view. (the same as region if not dual-mapped) */
+	uint8_t *wregion;
+
+	/* Code blocks sorted by address. */
+	struct jit_code_block *block_list;
+
+	/* Statistics. */
+	size_t used_size;
+	int func_count;
+	int compile_count;
+	int evict_count;
+
+	/* Diagnostics of functions that failed to compile. */
+	int fail_count;
+	char last_fail_message[1024];
+
+	/* Compilations done on the compiler thread. */
+	int async_count;
+
+	/* Guard failures that resumed the interpreter. */
+	int deopt_count;
+
+	/* Functions loaded from and written to the disk cache. */
+	int disk_load_count;
+	int disk_store_count;
+
+#if defined(JIT_ASYNC)
+	/* Lock for the block list, the statistics, and the job queue. */
+	pthread_mutex_t lock;
+
+	/* Compiler thread. (NULL if not started) */
+	struct jit_worker *worker;
+#endif
+};
+
+/*
+ * Instruction summary
+ */
+struct jit_op_info {
+	/* Opcode. */
+	uint8_t opcode;
+
+	/* Instruction size in bytes. */
+	int size;
+
+	/* Written tmpvar. (-1 if none) */
+	int dst;
+
+	/* Read tmpvars. */
+	int src_count;
+	int src[RT_ARG_MAX + 2];
+
+	/* Branch target LIR-PC. (-1 if not a branch) */
+	int target;
+};
+
+/*
+ * Decoded IR (JIT_SHARED_EMIT)
+ *  - jit_build() decodes the bytecode once into an array of jit_ir
+ *    before any code is emitted. The loop register assignment and the
+ *    choice of type guards are made on this array, in common code.
+ *  - A backend is a table of emitters. (struct jit_backend) The common
+ *    driver walks the IR, keeps the LIR-PC to native code map, enters
+ *    and leaves loops, and calls the emitter of each instruction with
+ *    ctx->cur_ir set. An emitter reads its operands by CONSUME_*().
+ *  - If a backend has loop registers, the driver stores them before
+ *    an instruction unless keeps_loop_regs is set. The emitters of
+ *    those instructions must read the loop registers instead of the
+ *    tmpvars, and store them by themselves before calling a helper.
+ */
+
+/* Type guard chosen from the profile. */
+enum jit_guard {
+	/* Generic code only. */
+	JIT_GUARD_NONE,
+
+	/* Both sources are integers. (arithmetic and comparison) */
+	JIT_GUARD_INT,
+
+	/* An array and an integer subscript. (LOADARRAY) */
+	JIT_GUARD_ARRAY,
+
+	/* A dictionary receiver. (LOADDOT and THISCALL) */
+	JIT_GUARD_DICT,
+};
+
+/* Source type proven by a typed opcode. (IADD, FADD, ...) */
+enum jit_typed {
+	/* Untyped. */
+	JIT_TYPED_NONE,
+
+	/* Both sources are integers. */
+	JIT_TYPED_INT,
+
+	/* Both sources are floats. */
+	JIT_TYPED_FLOAT,
+};
+
+/* IR instruction */
+struct jit_ir {
+	/* LIR-PC. */
+	uint32_t lpc;
+
+	/* Decoded operands. */
+	struct jit_op_info info;
+
+	/* Type guard. (enum jit_guard) */
+	int guard;
+
+	/* Proven source type. (enum jit_typed) */
+	int typed;
+
+	/* Is an ACONST or a DCONST freed with the frame? (LACONST or LDCONST) */
+	bool frame_owned;
+
+	/* Is the subscript proven in range? (ULOADARRAY or UGETDICTVALBYINDEX) */
+	bool in_range;
+
+	/* Is a call in a tail position? (TAILCALL) */
+	bool tail;
+
+	/* Observed dictionary slot plus one. (LOADDOT with JIT_GUARD_DICT) */
+	uint8_t slot;
+
+	/* Can the loop registers stay dirty across this instruction? */
+	bool keeps_loop_regs;
+};
+
+/* Number of opcode values. */
+#define JIT_OPCODE_MAX		256
+
+/* Backend */
+struct jit_context;
+struct jit_backend {
+	/* Registers for loop tmpvars. (0 if not used) */
+	int loop_reg_count;
+
+	/* Does the backend add a relocation for every absolute address? */
+	bool relocatable;
+
+	/* Put the entry code and the exception handler. */
+	bool (*put_prologue)(struct jit_context *ctx);
+
+	/* Put the exit code, and anything placed after the body. */
+	bool (*put_epilogue)(struct jit_context *ctx);
+
+	/* Load the registers of a loop at its header. (if loop_reg_count > 0) */
+	bool (*put_loop_loads)(struct jit_context *ctx, struct jit_loop *loop);
+
+	/* Store the dirty, or all written, loop registers. (if loop_reg_count > 0) */
+	bool (*put_loop_stores)(struct jit_context *ctx, bool all_written);
+
+	/* Emitters by opcode. (NULL if not supported) */
+	bool (*visit_op[JIT_OPCODE_MAX])(struct jit_context *ctx);
+
+	/* Patch a branch added by jit_add_branch_patch(). */
+	bool (*patch_branch)(struct jit_context *ctx, int patch_index);
+};
+
+#if defined(JIT_SHARED_EMIT)
+/* The backend of the target architecture. (defined in jit-<arch>.c) */
+extern const struct jit_backend jit_backend;
+#endif
 
 /*
  * JIT codegen context
@@ -46,37 +410,184 @@ struct jit_context {
 	/* Current code position. */
 	void *code;
 
+	/* Reserved block of the code cache. */
+	struct jit_code_block *block;
+
 	/* Exception handler. */
 	void *exception_code;
 
+	/* OSR entry. (NULL if not supported) */
+	void *osr_code;
+
+	/* Executable view address minus writable view address. */
+	ptrdiff_t exec_offset;
+
 	/* Current code LIR PC. */
 	int lpc;
 
-	/* Table to represent LIR-PC to Arm64-code map. */
+	/* IR of the function. (see jit_lower()) */
+	struct jit_ir *ir;
+	int ir_count;
+
+	/* IR instruction being emitted. */
+	struct jit_ir *cur_ir;
+
+	/* Table to represent LIR-PC to native code map. (sorted by lpc, growable) */
 	struct pc_entry {
 		uint32_t lpc;
 		uint32_t *code;
-	} pc_entry[PC_ENTRY_MAX];
+	} *pc_entry;
 	int pc_entry_count;
+	int pc_entry_size;
 
-	/* Table to represent branch patching entries. */
+	/* Table to represent branch patching entries. (growable) */
 	struct branch_patch {
 		uint32_t *code;
 		uint32_t lpc;
 		int type;
-	} branch_patch[BRANCH_PATCH_MAX];
+	} *branch_patch;
 	int branch_patch_count;
+	int branch_patch_size;
+
+	/* Deopt points. (growable, moved to the block on a commit) */
+	struct jit_deopt_point *deopt_point;
+	int deopt_point_count;
+	int deopt_point_size;
+
+	/* Relocations for the disk cache. (growable) */
+	struct jit_reloc *reloc;
+	int reloc_count;
+	int reloc_size;
+
+	/* Is an address not relocatable? (never stored to the disk cache) */
+	bool is_not_relocatable;
+
+	/* Is the code loaded from the disk cache? */
+	bool is_loaded;
+
+	/* Loops with register assignment. (see jit_regalloc()) */
+	struct jit_loop loop[JIT_LOOP_MAX];
+	int loop_count;
+
+	/* Current loop index. (-1 if outside) */
+	int cur_loop;
 };
 
 /* Map a region. */
 bool jit_map_memory_region(void **region, size_t size);
 
+/* Unmap a region. */
+void jit_unmap_memory_region(void *region, size_t size);
+
+/* Take a free code area and make it writable. (code_top is NULL if no room) */
+bool jit_alloc_code(struct jit_context *ctx);
+
+/* Register the generated code, make it executable, and publish it. */
+bool jit_commit_code(struct jit_context *ctx);
+
+/* Discard the generated code and make the region executable. */
+void jit_cancel_code(struct jit_context *ctx);
+
+/* Add a PC entry. */
+bool jit_add_pc_entry(struct jit_context *ctx, uint32_t lpc, void *code);
+
+/* Add a branch patch entry. */
+bool jit_add_branch_patch(struct jit_context *ctx, void *code, uint32_t lpc, int type);
+
+/* Add a deopt point for an exit at code. (tmpvar[] from jit_get_deopt_regs()) */
+bool jit_add_deopt_point(struct jit_context *ctx, void *code, uint32_t lpc, const int *tmpvar);
+
+/* Add a relocation for a 64-bit address at code. (before putting it) */
+bool jit_add_reloc(struct jit_context *ctx, int type, uint64_t value);
+
+/* Find a code address of an lpc. (NULL if not found) */
+void *jit_find_pc_entry(struct jit_context *ctx, uint32_t lpc);
+
+/* Record a failure, discard the code, and keep the function interpreted. */
+bool jit_fail(struct jit_context *ctx);
+
+/* Free the tables of a context. */
+void jit_free_context(struct jit_context *ctx);
+
 /* Make a region writable. */
 void jit_map_writable(void *region, size_t size);
 
 /* Make a region executable. */
 void jit_map_executable(void * region, size_t size);
 
+/* Decode an instruction at lpc. */
+bool jit_get_op_info(struct rt_func *func, int lpc, struct jit_op_info *info);
+
+/* Get an executable address of a generated code address. */
+static INLINE void *
+jit_get_exec_addr(
+	struct jit_context *ctx,
+	void *code)
+{
+	return (uint8_t *)code + ctx->exec_offset;
+}
+
+/* Get a type profile byte of the instruction at lpc. (0 if not observed) */
+static INLINE uint8_t
+jit_get_profile(
+	struct jit_context *ctx,
+	int lpc,
+	int index)
+{
+	if (ctx->func->profile == NULL)
+		return 0;
+
+	return __atomic_load_n(&ctx->func->profile[lpc + index], __ATOMIC_RELAXED);
+}
+
+/* Get a register index that holds a tmpvar in the current loop. (-1 if none) */
+static INLINE int
+jit_get_loop_reg(
+	struct jit_context *ctx,
+	int tmpvar)
+{
+	struct jit_loop *loop;
+	int i;
+
+	if (ctx->cur_loop < 0)
+		return -1;
+
+	loop = &ctx->loop[ctx->cur_loop];
+	for (i = 0; i < loop->reg_count; i++) {
+		if (loop->tmpvar[i] == tmpvar)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Get tmpvars of the loop registers that an exit saves here. (returns the count) */
+static INLINE int
+jit_get_deopt_regs(
+	struct jit_context *ctx,
+	int *tmpvar)
+{
+	struct jit_loop *loop;
+	int i, n;
+
+	for (i = 0; i < JIT_LOOP_REG_MAX; i++)
+		tmpvar[i] = -1;
+
+	if (ctx->cur_loop < 0)
+		return 0;
+
+	loop = &ctx->loop[ctx->cur_loop];
+	n = 0;
+	for (i = 0; i < loop->reg_count; i++) {
+		if (loop->is_written[i] && loop->is_dirty[i]) {
+			tmpvar[i] = loop->tmpvar[i];
+			n++;
+		}
+	}
+
+	return n;
+}
+
 /*
  * Get an opcode.
  */
@@ -173,6 +684,29 @@ jit_get_imm8(
 	return true;
 }
 
+/*
+ * Get an imm16 operand.
+ */
+#define CONSUME_IMM16(d)	if (!jit_get_imm16(ctx, &d)) return false
+static INLINE bool
+jit_get_imm16(
+	struct jit_context *ctx,
+	int *imm16)
+{
+	if (ctx->lpc + 2 > ctx->func->bytecode_size) {
+		rt_error(ctx->rt, BROKEN_BYTECODE);
+		*imm16 = 0;
+		return false;
+	}
+
+	*imm16 = (ctx->func->bytecode[ctx->lpc] << 8) |
+		  ctx->func->bytecode[ctx->lpc + 1];
+
+	ctx->lpc += 2;
+
+	return true;
+}
+
 /*
  * Get a string operand.
  */
@@ -198,6 +732,36 @@ jit_get_opr_string(
 	return true;
 }
 
+/* Get a SWITCH table that starts at the src operand. (see lir.h) */
+#define CONSUME_TABLE(d)	if (!jit_get_opr_table(ctx, &d)) return false
+static INLINE bool
+jit_get_opr_table(
+	struct jit_context *ctx,
+	const uint8_t **d)
+{
+	int len;
+
+	if (ctx->lpc + 4 > ctx->func->bytecode_size) {
+		rt_error(ctx->rt, BROKEN_BYTECODE);
+		*d = NULL;
+		return false;
+	}
+
+	len = (ctx->func->bytecode[ctx->lpc + 2] << 8) |
+	       ctx->func->bytecode[ctx->lpc + 3];
+	if (len < 4 || ctx->lpc + len > ctx->func->bytecode_size) {
+		rt_error(ctx->rt, BROKEN_BYTECODE);
+		*d = NULL;
+		return false;
+	}
+
+	*d = &ctx->func->bytecode[ctx->lpc];
+
+	ctx->lpc += len;
+
+	return true;
+}
+
 #endif /* defined(USE_JIT) */
 
 #endif
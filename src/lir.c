@@ -30,6 +30,7 @@
  * Config
  */
 extern int linguine_conf_optimize;
+extern bool linguine_conf_tail_call;
 
 /*
  * Target LIR.
@@ -52,6 +53,9 @@ static int bytecode_top;
 static int tmpvar_top;
 static int tmpvar_count;
 
+/* Frame size before the tmpvar coalescing. */
+static int frame_size_before;
+
 /*
  * Location table.
  */
@@ -69,6 +73,43 @@ struct loc_entry {
 static struct loc_entry loc_tbl[LOC_MAX];
 static int loc_count;
 
+/*
+ * Inline expansion. (-O)
+ */
+
+/* Maximum nesting of inlined calls. */
+#define INLINE_DEPTH_MAX	4
+
+/* Maximum expression nodes of an inlined function body. */
+#define INLINE_EXPR_BUDGET	16
+
+struct inline_frame {
+	/* Inlined function. */
+	struct hir_block *func;
+
+	/* Tmpvars that hold the arguments. */
+	int tmpvar[HIR_PARAM_SIZE];
+};
+
+static struct hir_block *lir_cur_func;
+static struct inline_frame inline_stack[INLINE_DEPTH_MAX];
+static int inline_depth;
+
+/*
+ * Switch lowering. (-O)
+ */
+
+/* Minimum and maximum cases of a chain lowered to a SWITCH. */
+#define SWITCH_CASE_MIN		4
+#define SWITCH_CASE_MAX		1024
+
+/* Case literals of the current chain, and its table from src. */
+static struct hir_term *switch_case[SWITCH_CASE_MAX];
+static uint8_t switch_table[65536];
+
+/* Offset of the jump operand to the first case body. (patched by the chain) */
+static int switch_head_jmp;
+
 /*
  * Error position and message.
  */
@@ -84,6 +125,13 @@ static int lir_count_local(struct hir_block *func);
 static bool lir_visit_block(struct hir_block *block);
 static bool lir_visit_basic_block(struct hir_block *block);
 static bool lir_visit_if_block(struct hir_block *block);
+static int lir_make_switch_table(struct hir_block *block);
+static struct hir_term *lir_get_switch_case(struct hir_expr *cond, const char *symbol);
+static bool lir_visit_switch_chain(struct hir_block *block, int table_len);
+static bool lir_put_switch_tree(int index_tmpvar, struct hir_block **target, int lo, int hi);
+static void lir_switch_set_u16(int pos, uint16_t val);
+static void lir_switch_set_u32(int pos, uint32_t val);
+static uint16_t lir_switch_get_u16(int pos);
 static bool lir_visit_for_block(struct hir_block *block);
 static bool lir_visit_for_range_block(struct hir_block *block);
 static bool lir_visit_for_kv_block(struct hir_block *block);
@@ -97,6 +145,14 @@ static bool lir_visit_unary_expr(int dst_tmpvar, struct hir_expr *expr, struct h
 static bool lir_visit_binary_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
 static bool lir_visit_dot_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
 static bool lir_visit_call_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
+static bool lir_put_call(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block, uint8_t opcode);
+static bool lir_is_return_stmt(struct hir_stmt *stmt);
+static struct hir_block *lir_find_inline_callee(struct hir_expr *expr, struct hir_block *block, struct hir_stmt **body);
+static int lir_count_expr_size(struct hir_expr *expr);
+static bool lir_is_free_symbol_bound(struct hir_expr *expr, struct hir_block *callee);
+static bool lir_is_symbol_stored(const char *symbol);
+static bool lir_is_symbol_stored_in_block(struct hir_block *block, const char *symbol);
+static bool lir_visit_inline_call(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block, struct hir_block *callee, struct hir_stmt *body);
 static bool lir_visit_thiscall_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
 static bool lir_visit_array_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
 static bool lir_visit_dict_expr(int dst_tmpvar, struct hir_expr *expr, struct hir_block *block);
@@ -119,6 +175,8 @@ static bool lir_put_u8(uint8_t b);
 static bool lir_put_u16(uint16_t b);
 static bool lir_put_u32(uint32_t b);
 static void patch_block_address(void);
+static bool lir_is_call_free(uint32_t start, uint32_t end);
+static bool lir_optimize(int ret_tmpvar);
 static void lir_fatal(const char *msg, ...);
 static void lir_out_of_memory(void);
 
@@ -155,6 +213,10 @@ lir_build(
 	/* Initialize the relocation table. */
 	loc_count = 0;
 
+	/* Initialize the inliner. */
+	lir_cur_func = hir_func;
+	inline_depth = 0;
+
 	/* Visit blocks. */
 	cur_block = hir_func->val.func.inner;
 	while (cur_block != NULL) {
@@ -173,6 +235,13 @@ lir_build(
 	/* Patch block address. */
 	patch_block_address();
 
+	/* Optimize the bytecode. */
+	frame_size_before = tmpvar_count + 1;
+	if (linguine_conf_optimize > 0) {
+		if (!lir_optimize(hir_func->val.func.param_count))
+			return false;
+	}
+
 	/* Make an lir_func. */
 	*lir_func = malloc(sizeof(struct lir_func));
 	if (lir_func == NULL) {
@@ -214,6 +283,7 @@ lir_build(
 	}
 
 	(*lir_func)->tmpvar_size = tmpvar_count + 1;
+	(*lir_func)->orig_tmpvar_size = frame_size_before;
 
 #ifdef DEBUG_DUMP_LIR
 	lir_dump(*lir_func);
@@ -315,13 +385,20 @@ static bool
 lir_visit_if_block(
 	struct hir_block *block)
 {
-	int cond_tmpvar;
+	int cond_tmpvar, table_len;
 	bool is_else;
 	struct hir_block *b;
 
 	assert(block != NULL);
 	assert(block->type == HIR_BLOCK_IF);
 
+	/* Lower a chain of comparisons with constants to a SWITCH. */
+	if (linguine_conf_optimize != 0 && block->val.if_.chain_prev == NULL) {
+		table_len = lir_make_switch_table(block);
+		if (table_len > 0)
+			return lir_visit_switch_chain(block, table_len);
+	}
+
 	/* Store the block address. */
 	block->addr = (uint32_t)bytecode_top;
 
@@ -405,6 +482,350 @@ lir_visit_if_block(
 	return true;
 }
 
+/*
+ * Make the SWITCH table of an if-elif chain in switch_table.
+ *  - Every condition must be "symbol == literal" with the same symbol,
+ *    and the literals must be distinct integers or distinct strings.
+ *  - Returns the table length from src, or 0 if the chain doesn't fit.
+ */
+static int
+lir_make_switch_table(
+	struct hir_block *block)
+{
+	struct hir_block *b;
+	struct hir_term *term;
+	const char *symbol;
+	int64_t min, max;
+	uint32_t h, mask, str_ofs;
+	int count, kind, len, slot_size, i, j, k;
+
+	/* The subject is the LHS symbol of the first condition. */
+	if (block->val.if_.cond == NULL ||
+	    block->val.if_.cond->type != HIR_EXPR_EQ ||
+	    block->val.if_.cond->val.binary.expr[0]->type != HIR_EXPR_TERM ||
+	    block->val.if_.cond->val.binary.expr[0]->val.term.term->type != HIR_TERM_SYMBOL)
+		return 0;
+	symbol = block->val.if_.cond->val.binary.expr[0]->val.term.term->val.symbol;
+
+	/* Collect the literals. */
+	count = 0;
+	for (b = block; b != NULL && b->val.if_.cond != NULL; b = b->val.if_.chain_next) {
+		if (count == SWITCH_CASE_MAX)
+			return 0;
+		term = lir_get_switch_case(b->val.if_.cond, symbol);
+		if (term == NULL)
+			return 0;
+		if (count > 0 && term->type != switch_case[0]->type)
+			return 0;
+		for (i = 0; i < count; i++) {
+			if (term->type == HIR_TERM_INT && switch_case[i]->val.i == term->val.i)
+				return 0;
+			if (term->type == HIR_TERM_STRING && strcmp(switch_case[i]->val.s, term->val.s) == 0)
+				return 0;
+		}
+		switch_case[count++] = term;
+	}
+	if (count < SWITCH_CASE_MIN)
+		return 0;
+
+	/* Choose a dense table for integers in a small range. */
+	if (switch_case[0]->type == HIR_TERM_INT) {
+		min = max = switch_case[0]->val.i;
+		for (i = 1; i < count; i++) {
+			if (switch_case[i]->val.i < min)
+				min = switch_case[i]->val.i;
+			if (switch_case[i]->val.i > max)
+				max = switch_case[i]->val.i;
+		}
+		kind = (max - min + 1 <= (int64_t)count * 2) ? LIR_SWITCH_DENSE : LIR_SWITCH_INT;
+	} else {
+		min = max = 0;
+		kind = LIR_SWITCH_STRING;
+	}
+
+	/* Put the header. (src is set by the caller) */
+	switch_table[4] = (uint8_t)kind;
+	switch_table[5] = (uint8_t)(count >> 8);
+	switch_table[6] = (uint8_t)count;
+	len = LIR_SWITCH_HEADER_SIZE;
+
+	if (kind == LIR_SWITCH_DENSE) {
+		lir_switch_set_u32(len, (uint32_t)min);
+		lir_switch_set_u16(len + 4, (uint16_t)(max - min + 1));
+		len += 6;
+		for (k = 0; k < max - min + 1; k++)
+			lir_switch_set_u16(len + k * 2, LIR_SWITCH_EMPTY);
+		for (i = 0; i < count; i++)
+			lir_switch_set_u16(len + (int)(switch_case[i]->val.i - min) * 2, (uint16_t)i);
+		len += (int)(max - min + 1) * 2;
+	} else {
+		/* A power of two with at most a half filled. */
+		for (mask = 1; mask + 1 < (uint32_t)count * 2; mask = (mask << 1) | 1)
+			;
+		slot_size = kind == LIR_SWITCH_INT ? 6 : 8;
+		lir_switch_set_u16(len, (uint16_t)mask);
+		len += 2;
+		for (k = 0; k <= (int)mask; k++) {
+			memset(&switch_table[len + k * slot_size], 0, (size_t)slot_size);
+			lir_switch_set_u16(len + k * slot_size + 4, LIR_SWITCH_EMPTY);
+		}
+		str_ofs = (uint32_t)(len + (int)(mask + 1) * slot_size);
+		for (i = 0; i < count; i++) {
+			if (kind == LIR_SWITCH_INT)
+				h = lir_hash_int(switch_case[i]->val.i);
+			else
+				h = lir_hash_string(switch_case[i]->val.s);
+			for (j = (int)(h & mask); ; j = (int)((uint32_t)(j + 1) & mask)) {
+				if (lir_switch_get_u16(len + j * slot_size + 4) == LIR_SWITCH_EMPTY)
+					break;
+			}
+			k = len + j * slot_size;
+			lir_switch_set_u16(k + 4, (uint16_t)i);
+			if (kind == LIR_SWITCH_INT) {
+				lir_switch_set_u32(k, (uint32_t)switch_case[i]->val.i);
+				continue;
+			}
+			if (str_ofs + strlen(switch_case[i]->val.s) + 1 > 0xffff)
+				return 0;
+			lir_switch_set_u32(k, h);
+			lir_switch_set_u16(k + 6, (uint16_t)str_ofs);
+			strcpy((char *)&switch_table[str_ofs], switch_case[i]->val.s);
+			str_ofs += (uint32_t)strlen(switch_case[i]->val.s) + 1;
+		}
+		len = (int)str_ofs;
+	}
+	lir_switch_set_u16(2, (uint16_t)len);
+
+	return len;
+}
+
+/* Get the literal of a condition "symbol == literal". */
+static struct hir_term *
+lir_get_switch_case(
+	struct hir_expr *cond,
+	const char *symbol)
+{
+	struct hir_expr *lhs, *rhs;
+
+	if (cond == NULL || cond->type != HIR_EXPR_EQ)
+		return NULL;
+	lhs = cond->val.binary.expr[0];
+	rhs = cond->val.binary.expr[1];
+	if (lhs->type != HIR_EXPR_TERM ||
+	    lhs->val.term.term->type != HIR_TERM_SYMBOL ||
+	    strcmp(lhs->val.term.term->val.symbol, symbol) != 0)
+		return NULL;
+	if (rhs->type != HIR_EXPR_TERM)
+		return NULL;
+	if (rhs->val.term.term->type != HIR_TERM_INT &&
+	    rhs->val.term.term->type != HIR_TERM_STRING)
+		return NULL;
+
+	return rhs->val.term.term;
+}
+
+/*
+ * Visit an if-elif chain as a SWITCH.
+ *  - The SWITCH maps the subject to a case index, and a binary search
+ *    over the index jumps to the block. The branches stay two-way.
+ */
+static bool
+lir_visit_switch_chain(
+	struct hir_block *block,
+	int table_len)
+{
+	struct hir_block *target[SWITCH_CASE_MAX + 1];
+	struct hir_block *b, *inner;
+	int subject_tmpvar, index_tmpvar, count, i;
+
+	/* Store the block address. */
+	block->addr = (uint32_t)bytecode_top;
+
+	/* Get the targets. The last one is the else-block or the successor. */
+	count = 0;
+	for (b = block; b != NULL && b->val.if_.cond != NULL; b = b->val.if_.chain_next)
+		target[count++] = b;
+	target[count] = b != NULL ? b : block->succ;
+
+	/* Visit the subject, and put a switch. */
+	if (!lir_increment_tmpvar(&subject_tmpvar))
+		return false;
+	if (!lir_visit_expr(subject_tmpvar, block->val.if_.cond->val.binary.expr[0], block))
+		return false;
+	if (!lir_increment_tmpvar(&index_tmpvar))
+		return false;
+	lir_switch_set_u16(0, (uint16_t)subject_tmpvar);
+	if (!lir_put_opcode(LOP_SWITCH))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)index_tmpvar))
+		return false;
+	for (i = 0; i < table_len; i++) {
+		if (!lir_put_imm8(switch_table[i]))
+			return false;
+	}
+
+	/* Jump by the case index. */
+	if (!lir_put_switch_tree(index_tmpvar, target, 0, count))
+		return false;
+	lir_decrement_tmpvar(index_tmpvar);
+	lir_decrement_tmpvar(subject_tmpvar);
+
+	/* Visit the blocks. The head keeps its address for the jumps into the chain. */
+	for (i = 0; i <= count; i++) {
+		b = target[i];
+		if (i == count && b == block->succ)
+			break;
+		if (i == 0) {
+			bytecode[switch_head_jmp] = (uint8_t)((bytecode_top >> 24) & 0xff);
+			bytecode[switch_head_jmp + 1] = (uint8_t)((bytecode_top >> 16) & 0xff);
+			bytecode[switch_head_jmp + 2] = (uint8_t)((bytecode_top >> 8) & 0xff);
+			bytecode[switch_head_jmp + 3] = (uint8_t)(bytecode_top & 0xff);
+		} else {
+			b->addr = (uint32_t)bytecode_top;
+		}
+		inner = b->val.if_.inner;
+		while (inner != NULL) {
+			if (!lir_visit_block(inner))
+				return false;
+			if (inner->stop)
+				break;
+			inner = inner->succ;
+		}
+		if (i < count) {
+			/* Jump to a first non-if block. */
+			if (!lir_put_opcode(LOP_JMP))
+				return false;
+			if (!lir_put_branch_addr(block->succ))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Put a binary search of a case index in [lo, hi] that jumps to the target. */
+static bool
+lir_put_switch_tree(
+	int index_tmpvar,
+	struct hir_block **target,
+	int lo,
+	int hi)
+{
+	int cond_tmpvar, mid, addr;
+
+	if (lo == hi) {
+		if (!lir_put_opcode(LOP_JMP))
+			return false;
+		if (lo == 0) {
+			/* The body of the head is patched after the tree. */
+			switch_head_jmp = bytecode_top;
+			if (!lir_put_imm32(0))
+				return false;
+			return true;
+		}
+		if (!lir_put_branch_addr(target[lo]))
+			return false;
+		return true;
+	}
+
+	/* if (index < mid) goto left; */
+	mid = (lo + hi + 1) / 2;
+	if (!lir_increment_tmpvar(&cond_tmpvar))
+		return false;
+	if (!lir_put_opcode(LOP_ICONST))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)cond_tmpvar))
+		return false;
+	if (!lir_put_imm32((uint32_t)mid))
+		return false;
+	if (!lir_put_opcode(LOP_LT))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)cond_tmpvar))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)index_tmpvar))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)cond_tmpvar))
+		return false;
+	if (!lir_put_opcode(LOP_JMPIFTRUE))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)cond_tmpvar))
+		return false;
+	addr = bytecode_top;
+	if (!lir_put_imm32(0))
+		return false;
+	lir_decrement_tmpvar(cond_tmpvar);
+
+	/* right: */
+	if (!lir_put_switch_tree(index_tmpvar, target, mid, hi))
+		return false;
+
+	/* left: */
+	bytecode[addr] = (uint8_t)((bytecode_top >> 24) & 0xff);
+	bytecode[addr + 1] = (uint8_t)((bytecode_top >> 16) & 0xff);
+	bytecode[addr + 2] = (uint8_t)((bytecode_top >> 8) & 0xff);
+	bytecode[addr + 3] = (uint8_t)(bytecode_top & 0xff);
+	if (!lir_put_switch_tree(index_tmpvar, target, lo, mid - 1))
+		return false;
+
+	return true;
+}
+
+static void
+lir_switch_set_u16(
+	int pos,
+	uint16_t val)
+{
+	switch_table[pos] = (uint8_t)((val >> 8) & 0xff);
+	switch_table[pos + 1] = (uint8_t)(val & 0xff);
+}
+
+static void
+lir_switch_set_u32(
+	int pos,
+	uint32_t val)
+{
+	switch_table[pos] = (uint8_t)((val >> 24) & 0xff);
+	switch_table[pos + 1] = (uint8_t)((val >> 16) & 0xff);
+	switch_table[pos + 2] = (uint8_t)((val >> 8) & 0xff);
+	switch_table[pos + 3] = (uint8_t)(val & 0xff);
+}
+
+static uint16_t
+lir_switch_get_u16(
+	int pos)
+{
+	return (uint16_t)(((uint32_t)switch_table[pos] << 8) | (uint32_t)switch_table[pos + 1]);
+}
+
+/* Hash an integer case. (shared with the runtime) */
+uint32_t
+lir_hash_int(
+	int key)
+{
+	uint32_t h;
+
+	h = (uint32_t)key * 0x9e3779b1U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* Hash a string case by FNV-1a. (shared with the runtime) */
+uint32_t
+lir_hash_string(
+	const char *key)
+{
+	uint32_t h;
+
+	h = 0x811c9dc5U;
+	while (*key != '\0') {
+		h ^= (uint8_t)*key++;
+		h *= 0x01000193U;
+	}
+
+	return h;
+}
+
 static bool
 lir_visit_for_block(
 	struct hir_block *block)
@@ -529,7 +950,7 @@ static bool
 lir_visit_for_kv_block(
 	struct hir_block *block)
 {
-	uint32_t loop_addr;
+	uint32_t loop_addr, load_addr, body_addr;
 	int col_tmpvar, size_tmpvar, i_tmpvar, key_tmpvar, val_tmpvar, cmp_tmpvar;
 	struct hir_block *b;
 
@@ -607,6 +1028,7 @@ lir_visit_for_kv_block(
 		return false;
 	if (!lir_put_tmpvar((uint16_t)i_tmpvar))
 		return false;
+	load_addr = (uint32_t)bytecode_top;
 	if (!lir_put_opcode(LOP_GETDICTVALBYINDEX)) 	/* val = dict.getValByIndex(i) */
 		return false;
 	if (!lir_put_tmpvar((uint16_t)val_tmpvar))
@@ -621,6 +1043,7 @@ lir_visit_for_kv_block(
 		return false;
 
 	/* Visit an inner block. */
+	body_addr = (uint32_t)bytecode_top;
 	b = block->val.for_.inner;
 	while (b != NULL) {
 		if (!lir_visit_block(b))
@@ -630,6 +1053,13 @@ lir_visit_for_kv_block(
 		b = b->succ;
 	}
 
+	/*
+	 * i < size holds at the load. Only a call can remove an element, so
+	 * the value is loaded without the bounds check if the body has none.
+	 */
+	if (linguine_conf_optimize > 0 && lir_is_call_free(body_addr, (uint32_t)bytecode_top))
+		bytecode[load_addr] = LOP_UGETDICTVALBYINDEX;
+
 	/* Put a back-edge jump. */
 	if (!lir_put_opcode(LOP_JMP))
 		return false;
@@ -648,7 +1078,7 @@ static bool
 lir_visit_for_v_block(
 	struct hir_block *block)
 {
-	uint32_t loop_addr;
+	uint32_t loop_addr, load_addr, body_addr;
 	int arr_tmpvar, size_tmpvar, i_tmpvar, val_tmpvar, cmp_tmpvar;
 	struct hir_block *b;
 
@@ -716,6 +1146,7 @@ lir_visit_for_v_block(
 		return false;
 	if (!lir_put_branch_addr(block->succ))
 		return false;
+	load_addr = (uint32_t)bytecode_top;
 	if (!lir_put_opcode(LOP_LOADARRAY)) 	/* val = array[i] */
 		return false;
 	if (!lir_put_tmpvar((uint16_t)val_tmpvar))
@@ -730,6 +1161,7 @@ lir_visit_for_v_block(
 		return false;
 
 	/* Visit an inner block. */
+	body_addr = (uint32_t)bytecode_top;
 	b = block->val.for_.inner;
 	while (b != NULL) {
 		if (!lir_visit_block(b))
@@ -739,6 +1171,10 @@ lir_visit_for_v_block(
 		b = b->succ;
 	}
 
+	/* The same as the dictionary: only a call can shrink the array. */
+	if (linguine_conf_optimize > 0 && lir_is_call_free(body_addr, (uint32_t)bytecode_top))
+		bytecode[load_addr] = LOP_ULOADARRAY;
+
 	/* Put a back-edge jump. */
 	if (!lir_put_opcode(LOP_JMP))
 		return false;
@@ -862,9 +1298,14 @@ lir_visit_stmt(
 			return false;
 	}
 
-	/* Visit RHS. */
-	if (!lir_visit_expr(rhs_tmpvar, stmt->rhs, parent))
-		return false;
+	/* Visit RHS. A returned call reuses the frame. */
+	if (stmt->is_tail_call && linguine_conf_tail_call) {
+		if (!lir_put_call(rhs_tmpvar, stmt->rhs, parent, LOP_TAILCALL))
+			return false;
+	} else {
+		if (!lir_visit_expr(rhs_tmpvar, stmt->rhs, parent))
+			return false;
+	}
 
 	/* Visit LHS if LHS is not an explicit local variable. */
 	if (stmt->lhs != NULL && !is_lhs_local) {
@@ -936,6 +1377,33 @@ lir_visit_stmt(
 	if (!is_lhs_local)
 		lir_decrement_tmpvar(rhs_tmpvar);
 
+	/* Jump to the end unless the return falls through to it. */
+	if (lir_is_return_stmt(stmt) &&
+	    !(stmt->next == NULL && parent->stop &&
+	      parent->parent->type == HIR_BLOCK_FUNC)) {
+		if (!lir_put_opcode(LOP_JMP))
+			return false;
+		if (!lir_put_branch_addr(lir_cur_func->succ))
+			return false;
+	}
+
+	return true;
+}
+
+/* Check whether a statement is a return. */
+static bool
+lir_is_return_stmt(
+	struct hir_stmt *stmt)
+{
+	if (stmt->lhs == NULL)
+		return false;
+	if (stmt->lhs->type != HIR_EXPR_TERM)
+		return false;
+	if (stmt->lhs->val.term.term->type != HIR_TERM_SYMBOL)
+		return false;
+	if (strcmp(stmt->lhs->val.term.term->val.symbol, "$return") != 0)
+		return false;
+
 	return true;
 }
 
@@ -1221,10 +1689,23 @@ lir_visit_call_expr(
 	int dst_tmpvar,
 	struct hir_expr *expr,
 	struct hir_block *block)
+{
+	return lir_put_call(dst_tmpvar, expr, block, LOP_CALL);
+}
+
+/* Put a CALL, or a TAILCALL that reuses the frame for a returned call. */
+static bool
+lir_put_call(
+	int dst_tmpvar,
+	struct hir_expr *expr,
+	struct hir_block *block,
+	uint8_t opcode)
 {
 	int arg_tmpvar[HIR_PARAM_SIZE];
 	int arg_count;
 	int func_tmpvar;
+	int chk_tmpvar;
+	int slow_addr, done_addr;
 	int i;
 
 	assert(expr != NULL);
@@ -1234,7 +1715,54 @@ lir_visit_call_expr(
 	assert(expr->val.call.arg_count < HIR_PARAM_SIZE);
 
 	arg_count = expr->val.call.arg_count;
-	
+
+	/*
+	 * Expand a small global function in place if possible. Another
+	 * file may rebind the name, so the expansion is guarded by a
+	 * CHKFUNC and the call below is the fallback.
+	 */
+	done_addr = -1;
+	if (linguine_conf_optimize != 0) {
+		struct hir_block *callee;
+		struct hir_stmt *body;
+
+		callee = lir_find_inline_callee(expr, block, &body);
+		if (callee != NULL) {
+			/* if (!CHKFUNC(symbol)) goto slow; */
+			if (!lir_increment_tmpvar(&chk_tmpvar))
+				return false;
+			if (!lir_put_opcode(LOP_CHKFUNC))
+				return false;
+			if (!lir_put_tmpvar((uint16_t)chk_tmpvar))
+				return false;
+			if (!lir_put_string(expr->val.call.func->val.term.term->val.symbol))
+				return false;
+			if (!lir_put_opcode(LOP_JMPIFFALSE))
+				return false;
+			if (!lir_put_tmpvar((uint16_t)chk_tmpvar))
+				return false;
+			slow_addr = bytecode_top;
+			if (!lir_put_imm32(0))
+				return false;
+			lir_decrement_tmpvar(chk_tmpvar);
+
+			/* The inlined body, then goto done. */
+			if (!lir_visit_inline_call(dst_tmpvar, expr, block, callee, body))
+				return false;
+			if (!lir_put_opcode(LOP_JMP))
+				return false;
+			done_addr = bytecode_top;
+			if (!lir_put_imm32(0))
+				return false;
+
+			/* slow: */
+			bytecode[slow_addr] = (uint8_t)((bytecode_top >> 24) & 0xff);
+			bytecode[slow_addr + 1] = (uint8_t)((bytecode_top >> 16) & 0xff);
+			bytecode[slow_addr + 2] = (uint8_t)((bytecode_top >> 8) & 0xff);
+			bytecode[slow_addr + 3] = (uint8_t)(bytecode_top & 0xff);
+		}
+	}
+
 	/* Visit the func expr. */
 	if (!lir_increment_tmpvar(&func_tmpvar))
 		return false;
@@ -1250,7 +1778,7 @@ lir_visit_call_expr(
 	}
 
 	/* Put a bytecode sequence. */
-	if (!lir_put_opcode(LOP_CALL))
+	if (!lir_put_opcode(opcode))
 		return false;
 	if (!lir_put_tmpvar((uint16_t)dst_tmpvar))
 		return false;
@@ -1267,67 +1795,392 @@ lir_visit_call_expr(
 		lir_decrement_tmpvar(arg_tmpvar[i]);
 	lir_decrement_tmpvar(func_tmpvar);
 
+	/* done: */
+	if (done_addr != -1) {
+		bytecode[done_addr] = (uint8_t)((bytecode_top >> 24) & 0xff);
+		bytecode[done_addr + 1] = (uint8_t)((bytecode_top >> 16) & 0xff);
+		bytecode[done_addr + 2] = (uint8_t)((bytecode_top >> 8) & 0xff);
+		bytecode[done_addr + 3] = (uint8_t)(bytecode_top & 0xff);
+	}
+
 	return true;
 }
 
-static bool
-lir_visit_thiscall_expr(
-	int dst_tmpvar,
+/*
+ * Find a function that can be inlined at a call site.
+ *
+ * A callee qualifies if it is a global function of this build whose
+ * body is a single return statement within the size budget, nobody
+ * stores to its name, its free symbols can't resolve to a frame-local
+ * binding of the caller, and it is not on the current inline chain.
+ */
+static struct hir_block *
+lir_find_inline_callee(
 	struct hir_expr *expr,
-	struct hir_block *block)
+	struct hir_block *block,
+	struct hir_stmt **body)
 {
-	int arg_tmpvar[HIR_PARAM_SIZE];
-	int arg_count;
-	int obj_tmpvar;
-	int i;
+	struct hir_block *caller, *callee, *b;
+	struct hir_local *local;
+	struct hir_stmt *stmt;
+	const char *symbol;
+	int i, func_count;
+
+	/* The func expr must be a plain symbol. */
+	if (expr->val.call.func->type != HIR_EXPR_TERM)
+		return NULL;
+	if (expr->val.call.func->val.term.term->type != HIR_TERM_SYMBOL)
+		return NULL;
+	symbol = expr->val.call.func->val.term.term->val.symbol;
+
+	/* The symbol must not be shadowed by a local variable. */
+	caller = block->parent;
+	while (caller->type != HIR_BLOCK_FUNC)
+		caller = caller->parent;
+	for (local = caller->val.func.local; local != NULL; local = local->next) {
+		if (strcmp(local->symbol, symbol) == 0)
+			return NULL;
+	}
 
-	assert(expr != NULL);
-	assert(expr->type == HIR_EXPR_THISCALL);
-	assert(expr->val.thiscall.func != NULL);
-	assert(expr->val.thiscall.arg_count >= 0);
-	assert(expr->val.thiscall.arg_count < HIR_PARAM_SIZE);
+	/* Search a function by name. */
+	callee = NULL;
+	func_count = hir_get_function_count();
+	for (i = 0; i < func_count; i++) {
+		if (strcmp(hir_get_function(i)->val.func.name, symbol) == 0) {
+			callee = hir_get_function(i);
+			break;
+		}
+	}
+	if (callee == NULL)
+		return NULL;
+
+	/* Exclude recursions. */
+	if (callee == lir_cur_func)
+		return NULL;
+	if (inline_depth >= INLINE_DEPTH_MAX)
+		return NULL;
+	for (i = 0; i < inline_depth; i++) {
+		if (inline_stack[i].func == callee)
+			return NULL;
+	}
 
-	arg_count = expr->val.thiscall.arg_count;
-	
-	/* Visit the object expr. */
-	if (!lir_increment_tmpvar(&obj_tmpvar))
-		return false;
-	if (!lir_visit_expr(obj_tmpvar, expr->val.thiscall.obj, block))
-		return false;
+	/* The arguments must match, and only the params and the return slot are locals. */
+	if (callee->val.func.param_count != expr->val.call.arg_count)
+		return NULL;
+	if (lir_count_local(callee) != callee->val.func.param_count + 1)
+		return NULL;
 
-	/* Visit the arg exprs. */
-	for (i = 0; i < arg_count; i++) {
-		if (!lir_increment_tmpvar(&arg_tmpvar[i]))
-			return false;
-		if (!lir_visit_expr(arg_tmpvar[i], expr->val.thiscall.arg[i], block))
-			return false;
+	/* The body must be a single return statement. */
+	stmt = NULL;
+	b = callee->val.func.inner;
+	while (b != NULL) {
+		if (b->type != HIR_BLOCK_BASIC)
+			return NULL;
+		if (b->val.basic.stmt_list != NULL) {
+			if (stmt != NULL || b->val.basic.stmt_list->next != NULL)
+				return NULL;
+			stmt = b->val.basic.stmt_list;
+		}
+		if (b->stop)
+			break;
+		b = b->succ;
 	}
+	if (stmt == NULL || !lir_is_return_stmt(stmt))
+		return NULL;
+	if (lir_count_expr_size(stmt->rhs) > INLINE_EXPR_BUDGET)
+		return NULL;
 
-	/* Put a bytecode sequence. */
-	if (!lir_put_opcode(LOP_THISCALL))
-		return false;
-	if (!lir_put_tmpvar((uint16_t)dst_tmpvar))
-		return false;
-	if (!lir_put_tmpvar((uint16_t)obj_tmpvar))
-		return false;
-	if (!lir_put_string(expr->val.thiscall.func))
-		return false;
-	if (!lir_put_imm8((uint8_t)arg_count))
-		return false;
-	for (i = 0; i < arg_count; i++) {
-		if (!lir_put_tmpvar((uint16_t)arg_tmpvar[i]))
-			return false;
-	}
+	/* The global binding must never change. */
+	if (lir_is_symbol_stored(symbol))
+		return NULL;
 
-	for (i = arg_count - 1; i >= 0; i--)
-		lir_decrement_tmpvar(arg_tmpvar[i]);
-	lir_decrement_tmpvar(obj_tmpvar);
+	/* Free symbols must not hit the frame-local bindings of the caller. */
+	if (lir_is_free_symbol_bound(stmt->rhs, callee))
+		return NULL;
 
-	return true;
+	*body = stmt;
+	return callee;
 }
 
-static bool
-lir_visit_array_expr(
+/* Count the nodes of an expression. */
+static int
+lir_count_expr_size(
+	struct hir_expr *expr)
+{
+	int size, i;
+
+	if (expr == NULL)
+		return 0;
+
+	size = 1;
+	switch (expr->type) {
+	case HIR_EXPR_TERM:
+		break;
+	case HIR_EXPR_PAR:
+	case HIR_EXPR_NEG:
+		size += lir_count_expr_size(expr->val.unary.expr);
+		break;
+	case HIR_EXPR_DOT:
+		size += lir_count_expr_size(expr->val.dot.obj);
+		break;
+	case HIR_EXPR_CALL:
+		size += lir_count_expr_size(expr->val.call.func);
+		for (i = 0; i < expr->val.call.arg_count; i++)
+			size += lir_count_expr_size(expr->val.call.arg[i]);
+		break;
+	case HIR_EXPR_THISCALL:
+		size += lir_count_expr_size(expr->val.thiscall.obj);
+		for (i = 0; i < expr->val.thiscall.arg_count; i++)
+			size += lir_count_expr_size(expr->val.thiscall.arg[i]);
+		break;
+	case HIR_EXPR_ARRAY:
+		for (i = 0; i < expr->val.array.elem_count; i++)
+			size += lir_count_expr_size(expr->val.array.elem[i]);
+		break;
+	case HIR_EXPR_DICT:
+		for (i = 0; i < expr->val.dict.kv_count; i++)
+			size += lir_count_expr_size(expr->val.dict.value[i]);
+		break;
+	default:
+		size += lir_count_expr_size(expr->val.binary.expr[0]);
+		size += lir_count_expr_size(expr->val.binary.expr[1]);
+		break;
+	}
+
+	return size;
+}
+
+/* Check whether the caller frame may bind a free symbol of an expression. */
+static bool
+lir_is_free_symbol_bound(
+	struct hir_expr *expr,
+	struct hir_block *callee)
+{
+	struct hir_local *local;
+	const char *symbol;
+	int i;
+
+	if (expr == NULL)
+		return false;
+
+	switch (expr->type) {
+	case HIR_EXPR_TERM:
+		if (expr->val.term.term->type != HIR_TERM_SYMBOL)
+			return false;
+		symbol = expr->val.term.term->val.symbol;
+		for (local = callee->val.func.local; local != NULL; local = local->next) {
+			if (strcmp(local->symbol, symbol) == 0)
+				return false;
+		}
+		return lir_is_symbol_stored_in_block(lir_cur_func->val.func.inner, symbol);
+	case HIR_EXPR_PAR:
+	case HIR_EXPR_NEG:
+		return lir_is_free_symbol_bound(expr->val.unary.expr, callee);
+	case HIR_EXPR_DOT:
+		return lir_is_free_symbol_bound(expr->val.dot.obj, callee);
+	case HIR_EXPR_CALL:
+		if (lir_is_free_symbol_bound(expr->val.call.func, callee))
+			return true;
+		for (i = 0; i < expr->val.call.arg_count; i++) {
+			if (lir_is_free_symbol_bound(expr->val.call.arg[i], callee))
+				return true;
+		}
+		return false;
+	case HIR_EXPR_THISCALL:
+		if (lir_is_free_symbol_bound(expr->val.thiscall.obj, callee))
+			return true;
+		for (i = 0; i < expr->val.thiscall.arg_count; i++) {
+			if (lir_is_free_symbol_bound(expr->val.thiscall.arg[i], callee))
+				return true;
+		}
+		return false;
+	case HIR_EXPR_ARRAY:
+		for (i = 0; i < expr->val.array.elem_count; i++) {
+			if (lir_is_free_symbol_bound(expr->val.array.elem[i], callee))
+				return true;
+		}
+		return false;
+	case HIR_EXPR_DICT:
+		for (i = 0; i < expr->val.dict.kv_count; i++) {
+			if (lir_is_free_symbol_bound(expr->val.dict.value[i], callee))
+				return true;
+		}
+		return false;
+	default:
+		if (lir_is_free_symbol_bound(expr->val.binary.expr[0], callee))
+			return true;
+		return lir_is_free_symbol_bound(expr->val.binary.expr[1], callee);
+	}
+}
+
+/* Check whether any function of this build assigns to a symbol. */
+static bool
+lir_is_symbol_stored(
+	const char *symbol)
+{
+	struct hir_block *func;
+	int i, func_count;
+
+	func_count = hir_get_function_count();
+	for (i = 0; i < func_count; i++) {
+		func = hir_get_function(i);
+		if (lir_is_symbol_stored_in_block(func->val.func.inner, symbol))
+			return true;
+	}
+
+	return false;
+}
+
+/* Check whether a block list assigns to a symbol. */
+static bool
+lir_is_symbol_stored_in_block(
+	struct hir_block *block,
+	const char *symbol)
+{
+	struct hir_stmt *stmt;
+	struct hir_block *b;
+
+	b = block;
+	while (b != NULL) {
+		switch (b->type) {
+		case HIR_BLOCK_BASIC:
+			for (stmt = b->val.basic.stmt_list; stmt != NULL; stmt = stmt->next) {
+				if (stmt->lhs != NULL &&
+				    stmt->lhs->type == HIR_EXPR_TERM &&
+				    stmt->lhs->val.term.term->type == HIR_TERM_SYMBOL &&
+				    strcmp(stmt->lhs->val.term.term->val.symbol, symbol) == 0)
+					return true;
+			}
+			break;
+		case HIR_BLOCK_IF:
+			if (lir_is_symbol_stored_in_block(b->val.if_.inner, symbol))
+				return true;
+			if (lir_is_symbol_stored_in_block(b->val.if_.chain_next, symbol))
+				return true;
+			break;
+		case HIR_BLOCK_FOR:
+			if (lir_is_symbol_stored_in_block(b->val.for_.inner, symbol))
+				return true;
+			break;
+		case HIR_BLOCK_WHILE:
+			if (lir_is_symbol_stored_in_block(b->val.while_.inner, symbol))
+				return true;
+			break;
+		default:
+			break;
+		}
+		if (b->stop)
+			break;
+		b = b->succ;
+	}
+
+	return false;
+}
+
+/* Expand a call to a small function in place. */
+static bool
+lir_visit_inline_call(
+	int dst_tmpvar,
+	struct hir_expr *expr,
+	struct hir_block *block,
+	struct hir_block *callee,
+	struct hir_stmt *body)
+{
+	struct inline_frame *frame;
+	struct hir_block *body_block;
+	int arg_tmpvar[HIR_PARAM_SIZE];
+	int arg_count;
+	int i;
+
+	arg_count = expr->val.call.arg_count;
+
+	/* Visit the arg exprs in the caller scope. */
+	for (i = 0; i < arg_count; i++) {
+		if (!lir_increment_tmpvar(&arg_tmpvar[i]))
+			return false;
+		if (!lir_visit_expr(arg_tmpvar[i], expr->val.call.arg[i], block))
+			return false;
+	}
+
+	/* Bind the params of the callee to the argument tmpvars. */
+	frame = &inline_stack[inline_depth++];
+	frame->func = callee;
+	for (i = 0; i < arg_count; i++)
+		frame->tmpvar[i] = arg_tmpvar[i];
+
+	/* Visit the returned expr in the callee scope. */
+	body_block = callee->val.func.inner;
+	while (body_block->val.basic.stmt_list != body)
+		body_block = body_block->succ;
+	if (!lir_visit_expr(dst_tmpvar, body->rhs, body_block))
+		return false;
+
+	inline_depth--;
+
+	for (i = arg_count - 1; i >= 0; i--)
+		lir_decrement_tmpvar(arg_tmpvar[i]);
+
+	return true;
+}
+
+static bool
+lir_visit_thiscall_expr(
+	int dst_tmpvar,
+	struct hir_expr *expr,
+	struct hir_block *block)
+{
+	int arg_tmpvar[HIR_PARAM_SIZE];
+	int arg_count;
+	int obj_tmpvar;
+	int i;
+
+	assert(expr != NULL);
+	assert(expr->type == HIR_EXPR_THISCALL);
+	assert(expr->val.thiscall.func != NULL);
+	assert(expr->val.thiscall.arg_count >= 0);
+	assert(expr->val.thiscall.arg_count < HIR_PARAM_SIZE);
+
+	arg_count = expr->val.thiscall.arg_count;
+	
+	/* Visit the object expr. */
+	if (!lir_increment_tmpvar(&obj_tmpvar))
+		return false;
+	if (!lir_visit_expr(obj_tmpvar, expr->val.thiscall.obj, block))
+		return false;
+
+	/* Visit the arg exprs. */
+	for (i = 0; i < arg_count; i++) {
+		if (!lir_increment_tmpvar(&arg_tmpvar[i]))
+			return false;
+		if (!lir_visit_expr(arg_tmpvar[i], expr->val.thiscall.arg[i], block))
+			return false;
+	}
+
+	/* Put a bytecode sequence. */
+	if (!lir_put_opcode(LOP_THISCALL))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)dst_tmpvar))
+		return false;
+	if (!lir_put_tmpvar((uint16_t)obj_tmpvar))
+		return false;
+	if (!lir_put_string(expr->val.thiscall.func))
+		return false;
+	if (!lir_put_imm8((uint8_t)arg_count))
+		return false;
+	for (i = 0; i < arg_count; i++) {
+		if (!lir_put_tmpvar((uint16_t)arg_tmpvar[i]))
+			return false;
+	}
+
+	for (i = arg_count - 1; i >= 0; i--)
+		lir_decrement_tmpvar(arg_tmpvar[i]);
+	lir_decrement_tmpvar(obj_tmpvar);
+
+	return true;
+}
+
+static bool
+lir_visit_array_expr(
 	int dst_tmpvar,
 	struct hir_expr *expr,
 	struct hir_block *block)
@@ -1517,8 +2370,14 @@ lir_visit_symbol_term(
 			return false;
 		if (!lir_put_tmpvar((uint16_t)dst_tmpvar))
 			return false;
-		if (!lir_put_tmpvar((uint16_t)local->index))
-			return false;
+		if (inline_depth > 0 && inline_stack[inline_depth - 1].func == func) {
+			/* A param of an inlined function. */
+			if (!lir_put_tmpvar((uint16_t)inline_stack[inline_depth - 1].tmpvar[local->index]))
+				return false;
+		} else {
+			if (!lir_put_tmpvar((uint16_t)local->index))
+				return false;
+		}
 	} else {
 		/* The term is not an explicit local variable. */
 		if (!lir_put_opcode(LOP_LOADSYMBOL))
@@ -1796,73 +2655,2193 @@ patch_block_address(void)
 }
 
 /*
- * Free a constructed LIR.
+ * Optimization (-O)
+ *
+ * The bytecode is decoded into instructions and basic blocks, then
+ * rewritten in place.  Jumps to jumps are threaded, unreachable code
+ * is removed, copies made by ASSIGN are propagated into the readers
+ * within a basic block, stores to tmpvars that are never read again
+ * are removed by a liveness analysis, loop-invariant instructions are
+ * moved to loop preheaders, and jumps to the next instruction are
+ * removed.  The remaining instructions are packed and
+ * the branch targets are relocated.  Finally, the packed bytecode is
+ * decoded again, the arithmetic on inferred types is rewritten to the
+ * typed opcodes, the containers that never leave the frame are marked,
+ * and the tmpvars whose live ranges don't overlap are coalesced into
+ * the same slots.
  */
-void
-lir_free(struct lir_func *func)
-{
-	int i;
 
-	assert(func != NULL);
+/* Maximum read operands of an instruction. (callee or object + args) */
+#define OPT_SRC_MAX	(LIR_PARAM_SIZE + 1)
 
-	free(func->func_name);
-	for (i = 0; i < func->param_count; i++)
-		free(func->param_name[i]);
-	free(func->bytecode);
-	memset(func, 0, sizeof(struct lir_func));
-}
+/* Maximum rounds of the dead store elimination. */
+#define OPT_DSE_ROUNDS	4
 
-/*
- * Get a file name.
- */
-const char *
-lir_get_file_name(void)
+/* Maximum instructions of a loop test copied to a preheader. */
+#define OPT_GUARD_MAX	8
+
+/* Decoded instruction. */
+struct opt_insn {
+	/* Offset in the bytecode buffer. */
+	uint32_t offset;
+
+	/* Instruction size. */
+	int size;
+
+	/* Opcode. */
+	uint8_t op;
+
+	/* Relative offset of the written tmpvar. (-1 if none) */
+	int dst_ofs;
+
+	/* Relative offsets of the read tmpvars. */
+	int src_count;
+	int src_ofs[OPT_SRC_MAX];
+
+	/* Relative offset of the branch target. (-1 if none) */
+	int target_ofs;
+
+	/* Basic block index. */
+	int block;
+
+	/* Is removed? */
+	bool removed;
+
+	/* Is moved to the preheader of its loop? */
+	bool hoisted;
+
+	/* Latch index if this is a loop header with a preheader. (-1 if none) */
+	int latch;
+
+	/* Last index of the loop test that is copied to the preheader. */
+	int guard_end;
+};
+
+/* Branch put by the compaction. */
+struct opt_branch {
+	/* Offset in the packed buffer. */
+	uint32_t pos;
+
+	/* Source instruction index. */
+	int insn;
+
+	/* Is a copy in a preheader? */
+	bool copy;
+};
+
+static struct opt_insn *opt_insn;
+static int opt_insn_count;
+
+/* Instruction index by bytecode offset. (-1 if not a boundary) */
+static int *opt_insn_at;
+
+/* Basic blocks. */
+static int opt_block_count;
+static int *opt_block_head;
+
+/* Tmpvar bitset width. */
+static int opt_tmpvar_count;
+static int opt_word_count;
+
+/* Live tmpvars at the entry and the exit of each basic block. */
+static uint32_t *opt_live_in;
+static uint32_t *opt_live_out;
+
+/* Branches in the packed buffer. */
+static struct opt_branch *opt_branch;
+static int opt_branch_count;
+
+static uint16_t
+lir_opt_get_u16(
+	uint32_t pos)
 {
-	return lir_file_name;
+	return (uint16_t)(((uint32_t)bytecode[pos] << 8) | (uint32_t)bytecode[pos + 1]);
 }
 
-/*
- * Get an error line.
- */
-int
-lir_get_error_line(void)
+static void
+lir_opt_set_u16(
+	uint32_t pos,
+	uint16_t val)
 {
-	return lir_error_line;
+	bytecode[pos] = (uint8_t)((val >> 8) & 0xff);
+	bytecode[pos + 1] = (uint8_t)(val & 0xff);
 }
 
-/*
- * Get an error message.
- */
-const char *
-lir_get_error_message(void)
+static uint32_t
+lir_opt_get_u32(
+	uint32_t pos)
 {
-	return lir_error_message;
+	return ((uint32_t)bytecode[pos] << 24) |
+	       ((uint32_t)bytecode[pos + 1] << 16) |
+	       ((uint32_t)bytecode[pos + 2] << 8) |
+	       (uint32_t)bytecode[pos + 3];
 }
 
-/* Set an error message. */
 static void
-lir_fatal(
-	const char *msg,
-	...)
+lir_opt_set_u32(
+	uint8_t *buf,
+	uint32_t pos,
+	uint32_t val)
 {
-	va_list ap;
-
-	va_start(ap, msg);
-	vsnprintf(lir_error_message,
-		  sizeof(lir_error_message),
-		  msg,
-		  ap);
-	va_end(ap);
+	buf[pos] = (uint8_t)((val >> 24) & 0xff);
+	buf[pos + 1] = (uint8_t)((val >> 16) & 0xff);
+	buf[pos + 2] = (uint8_t)((val >> 8) & 0xff);
+	buf[pos + 3] = (uint8_t)(val & 0xff);
 }
 
-/* Set an out-of-memory error message. */
-static void
-lir_out_of_memory(void)
+/* Get a string length at a bytecode offset. */
+static int
+lir_opt_strlen(
+	uint32_t pos)
 {
-	snprintf(lir_error_message,
-		 sizeof(lir_error_message),
-		 "%s",
-		 _("LIR: Out of memory error."));
+	return (int)strlen((const char *)&bytecode[pos]);
+}
+
+/* Decode an instruction. Returns false for an unknown instruction. */
+static bool
+lir_opt_decode(
+	uint32_t offset,
+	struct opt_insn *insn)
+{
+	int len, arg_count, i;
+
+	insn->offset = offset;
+	insn->op = bytecode[offset];
+	insn->dst_ofs = -1;
+	insn->src_count = 0;
+	insn->target_ofs = -1;
+	insn->block = -1;
+	insn->removed = false;
+	insn->hoisted = false;
+	insn->latch = -1;
+	insn->guard_end = -1;
+
+	switch (insn->op) {
+	case LOP_NOP:
+		insn->size = 1;
+		break;
+	case LOP_ASSIGN:
+	case LOP_NEG:
+	case LOP_LEN:
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		insn->size = 5;
+		break;
+	case LOP_ICONST:
+	case LOP_FCONST:
+		insn->dst_ofs = 1;
+		insn->size = 7;
+		break;
+	case LOP_SCONST:
+		insn->dst_ofs = 1;
+		insn->size = 3 + lir_opt_strlen(offset + 3) + 1;
+		break;
+	case LOP_ACONST:
+	case LOP_DCONST:
+	case LOP_LACONST:
+	case LOP_LDCONST:
+		insn->dst_ofs = 1;
+		insn->size = 3;
+		break;
+	case LOP_INC:
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 1;
+		insn->size = 3;
+		break;
+	case LOP_ADD:
+	case LOP_SUB:
+	case LOP_MUL:
+	case LOP_DIV:
+	case LOP_MOD:
+	case LOP_AND:
+	case LOP_OR:
+	case LOP_XOR:
+	case LOP_LT:
+	case LOP_LTE:
+	case LOP_GT:
+	case LOP_GTE:
+	case LOP_EQ:
+	case LOP_NEQ:
+	case LOP_EQI:
+	case LOP_IADD:
+	case LOP_ISUB:
+	case LOP_IMUL:
+	case LOP_ILT:
+	case LOP_ILTE:
+	case LOP_IGT:
+	case LOP_IGTE:
+	case LOP_IEQ:
+	case LOP_INEQ:
+	case LOP_FADD:
+	case LOP_FSUB:
+	case LOP_FMUL:
+	case LOP_FDIV:
+	case LOP_FLT:
+	case LOP_FLTE:
+	case LOP_FGT:
+	case LOP_FGTE:
+	case LOP_FEQ:
+	case LOP_FNEQ:
+	case LOP_LOADARRAY:
+	case LOP_GETDICTKEYBYINDEX:
+	case LOP_GETDICTVALBYINDEX:
+	case LOP_ULOADARRAY:
+	case LOP_UGETDICTVALBYINDEX:
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		insn->src_ofs[insn->src_count++] = 5;
+		insn->size = 7;
+		break;
+	case LOP_STOREARRAY:
+		insn->src_ofs[insn->src_count++] = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		insn->src_ofs[insn->src_count++] = 5;
+		insn->size = 7;
+		break;
+	case LOP_STOREDOT:
+		len = lir_opt_strlen(offset + 3);
+		insn->src_ofs[insn->src_count++] = 1;
+		insn->src_ofs[insn->src_count++] = 3 + len + 1;
+		insn->size = 3 + len + 1 + 2;
+		break;
+	case LOP_LOADDOT:
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		insn->size = 5 + lir_opt_strlen(offset + 5) + 1;
+		break;
+	case LOP_STORESYMBOL:
+		len = lir_opt_strlen(offset + 1);
+		insn->src_ofs[insn->src_count++] = 1 + len + 1;
+		insn->size = 1 + len + 1 + 2;
+		break;
+	case LOP_LOADSYMBOL:
+	case LOP_CHKFUNC:
+		insn->dst_ofs = 1;
+		insn->size = 3 + lir_opt_strlen(offset + 3) + 1;
+		break;
+	case LOP_CALL:
+	case LOP_TAILCALL:
+		arg_count = bytecode[offset + 5];
+		if (arg_count > LIR_PARAM_SIZE)
+			return false;
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		for (i = 0; i < arg_count; i++)
+			insn->src_ofs[insn->src_count++] = 6 + i * 2;
+		insn->size = 6 + arg_count * 2;
+		break;
+	case LOP_THISCALL:
+		len = lir_opt_strlen(offset + 5);
+		arg_count = bytecode[offset + 5 + (uint32_t)len + 1];
+		if (arg_count > LIR_PARAM_SIZE)
+			return false;
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		for (i = 0; i < arg_count; i++)
+			insn->src_ofs[insn->src_count++] = 5 + len + 2 + i * 2;
+		insn->size = 5 + len + 2 + arg_count * 2;
+		break;
+	case LOP_JMP:
+		insn->target_ofs = 1;
+		insn->size = 5;
+		break;
+	case LOP_JMPIFTRUE:
+	case LOP_JMPIFFALSE:
+	case LOP_JMPIFEQ:
+		insn->src_ofs[insn->src_count++] = 1;
+		insn->target_ofs = 3;
+		insn->size = 7;
+		break;
+	case LOP_LINEINFO:
+		insn->size = 5;
+		break;
+	case LOP_SWITCH:
+		len = lir_opt_get_u16(offset + 5);
+		if (len < LIR_SWITCH_HEADER_SIZE)
+			return false;
+		insn->dst_ofs = 1;
+		insn->src_ofs[insn->src_count++] = 3;
+		insn->size = 3 + len;
+		break;
+	default:
+		return false;
+	}
+
+	if (offset + (uint32_t)insn->size > (uint32_t)bytecode_top)
+		return false;
+
+	return true;
+}
+
+/* Get a tmpvar operand. */
+static int
+lir_opt_get_tmpvar(
+	struct opt_insn *insn,
+	int ofs)
+{
+	return lir_opt_get_u16(insn->offset + (uint32_t)ofs);
+}
+
+/* Get a branch target. */
+static uint32_t
+lir_opt_get_target(
+	struct opt_insn *insn)
+{
+	return lir_opt_get_u32(insn->offset + (uint32_t)insn->target_ofs);
+}
+
+/* Get an instruction index of a branch target. (opt_insn_count for the end) */
+static int
+lir_opt_get_target_insn(
+	struct opt_insn *insn)
+{
+	uint32_t target;
+
+	target = lir_opt_get_target(insn);
+	if (target == (uint32_t)bytecode_top)
+		return opt_insn_count;
+
+	return opt_insn_at[target];
+}
+
+/* Get a first kept instruction at or after an index. */
+static int
+lir_opt_next_kept(
+	int index)
+{
+	while (index < opt_insn_count && opt_insn[index].removed)
+		index++;
+
+	return index;
+}
+
+/* Get successor instruction indices. */
+static int
+lir_opt_get_succ(
+	int index,
+	int *succ)
+{
+	struct opt_insn *insn;
+
+	insn = &opt_insn[index];
+	switch (insn->op) {
+	case LOP_JMP:
+		succ[0] = lir_opt_next_kept(lir_opt_get_target_insn(insn));
+		return 1;
+	case LOP_JMPIFTRUE:
+	case LOP_JMPIFFALSE:
+	case LOP_JMPIFEQ:
+		succ[0] = lir_opt_next_kept(index + 1);
+		succ[1] = lir_opt_next_kept(lir_opt_get_target_insn(insn));
+		return 2;
+	default:
+		succ[0] = lir_opt_next_kept(index + 1);
+		return 1;
+	}
+}
+
+/* Get successor instruction indices of a basic block. */
+static int
+lir_opt_get_block_succ(
+	int block,
+	int *succ)
+{
+	int end, last;
+
+	end = block + 1 < opt_block_count ? opt_block_head[block + 1] : opt_insn_count;
+	last = end - 1;
+	while (last >= opt_block_head[block] && opt_insn[last].removed)
+		last--;
+
+	/* An emptied block falls through. */
+	if (last < opt_block_head[block]) {
+		succ[0] = lir_opt_next_kept(end);
+		return 1;
+	}
+
+	return lir_opt_get_succ(last, succ);
+}
+
+/* Check whether a range of the bytecode buffer has no call. */
+static bool
+lir_is_call_free(
+	uint32_t start,
+	uint32_t end)
+{
+	struct opt_insn insn;
+	uint32_t pc;
+
+	for (pc = start; pc < end; pc += (uint32_t)insn.size) {
+		if (!lir_opt_decode(pc, &insn))
+			return false;
+		if (insn.op == LOP_CALL || insn.op == LOP_THISCALL ||
+		    insn.op == LOP_TAILCALL)
+			return false;
+	}
+
+	return true;
+}
+
+/* Decode the bytecode buffer. Returns false on an allocation failure. */
+static bool
+lir_opt_decode_all(
+	bool *valid)
+{
+	struct opt_insn insn;
+	uint32_t pc, target;
+	int i;
+
+	*valid = false;
+
+	/* Count the instructions. */
+	opt_insn_count = 0;
+	pc = 0;
+	while (pc < (uint32_t)bytecode_top) {
+		if (!lir_opt_decode(pc, &insn))
+			return true;
+		pc += (uint32_t)insn.size;
+		opt_insn_count++;
+	}
+
+	opt_insn = malloc(sizeof(struct opt_insn) * (size_t)(opt_insn_count + 1));
+	opt_insn_at = malloc(sizeof(int) * (size_t)(bytecode_top + 1));
+	if (opt_insn == NULL || opt_insn_at == NULL)
+		return false;
+	for (i = 0; i <= bytecode_top; i++)
+		opt_insn_at[i] = -1;
+
+	/* Decode the instructions. */
+	pc = 0;
+	for (i = 0; i < opt_insn_count; i++) {
+		lir_opt_decode(pc, &opt_insn[i]);
+		opt_insn_at[pc] = i;
+		pc += (uint32_t)opt_insn[i].size;
+	}
+
+	/* Branch targets must be instruction boundaries. */
+	for (i = 0; i < opt_insn_count; i++) {
+		if (opt_insn[i].target_ofs < 0)
+			continue;
+		target = lir_opt_get_target(&opt_insn[i]);
+		if (target > (uint32_t)bytecode_top)
+			return true;
+		if (target < (uint32_t)bytecode_top && opt_insn_at[target] == -1)
+			return true;
+	}
+
+	*valid = true;
+
+	return true;
+}
+
+/* Retarget branches that jump to a JMP. */
+static void
+lir_opt_thread_jumps(void)
+{
+	struct opt_insn *insn;
+	int i, j, hop;
+
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+		if (insn->target_ofs < 0)
+			continue;
+
+		/* Follow a chain of jumps. (Cycles are cut by the hop count.) */
+		j = lir_opt_get_target_insn(insn);
+		for (hop = 0; hop < opt_insn_count; hop++) {
+			if (j == opt_insn_count || j == i || opt_insn[j].op != LOP_JMP)
+				break;
+			j = lir_opt_get_target_insn(&opt_insn[j]);
+		}
+
+		lir_opt_set_u32(bytecode,
+				insn->offset + (uint32_t)insn->target_ofs,
+				j == opt_insn_count ? (uint32_t)bytecode_top : opt_insn[j].offset);
+	}
+}
+
+/* Remove instructions that are not reachable from the entry. */
+static bool
+lir_opt_remove_unreachable(void)
+{
+	int *stack;
+	int sp, i, n, succ[2];
+
+	stack = malloc(sizeof(int) * (size_t)(opt_insn_count + 1));
+	if (stack == NULL)
+		return false;
+
+	for (i = 0; i < opt_insn_count; i++)
+		opt_insn[i].removed = true;
+
+	sp = 0;
+	if (opt_insn_count > 0) {
+		opt_insn[0].removed = false;
+		stack[sp++] = 0;
+	}
+	while (sp > 0) {
+		i = stack[--sp];
+
+		/* All instructions are marked removed here, so walk the raw successors. */
+		switch (opt_insn[i].op) {
+		case LOP_JMP:
+			succ[0] = lir_opt_get_target_insn(&opt_insn[i]);
+			n = 1;
+			break;
+		case LOP_JMPIFTRUE:
+		case LOP_JMPIFFALSE:
+		case LOP_JMPIFEQ:
+			succ[0] = i + 1;
+			succ[1] = lir_opt_get_target_insn(&opt_insn[i]);
+			n = 2;
+			break;
+		default:
+			succ[0] = i + 1;
+			n = 1;
+			break;
+		}
+		while (n-- > 0) {
+			if (succ[n] < opt_insn_count && opt_insn[succ[n]].removed) {
+				opt_insn[succ[n]].removed = false;
+				stack[sp++] = succ[n];
+			}
+		}
+	}
+
+	free(stack);
+
+	return true;
+}
+
+/* Split the kept instructions into basic blocks. */
+static bool
+lir_opt_build_blocks(void)
+{
+	bool *leader;
+	int i, n, succ[2];
+
+	leader = calloc((size_t)(opt_insn_count + 1), sizeof(bool));
+	opt_block_head = malloc(sizeof(int) * (size_t)(opt_insn_count + 1));
+	if (leader == NULL || opt_block_head == NULL) {
+		free(leader);
+		return false;
+	}
+
+	/* Mark the leaders. */
+	leader[lir_opt_next_kept(0)] = true;
+	for (i = 0; i < opt_insn_count; i++) {
+		if (opt_insn[i].removed || opt_insn[i].target_ofs < 0)
+			continue;
+		n = lir_opt_get_succ(i, succ);
+		while (n-- > 0)
+			leader[succ[n]] = true;
+	}
+
+	/* Number the blocks. */
+	opt_block_count = 0;
+	for (i = 0; i < opt_insn_count; i++) {
+		if (opt_insn[i].removed)
+			continue;
+		if (leader[i])
+			opt_block_head[opt_block_count++] = i;
+		opt_insn[i].block = opt_block_count - 1;
+	}
+
+	free(leader);
+
+	return true;
+}
+
+/* Replace reads of ASSIGN copies with their sources within each basic block. */
+static bool
+lir_opt_propagate_copies(void)
+{
+	struct opt_insn *insn;
+	int *copy_of, *active;
+	int active_count, i, j, k, r, w;
+
+	copy_of = malloc(sizeof(int) * (size_t)(opt_tmpvar_count + 1));
+	active = malloc(sizeof(int) * (size_t)(opt_tmpvar_count + 1));
+	if (copy_of == NULL || active == NULL) {
+		free(copy_of);
+		free(active);
+		return false;
+	}
+	for (i = 0; i <= opt_tmpvar_count; i++)
+		copy_of[i] = -1;
+
+	active_count = 0;
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+
+		/* Forget the copies at a block boundary. */
+		if (opt_block_head[insn->block] == i) {
+			for (j = 0; j < active_count; j++)
+				copy_of[active[j]] = -1;
+			active_count = 0;
+		}
+
+		/* Rewrite the reads. (INC reads and writes the same operand.) */
+		for (k = 0; k < insn->src_count; k++) {
+			if (insn->src_ofs[k] == insn->dst_ofs)
+				continue;
+			r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+			if (r <= opt_tmpvar_count && copy_of[r] != -1)
+				lir_opt_set_u16(insn->offset + (uint32_t)insn->src_ofs[k], (uint16_t)copy_of[r]);
+		}
+
+		if (insn->dst_ofs < 0)
+			continue;
+
+		/* Kill the copies from and to the written tmpvar. */
+		w = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+		for (j = 0; j < active_count; j++) {
+			if (active[j] == w || copy_of[active[j]] == w) {
+				copy_of[active[j]] = -1;
+				active[j--] = active[--active_count];
+			}
+		}
+
+		/* Record a new copy. */
+		if (insn->op == LOP_ASSIGN) {
+			r = lir_opt_get_tmpvar(insn, insn->src_ofs[0]);
+			if (r == w) {
+				insn->removed = true;
+			} else if (w <= opt_tmpvar_count && r <= opt_tmpvar_count) {
+				copy_of[w] = r;
+				active[active_count++] = w;
+			}
+		}
+	}
+
+	free(copy_of);
+	free(active);
+
+	return true;
+}
+
+/* Check whether an instruction has no effect other than writing dst. */
+static bool
+lir_opt_is_pure(
+	struct opt_insn *insn)
+{
+	switch (insn->op) {
+	case LOP_ASSIGN:
+	case LOP_ICONST:
+	case LOP_FCONST:
+	case LOP_SCONST:
+	case LOP_ACONST:
+	case LOP_DCONST:
+	case LOP_LACONST:
+	case LOP_LDCONST:
+		return true;
+	default:
+		return false;
+	}
+}
+
+#define OPT_BIT_TEST(set, i)	((set)[(i) / 32] & (1u << ((i) % 32)))
+#define OPT_BIT_SET(set, i)	((set)[(i) / 32] |= (1u << ((i) % 32)))
+#define OPT_BIT_CLEAR(set, i)	((set)[(i) / 32] &= ~(1u << ((i) % 32)))
+
+/* Solve the liveness of the tmpvars at the block boundaries. */
+static bool
+lir_opt_solve_liveness(
+	int ret_tmpvar)
+{
+	struct opt_insn *insn;
+	uint32_t *use, *def, *in, *out, word;
+	int b, i, k, n, r, succ[2];
+	bool changed;
+
+	free(opt_live_in);
+	free(opt_live_out);
+	opt_live_in = NULL;
+	opt_live_out = NULL;
+
+	use = calloc((size_t)(opt_block_count * opt_word_count), sizeof(uint32_t));
+	def = calloc((size_t)(opt_block_count * opt_word_count), sizeof(uint32_t));
+	in = calloc((size_t)(opt_block_count * opt_word_count), sizeof(uint32_t));
+	out = calloc((size_t)(opt_block_count * opt_word_count), sizeof(uint32_t));
+	if (use == NULL || def == NULL || in == NULL || out == NULL) {
+		free(use);
+		free(def);
+		free(in);
+		free(out);
+		return false;
+	}
+
+	/* Collect the upward-exposed reads and the writes of each block. */
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+		b = insn->block;
+		for (k = 0; k < insn->src_count; k++) {
+			r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+			if (r <= opt_tmpvar_count && !OPT_BIT_TEST(&def[b * opt_word_count], r))
+				OPT_BIT_SET(&use[b * opt_word_count], r);
+		}
+		if (insn->dst_ofs >= 0) {
+			r = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+			if (r <= opt_tmpvar_count)
+				OPT_BIT_SET(&def[b * opt_word_count], r);
+		}
+	}
+
+	/* Iterate to the fixed point. The return value slot is read after the end. */
+	do {
+		changed = false;
+		for (b = opt_block_count - 1; b >= 0; b--) {
+			/* out = union of successor ins. */
+			n = lir_opt_get_block_succ(b, succ);
+			while (n-- > 0) {
+				for (k = 0; k < opt_word_count; k++) {
+					if (succ[n] == opt_insn_count) {
+						word = 0;
+						if (k == ret_tmpvar / 32)
+							word = 1u << (ret_tmpvar % 32);
+					} else {
+						word = in[opt_insn[succ[n]].block * opt_word_count + k];
+					}
+					out[b * opt_word_count + k] |= word;
+				}
+			}
+
+			/* in = use | (out & ~def) */
+			for (k = 0; k < opt_word_count; k++) {
+				word = use[b * opt_word_count + k] |
+				       (out[b * opt_word_count + k] & ~def[b * opt_word_count + k]);
+				if (word != in[b * opt_word_count + k]) {
+					in[b * opt_word_count + k] = word;
+					changed = true;
+				}
+			}
+		}
+	} while (changed);
+
+	free(use);
+	free(def);
+	opt_live_in = in;
+	opt_live_out = out;
+
+	return true;
+}
+
+/* Remove the pure instructions whose results are never read. */
+static bool
+lir_opt_remove_dead_stores(
+	int ret_tmpvar,
+	bool *progress)
+{
+	struct opt_insn *insn;
+	uint32_t *live;
+	int b, i, k, r, end;
+
+	if (!lir_opt_solve_liveness(ret_tmpvar))
+		return false;
+
+	live = calloc((size_t)opt_word_count, sizeof(uint32_t));
+	if (live == NULL)
+		return false;
+
+	/* Walk each block backward and remove the dead writes. */
+	for (b = 0; b < opt_block_count; b++) {
+		memcpy(live, &opt_live_out[b * opt_word_count], sizeof(uint32_t) * (size_t)opt_word_count);
+		end = b + 1 < opt_block_count ? opt_block_head[b + 1] : opt_insn_count;
+		for (i = end - 1; i >= opt_block_head[b]; i--) {
+			insn = &opt_insn[i];
+			if (insn->removed)
+				continue;
+			if (insn->dst_ofs >= 0) {
+				r = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+				if (r <= opt_tmpvar_count) {
+					if (lir_opt_is_pure(insn) && !OPT_BIT_TEST(live, r)) {
+						insn->removed = true;
+						*progress = true;
+						continue;
+					}
+					OPT_BIT_CLEAR(live, r);
+				}
+			}
+			for (k = 0; k < insn->src_count; k++) {
+				r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+				if (r <= opt_tmpvar_count)
+					OPT_BIT_SET(live, r);
+			}
+		}
+	}
+
+	free(live);
+
+	return true;
+}
+
+/* Remove the JMPs to the next kept instruction. */
+static void
+lir_opt_remove_jumps_to_next(void)
+{
+	int i;
+
+	for (i = opt_insn_count - 1; i >= 0; i--) {
+		if (opt_insn[i].removed || opt_insn[i].op != LOP_JMP)
+			continue;
+		if (lir_opt_next_kept(lir_opt_get_target_insn(&opt_insn[i])) == lir_opt_next_kept(i + 1))
+			opt_insn[i].removed = true;
+	}
+}
+
+/* Check whether an instruction may change anything other than its dst. */
+static bool
+lir_opt_has_side_effect(
+	struct opt_insn *insn)
+{
+	switch (insn->op) {
+	case LOP_STOREARRAY:
+	case LOP_STOREDOT:
+	case LOP_STORESYMBOL:
+	case LOP_CALL:
+	case LOP_THISCALL:
+	case LOP_TAILCALL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Check whether an instruction computes its dst only from its operands. */
+static bool
+lir_opt_is_hoistable(
+	struct opt_insn *insn,
+	bool *may_fail)
+{
+	switch (insn->op) {
+	case LOP_ASSIGN:
+	case LOP_ICONST:
+	case LOP_FCONST:
+	case LOP_SCONST:
+		*may_fail = false;
+		return true;
+	case LOP_NEG:
+	case LOP_ADD:
+	case LOP_SUB:
+	case LOP_MUL:
+	case LOP_DIV:
+	case LOP_MOD:
+	case LOP_AND:
+	case LOP_OR:
+	case LOP_XOR:
+	case LOP_LT:
+	case LOP_LTE:
+	case LOP_GT:
+	case LOP_GTE:
+	case LOP_EQ:
+	case LOP_NEQ:
+	case LOP_EQI:
+	case LOP_LOADARRAY:
+	case LOP_LEN:
+	case LOP_LOADDOT:
+	case LOP_LOADSYMBOL:
+		*may_fail = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Check whether a loop has a single entry, a single latch and no inner loop. */
+static bool
+lir_opt_is_simple_loop(
+	int head,
+	int latch)
+{
+	int i, t;
+
+	if (opt_insn[head].latch != -1)
+		return false;
+
+	for (i = 0; i < opt_insn_count; i++) {
+		if (opt_insn[i].removed || opt_insn[i].target_ofs < 0)
+			continue;
+		t = lir_opt_next_kept(lir_opt_get_target_insn(&opt_insn[i]));
+		if (i >= head && i <= latch) {
+			/* Another back-edge inside. */
+			if (i != latch && t <= i)
+				return false;
+		} else {
+			/* A side entry or another latch. */
+			if (t > head && t <= latch)
+				return false;
+			if (t == head && i > latch)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Find the loop test that exits a loop, and check that it can be copied. */
+static int
+lir_opt_find_guard(
+	int head,
+	int latch)
+{
+	struct opt_insn *insn;
+	bool may_fail;
+	int i, j, k, n, w;
+
+	n = 0;
+	for (i = head; i < latch; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+		if (++n > OPT_GUARD_MAX)
+			return -1;
+
+		/* The first branch must leave the loop. */
+		if (insn->target_ofs >= 0) {
+			if (insn->op == LOP_JMP)
+				return -1;
+			if (lir_opt_next_kept(lir_opt_get_target_insn(insn)) <= latch)
+				return -1;
+			return i;
+		}
+
+		/* The copy runs once more, so it must not feed itself. */
+		if (!lir_opt_is_hoistable(insn, &may_fail))
+			return -1;
+		w = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+		for (j = head; j <= i; j++) {
+			if (opt_insn[j].removed)
+				continue;
+			for (k = 0; k < opt_insn[j].src_count; k++) {
+				if (lir_opt_get_tmpvar(&opt_insn[j], opt_insn[j].src_ofs[k]) == w)
+					return -1;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/* Check whether a loop stores to a symbol, or to a field if field is not NULL. */
+static bool
+lir_opt_is_stored_in_loop(
+	int head,
+	int latch,
+	uint8_t op,
+	const char *name)
+{
+	struct opt_insn *insn;
+	const char *s;
+	int i;
+
+	for (i = head; i <= latch; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed || insn->op != op)
+			continue;
+		if (op == LOP_STORESYMBOL)
+			s = (const char *)&bytecode[insn->offset + 1];
+		else
+			s = (const char *)&bytecode[insn->offset + 3];
+		if (strcmp(s, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* Rename the dst of an instruction if its reads end within the basic block. */
+static bool
+lir_opt_rename_dst(
+	int index,
+	int latch,
+	int *write_count,
+	int *writer)
+{
+	struct opt_insn *insn;
+	int i, j, k, w, n, block;
+	bool closed;
+
+	if (tmpvar_count + 1 >= TMPVAR_MAX)
+		return false;
+
+	/* Find the reads up to the next write in the block. */
+	w = lir_opt_get_tmpvar(&opt_insn[index], opt_insn[index].dst_ofs);
+	block = opt_insn[index].block;
+	closed = false;
+	for (i = index + 1; i <= latch; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+		if (insn->block != block)
+			break;
+		if (insn->dst_ofs >= 0 && lir_opt_get_tmpvar(insn, insn->dst_ofs) == w) {
+			/* INC reads and writes the same operand. */
+			for (k = 0; k < insn->src_count; k++) {
+				if (insn->src_ofs[k] == insn->dst_ofs)
+					return false;
+			}
+			closed = true;
+			break;
+		}
+	}
+	if (!closed && OPT_BIT_TEST(&opt_live_out[block * opt_word_count], w))
+		return false;
+
+	/* Rewrite the dst and the reads. */
+	n = ++tmpvar_count;
+	lir_opt_set_u16(opt_insn[index].offset + (uint32_t)opt_insn[index].dst_ofs, (uint16_t)n);
+	for (j = index + 1; j < i; j++) {
+		insn = &opt_insn[j];
+		if (insn->removed)
+			continue;
+		for (k = 0; k < insn->src_count; k++) {
+			if (lir_opt_get_tmpvar(insn, insn->src_ofs[k]) == w)
+				lir_opt_set_u16(insn->offset + (uint32_t)insn->src_ofs[k], (uint16_t)n);
+		}
+	}
+	if (closed) {
+		insn = &opt_insn[i];
+		for (k = 0; k < insn->src_count; k++) {
+			if (lir_opt_get_tmpvar(insn, insn->src_ofs[k]) == w)
+				lir_opt_set_u16(insn->offset + (uint32_t)insn->src_ofs[k], (uint16_t)n);
+		}
+	}
+
+	write_count[w]--;
+	write_count[n] = 1;
+	writer[n] = index;
+
+	return true;
+}
+
+/* Hoist the invariant instructions of a loop. Returns the count. */
+static int
+lir_opt_hoist_loop(
+	int head,
+	int latch,
+	int guard,
+	int *write_count,
+	int *writer)
+{
+	struct opt_insn *insn;
+	const char *name;
+	bool has_call, has_store_array, has_store_dot, side_effect, may_fail, ok;
+	int i, k, r, t, w, reach, count;
+
+	/* Summarize the writes of the loop. */
+	memset(write_count, 0, sizeof(int) * (TMPVAR_MAX + 1));
+	has_call = false;
+	has_store_array = false;
+	has_store_dot = false;
+	for (i = head; i <= latch; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+		if (insn->op == LOP_CALL || insn->op == LOP_THISCALL ||
+		    insn->op == LOP_TAILCALL)
+			has_call = true;
+		if (insn->op == LOP_STOREARRAY)
+			has_store_array = true;
+		if (insn->op == LOP_STOREDOT)
+			has_store_dot = true;
+		if (insn->dst_ofs >= 0) {
+			w = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+			if (w <= opt_tmpvar_count) {
+				write_count[w]++;
+				writer[w] = i;
+			}
+		}
+	}
+
+	/* Walk the body after the loop test. */
+	count = 0;
+	reach = guard;
+	side_effect = false;
+	for (i = guard + 1; i < latch; i++) {
+		insn = &opt_insn[i];
+		if (insn->removed)
+			continue;
+
+		/* Is this executed on every iteration? */
+		ok = reach <= i;
+
+		/* Stay behind a side effect if this may fail. */
+		if (ok && !lir_opt_is_hoistable(insn, &may_fail))
+			ok = false;
+		if (ok && may_fail && side_effect)
+			ok = false;
+
+		/* The JIT branches on the flags of the EQI before a JMPIFEQ. */
+		if (ok && insn->op == LOP_EQI)
+			ok = false;
+
+		/* The operands must be invariant. */
+		for (k = 0; ok && k < insn->src_count; k++) {
+			r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+			if (r > tmpvar_count)
+				ok = false;
+			else if (write_count[r] != 0 && !opt_insn[writer[r]].hoisted)
+				ok = false;
+		}
+
+		/*
+		 * Calls and stores to a container invalidate the loads. A
+		 * callee may be in another source and assign any global.
+		 */
+		if (ok) {
+			switch (insn->op) {
+			case LOP_LOADSYMBOL:
+				name = (const char *)&bytecode[insn->offset + 3];
+				if (has_call)
+					ok = false;
+				else if (lir_opt_is_stored_in_loop(head, latch, LOP_STORESYMBOL, name))
+					ok = false;
+				break;
+			case LOP_LOADDOT:
+				name = (const char *)&bytecode[insn->offset + 5];
+				if (has_call || has_store_array)
+					ok = false;
+				else if (lir_opt_is_stored_in_loop(head, latch, LOP_STOREDOT, name))
+					ok = false;
+				break;
+			case LOP_LEN:
+			case LOP_LOADARRAY:
+				if (has_call || has_store_array || has_store_dot)
+					ok = false;
+				break;
+			default:
+				break;
+			}
+		}
+
+		/*
+		 * The dst must be written only here and not read before.
+		 * Otherwise, the result is renamed to a fresh tmpvar.
+		 */
+		if (ok) {
+			w = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+			if (w > opt_tmpvar_count)
+				ok = false;
+			else if (write_count[w] != 1 ||
+				 OPT_BIT_TEST(&opt_live_in[opt_insn[head].block * opt_word_count], w))
+				ok = lir_opt_rename_dst(i, latch, write_count, writer);
+		}
+
+		if (ok) {
+			insn->hoisted = true;
+			count++;
+			continue;
+		}
+
+		if (lir_opt_has_side_effect(insn))
+			side_effect = true;
+
+		/* A forward branch skips the instructions up to its target. */
+		if (insn->target_ofs >= 0) {
+			t = lir_opt_next_kept(lir_opt_get_target_insn(insn));
+			if (t > latch)
+				t = opt_insn_count;
+			if (t > reach)
+				reach = t;
+		}
+	}
+
+	return count;
+}
+
+/* Move the loop-invariant instructions of the innermost loops to preheaders. */
+static bool
+lir_opt_hoist_invariants(
+	int ret_tmpvar)
+{
+	int *write_count, *writer;
+	int latch, head, guard, i, size, grow;
+
+	if (!lir_opt_solve_liveness(ret_tmpvar))
+		return false;
+
+	write_count = malloc(sizeof(int) * (TMPVAR_MAX + 1));
+	writer = malloc(sizeof(int) * (TMPVAR_MAX + 1));
+	if (write_count == NULL || writer == NULL) {
+		free(write_count);
+		free(writer);
+		return false;
+	}
+
+	grow = 0;
+	for (latch = 0; latch < opt_insn_count; latch++) {
+		/* Find a back-edge. */
+		if (opt_insn[latch].removed || opt_insn[latch].op != LOP_JMP)
+			continue;
+		head = lir_opt_next_kept(lir_opt_get_target_insn(&opt_insn[latch]));
+		if (head > latch)
+			continue;
+		if (!lir_opt_is_simple_loop(head, latch))
+			continue;
+
+		/* The preheader repeats the loop test so that a zero-trip loop runs nothing. */
+		guard = lir_opt_find_guard(head, latch);
+		if (guard < 0)
+			continue;
+		size = 0;
+		for (i = head; i <= guard; i++) {
+			if (!opt_insn[i].removed)
+				size += opt_insn[i].size;
+		}
+		if (bytecode_top + grow + size > BYTECODE_BUF_SIZE)
+			continue;
+
+		if (lir_opt_hoist_loop(head, latch, guard, write_count, writer) > 0) {
+			opt_insn[head].latch = latch;
+			opt_insn[head].guard_end = guard;
+			grow += size;
+		}
+	}
+
+	free(write_count);
+	free(writer);
+
+	return true;
+}
+
+/* Put an instruction to the packed buffer. */
+static void
+lir_opt_put_insn(
+	uint8_t *buf,
+	uint32_t *pos,
+	int index,
+	bool copy)
+{
+	assert(*pos + (uint32_t)opt_insn[index].size <= BYTECODE_BUF_SIZE);
+
+	if (opt_insn[index].target_ofs >= 0) {
+		opt_branch[opt_branch_count].pos = *pos;
+		opt_branch[opt_branch_count].insn = index;
+		opt_branch[opt_branch_count].copy = copy;
+		opt_branch_count++;
+	}
+
+	memcpy(&buf[*pos], &bytecode[opt_insn[index].offset], (size_t)opt_insn[index].size);
+	*pos += (uint32_t)opt_insn[index].size;
+}
+
+/* Pack the kept instructions and relocate the branch targets. */
+static bool
+lir_opt_compact(void)
+{
+	struct opt_insn *insn;
+	uint8_t *buf;
+	uint32_t *new_offset, *pre_offset, pos, addr;
+	int i, j, t;
+
+	buf = malloc(BYTECODE_BUF_SIZE);
+	new_offset = malloc(sizeof(uint32_t) * (size_t)(opt_insn_count + 1));
+	pre_offset = malloc(sizeof(uint32_t) * (size_t)(opt_insn_count + 1));
+	opt_branch = malloc(sizeof(struct opt_branch) * (size_t)(opt_insn_count * 2 + 1));
+	if (buf == NULL || new_offset == NULL || pre_offset == NULL || opt_branch == NULL) {
+		free(buf);
+		free(new_offset);
+		free(pre_offset);
+		free(opt_branch);
+		opt_branch = NULL;
+		return false;
+	}
+
+	/* A removed or hoisted instruction maps to the next kept one. */
+	pos = 0;
+	opt_branch_count = 0;
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+
+		/* Put a preheader: a copy of the loop test and the hoisted instructions. */
+		if (!insn->removed && insn->latch >= 0) {
+			pre_offset[i] = pos;
+			for (j = i; j <= insn->latch; j++) {
+				if (opt_insn[j].removed)
+					continue;
+				if (j <= insn->guard_end || opt_insn[j].hoisted)
+					lir_opt_put_insn(buf, &pos, j, true);
+			}
+		}
+
+		new_offset[i] = pos;
+		if (!insn->removed && !insn->hoisted)
+			lir_opt_put_insn(buf, &pos, i, false);
+	}
+	new_offset[opt_insn_count] = pos;
+
+	/* Relocate the branch targets. Only the latch enters a loop past its preheader. */
+	for (i = 0; i < opt_branch_count; i++) {
+		j = opt_branch[i].insn;
+		t = lir_opt_next_kept(lir_opt_get_target_insn(&opt_insn[j]));
+		if (t < opt_insn_count && opt_insn[t].latch >= 0) {
+			if (!opt_branch[i].copy && j >= t && j <= opt_insn[t].latch)
+				addr = new_offset[t];
+			else
+				addr = pre_offset[t];
+		} else {
+			addr = new_offset[lir_opt_get_target_insn(&opt_insn[j])];
+		}
+		lir_opt_set_u32(buf, opt_branch[i].pos + (uint32_t)opt_insn[j].target_ofs, addr);
+	}
+
+	memset(bytecode, 0, (size_t)bytecode_top);
+	memcpy(bytecode, buf, pos);
+	bytecode_top = (int)pos;
+
+	free(buf);
+	free(new_offset);
+	free(pre_offset);
+	free(opt_branch);
+	opt_branch = NULL;
+
+	return true;
+}
+
+/*
+ * Type inference
+ *  - A forward analysis over the basic blocks finds the tmpvars and the
+ *    stored symbols that always hold an integer or a float. The types
+ *    come from ICONST and FCONST, INC of the range counters, copies,
+ *    and arithmetic on known types.
+ *  - A symbol keeps its type from a STORESYMBOL to a LOADSYMBOL. Any
+ *    symbol may name a global that a source linked later defines, so
+ *    the types of all symbols are unknown at the entry and after a call.
+ *  - Arithmetic and comparisons on two integers or two floats are
+ *    rewritten to the typed opcodes that skip the type switch.
+ */
+
+/* Inferred types. */
+#define OPT_TYPE_NONE		0	/* Not reached yet. */
+#define OPT_TYPE_INT		1
+#define OPT_TYPE_FLOAT		2
+#define OPT_TYPE_ANY		3
+
+/* Maximum symbols whose types are tracked. */
+#define OPT_SYMBOL_MAX		32
+
+/* Tracked symbols. (point into the bytecode buffer) */
+static const char *opt_symbol[OPT_SYMBOL_MAX];
+static int opt_symbol_count;
+
+/* Get a symbol operand of STORESYMBOL or LOADSYMBOL. */
+static const char *
+lir_opt_get_symbol(
+	struct opt_insn *insn)
+{
+	if (insn->op == LOP_STORESYMBOL)
+		return (const char *)&bytecode[insn->offset + 1];
+
+	return (const char *)&bytecode[insn->offset + 3];
+}
+
+/* Find a tracked symbol. (-1 if not tracked) */
+static int
+lir_opt_find_symbol(
+	const char *symbol)
+{
+	int i;
+
+	for (i = 0; i < opt_symbol_count; i++) {
+		if (strcmp(opt_symbol[i], symbol) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Collect the stored symbols. */
+static void
+lir_opt_collect_symbols(void)
+{
+	const char *symbol;
+	int i;
+
+	opt_symbol_count = 0;
+	for (i = 0; i < opt_insn_count; i++) {
+		if (opt_insn[i].op != LOP_STORESYMBOL)
+			continue;
+		symbol = lir_opt_get_symbol(&opt_insn[i]);
+		if (lir_opt_find_symbol(symbol) != -1 || opt_symbol_count == OPT_SYMBOL_MAX)
+			continue;
+		opt_symbol[opt_symbol_count] = symbol;
+		opt_symbol_count++;
+	}
+}
+
+/* Get a typed opcode of an instruction for the source types. (op if none) */
+static uint8_t
+lir_opt_get_typed_op(
+	struct opt_insn *insn,
+	const uint8_t *type)
+{
+	static const uint8_t int_op[][2] = {
+		{LOP_ADD, LOP_IADD}, {LOP_SUB, LOP_ISUB}, {LOP_MUL, LOP_IMUL},
+		{LOP_LT, LOP_ILT}, {LOP_LTE, LOP_ILTE}, {LOP_GT, LOP_IGT},
+		{LOP_GTE, LOP_IGTE}, {LOP_EQ, LOP_IEQ}, {LOP_NEQ, LOP_INEQ},
+	};
+	static const uint8_t float_op[][2] = {
+		{LOP_ADD, LOP_FADD}, {LOP_SUB, LOP_FSUB}, {LOP_MUL, LOP_FMUL},
+		{LOP_DIV, LOP_FDIV}, {LOP_LT, LOP_FLT}, {LOP_LTE, LOP_FLTE},
+		{LOP_GT, LOP_FGT}, {LOP_GTE, LOP_FGTE}, {LOP_EQ, LOP_FEQ},
+		{LOP_NEQ, LOP_FNEQ},
+	};
+	uint8_t t1, t2;
+	size_t i;
+
+	if (insn->src_count != 2 || insn->dst_ofs < 0)
+		return insn->op;
+
+	t1 = type[lir_opt_get_tmpvar(insn, insn->src_ofs[0])];
+	t2 = type[lir_opt_get_tmpvar(insn, insn->src_ofs[1])];
+	if (t1 == OPT_TYPE_INT && t2 == OPT_TYPE_INT) {
+		for (i = 0; i < sizeof(int_op) / sizeof(int_op[0]); i++) {
+			if (int_op[i][0] == insn->op)
+				return int_op[i][1];
+		}
+	} else if (t1 == OPT_TYPE_FLOAT && t2 == OPT_TYPE_FLOAT) {
+		for (i = 0; i < sizeof(float_op) / sizeof(float_op[0]); i++) {
+			if (float_op[i][0] == insn->op)
+				return float_op[i][1];
+		}
+	}
+
+	return insn->op;
+}
+
+/* Apply an instruction to the types. */
+static void
+lir_opt_transfer_types(
+	struct opt_insn *insn,
+	uint8_t *type)
+{
+	uint8_t t1, t2, result;
+	int i, sym;
+
+	t1 = insn->src_count > 0 ? type[lir_opt_get_tmpvar(insn, insn->src_ofs[0])] : OPT_TYPE_ANY;
+	t2 = insn->src_count > 1 ? type[lir_opt_get_tmpvar(insn, insn->src_ofs[1])] : OPT_TYPE_ANY;
+
+	result = OPT_TYPE_ANY;
+	switch (insn->op) {
+	case LOP_ICONST:
+	case LOP_INC:		/* Fails on a non-integer. */
+	case LOP_NEG:
+	case LOP_MOD:
+	case LOP_AND:
+	case LOP_OR:
+	case LOP_XOR:
+	case LOP_LEN:
+	case LOP_SWITCH:
+	case LOP_CHKFUNC:
+		result = OPT_TYPE_INT;
+		break;
+	case LOP_FCONST:
+		result = OPT_TYPE_FLOAT;
+		break;
+	case LOP_ASSIGN:
+		result = t1;
+		break;
+	case LOP_ADD:
+	case LOP_SUB:
+	case LOP_MUL:
+	case LOP_DIV:
+		/* An integer and a float make a float. */
+		if ((t1 == OPT_TYPE_INT || t1 == OPT_TYPE_FLOAT) &&
+		    (t2 == OPT_TYPE_INT || t2 == OPT_TYPE_FLOAT))
+			result = (t1 == OPT_TYPE_INT && t2 == OPT_TYPE_INT) ? OPT_TYPE_INT : OPT_TYPE_FLOAT;
+		break;
+	case LOP_LT:
+	case LOP_LTE:
+	case LOP_GT:
+	case LOP_GTE:
+	case LOP_EQ:
+	case LOP_NEQ:
+		/* A string compared to a number leaves dst as is. */
+		if ((t1 == OPT_TYPE_INT || t1 == OPT_TYPE_FLOAT) &&
+		    (t2 == OPT_TYPE_INT || t2 == OPT_TYPE_FLOAT))
+			result = OPT_TYPE_INT;
+		break;
+	case LOP_IADD:
+	case LOP_ISUB:
+	case LOP_IMUL:
+	case LOP_ILT:
+	case LOP_ILTE:
+	case LOP_IGT:
+	case LOP_IGTE:
+	case LOP_IEQ:
+	case LOP_INEQ:
+	case LOP_FLT:
+	case LOP_FLTE:
+	case LOP_FGT:
+	case LOP_FGTE:
+	case LOP_FEQ:
+	case LOP_FNEQ:
+		result = OPT_TYPE_INT;
+		break;
+	case LOP_FADD:
+	case LOP_FSUB:
+	case LOP_FMUL:
+	case LOP_FDIV:
+		result = OPT_TYPE_FLOAT;
+		break;
+	case LOP_LOADSYMBOL:
+		sym = lir_opt_find_symbol(lir_opt_get_symbol(insn));
+		if (sym != -1)
+			result = type[tmpvar_count + 1 + sym];
+		break;
+	case LOP_STORESYMBOL:
+		sym = lir_opt_find_symbol(lir_opt_get_symbol(insn));
+		if (sym != -1)
+			type[tmpvar_count + 1 + sym] = t1;
+		break;
+	default:
+		/* EQI is not written by the JIT. */
+		break;
+	}
+
+	if (insn->dst_ofs >= 0)
+		type[lir_opt_get_tmpvar(insn, insn->dst_ofs)] = result;
+
+	/* A callee may assign any symbol that is a global at runtime. */
+	if (insn->op == LOP_CALL || insn->op == LOP_THISCALL ||
+	    insn->op == LOP_TAILCALL) {
+		for (i = 0; i < opt_symbol_count; i++)
+			type[tmpvar_count + 1 + i] = OPT_TYPE_ANY;
+	}
+}
+
+/* Merge the types at the exit of a block into the entry of a successor. */
+static bool
+lir_opt_merge_types(
+	uint8_t *dst,
+	const uint8_t *src,
+	int width)
+{
+	bool changed;
+	int i;
+
+	changed = false;
+	for (i = 0; i < width; i++) {
+		if (dst[i] == src[i] || dst[i] == OPT_TYPE_ANY)
+			continue;
+		dst[i] = dst[i] == OPT_TYPE_NONE ? src[i] : OPT_TYPE_ANY;
+		changed = true;
+	}
+
+	return changed;
+}
+
+/* Infer the types and rewrite the typed arithmetic. */
+static bool
+lir_opt_infer_types(void)
+{
+	struct opt_insn *insn;
+	uint8_t *in, *cur, op;
+	int width, b, i, end, n, succ[2];
+	bool changed;
+
+	lir_opt_collect_symbols();
+	width = tmpvar_count + 1 + opt_symbol_count;
+
+	in = calloc((size_t)(opt_block_count * width), sizeof(uint8_t));
+	cur = malloc((size_t)width);
+	if (in == NULL || cur == NULL) {
+		free(in);
+		free(cur);
+		return false;
+	}
+
+	/* Nothing is known at the entry. (OPT_TYPE_NONE marks unreached blocks.) */
+	memset(in, OPT_TYPE_ANY, (size_t)width);
+
+	/* Iterate to the fixed point. */
+	do {
+		changed = false;
+		for (b = 0; b < opt_block_count; b++) {
+			if (b > 0 && in[b * width] == OPT_TYPE_NONE)
+				continue;
+			memcpy(cur, &in[b * width], (size_t)width);
+			end = b + 1 < opt_block_count ? opt_block_head[b + 1] : opt_insn_count;
+			for (i = opt_block_head[b]; i < end; i++)
+				lir_opt_transfer_types(&opt_insn[i], cur);
+
+			n = lir_opt_get_block_succ(b, succ);
+			while (n-- > 0) {
+				if (succ[n] == opt_insn_count)
+					continue;
+				if (lir_opt_merge_types(&in[opt_insn[succ[n]].block * width], cur, width))
+					changed = true;
+			}
+		}
+	} while (changed);
+
+	/* Rewrite the opcodes. The operand layout is the same. */
+	for (b = 0; b < opt_block_count; b++) {
+		if (b > 0 && in[b * width] == OPT_TYPE_NONE)
+			continue;
+		memcpy(cur, &in[b * width], (size_t)width);
+		end = b + 1 < opt_block_count ? opt_block_head[b + 1] : opt_insn_count;
+		for (i = opt_block_head[b]; i < end; i++) {
+			insn = &opt_insn[i];
+			op = lir_opt_get_typed_op(insn, cur);
+			lir_opt_transfer_types(insn, cur);
+			insn->op = op;
+			bytecode[insn->offset] = op;
+		}
+	}
+
+	free(in);
+	free(cur);
+
+	return true;
+}
+
+/*
+ * Escape analysis
+ *  - For each ACONST and DCONST, a forward analysis over the basic
+ *    blocks tracks the tmpvars and the stored symbols that may hold the
+ *    container. Copies by ASSIGN, STORESYMBOL and LOADSYMBOL carry it,
+ *    and other writes kill it.
+ *  - The container escapes if it is passed to a call, used as the
+ *    object of a THISCALL, stored into a container, stored to an
+ *    untracked symbol, or held by the return value slot at the end.
+ *  - A container that never escapes is made by LACONST or LDCONST, and
+ *    the runtime frees it when the frame is left. A symbol that turns
+ *    out to be a global at runtime keeps the container alive.
+ */
+
+/* Does an instruction leak a source into somewhere that outlives the frame? */
+static bool
+lir_opt_is_escaping_use(
+	struct opt_insn *insn,
+	int k)
+{
+	switch (insn->op) {
+	case LOP_ASSIGN:
+	case LOP_STORESYMBOL:
+		/* Tracked as copies. */
+		return false;
+	case LOP_STOREARRAY:
+		/* The container and the index stay. */
+		return k == 2;
+	case LOP_STOREDOT:
+		return k == 1;
+	case LOP_NEG:
+	case LOP_INC:
+	case LOP_ADD:
+	case LOP_SUB:
+	case LOP_MUL:
+	case LOP_DIV:
+	case LOP_MOD:
+	case LOP_AND:
+	case LOP_OR:
+	case LOP_XOR:
+	case LOP_LT:
+	case LOP_LTE:
+	case LOP_GT:
+	case LOP_GTE:
+	case LOP_EQ:
+	case LOP_NEQ:
+	case LOP_EQI:
+	case LOP_IADD:
+	case LOP_ISUB:
+	case LOP_IMUL:
+	case LOP_ILT:
+	case LOP_ILTE:
+	case LOP_IGT:
+	case LOP_IGTE:
+	case LOP_IEQ:
+	case LOP_INEQ:
+	case LOP_FADD:
+	case LOP_FSUB:
+	case LOP_FMUL:
+	case LOP_FDIV:
+	case LOP_FLT:
+	case LOP_FLTE:
+	case LOP_FGT:
+	case LOP_FGTE:
+	case LOP_FEQ:
+	case LOP_FNEQ:
+	case LOP_LOADARRAY:
+	case LOP_LEN:
+	case LOP_GETDICTKEYBYINDEX:
+	case LOP_GETDICTVALBYINDEX:
+	case LOP_ULOADARRAY:
+	case LOP_UGETDICTVALBYINDEX:
+	case LOP_LOADDOT:
+	case LOP_SWITCH:
+	case LOP_JMPIFTRUE:
+	case LOP_JMPIFFALSE:
+	case LOP_JMPIFEQ:
+		/* Read only. The results don't alias the sources. */
+		return false;
+	default:
+		/* CALL, THISCALL and anything unknown. */
+		return true;
+	}
+}
+
+/* Track the holders of a container through an instruction. Returns false on an escape. */
+static bool
+lir_opt_transfer_holders(
+	struct opt_insn *insn,
+	int site,
+	uint32_t *held)
+{
+	int k, r, sym, dst;
+	bool hold;
+
+	if (insn == &opt_insn[site]) {
+		OPT_BIT_SET(held, lir_opt_get_tmpvar(insn, insn->dst_ofs));
+		return true;
+	}
+
+	for (k = 0; k < insn->src_count; k++) {
+		r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+		if (OPT_BIT_TEST(held, r) && lir_opt_is_escaping_use(insn, k))
+			return false;
+	}
+
+	dst = insn->dst_ofs >= 0 ? lir_opt_get_tmpvar(insn, insn->dst_ofs) : -1;
+	switch (insn->op) {
+	case LOP_ASSIGN:
+		hold = OPT_BIT_TEST(held, lir_opt_get_tmpvar(insn, insn->src_ofs[0])) != 0;
+		break;
+	case LOP_STORESYMBOL:
+		sym = lir_opt_find_symbol(lir_opt_get_symbol(insn));
+		hold = OPT_BIT_TEST(held, lir_opt_get_tmpvar(insn, insn->src_ofs[0])) != 0;
+		if (sym == -1)
+			return !hold;
+		dst = tmpvar_count + 1 + sym;
+		break;
+	case LOP_LOADSYMBOL:
+		sym = lir_opt_find_symbol(lir_opt_get_symbol(insn));
+		hold = sym != -1 && OPT_BIT_TEST(held, tmpvar_count + 1 + sym);
+		break;
+	default:
+		hold = false;
+		break;
+	}
+	if (dst != -1) {
+		if (hold)
+			OPT_BIT_SET(held, dst);
+		else
+			OPT_BIT_CLEAR(held, dst);
+	}
+
+	return true;
+}
+
+/* Check if a container made at an instruction may leave the frame. */
+static bool
+lir_opt_is_escaping(
+	int site,
+	int ret_tmpvar,
+	int words,
+	uint32_t *in,
+	uint32_t *cur)
+{
+	int b, i, k, n, end, succ[2], to;
+	bool changed;
+
+	memset(in, 0, sizeof(uint32_t) * (size_t)(opt_block_count * words));
+
+	/* Iterate to the fixed point. */
+	do {
+		changed = false;
+		for (b = 0; b < opt_block_count; b++) {
+			memcpy(cur, &in[b * words], sizeof(uint32_t) * (size_t)words);
+			end = b + 1 < opt_block_count ? opt_block_head[b + 1] : opt_insn_count;
+			for (i = opt_block_head[b]; i < end; i++) {
+				if (!lir_opt_transfer_holders(&opt_insn[i], site, cur))
+					return true;
+			}
+
+			n = lir_opt_get_block_succ(b, succ);
+			while (n-- > 0) {
+				/* The caller reads the return value. */
+				if (succ[n] == opt_insn_count) {
+					if (OPT_BIT_TEST(cur, ret_tmpvar))
+						return true;
+					continue;
+				}
+				to = opt_insn[succ[n]].block * words;
+				for (k = 0; k < words; k++) {
+					if ((in[to + k] | cur[k]) != in[to + k]) {
+						in[to + k] |= cur[k];
+						changed = true;
+					}
+				}
+			}
+		}
+	} while (changed);
+
+	return false;
+}
+
+/* Rewrite the containers that never leave the frame. */
+static bool
+lir_opt_find_frame_containers(
+	int ret_tmpvar)
+{
+	struct opt_insn *insn;
+	uint32_t *in, *cur;
+	int i, words;
+
+	words = (tmpvar_count + 1 + opt_symbol_count + 31) / 32;
+	in = malloc(sizeof(uint32_t) * (size_t)(opt_block_count * words));
+	cur = malloc(sizeof(uint32_t) * (size_t)words);
+	if (in == NULL || cur == NULL) {
+		free(in);
+		free(cur);
+		return false;
+	}
+
+	/* The operand layout is the same. */
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+		if (insn->op != LOP_ACONST && insn->op != LOP_DCONST)
+			continue;
+		if (lir_opt_is_escaping(i, ret_tmpvar, words, in, cur))
+			continue;
+		insn->op = insn->op == LOP_ACONST ? LOP_LACONST : LOP_LDCONST;
+		bytecode[insn->offset] = insn->op;
+	}
+
+	free(in);
+	free(cur);
+
+	return true;
+}
+
+/*
+ * Tmpvar coalescing
+ *  - The live ranges of the tmpvars are computed per instruction from
+ *    the block liveness.
+ *  - Two tmpvars interfere if one is written while the other is live,
+ *    or if they are the dst and a src of the same instruction.
+ *  - The parameters and the return value slot keep their indices. The
+ *    other tmpvars are renumbered to the lowest slot that no
+ *    interfering tmpvar has, so the frame shrinks to the number of
+ *    values live at the same time.
+ */
+
+/* Interference matrix. */
+static uint32_t *opt_conflict;
+
+/* Record that two tmpvars can't share a slot. */
+static void
+lir_opt_add_conflict(
+	int a,
+	int b)
+{
+	if (a == b)
+		return;
+	OPT_BIT_SET(&opt_conflict[a * opt_word_count], b);
+	OPT_BIT_SET(&opt_conflict[b * opt_word_count], a);
+}
+
+/* Build the interference matrix. */
+static bool
+lir_opt_build_conflicts(
+	int ret_tmpvar,
+	bool *used)
+{
+	struct opt_insn *insn;
+	uint32_t *live;
+	int b, i, k, r, d, v, end;
+
+	live = calloc((size_t)opt_word_count, sizeof(uint32_t));
+	if (live == NULL)
+		return false;
+
+	for (b = 0; b < opt_block_count; b++) {
+		memcpy(live, &opt_live_out[b * opt_word_count], sizeof(uint32_t) * (size_t)opt_word_count);
+		end = b + 1 < opt_block_count ? opt_block_head[b + 1] : opt_insn_count;
+		for (i = end - 1; i >= opt_block_head[b]; i--) {
+			insn = &opt_insn[i];
+			if (insn->dst_ofs >= 0) {
+				d = lir_opt_get_tmpvar(insn, insn->dst_ofs);
+				used[d] = true;
+				for (v = 0; v <= opt_tmpvar_count; v++) {
+					if (OPT_BIT_TEST(live, v))
+						lir_opt_add_conflict(d, v);
+				}
+				for (k = 0; k < insn->src_count; k++)
+					lir_opt_add_conflict(d, lir_opt_get_tmpvar(insn, insn->src_ofs[k]));
+				OPT_BIT_CLEAR(live, d);
+			}
+			for (k = 0; k < insn->src_count; k++) {
+				r = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+				used[r] = true;
+				OPT_BIT_SET(live, r);
+			}
+		}
+	}
+
+	/* The parameters are written by the caller before the entry. */
+	for (i = 0; i < ret_tmpvar; i++) {
+		for (v = 0; v <= opt_tmpvar_count; v++) {
+			if (OPT_BIT_TEST(opt_live_in, v))
+				lir_opt_add_conflict(i, v);
+		}
+	}
+
+	free(live);
+
+	return true;
+}
+
+/* Renumber the tmpvars so that the ones never live together share a slot. */
+static bool
+lir_opt_coalesce_tmpvars(
+	int ret_tmpvar)
+{
+	struct opt_insn *insn;
+	bool *used, *taken;
+	int *slot;
+	int i, k, v, u, n, top, val[OPT_SRC_MAX], dst;
+
+	frame_size_before = tmpvar_count + 1;
+
+	/* Tmpvars added by the hoisting are included. */
+	opt_tmpvar_count = tmpvar_count;
+	opt_word_count = (tmpvar_count + 1 + 31) / 32;
+	n = tmpvar_count + 1;
+
+	if (!lir_opt_solve_liveness(ret_tmpvar))
+		return false;
+
+	opt_conflict = calloc((size_t)(n * opt_word_count), sizeof(uint32_t));
+	used = calloc((size_t)n, sizeof(bool));
+	taken = calloc((size_t)n, sizeof(bool));
+	slot = malloc(sizeof(int) * (size_t)n);
+	if (opt_conflict == NULL || used == NULL || taken == NULL || slot == NULL) {
+		free(opt_conflict);
+		free(used);
+		free(taken);
+		free(slot);
+		opt_conflict = NULL;
+		return false;
+	}
+
+	if (!lir_opt_build_conflicts(ret_tmpvar, used)) {
+		free(opt_conflict);
+		free(used);
+		free(taken);
+		free(slot);
+		opt_conflict = NULL;
+		return false;
+	}
+
+	/* Keep the parameters and the return value slot, color the rest. */
+	top = ret_tmpvar;
+	for (v = 0; v < n; v++) {
+		if (v <= ret_tmpvar) {
+			slot[v] = v;
+			continue;
+		}
+		slot[v] = -1;
+		if (!used[v])
+			continue;
+		memset(taken, 0, sizeof(bool) * (size_t)n);
+		for (u = 0; u < v; u++) {
+			if (slot[u] != -1 && OPT_BIT_TEST(&opt_conflict[v * opt_word_count], u))
+				taken[slot[u]] = true;
+		}
+		for (k = 0; taken[k]; k++)
+			;
+		slot[v] = k;
+		if (k > top)
+			top = k;
+	}
+
+	/* Rewrite the operands. INC reads and writes the same one. */
+	for (i = 0; i < opt_insn_count; i++) {
+		insn = &opt_insn[i];
+		for (k = 0; k < insn->src_count; k++)
+			val[k] = lir_opt_get_tmpvar(insn, insn->src_ofs[k]);
+		dst = insn->dst_ofs >= 0 ? lir_opt_get_tmpvar(insn, insn->dst_ofs) : -1;
+		for (k = 0; k < insn->src_count; k++)
+			lir_opt_set_u16(insn->offset + (uint32_t)insn->src_ofs[k], (uint16_t)slot[val[k]]);
+		if (dst != -1)
+			lir_opt_set_u16(insn->offset + (uint32_t)insn->dst_ofs, (uint16_t)slot[dst]);
+	}
+	tmpvar_count = top;
+
+	free(opt_conflict);
+	free(used);
+	free(taken);
+	free(slot);
+	opt_conflict = NULL;
+
+	return true;
+}
+
+/* Run the passes. Returns false on an allocation failure. */
+static bool
+lir_opt_run(
+	int ret_tmpvar)
+{
+	bool valid, progress;
+	int round;
+
+	/* Leave an undecodable bytecode as is. */
+	if (!lir_opt_decode_all(&valid))
+		return false;
+	if (!valid || opt_insn_count == 0)
+		return true;
+
+	lir_opt_thread_jumps();
+	if (!lir_opt_remove_unreachable())
+		return false;
+	if (!lir_opt_build_blocks())
+		return false;
+	if (!lir_opt_propagate_copies())
+		return false;
+
+	/* A removed copy may make its source dead. */
+	for (round = 0; round < OPT_DSE_ROUNDS; round++) {
+		progress = false;
+		if (!lir_opt_remove_dead_stores(ret_tmpvar, &progress))
+			return false;
+		if (!progress)
+			break;
+	}
+
+	if (!lir_opt_hoist_invariants(ret_tmpvar))
+		return false;
+
+	lir_opt_remove_jumps_to_next();
+	if (!lir_opt_compact())
+		return false;
+
+	/* Type the packed bytecode. */
+	free(opt_insn);
+	free(opt_insn_at);
+	free(opt_block_head);
+	opt_insn = NULL;
+	opt_insn_at = NULL;
+	opt_block_head = NULL;
+	if (!lir_opt_decode_all(&valid))
+		return false;
+	if (!valid || opt_insn_count == 0)
+		return true;
+	if (!lir_opt_build_blocks())
+		return false;
+	if (!lir_opt_infer_types())
+		return false;
+	if (!lir_opt_find_frame_containers(ret_tmpvar))
+		return false;
+	if (!lir_opt_coalesce_tmpvars(ret_tmpvar))
+		return false;
+
+	return true;
+}
+
+/* Optimize the bytecode buffer. */
+static bool
+lir_optimize(
+	int ret_tmpvar)
+{
+	bool ret;
+
+	opt_insn = NULL;
+	opt_insn_count = 0;
+	opt_insn_at = NULL;
+	opt_block_head = NULL;
+	opt_block_count = 0;
+	opt_live_in = NULL;
+	opt_live_out = NULL;
+	opt_tmpvar_count = tmpvar_count;
+	opt_word_count = (tmpvar_count + 1 + 31) / 32;
+
+	ret = lir_opt_run(ret_tmpvar);
+
+	free(opt_insn);
+	free(opt_insn_at);
+	free(opt_block_head);
+	free(opt_live_in);
+	free(opt_live_out);
+
+	if (!ret)
+		lir_out_of_memory();
+
+	return ret;
+}
+
+/*
+ * Free a constructed LIR.
+ */
+void
+lir_free(struct lir_func *func)
+{
+	int i;
+
+	assert(func != NULL);
+
+	free(func->func_name);
+	for (i = 0; i < func->param_count; i++)
+		free(func->param_name[i]);
+	free(func->bytecode);
+	memset(func, 0, sizeof(struct lir_func));
+}
+
+/*
+ * Get a file name.
+ */
+const char *
+lir_get_file_name(void)
+{
+	return lir_file_name;
+}
+
+/*
+ * Get an error line.
+ */
+int
+lir_get_error_line(void)
+{
+	return lir_error_line;
+}
+
+/*
+ * Get an error message.
+ */
+const char *
+lir_get_error_message(void)
+{
+	return lir_error_message;
+}
+
+/* Set an error message. */
+static void
+lir_fatal(
+	const char *msg,
+	...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vsnprintf(lir_error_message,
+		  sizeof(lir_error_message),
+		  msg,
+		  ap);
+	va_end(ap);
+}
+
+/* Set an out-of-memory error message. */
+static void
+lir_out_of_memory(void)
+{
+	snprintf(lir_error_message,
+		 sizeof(lir_error_message),
+		 "%s",
+		 _("LIR: Out of memory error."));
 }
 
 /*
@@ -1903,7 +4882,7 @@ static INLINE void imm4(uint8_t **pc, uint32_t *ret)
 	b2 = *((*pc) + 2);
 	b3 = *((*pc) + 3);
 
-	*ret = (uint32_t)((b0 << 24) | (b1 << 16) | (b2 << 8) | (b3 + 3));
+	*ret = (uint32_t)((b0 << 24) | (b1 << 16) | (b2 << 8) | b3);
 
 	(*pc) += 4;
 }
@@ -1925,6 +4904,8 @@ lir_dump(
 	pc = func->bytecode;
 	end = func->bytecode + func->bytecode_size;
 
+	printf("func %s: (tmpvar_size:%d)\n", func->func_name, func->tmpvar_size);
+
 	while (pc < end) {
 		int opcode;
 		int ofs;
@@ -1938,8 +4919,26 @@ lir_dump(
 			printf("%04d: LINEINFO(line:%d)\n", ofs, line);
 			break;
 		}
+		case LOP_SWITCH:
+		{
+			uint16_t dst;
+			uint16_t src;
+			uint16_t len;
+			uint8_t kind;
+			uint16_t count;
+			static const char *kind_name[] = {"dense", "int", "string"};
+			IMM2(dst);
+			IMM2(src);
+			IMM2(len);
+			IMM1(kind);
+			IMM2(count);
+			printf("%04d: SWITCH(dst:%d, src:%d, table:%s, count:%d)\n", ofs, dst, src,
+			       kind <= LIR_SWITCH_STRING ? kind_name[kind] : "?", count);
+			pc += len - LIR_SWITCH_HEADER_SIZE;
+			break;
+		}
 		case LOP_NOP:
-			pc++;
+			printf("%04d: NOP\n", ofs);
 			break;
 		case LOP_ASSIGN:
 		{
@@ -1966,7 +4965,7 @@ lir_dump(
 			float val_f;
 			IMM2(dst);
 			IMM4(val);
-			val_f = *(float *)&val;
+			memcpy(&val_f, &val, sizeof(float));
 			printf("%04d: FCONST(dst:%d, val:%f)\n", ofs, dst, val_f);
 			break;
 		}
@@ -1993,6 +4992,20 @@ lir_dump(
 			printf("%04d: DCONST(dst:%d)\n", ofs, dst);
 			break;
 		}
+		case LOP_LACONST:
+		{
+			uint16_t dst;
+			IMM2(dst);
+			printf("%04d: LACONST(dst:%d)\n", ofs, dst);
+			break;
+		}
+		case LOP_LDCONST:
+		{
+			uint16_t dst;
+			IMM2(dst);
+			printf("%04d: LDCONST(dst:%d)\n", ofs, dst);
+			break;
+		}
 		case LOP_INC:
 		{
 			uint16_t dst;
@@ -2000,7 +5013,15 @@ lir_dump(
 			printf("%04d: INC(dst:%d)\n", ofs, dst);
 			break;
 		}
-		//case LOP_NEG:
+		case LOP_NEG:
+		{
+			uint16_t dst;
+			uint16_t src;
+			IMM2(dst);
+			IMM2(src);
+			printf("%04d: NEG(dst:%d, src:%d)\n", ofs, dst, src);
+			break;
+		}
 		case LOP_ADD:
 		{
 			uint16_t dst;
@@ -2009,19 +5030,119 @@ lir_dump(
 			IMM2(dst);
 			IMM2(src1);
 			IMM2(src2);
-			printf("%04d: ADD(dst:%d, src1:%d, src2: %d)\n", ofs, dst, src1, src2);
-			break;
-		}
-		//case LOP_SUB:
-		//case LOP_MUL:
-		//case LOP_DIV:
-		//case LOP_MOD:
-		//case LOP_AND:
-		//case LOP_OR:
-		//case LOP_XOR:
-		//case LOP_LT:
-		//case LOP_LTE:
-		//case LOP_GT:
+			printf("%04d: ADD(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_SUB:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: SUB(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_MUL:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: MUL(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_DIV:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: DIV(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_MOD:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: MOD(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_AND:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: AND(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_OR:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: OR(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_XOR:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: XOR(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_LT:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: LT(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_LTE:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: LTE(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_GT:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: GT(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
 		case LOP_GTE:
 		{
 			uint16_t dst;
@@ -2055,7 +5176,17 @@ lir_dump(
 			printf("%04d: EQI(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
 			break;
 		}
-		//case LOP_NEQ:
+		case LOP_NEQ:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: NEQ(dst:%d, src1:%d, src2:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
 		case LOP_LOADARRAY:
 		{
 			uint16_t dst;
@@ -2106,11 +5237,53 @@ lir_dump(
 			IMM2(dst);
 			IMM2(dict);
 			IMM2(index);
-			printf("%04d: GETDICTKEYBYINDEX(dst:%d, dict:%d, index:%d)\n", ofs, dst, dict, index);
+			printf("%04d: GETDICTVALBYINDEX(dst:%d, dict:%d, index:%d)\n", ofs, dst, dict, index);
+			break;
+		}
+		case LOP_ULOADARRAY:
+		{
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: ULOADARRAY(dst:%d, arr:%d, subsc:%d)\n", ofs, dst, src1, src2);
+			break;
+		}
+		case LOP_UGETDICTVALBYINDEX:
+		{
+			uint16_t dst;
+			uint16_t dict;
+			uint16_t index;
+			IMM2(dst);
+			IMM2(dict);
+			IMM2(index);
+			printf("%04d: UGETDICTVALBYINDEX(dst:%d, dict:%d, index:%d)\n", ofs, dst, dict, index);
+			break;
+		}
+		case LOP_STOREDOT:
+		{
+			uint16_t obj;
+			const char *field;
+			uint16_t src;
+			IMM2(obj);
+			IMMS(field);
+			IMM2(src);
+			printf("%04d: STOREDOT(obj:%d, field:%s, src:%d)\n", ofs, obj, field, src);
+			break;
+		}
+		case LOP_LOADDOT:
+		{
+			uint16_t dst;
+			uint16_t obj;
+			const char *field;
+			IMM2(dst);
+			IMM2(obj);
+			IMMS(field);
+			printf("%04d: LOADDOT(dst:%d, obj:%d, field:%s)\n", ofs, dst, obj, field);
 			break;
 		}
-		//case LOP_STOREDOT:
-		//case LOP_LOADDOT:
 		case LOP_STORESYMBOL:
 		{
 			const char *symbol;
@@ -2126,7 +5299,16 @@ lir_dump(
 			const char *symbol;
 			IMM2(dst);
 			IMMS(symbol);
-			printf("%04d: LOADSYMBOL(src: %d, symbol:%s)\n", ofs, dst, symbol);
+			printf("%04d: LOADSYMBOL(dst:%d, symbol:%s)\n", ofs, dst, symbol);
+			break;
+		}
+		case LOP_CHKFUNC:
+		{
+			uint16_t dst;
+			const char *symbol;
+			IMM2(dst);
+			IMMS(symbol);
+			printf("%04d: CHKFUNC(dst:%d, symbol:%s)\n", ofs, dst, symbol);
 			break;
 		}
 		case LOP_CALL:
@@ -2139,7 +5321,45 @@ lir_dump(
 			IMM2(dst);
 			IMM2(func);
 			IMM1(arg_count);
-			printf("%04d: CALL(dst: %d, arg_count:%d", ofs, dst, arg_count);
+			printf("%04d: CALL(dst:%d, func:%d, arg_count:%d", ofs, dst, func, arg_count);
+			for (i = 0; i < arg_count; i++) {
+				IMM2(arg);
+				printf(", %d", arg);
+			}
+			printf(")\n");
+			break;
+		}
+		case LOP_TAILCALL:
+		{
+			uint16_t dst;
+			uint16_t func;
+			uint8_t arg_count;
+			uint16_t arg;
+			int i;
+			IMM2(dst);
+			IMM2(func);
+			IMM1(arg_count);
+			printf("%04d: TAILCALL(dst:%d, func:%d, arg_count:%d", ofs, dst, func, arg_count);
+			for (i = 0; i < arg_count; i++) {
+				IMM2(arg);
+				printf(", %d", arg);
+			}
+			printf(")\n");
+			break;
+		}
+		case LOP_THISCALL:
+		{
+			uint16_t dst;
+			uint16_t obj;
+			const char *name;
+			uint8_t arg_count;
+			uint16_t arg;
+			int i;
+			IMM2(dst);
+			IMM2(obj);
+			IMMS(name);
+			IMM1(arg_count);
+			printf("%04d: THISCALL(dst:%d, obj:%d, name:%s, arg_count:%d", ofs, dst, obj, name, arg_count);
 			for (i = 0; i < arg_count; i++) {
 				IMM2(arg);
 				printf(", %d", arg);
@@ -2147,7 +5367,6 @@ lir_dump(
 			printf(")\n");
 			break;
 		}
-		//case LOP_THISCALL:
 		case LOP_JMP:
 		{
 			uint32_t target;
@@ -2182,6 +5401,41 @@ lir_dump(
 			printf("%04d: JMPIFEQ(src:%d, target:%d)\n", ofs, src, target);
 			break;
 		}
+		case LOP_IADD:
+		case LOP_ISUB:
+		case LOP_IMUL:
+		case LOP_ILT:
+		case LOP_ILTE:
+		case LOP_IGT:
+		case LOP_IGTE:
+		case LOP_IEQ:
+		case LOP_INEQ:
+		case LOP_FADD:
+		case LOP_FSUB:
+		case LOP_FMUL:
+		case LOP_FDIV:
+		case LOP_FLT:
+		case LOP_FLTE:
+		case LOP_FGT:
+		case LOP_FGTE:
+		case LOP_FEQ:
+		case LOP_FNEQ:
+		{
+			static const char *name[] = {
+				"IADD", "ISUB", "IMUL", "ILT", "ILTE", "IGT",
+				"IGTE", "IEQ", "INEQ", "FADD", "FSUB", "FMUL",
+				"FDIV", "FLT", "FLTE", "FGT", "FGTE", "FEQ",
+				"FNEQ"
+			};
+			uint16_t dst;
+			uint16_t src1;
+			uint16_t src2;
+			IMM2(dst);
+			IMM2(src1);
+			IMM2(src2);
+			printf("%04d: %s(dst:%d, src1:%d, src2:%d)\n", ofs, name[opcode - LOP_IADD], dst, src1, src2);
+			break;
+		}
 		default:
 			assert(INVALID_OPCODE);
 			break;
@@ -38,10 +38,31 @@
  */
 bool linguine_conf_use_jit = true;
 int linguine_conf_optimize = 0;
+int linguine_conf_jit_threshold = 8;		/* 0 for eager compilation */
+int linguine_conf_jit_loop_threshold = 1000;
+size_t linguine_conf_jit_cache_size = 16 * 1024 * 1024;
+bool linguine_conf_jit_dual_map = true;
+bool linguine_conf_jit_async = false;
+bool linguine_conf_jit_profile = false;
+bool linguine_conf_jit_deopt_stress = false;
+const char *linguine_conf_jit_disk_cache = NULL;	/* NULL to disable */
+bool linguine_conf_dump_lir = false;
+bool linguine_conf_dump_frame_size = false;
+bool linguine_conf_tail_call = true;		/* false for the C backend */
 
 /* Text format buffer. */
 static char text_buf[65536];
 
+/* Initial slot count of a symbol set. (a power of two) */
+#define RT_SYMBOL_SET_MIN	64
+
+/* A set of names for rt_link(). (open addressing, the names are not copied) */
+struct rt_symbol_set {
+	const char **slot;
+	uint32_t mask;
+	uint32_t count;
+};
+
 /* Forward declarations. */
 static void rt_free_func(struct rt_env *rt, struct rt_func *func);
 static bool rt_register_lir(struct rt_env *rt, struct lir_func *lir);
@@ -49,9 +70,21 @@ static bool rt_register_bytecode_function(struct rt_env *rt, uint8_t *data, uint
 static const char *rt_read_bytecode_line(uint8_t *data, uint32_t size, int *pos);
 static bool rt_enter_frame(struct rt_env *rt, struct rt_func *func);
 static void rt_leave_frame(struct rt_env *rt);
+static void rt_release_frame_objects(struct rt_env *rt);
+static bool rt_run_frame(struct rt_env *rt, struct rt_func *func);
+static bool rt_prepare_jit(struct rt_env *rt, struct rt_func *func);
+static bool rt_prepare_all_jit(struct rt_env *rt);
+static int rt_get_insn_size(struct rt_func *func, int pc);
+static bool rt_is_callee_load(struct rt_func *func, int pc, int size);
+static bool rt_link_func(struct rt_env *rt, struct rt_func *func, struct rt_symbol_set *stored);
+static bool rt_collect_stored_symbols(struct rt_env *rt, struct rt_symbol_set *set);
+static bool rt_add_stored_symbol(struct rt_env *rt, struct rt_symbol_set *set, const char *name);
+static bool rt_is_symbol_stored(struct rt_symbol_set *set, const char *name);
+static void rt_set_file_name(struct rt_env *rt, const char *file_name);
 static bool rt_expand_array(struct rt_env *rt, struct rt_value *array, int size);
 static bool rt_expand_dict(struct rt_env *rt, struct rt_value *dict, int size);
 static void rt_make_deep_reference(struct rt_env *rt, struct rt_value *val);
+static void rt_clear_frame_owner(struct rt_value *val);
 static void rt_recursively_mark_object(struct rt_env *rt, struct rt_value *val);
 static void rt_free_string(struct rt_env *rt, struct rt_string *str);
 static void rt_free_array(struct rt_env *rt, struct rt_array *array);
@@ -75,6 +108,7 @@ rt_create(
 	if (env == NULL)
 		return false;
 	memset(env, 0, sizeof(struct rt_env));
+	env->jit_profile = linguine_conf_jit_profile;
 
 	/* Register the intrinsics. */
 	if (!rt_register_intrinsics(env)) {
@@ -129,6 +163,9 @@ rt_destroy(
 		dict = next_dict;
 	}
 
+	/* Free the JIT code cache. (stops the compiler thread first) */
+	jit_free_cache(rt);
+
 	/* Free functions. */
 	func = rt->func_list;
 	while (func != NULL) {
@@ -161,11 +198,11 @@ rt_free_func(
 	}
 	free(func->file_name);
 	free(func->bytecode);
+	free(func->profile);
+	free(func->link_global);
 
-	if (func->jit_code != NULL) {
+	if (func->jit_code != NULL)
 		jit_free(rt, func);
-		func->jit_code = NULL;
-	}
 }
 
 /*
@@ -234,6 +271,20 @@ rt_register_source(
 				break;
 			}
 
+			/* Print the bytecode if requested. */
+			if (linguine_conf_dump_lir)
+				lir_dump(lfunc);
+
+			/* Print the frame size before and after the coalescing. */
+			if (linguine_conf_dump_frame_size) {
+				printf("frame %s: %d -> %d tmpvars (%zu -> %zu bytes)\n",
+				       lfunc->func_name,
+				       lfunc->orig_tmpvar_size,
+				       lfunc->tmpvar_size,
+				       sizeof(struct rt_value) * (size_t)lfunc->orig_tmpvar_size,
+				       sizeof(struct rt_value) * (size_t)lfunc->tmpvar_size);
+			}
+
 			/* Make a function object. */
 			if (!rt_register_lir(rt, lfunc))
 				break;
@@ -297,31 +348,30 @@ rt_register_lir(
 	}
 	memcpy(func->bytecode, lir->bytecode, (size_t)lir->bytecode_size);
 	func->tmpvar_size = lir->tmpvar_size;
+	if (linguine_conf_use_jit) {
+		func->profile = calloc((size_t)lir->bytecode_size, 1);
+		if (func->profile == NULL) {
+			rt_out_of_memory(rt);
+			return false;
+		}
+	}
 	func->file_name = strdup(lir->file_name);
 	if (func->file_name == NULL) {
 		rt_out_of_memory(rt);
 		return false;
 	}
 
-	/* Insert a bindglobal. */
-	global = malloc(sizeof(struct rt_bindglobal));
-	if (global == NULL) {
-		rt_out_of_memory(rt);
-		return false;
-	}
-	global->name = strdup(func->name);
-	if (global->name == NULL) {
-		rt_out_of_memory(rt);
-		return false;
+	/* Bind the name. (reuse a bindglobal that rt_link() may have bound) */
+	if (!rt_find_global(rt, func->name, &global)) {
+		if (!rt_add_global(rt, func->name, &global))
+			return false;
 	}
 	global->val.type = RT_VALUE_FUNC;
 	global->val.val.func = func;
-	global->next = rt->global;
-	rt->global = global;
 
-	/* Do JIT compilation */
-	if (linguine_conf_use_jit) {
-		if (!jit_build(rt, func))
+	/* Prepare for JIT now if the others are. (otherwise after rt_link()) */
+	if (rt->jit_ready) {
+		if (!rt_prepare_jit(rt, func))
 			return false;
 	}
 
@@ -332,6 +382,41 @@ rt_register_lir(
 	return true;
 }
 
+/* Take the code from the disk cache, or do JIT compilation if not tiered. */
+static bool
+rt_prepare_jit(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	if (linguine_conf_use_jit && !jit_load_disk_code(rt, func)) {
+		if (linguine_conf_jit_threshold == 0) {
+			if (!jit_build(rt, func))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Prepare the registered functions for JIT. (the code sees the linked bytecode) */
+static bool
+rt_prepare_all_jit(
+	struct rt_env *rt)
+{
+	struct rt_func *func;
+
+	rt->jit_ready = true;
+
+	for (func = rt->func_list; func != NULL; func = func->next) {
+		if (func->cfunc != NULL || func->jit_code != NULL)
+			continue;
+		if (!rt_prepare_jit(rt, func))
+			return false;
+	}
+
+	return true;
+}
+
 /*
  * Register functions from bytecode data.
  */
@@ -569,25 +654,401 @@ rt_register_cfunc(
 	func->cfunc = cfunc;
 	func->tmpvar_size = param_count + 1;
 
-	global = malloc(sizeof(struct rt_bindglobal));
-	if (global == NULL) {
-		rt_out_of_memory(rt);
+	/* Bind the name. (reuse a bindglobal that rt_link() may have bound) */
+	if (!rt_find_global(rt, name, &global)) {
+		if (!rt_add_global(rt, name, &global))
+			return false;
+	}
+	global->val.type = RT_VALUE_FUNC;
+	global->val.val.func = func;
+
+	return true;
+}
+
+/*
+ * Link the registered functions.
+ */
+bool
+rt_link(
+	struct rt_env *rt)
+{
+	struct rt_symbol_set stored;
+	struct rt_func *func;
+	bool is_succeeded;
+
+	/* Collect the names that any function stores. */
+	if (!rt_collect_stored_symbols(rt, &stored))
+		return false;
+
+	/* Bind the names in each function. */
+	is_succeeded = true;
+	for (func = rt->func_list; func != NULL; func = func->next) {
+		if (func->cfunc != NULL)
+			continue;
+		if (!rt_link_func(rt, func, &stored)) {
+			is_succeeded = false;
+			break;
+		}
+	}
+	free(stored.slot);
+	if (!is_succeeded)
 		return false;
+
+	/* Prepare for JIT with the linked bytecode. */
+	if (!rt->jit_ready) {
+		if (!rt_prepare_all_jit(rt))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Check whether a LOADSYMBOL loads the callee of a later CALL.
+ *  - The tmpvar of a callee is not written until its CALL, so the scan
+ *    stops at the first other write to it.
+ */
+static bool
+rt_is_callee_load(
+	struct rt_func *func,
+	int pc,
+	int size)
+{
+	uint8_t *bc;
+	int dst;
+
+	bc = func->bytecode;
+	dst = (bc[pc + 1] << 8) | bc[pc + 2];
+	for (pc += size; pc < func->bytecode_size; pc += size) {
+		size = rt_get_insn_size(func, pc);
+		if (size < 0)
+			return false;
+		switch (bc[pc]) {
+		case ROP_NOP:
+		case ROP_LINEINFO:
+		case ROP_JMP:
+		case ROP_JMPIFTRUE:
+		case ROP_JMPIFFALSE:
+		case ROP_JMPIFEQ:
+		case ROP_STORESYMBOL:
+		case ROP_STOREARRAY:
+		case ROP_STOREDOT:
+			/* Writes no tmpvar. */
+			continue;
+		case ROP_CALL:
+		case ROP_TAILCALL:
+			if (((bc[pc + 3] << 8) | bc[pc + 4]) == dst)
+				return true;
+			break;
+		default:
+			break;
+		}
+
+		/* The other instructions write the tmpvar of the first operand. */
+		if (((bc[pc + 1] << 8) | bc[pc + 2]) == dst)
+			return false;
+	}
+
+	return false;
+}
+
+/* Bind the LOADSYMBOLs of a function. */
+static bool
+rt_link_func(
+	struct rt_env *rt,
+	struct rt_func *func,
+	struct rt_symbol_set *stored)
+{
+	struct rt_bindglobal *global;
+	struct rt_bindglobal **link_global;
+	const char *name;
+	int pc, size, line, index, i;
+	uint8_t *bc;
+	bool is_rewritten;
+
+	bc = func->bytecode;
+	line = 0;
+	is_rewritten = false;
+	for (pc = 0; pc < func->bytecode_size; pc += size) {
+		size = rt_get_insn_size(func, pc);
+		if (size < 0) {
+			rt_error(rt, _("Broken bytecode."));
+			return false;
+		}
+		if (bc[pc] == ROP_LINEINFO) {
+			line = (int)(((uint32_t)bc[pc + 1] << 24) | ((uint32_t)bc[pc + 2] << 16) |
+				     ((uint32_t)bc[pc + 3] << 8) | (uint32_t)bc[pc + 4]);
+			continue;
+		}
+		if (bc[pc] != ROP_LOADSYMBOL)
+			continue;
+
+		/* A local, or a global assigned anywhere, stays a lookup. */
+		name = (const char *)&bc[pc + 3];
+		if (strcmp(name, "this") == 0 || rt_is_symbol_stored(stored, name))
+			continue;
+
+		/* Report a callee that cannot be bound at runtime. (-O drops LINEINFO) */
+		if (!rt_find_global(rt, name, &global)) {
+			if (!rt_is_callee_load(func, pc, size))
+				continue;
+			rt_set_file_name(rt, func->file_name);
+			rt->line = line;
+			if (line == 0)
+				rt_error(rt, _("Symbol \"%s\" not found in %s(). (The line is unknown with -O.)"), name, func->name);
+			else
+				rt_error(rt, _("Symbol \"%s\" not found."), name);
+			return false;
+		}
+		if (global->val.type != RT_VALUE_FUNC)
+			continue;
+
+		/* Get an index of the global. */
+		for (index = 0; index < func->link_global_count; index++) {
+			if (func->link_global[index] == global)
+				break;
+		}
+		if (index == func->link_global_count) {
+			if (index > 0xffff)
+				continue;
+			link_global = realloc(func->link_global, sizeof(struct rt_bindglobal *) * (size_t)(index + 1));
+			if (link_global == NULL) {
+				rt_out_of_memory(rt);
+				return false;
+			}
+			func->link_global = link_global;
+			func->link_global[index] = global;
+			func->link_global_count++;
+		}
+
+		/* Code of the unlinked bytecode is rebuilt later. */
+		if (func->jit_code != NULL)
+			jit_free(rt, func);
+
+		/* Rewrite to LOADFUNC and pad the rest of the name with NOPs. */
+		bc[pc] = ROP_LOADFUNC;
+		bc[pc + 3] = (uint8_t)(index >> 8);
+		bc[pc + 4] = (uint8_t)index;
+		for (i = 5; i < size; i++)
+			bc[pc + i] = ROP_NOP;
+		is_rewritten = true;
+	}
+
+	/* Prepare the rebuilt code if the others are ready. */
+	if (is_rewritten && rt->jit_ready && func->jit_code == NULL) {
+		if (!rt_prepare_jit(rt, func))
+			return false;
 	}
 
-	global->name = strdup(name);
-	if (global->name == NULL) {
+	return true;
+}
+
+/* Collect the names of the STORESYMBOLs of all functions in one pass. */
+static bool
+rt_collect_stored_symbols(
+	struct rt_env *rt,
+	struct rt_symbol_set *set)
+{
+	struct rt_func *func;
+	int pc, size;
+
+	set->mask = RT_SYMBOL_SET_MIN - 1;
+	set->count = 0;
+	set->slot = calloc(RT_SYMBOL_SET_MIN, sizeof(const char *));
+	if (set->slot == NULL) {
 		rt_out_of_memory(rt);
 		return false;
 	}
-	global->val.type = RT_VALUE_FUNC;
-	global->val.val.func = func;
-	global->next = rt->global;
-	rt->global = global;
+
+	for (func = rt->func_list; func != NULL; func = func->next) {
+		if (func->cfunc != NULL)
+			continue;
+		for (pc = 0; pc < func->bytecode_size; pc += size) {
+			size = rt_get_insn_size(func, pc);
+			if (size < 0)
+				break;
+			if (func->bytecode[pc] != ROP_STORESYMBOL)
+				continue;
+			if (!rt_add_stored_symbol(rt, set, (const char *)&func->bytecode[pc + 1])) {
+				free(set->slot);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Add a name to a symbol set. (the set keeps at most half of the slots used) */
+static bool
+rt_add_stored_symbol(
+	struct rt_env *rt,
+	struct rt_symbol_set *set,
+	const char *name)
+{
+	const char **slot;
+	uint32_t mask, h, i;
+
+	/* Find the name or an empty slot. */
+	h = lir_hash_string(name) & set->mask;
+	while (set->slot[h] != NULL) {
+		if (strcmp(set->slot[h], name) == 0)
+			return true;
+		h = (h + 1) & set->mask;
+	}
+
+	/* Grow and rehash. */
+	if ((set->count + 1) * 2 > set->mask + 1) {
+		mask = set->mask * 2 + 1;
+		slot = calloc((size_t)mask + 1, sizeof(const char *));
+		if (slot == NULL) {
+			rt_out_of_memory(rt);
+			return false;
+		}
+		for (i = 0; i <= set->mask; i++) {
+			if (set->slot[i] == NULL)
+				continue;
+			h = lir_hash_string(set->slot[i]) & mask;
+			while (slot[h] != NULL)
+				h = (h + 1) & mask;
+			slot[h] = set->slot[i];
+		}
+		free(set->slot);
+		set->slot = slot;
+		set->mask = mask;
+
+		h = lir_hash_string(name) & mask;
+		while (slot[h] != NULL)
+			h = (h + 1) & mask;
+	}
+
+	set->slot[h] = name;
+	set->count++;
 
 	return true;
 }
 
+/* Check if any function stores a symbol. */
+static bool
+rt_is_symbol_stored(
+	struct rt_symbol_set *set,
+	const char *name)
+{
+	uint32_t h;
+
+	h = lir_hash_string(name) & set->mask;
+	while (set->slot[h] != NULL) {
+		if (strcmp(set->slot[h], name) == 0)
+			return true;
+		h = (h + 1) & set->mask;
+	}
+
+	return false;
+}
+
+/* Get the size of an instruction. (-1 if broken) */
+static int
+rt_get_insn_size(
+	struct rt_func *func,
+	int pc)
+{
+	const uint8_t *bc, *nul;
+	int remain, size, len;
+
+	bc = &func->bytecode[pc];
+	remain = func->bytecode_size - pc;
+
+	/* The string operand, if any. */
+	len = 0;
+	switch (bc[0]) {
+	case ROP_SCONST:
+	case ROP_LOADSYMBOL:
+	case ROP_CHKFUNC:
+	case ROP_STOREDOT:
+		size = 3;
+		break;
+	case ROP_LOADDOT:
+	case ROP_THISCALL:
+		size = 5;
+		break;
+	case ROP_STORESYMBOL:
+		size = 1;
+		break;
+	default:
+		size = 0;
+		break;
+	}
+	if (size > 0) {
+		if (size >= remain)
+			return -1;
+		nul = memchr(&bc[size], 0, (size_t)(remain - size));
+		if (nul == NULL)
+			return -1;
+		len = (int)(nul - &bc[size]);
+	}
+
+	switch (bc[0]) {
+	case ROP_NOP:
+		size = 1;
+		break;
+	case ROP_ACONST:
+	case ROP_DCONST:
+	case ROP_LACONST:
+	case ROP_LDCONST:
+	case ROP_INC:
+		size = 3;
+		break;
+	case ROP_ASSIGN:
+	case ROP_NEG:
+	case ROP_LEN:
+	case ROP_JMP:
+	case ROP_LINEINFO:
+	case ROP_LOADFUNC:
+		size = 5;
+		break;
+	case ROP_SCONST:
+	case ROP_LOADSYMBOL:
+	case ROP_CHKFUNC:
+		size = 3 + len + 1;
+		break;
+	case ROP_STOREDOT:
+		size = 3 + len + 1 + 2;
+		break;
+	case ROP_LOADDOT:
+		size = 5 + len + 1;
+		break;
+	case ROP_STORESYMBOL:
+		size = 1 + len + 1 + 2;
+		break;
+	case ROP_CALL:
+	case ROP_TAILCALL:
+		if (remain < 6)
+			return -1;
+		size = 6 + bc[5] * 2;
+		break;
+	case ROP_THISCALL:
+		if (remain < 5 + len + 2)
+			return -1;
+		size = 5 + len + 2 + bc[5 + len + 1] * 2;
+		break;
+	case ROP_SWITCH:
+		if (remain < 7)
+			return -1;
+		size = 3 + ((bc[5] << 8) | bc[6]);
+		break;
+	default:
+		/* The others have three tmpvars, or a tmpvar and an imm32. */
+		if (bc[0] > ROP_CHKFUNC)
+			return -1;
+		size = 7;
+		break;
+	}
+	if (size > remain)
+		return -1;
+
+	return size;
+}
+
 /*
  * Call a function with a name.
  */
@@ -641,6 +1102,12 @@ rt_call(
 	struct rt_bindlocal *local;
 	int i;
 
+	/* Prepare for JIT if rt_link() was not called. */
+	if (!rt->jit_ready) {
+		if (!rt_prepare_all_jit(rt))
+			return false;
+	}
+
 	/* Allocate a frame for this call. */
 	if (!rt_enter_frame(rt, func))
 		return false;
@@ -657,28 +1124,8 @@ rt_call(
 		rt->frame->tmpvar[i] = arg[i];
 
 	/* Run. */
-	if (func->cfunc != NULL) {
-		/* Call an intrinsic or an FFI function implemented in C. */
-		if (!func->cfunc(rt))
-			return false;
-	} else {
-		/* Set a file name. */
-		strncpy(rt->file_name, rt->frame->func->file_name, sizeof(rt->file_name) - 1);
-
-		if (func->jit_code != NULL) {
-			/* Call a JIT-generated code. */
-			if (!func->jit_code(rt)) {
-				//printf("Returned from JIT code (false).\n");
-				return false;
-			}
-			//printf("Returned from JIT code (true).\n");
-			//printf("%d: %d\n", rt->frame->tmpvar[0].type, rt->frame->tmpvar[0].val.i);
-		} else {
-			/* Call the bytecode interpreter. */
-			if (!rt_visit_bytecode(rt, func))
-				return false;
-		}
-	}
+	if (!rt_run_frame(rt, func))
+		return false;
 
 	/* Search a return value. */
 	if (!rt_get_return(rt, ret))
@@ -690,6 +1137,80 @@ rt_call(
 	return true;
 }
 
+/* Run a function on the current frame, and then the callees of its tail calls. */
+static bool
+rt_run_frame(
+	struct rt_env *rt,
+	struct rt_func *func)
+{
+	bool (*jit_code)(struct rt_env *);
+	int lpc;
+
+	while (func != NULL) {
+		rt->frame->tail_func = NULL;
+
+		if (func->cfunc != NULL) {
+			/* Call an intrinsic or an FFI function implemented in C. */
+			if (!func->cfunc(rt))
+				return false;
+		} else {
+			/* Set a file name. */
+			rt_set_file_name(rt, func->file_name);
+
+			/* Do JIT compilation if the function got hot. */
+			jit_code = __atomic_load_n(&func->jit_code, __ATOMIC_ACQUIRE);
+			if (linguine_conf_use_jit && jit_code == NULL) {
+				if (++func->call_count == linguine_conf_jit_threshold ||
+				    __atomic_load_n(&func->jit_state, __ATOMIC_ACQUIRE) == RT_JIT_RETRY) {
+					if (!jit_request(rt, func))
+						return false;
+				}
+
+				/* The code may be published here or by the compiler thread. */
+				jit_code = __atomic_load_n(&func->jit_code, __ATOMIC_ACQUIRE);
+			}
+
+			if (jit_code != NULL) {
+				/* Call a JIT-generated code. */
+				func->jit_last_use = ++rt->jit_clock;
+				if (!jit_code(rt)) {
+					//printf("Returned from JIT code (false).\n");
+					return false;
+				}
+				//printf("Returned from JIT code (true).\n");
+				//printf("%d: %d\n", rt->frame->tmpvar[0].type, rt->frame->tmpvar[0].val.i);
+
+				/* If a type guard failed, run the rest on the interpreter. */
+				if (rt->frame->deopt_addr != NULL) {
+					if (!jit_deoptimize(rt, func, &lpc))
+						return false;
+					if (!rt_resume_bytecode(rt, func, lpc))
+						return false;
+				}
+			} else {
+				/* Call the bytecode interpreter. */
+				if (!rt_visit_bytecode(rt, func))
+					return false;
+			}
+		}
+
+		/* Continue with the callee if the function ended with a tail call. */
+		func = rt->frame->tail_func;
+	}
+
+	return true;
+}
+
+/* Set the file name for errors. (The copy is skipped for the same file.) */
+static void
+rt_set_file_name(
+	struct rt_env *rt,
+	const char *file_name)
+{
+	if (strcmp(rt->file_name, file_name) != 0)
+		strncpy(rt->file_name, file_name, sizeof(rt->file_name) - 1);
+}
+
 /* Enter a new calling frame. */
 static bool
 rt_enter_frame(
@@ -725,6 +1246,24 @@ rt_leave_frame(
 	struct rt_env *rt)
 {
 	struct rt_frame *frame;
+
+	/* Release the objects made in the frame. */
+	rt_release_frame_objects(rt);
+
+	/* Unlink from the list. */
+	frame = rt->frame;
+	rt->frame = rt->frame->next;
+
+	/* Free. */
+	free(frame->tmpvar);
+	free(frame);
+}
+
+/* Release the objects made in the current frame. */
+static void
+rt_release_frame_objects(
+	struct rt_env *rt)
+{
 	struct rt_string *str, *next_str;
 	struct rt_array *arr, *next_arr;
 	struct rt_dict *dict, *next_dict;
@@ -743,6 +1282,13 @@ rt_leave_frame(
 	arr = rt->frame->shallow_arr_list;
 	while (arr != NULL) {
 		next_arr = arr->next;
+		if (arr->is_frame_owned) {
+			/* Never escaped. Free without the GC. */
+			rt_free_array(rt, arr);
+			rt->frame_free_count++;
+			arr = next_arr;
+			continue;
+		}
 		arr->next = rt->garbage_arr_list;
 		arr->prev = NULL;
 		if (rt->garbage_arr_list != NULL)
@@ -753,6 +1299,13 @@ rt_leave_frame(
 	dict = rt->frame->shallow_dict_list;
 	while (dict != NULL) {
 		next_dict = dict->next;
+		if (dict->is_frame_owned) {
+			/* Never escaped. Free without the GC. */
+			rt_free_dict(rt, dict);
+			rt->frame_free_count++;
+			dict = next_dict;
+			continue;
+		}
 		dict->next = rt->garbage_dict_list;
 		dict->prev = NULL;
 		if (rt->garbage_dict_list != NULL)
@@ -760,14 +1313,9 @@ rt_leave_frame(
 		rt->garbage_dict_list = dict;
 		dict = next_dict;
 	}
-
-	/* Unlink from the list. */
-	frame = rt->frame;
-	rt->frame = rt->frame->next;
-
-	/* Free. */
-	free(frame->tmpvar);
-	free(frame);
+	rt->frame->shallow_str_list = NULL;
+	rt->frame->shallow_arr_list = NULL;
+	rt->frame->shallow_dict_list = NULL;
 }
 
 /*
@@ -899,6 +1447,7 @@ rt_make_empty_array(struct rt_env *rt, struct rt_value *val)
 
 	/* Add to the shallow array list. */
 	if (rt->frame != NULL) {
+		rt->container_count++;
 		arr->next = rt->frame->shallow_arr_list;
 		if (rt->frame->shallow_arr_list != NULL)
 			rt->frame->shallow_arr_list->prev = arr;
@@ -955,6 +1504,7 @@ rt_make_empty_dict(struct rt_env *rt, struct rt_value *val)
 
 	/* Add to the shallow array list. */
 	if (rt->frame != NULL) {
+		rt->container_count++;
 		dict->next = rt->frame->shallow_dict_list;
 		if (rt->frame->shallow_dict_list != NULL)
 			rt->frame->shallow_dict_list->prev = dict;
@@ -973,6 +1523,38 @@ rt_make_empty_dict(struct rt_env *rt, struct rt_value *val)
 	return true;
 }
 
+/*
+ * Make an empty array value that is freed when the frame is left.
+ *  - The compiler proves that the array never escapes the frame.
+ */
+bool
+rt_make_frame_array(struct rt_env *rt, struct rt_value *val)
+{
+	if (!rt_make_empty_array(rt, val))
+		return false;
+
+	if (rt->frame != NULL)
+		val->val.arr->is_frame_owned = true;
+
+	return true;
+}
+
+/*
+ * Make an empty dictionary value that is freed when the frame is left.
+ *  - The compiler proves that the dictionary never escapes the frame.
+ */
+bool
+rt_make_frame_dict(struct rt_env *rt, struct rt_value *val)
+{
+	if (!rt_make_empty_dict(rt, val))
+		return false;
+
+	if (rt->frame != NULL)
+		val->val.dict->is_frame_owned = true;
+
+	return true;
+}
+
 /*
  * Clone a value.
  */
@@ -1133,7 +1715,7 @@ rt_set_array_elem(struct rt_env *rt, struct rt_value *array, int index, struct r
 	assert(array->type == RT_VALUE_ARRAY);
 
 	/* Expand the array if needed. */
-	if (!rt_expand_array(rt, array, index))
+	if (!rt_expand_array(rt, array, index + 1))
 		return false;
 	if (array->val.arr->size < index + 1)
 		array->val.arr->size = index + 1;
@@ -1299,6 +1881,26 @@ rt_get_dict_elem(struct rt_env *rt, struct rt_value *dict, const char *key, stru
 	return false;
 }
 
+/* Find a slot of a dictionary key, trying a hint first. (-1 if not found) */
+int
+rt_find_dict_slot(
+	struct rt_dict *dict,
+	const char *key,
+	int hint)
+{
+	int i;
+
+	if (hint >= 0 && hint < dict->size && strcmp(dict->key[hint], key) == 0)
+		return hint;
+
+	for (i = 0; i < dict->size; i++) {
+		if (strcmp(dict->key[i], key) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
 /* Set a dictionary element. */
 bool
 rt_set_dict_elem(struct rt_env *rt, struct rt_value *dict, const char *key, struct rt_value *val)
@@ -1894,6 +2496,21 @@ rt_make_deep_reference(
 	}
 }
 
+/*
+ * Keep a frame-owned container alive after the frame.
+ *  - A local name may resolve to a global at runtime. The container
+ *    then goes to the garbage list like the others.
+ */
+static void
+rt_clear_frame_owner(
+	struct rt_value *val)
+{
+	if (val->type == RT_VALUE_ARRAY)
+		val->val.arr->is_frame_owned = false;
+	else if (val->type == RT_VALUE_DICT)
+		val->val.dict->is_frame_owned = false;
+}
+
 /* Free a string. */
 static void
 rt_free_string(
@@ -1941,6 +2558,59 @@ rt_get_heap_usage(
 	return true;
 }
 
+/*
+ * Get the numbers of containers made in frames and freed with them.
+ */
+bool
+rt_get_container_stats(
+	struct rt_env *rt,
+	int *container_count,
+	int *frame_free_count)
+{
+	*container_count = rt->container_count;
+	*frame_free_count = rt->frame_free_count;
+	return true;
+}
+
+/*
+ * Get JIT code cache statistics.
+ */
+bool
+rt_get_jit_stats(
+	struct rt_env *rt,
+	struct rt_jit_stats *stats)
+{
+	jit_get_stats(rt, stats);
+	return true;
+}
+
+/*
+ * Enable perf map and GDB JIT interface output for code compiled after this.
+ */
+bool
+rt_set_jit_profile(
+	struct rt_env *rt,
+	bool enable)
+{
+	rt->jit_profile = enable;
+	return true;
+}
+
+/*
+ * Print the type profiles of the functions.
+ */
+void
+rt_dump_type_profile(
+	struct rt_env *rt)
+{
+	struct rt_func *func;
+
+	for (func = rt->func_list; func != NULL; func = func->next) {
+		if (func->profile != NULL)
+			jit_dump_profile(func);
+	}
+}
+
 /*
  * Execution Helpers
  */
@@ -2802,6 +3472,180 @@ rt_neq_helper(
 	return true;
 }
 
+/*
+ * LOADFUNC helper.
+ *  - index is of the globals that rt_link() bound to the running function.
+ *  - The global is read now, so a later rebinding is seen.
+ */
+bool
+rt_loadfunc_helper(
+	struct rt_env *rt,
+	int dst,
+	int index)
+{
+	struct rt_func *func;
+
+	func = rt->frame->func;
+	if (index < 0 || index >= func->link_global_count) {
+		rt_error(rt, _("Broken bytecode."));
+		return false;
+	}
+
+	rt->frame->tmpvar[dst] = func->link_global[index]->val;
+
+	return true;
+}
+
+/*
+ * SWITCH helper.
+ *  - The table starts at the src operand. (see lir.h)
+ *  - dst is set to the index of the matching case, or the case count.
+ */
+bool
+rt_switch_helper(
+	struct rt_env *rt,
+	int dst,
+	const uint8_t *table)
+{
+	struct rt_value *dst_val;
+	struct rt_value *src_val;
+	const char *s;
+	uint32_t h, mask, i;
+	int src, len, kind, count, index, min, range, ofs, pos, slot_size, str_ofs;
+
+#define U16(p)	((int)(((uint32_t)table[(p)] << 8) | (uint32_t)table[(p) + 1]))
+#define U32(p)	(((uint32_t)table[(p)] << 24) | ((uint32_t)table[(p) + 1] << 16) | \
+		 ((uint32_t)table[(p) + 2] << 8) | (uint32_t)table[(p) + 3])
+
+	/* Validate the header. */
+	src = U16(0);
+	len = U16(2);
+	kind = table[4];
+	count = U16(5);
+	if (src >= rt->frame->tmpvar_size || len < LIR_SWITCH_HEADER_SIZE + 2) {
+		rt_error(rt, _("Broken bytecode."));
+		return false;
+	}
+
+	dst_val = &rt->frame->tmpvar[dst];
+	src_val = &rt->frame->tmpvar[src];
+	ofs = LIR_SWITCH_HEADER_SIZE;
+
+	/* Check the subject type as EQ does. */
+	switch (src_val->type) {
+	case RT_VALUE_INT:
+	case RT_VALUE_FLOAT:
+		if (kind == LIR_SWITCH_STRING) {
+			rt_error(rt, _("Value is not a number."));
+			return false;
+		}
+		break;
+	case RT_VALUE_STRING:
+		if (kind != LIR_SWITCH_STRING) {
+			rt_error(rt, _("Value is not a string."));
+			return false;
+		}
+		break;
+	default:
+		rt_error(rt, _("Value is not a number or a string."));
+		return false;
+	}
+
+	index = count;
+	switch (kind) {
+	case LIR_SWITCH_DENSE:
+		if (ofs + 6 > len) {
+			rt_error(rt, _("Broken bytecode."));
+			return false;
+		}
+		min = (int)U32(ofs);
+		range = U16(ofs + 4);
+		ofs += 6;
+		if (ofs + range * 2 > len) {
+			rt_error(rt, _("Broken bytecode."));
+			return false;
+		}
+		if (src_val->type == RT_VALUE_INT) {
+			if (src_val->val.i >= min && (int64_t)src_val->val.i - min < range)
+				index = U16(ofs + (src_val->val.i - min) * 2);
+		} else {
+			/* A float matches the first case equal to it. */
+			for (pos = 0; pos < range; pos++) {
+				if ((float)((int64_t)min + pos) == src_val->val.f &&
+				    U16(ofs + pos * 2) != LIR_SWITCH_EMPTY) {
+					index = U16(ofs + pos * 2);
+					break;
+				}
+			}
+		}
+		break;
+	case LIR_SWITCH_INT:
+	case LIR_SWITCH_STRING:
+		mask = (uint32_t)U16(ofs);
+		ofs += 2;
+		slot_size = kind == LIR_SWITCH_INT ? 6 : 8;
+		if (ofs + (int)(mask + 1) * slot_size > len) {
+			rt_error(rt, _("Broken bytecode."));
+			return false;
+		}
+		if (kind == LIR_SWITCH_INT && src_val->type == RT_VALUE_FLOAT) {
+			/* A float matches the first case equal to it. */
+			for (i = 0; i <= mask; i++) {
+				pos = ofs + (int)i * slot_size;
+				if (U16(pos + 4) != LIR_SWITCH_EMPTY &&
+				    U16(pos + 4) < index &&
+				    (float)(int)U32(pos) == src_val->val.f)
+					index = U16(pos + 4);
+			}
+			break;
+		}
+		if (kind == LIR_SWITCH_INT)
+			h = lir_hash_int(src_val->val.i);
+		else
+			h = lir_hash_string(src_val->val.str->s);
+		for (i = 0; i <= mask; i++) {
+			pos = ofs + (int)((h + i) & mask) * slot_size;
+			if (U16(pos + 4) == LIR_SWITCH_EMPTY)
+				break;
+			if (kind == LIR_SWITCH_INT) {
+				if ((int)U32(pos) == src_val->val.i) {
+					index = U16(pos + 4);
+					break;
+				}
+				continue;
+			}
+			if (U32(pos) != h)
+				continue;
+			str_ofs = U16(pos + 6);
+			s = (const char *)&table[str_ofs];
+			if (str_ofs >= len || table[len - 1] != '\0') {
+				rt_error(rt, _("Broken bytecode."));
+				return false;
+			}
+			if (strcmp(s, src_val->val.str->s) == 0) {
+				index = U16(pos + 4);
+				break;
+			}
+		}
+		break;
+	default:
+		rt_error(rt, _("Broken bytecode."));
+		return false;
+	}
+
+#undef U16
+#undef U32
+
+	/* An empty slot falls to the last case. */
+	if (index > count)
+		index = count;
+
+	dst_val->type = RT_VALUE_INT;
+	dst_val->val.i = index;
+
+	return true;
+}
+
 /*
  * STOREARRAY helper.
  */
@@ -3057,6 +3901,43 @@ rt_loadsymbol_helper(
 	return true;
 }
 
+/*
+ * chkfunc helper.
+ *  - dst is 1 if symbol still resolves to the function of that name
+ *    defined in the file of the running function, 0 otherwise.
+ */
+bool
+rt_chkfunc_helper(
+	struct rt_env *rt,
+	int dst,
+	const char *symbol)
+{
+	struct rt_bindlocal *local;
+	struct rt_bindglobal *global;
+	struct rt_func *func;
+	const char *file_name;
+	bool is_same;
+
+	is_same = false;
+	if (!rt_find_local(rt, symbol, &local) &&
+	    rt_find_global(rt, symbol, &global) &&
+	    global->val.type == RT_VALUE_FUNC) {
+		func = global->val.val.func;
+		file_name = rt->frame->func->file_name;
+		if (func->cfunc == NULL &&
+		    strcmp(func->name, symbol) == 0 &&
+		    func->file_name != NULL &&
+		    file_name != NULL &&
+		    strcmp(func->file_name, file_name) == 0)
+			is_same = true;
+	}
+
+	rt->frame->tmpvar[dst].type = RT_VALUE_INT;
+	rt->frame->tmpvar[dst].val.i = is_same ? 1 : 0;
+
+	return true;
+}
+
 /*
  * storesymbol helper.
  */
@@ -3078,6 +3959,7 @@ rt_storesymbol_helper(
 		if (rt_find_global(rt, symbol, &global)) {
 			/* Found. */
 			global->val = rt->frame->tmpvar[src];
+			rt_clear_frame_owner(&global->val);
 			rt_make_deep_reference(rt, &global->val);
 		} else {
 			/* Not found. Bind a local variable. */
@@ -3113,6 +3995,28 @@ rt_loaddot_helper(
 	return true;
 }
 
+/*
+ * LOADDOT helper for a dictionary receiver with a profiled slot.
+ */
+bool
+rt_loaddot_slot_helper(
+	struct rt_env *rt,
+	int dst,
+	int dict,
+	const char *field,
+	int slot)
+{
+	slot = rt_find_dict_slot(rt->frame->tmpvar[dict].val.dict, field, slot);
+	if (slot < 0) {
+		rt_error(rt, _("Dictionary key \"%s\" not found."), field);
+		return false;
+	}
+
+	rt->frame->tmpvar[dst] = rt->frame->tmpvar[dict].val.dict->value[slot];
+
+	return true;
+}
+
 /*
  * STOREDOT helper.
  */
@@ -3160,18 +4064,142 @@ rt_call_helper(
 	for (i = 0; i < arg_count; i++)
 		arg_val[i] = rt->frame->tmpvar[arg[i]];
 
-	/* Make a callframe. */
+	/* Do call. (rt_call() makes a callframe) */
+	if (!rt_call(rt, callee, NULL, arg_count, &arg_val[0], &ret))
+		return false;
+
+	/* Store a return value. */
+	rt->frame->tmpvar[dst] = ret;
+
+	return true;
+}
+
+/*
+ * TAILCALL helper.
+ *  - Reuses the current frame for the callee, and makes the caller
+ *    return. rt_run_frame() then runs the callee in the frame.
+ */
+bool
+rt_tailcall_helper(
+	struct rt_env *rt,
+	int func,
+	int arg_count,
+	int *arg)
+{
+	struct rt_value arg_val[RT_ARG_MAX];
+	struct rt_func *callee;
+	struct rt_bindlocal *local, *next_local;
+	struct rt_frame *frame;
+	struct rt_value *tmpvar;
+	int i;
+
+	frame = rt->frame;
+
+	/* Get a function. */
+	if (frame->tmpvar[func].type != RT_VALUE_FUNC) {
+		rt_error(rt, _("Not a function."));
+		return false;
+	}
+	callee = frame->tmpvar[func].val.func;
+
+	/* Get values of arguments. */
+	for (i = 0; i < arg_count; i++)
+		arg_val[i] = frame->tmpvar[arg[i]];
+
+	/* Resize the tmpvars for the callee. */
+	if (frame->tmpvar_size != callee->tmpvar_size) {
+		tmpvar = realloc(frame->tmpvar, sizeof(struct rt_value) * (size_t)callee->tmpvar_size);
+		if (tmpvar == NULL) {
+			rt_out_of_memory(rt);
+			return false;
+		}
+		frame->tmpvar = tmpvar;
+		frame->tmpvar_size = callee->tmpvar_size;
+	}
+
+	/* Release the objects and the bindings of the caller. */
+	rt_release_frame_objects(rt);
+	local = frame->local;
+	while (local != NULL) {
+		next_local = local->next;
+		free(local->name);
+		free(local);
+		local = next_local;
+	}
+	frame->local = NULL;
+
+	/* Pass args. */
+	memset(frame->tmpvar, 0, sizeof(struct rt_value) * (size_t)frame->tmpvar_size);
+	for (i = 0; i < arg_count; i++)
+		frame->tmpvar[i] = arg_val[i];
+
+	frame->func = callee;
+	frame->deopt_addr = NULL;
+	frame->tail_func = callee;
+
+	return true;
+}
+
+/*
+ * Direct call helpers
+ *  - JIT code calls a compiled callee through its jit_code instead of
+ *    rt_call_helper(): rt_enter_call_helper(), (*callee->jit_code)(rt),
+ *    and then rt_leave_call_helper().
+ */
+
+/* Make a callframe of a compiled callee, and pass args from the caller. */
+bool
+rt_enter_call_helper(
+	struct rt_env *rt,
+	struct rt_func *callee,
+	int arg_count,
+	int *arg)
+{
+	struct rt_value *caller_tmpvar;
+	int i;
+
+	caller_tmpvar = rt->frame->tmpvar;
+
 	if (!rt_enter_frame(rt, callee))
 		return false;
 
-	/* Do call. */
-	if (!rt_call(rt, callee, NULL, arg_count, &arg_val[0], &ret))
+	for (i = 0; i < arg_count; i++)
+		rt->frame->tmpvar[i] = caller_tmpvar[arg[i]];
+
+	rt_set_file_name(rt, callee->file_name);
+	callee->jit_last_use = ++rt->jit_clock;
+
+	return true;
+}
+
+/* Finish a callee, and store its return value to the caller. */
+bool
+rt_leave_call_helper(
+	struct rt_env *rt,
+	int dst)
+{
+	struct rt_value ret;
+	int lpc;
+
+	/* If a type guard failed, run the rest on the interpreter. */
+	if (rt->frame->deopt_addr != NULL) {
+		if (!jit_deoptimize(rt, rt->frame->func, &lpc))
+			return false;
+		if (!rt_resume_bytecode(rt, rt->frame->func, lpc))
+			return false;
+	}
+
+	/* Run the callees of the tail calls in this frame. */
+	if (rt->frame->tail_func != NULL) {
+		if (!rt_run_frame(rt, rt->frame->tail_func))
+			return false;
+	}
+
+	if (!rt_get_return(rt, &ret))
 		return false;
 
-	/* Destroy a callframe. */
 	rt_leave_frame(rt);
 
-	/* Store a return value. */
 	rt->frame->tmpvar[dst] = ret;
 
 	return true;
@@ -3216,17 +4244,10 @@ rt_thiscall_helper(
 	for (i = 0; i < arg_count; i++)
 		arg_val[i] = rt->frame->tmpvar[arg[i]];
 
-	/* Make a callframe. */
-	if (!rt_enter_frame(rt, callee_value.val.func))
-		return false;
-
-	/* Do call. */
+	/* Do call. (rt_call() makes a callframe) */
 	if (!rt_call(rt, callee, obj_val, arg_count, &arg_val[0], &ret))
 		return false;
 
-	/* Destroy a callframe. */
-	rt_leave_frame(rt);
-
 	/* Store a return value. */
 	rt->frame->tmpvar[dst] = ret;
 
@@ -0,0 +1,101 @@
+#!/bin/sh
+
+#
+# Bounds check benchmark: for-value loops over 10M-element arrays, with
+# and without -O. The "build" shape only fills the array, so subtract
+# it from the others to see the loops. The arrays are resized first,
+# since a store past the end grows the table by one element.
+#
+
+set -eu
+
+N=10000000
+DIR=bench-bce.tmp
+
+rm -rf $DIR
+mkdir $DIR
+
+# Fill only.
+cat > $DIR/build.ls <<EOS
+func main() {
+    a = [];
+    resize(a, $N);
+    for (i in 0..$N) {
+        a[i] = i % 100;
+    }
+    print(a[$N - 1]);
+}
+EOS
+
+# Sum the integers three times.
+cat > $DIR/sum.ls <<EOS
+func main() {
+    a = [];
+    resize(a, $N);
+    for (i in 0..$N) {
+        a[i] = i % 100;
+    }
+    s = 0;
+    for (r in 0..3) {
+        for (v in a) {
+            s = s + v;
+        }
+    }
+    print(s);
+}
+EOS
+
+# Find the maximum of floats.
+cat > $DIR/max.ls <<EOS
+func main() {
+    a = [];
+    resize(a, $N);
+    for (i in 0..$N) {
+        a[i] = (i % 100) * 0.5;
+    }
+    m = 0.0;
+    for (v in a) {
+        if (v > m) {
+            m = v;
+        }
+    }
+    print(m);
+}
+EOS
+
+# Count the elements of two arrays in a nested loop.
+cat > $DIR/nested.ls <<EOS
+func main() {
+    a = [];
+    resize(a, $N);
+    for (i in 0..$N) {
+        a[i] = i;
+    }
+    b = [1, 2];
+    n = 0;
+    for (u in a) {
+        for (v in b) {
+            n = n + v;
+        }
+    }
+    print(n);
+}
+EOS
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    ../linguine "$@" > /dev/null
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms"
+}
+
+for shape in build sum max nested; do
+    echo "$shape:"
+    echo "  Interpreter:     $(run --disable-jit $DIR/$shape.ls)"
+    echo "  Interpreter -O:  $(run --disable-jit -O $DIR/$shape.ls)"
+    echo "  JIT:             $(run $DIR/$shape.ls)"
+    echo "  JIT -O:          $(run -O $DIR/$shape.ls)"
+done
+
+rm -rf $DIR
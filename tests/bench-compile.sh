@@ -0,0 +1,48 @@
+#!/bin/sh
+
+#
+# Compile latency benchmark: eager JIT on 5,000 small functions,
+# with and without the dual-mapped code cache.
+#
+
+set -eu
+
+FILES=50
+FUNCS=100
+DIR=bench-compile.tmp
+
+# Generate the script. (A file can have up to 128 functions.)
+rm -rf $DIR
+mkdir $DIR
+i=0
+while [ $i -lt $FILES ]; do
+    j=0
+    while [ $j -lt $FUNCS ]; do
+        cat >> $DIR/f$i.ls <<EOS
+func f${i}_${j}(a, b) {
+    return a + b * $j;
+}
+EOS
+        j=$((j + 1))
+    done
+    i=$((i + 1))
+done
+cat > $DIR/main.ls <<EOS
+func main() {
+    print(f0_0(1, 2) + f49_99(3, 4));
+}
+EOS
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    ../linguine "$@" $DIR/f*.ls $DIR/main.ls > /dev/null
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms, $(( (end - start) / 1000 / (FILES * FUNCS) )) us/function"
+}
+
+echo "Interpreter:           $(run --disable-jit)"
+echo "Eager JIT (dual map):  $(run --jit-threshold 0)"
+echo "Eager JIT (mprotect):  $(run --jit-threshold 0 --disable-jit-dual-map)"
+
+rm -rf $DIR
@@ -0,0 +1,102 @@
+#!/bin/sh
+
+#
+# Escape benchmark: functions that build scratch arrays and
+# dictionaries, with and without -O. Prints the containers made in
+# frames, the ones freed with their frames without the GC, and the
+# time.
+#
+
+set -eu
+
+N=200000
+DIR=bench-escape.tmp
+
+rm -rf $DIR
+mkdir $DIR
+
+# An array literal used for a lookup.
+cat > $DIR/lookup.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$N) {
+        s = s + digit(i % 4);
+    }
+    print(s);
+}
+func digit(n) {
+    table = [3, 1, 4, 1];
+    return table[n];
+}
+EOS
+
+# A dictionary used as a record.
+cat > $DIR/record.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$N) {
+        s = s + area(i % 100, i % 7);
+    }
+    print(s);
+}
+func area(w, h) {
+    rect = {width: w, height: h};
+    return rect.width * rect.height;
+}
+EOS
+
+# An array filled and summed in a loop.
+cat > $DIR/buffer.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$((N / 8))) {
+        s = s + window(i);
+    }
+    print(s);
+}
+func window(n) {
+    buf = [];
+    for (j in 0..8) {
+        buf[j] = n + j;
+    }
+    t = 0;
+    for (v in buf) {
+        t = t + v;
+    }
+    return t;
+}
+EOS
+
+# A pair returned to the caller. (escapes)
+cat > $DIR/pair.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$N) {
+        p = divmod(i, 7);
+        s = s + p[0] + p[1];
+    }
+    print(s);
+}
+func divmod(a, b) {
+    pair = [a / b, a % b];
+    return pair;
+}
+EOS
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    stats=$(../linguine --alloc-stats "$@" | tail -1)
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms, $stats"
+}
+
+for shape in lookup record buffer pair; do
+    echo "$shape:"
+    echo "  Interpreter:     $(run --disable-jit $DIR/$shape.ls)"
+    echo "  Interpreter -O:  $(run --disable-jit -O $DIR/$shape.ls)"
+    echo "  JIT:             $(run $DIR/$shape.ls)"
+    echo "  JIT -O:          $(run -O $DIR/$shape.ls)"
+done
+
+rm -rf $DIR
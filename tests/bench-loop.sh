@@ -0,0 +1,85 @@
+#!/bin/sh
+
+#
+# Loop benchmark: typical loop shapes with and without -O, on the
+# interpreter and on the JIT.
+#
+
+set -eu
+
+N=1000000
+DIR=bench-loop.tmp
+
+rm -rf $DIR
+mkdir $DIR
+
+# A field of a dictionary read in a loop.
+cat > $DIR/field.ls <<EOS
+func main() {
+    config = {scale: 3};
+    s = 0;
+    for (i in 0..$N) {
+        s = s + config.scale;
+    }
+    print(s);
+}
+EOS
+
+# An array read in a loop.
+cat > $DIR/array.ls <<EOS
+func main() {
+    arr = [1, 2, 3, 4];
+    s = 0;
+    for (i in 0..$N) {
+        s = s + arr[i % 4] * length(arr);
+    }
+    print(s);
+}
+EOS
+
+# A function called in a loop.
+cat > $DIR/call.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$N) {
+        s = s + f(i);
+    }
+    print(s);
+}
+func f(x) {
+    return x % 7;
+}
+EOS
+
+# Nested loops reading the outer state.
+cat > $DIR/nested.ls <<EOS
+func main() {
+    config = {scale: 3};
+    arr = [1, 2, 3, 4];
+    s = 0;
+    for (i in 0..$((N / 4))) {
+        for (j in 0..4) {
+            s = s + arr[j] * config.scale;
+        }
+    }
+    print(s);
+}
+EOS
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    ../linguine "$@" > /dev/null
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms"
+}
+
+for shape in field array call nested; do
+    echo "$shape:"
+    echo "  Interpreter:     $(run --disable-jit $DIR/$shape.ls)"
+    echo "  Interpreter -O:  $(run --disable-jit -O $DIR/$shape.ls)"
+    echo "  JIT:             $(run $DIR/$shape.ls)"
+    echo "  JIT -O:          $(run -O $DIR/$shape.ls)"
+done
+
+rm -rf $DIR
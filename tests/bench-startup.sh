@@ -0,0 +1,58 @@
+#!/bin/sh
+
+#
+# Startup benchmark: eager JIT vs. tiered JIT vs. the JIT disk cache
+# on a 5,000-function script.
+#
+
+set -eu
+
+FILES=50
+FUNCS=100
+DIR=bench-startup.tmp
+
+# Generate the script. (A file can have up to 128 functions.)
+rm -rf $DIR
+mkdir $DIR
+i=0
+while [ $i -lt $FILES ]; do
+    j=0
+    while [ $j -lt $FUNCS ]; do
+        cat >> $DIR/f$i.ls <<EOS
+func f${i}_${j}(a, b) {
+    s = 0;
+    for (k in 0..a) {
+        if (k % 2 == 0) {
+            s = s + k * b;
+        } else {
+            s = s - k;
+        }
+    }
+    return s;
+}
+EOS
+        j=$((j + 1))
+    done
+    i=$((i + 1))
+done
+cat > $DIR/main.ls <<EOS
+func main() {
+    print(f0_0(10, 2) + f49_99(10, 3));
+}
+EOS
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    ../linguine "$@" $DIR/f*.ls $DIR/main.ls > /dev/null
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms"
+}
+
+echo "Interpreter: $(run --disable-jit)"
+echo "Eager JIT:   $(run --jit-threshold 0)"
+echo "Tiered JIT:  $(run)"
+echo "Disk cache (cold): $(run --jit-threshold 0 --jit-disk-cache $DIR/cache)"
+echo "Disk cache (warm): $(run --jit-threshold 0 --jit-disk-cache $DIR/cache)"
+
+rm -rf $DIR
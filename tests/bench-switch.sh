@@ -0,0 +1,82 @@
+#!/bin/sh
+
+#
+# Switch benchmark: a handler with a 64-way if/elif chain on strings and
+# on integers, called 1M times, with and without -O.
+#
+
+set -eu
+
+N=1000000
+CASES=64
+DIR=bench-switch.tmp
+
+rm -rf $DIR
+mkdir $DIR
+
+# Write a handler whose chain compares the argument with the literals.
+handler() {
+    echo "func handle(ev) {"
+    i=0
+    while [ $i -lt $CASES ]; do
+        if [ $i -eq 0 ]; then
+            printf '    if (ev == %s) {\n' "$($1 $i)"
+        else
+            printf '    } else if (ev == %s) {\n' "$($1 $i)"
+        fi
+        echo "        return $i;"
+        i=$((i + 1))
+    done
+    echo "    } else {"
+    echo "        return 0;"
+    echo "    }"
+    echo "}"
+}
+str_case() { echo "\"event_$1\""; }
+int_case() { echo "$(($1 * 3))"; }
+
+# Strings.
+cat > $DIR/string.ls <<EOS
+func main() {
+    ev = [];
+    for (i in 0..$CASES) {
+        ev[i] = "event_" + i;
+    }
+    s = 0;
+    for (i in 0..$N) {
+        s = s + handle(ev[i % $CASES]);
+    }
+    print(s);
+}
+EOS
+handler str_case >> $DIR/string.ls
+
+# Integers.
+cat > $DIR/int.ls <<EOS
+func main() {
+    s = 0;
+    for (i in 0..$N) {
+        s = s + handle((i % $CASES) * 3);
+    }
+    print(s);
+}
+EOS
+handler int_case >> $DIR/int.ls
+
+# Run.
+run() {
+    start=$(date +%s%N)
+    ../linguine "$@" > /dev/null
+    end=$(date +%s%N)
+    echo "$(( (end - start) / 1000000 )) ms"
+}
+
+for shape in string int; do
+    echo "$shape:"
+    echo "  Interpreter:     $(run --disable-jit $DIR/$shape.ls)"
+    echo "  Interpreter -O:  $(run --disable-jit -O $DIR/$shape.ls)"
+    echo "  JIT:             $(run $DIR/$shape.ls)"
+    echo "  JIT -O:          $(run -O $DIR/$shape.ls)"
+done
+
+rm -rf $DIR
@@ -0,0 +1,133 @@
+/* -*- coding: utf-8; tab-width: 8; indent-tabs-mode: t; -*- */
+
+/*
+ * Linguine
+ * Copyright (c) 2025, Tamako Mori. All rights reserved.
+ */
+
+/*
+ * Test of rt_link() through the embedding API:
+ *  - A source registered after rt_link() rebinds a bound name.
+ *  - rt_set_global() after rt_link() rebinds a bound name.
+ */
+
+#include "linguine/runtime.h"
+
+#include <stdio.h>
+#include <string.h>
+
+extern bool linguine_conf_use_jit;
+extern int linguine_conf_jit_threshold;
+
+static const char *src_main =
+	"func main() {\n"
+	"    return f(5);\n"
+	"}\n"
+	"\n"
+	"func f(x) {\n"
+	"    return x + 1;\n"
+	"}\n"
+	"\n"
+	"func g(x) {\n"
+	"    return x * 100;\n"
+	"}\n";
+
+static const char *src_late =
+	"func f(x) {\n"
+	"    return x * 10;\n"
+	"}\n"
+	"\n"
+	"func h() {\n"
+	"    return f(1) + g(1);\n"
+	"}\n";
+
+/* Call a function and check the int it returns. */
+static bool
+check_call(
+	struct rt_env *rt,
+	const char *name,
+	int expected)
+{
+	struct rt_value ret;
+
+	if (!rt_call_with_name(rt, name, NULL, 0, NULL, &ret)) {
+		printf("%s:%d: error: %s\n",
+		       rt_get_error_file(rt),
+		       rt_get_error_line(rt),
+		       rt_get_error_message(rt));
+		return false;
+	}
+	if (ret.type != RT_VALUE_INT || ret.val.i != expected) {
+		printf("%s() returned %d, expected %d.\n", name, ret.val.i, expected);
+		return false;
+	}
+
+	return true;
+}
+
+/* Run the cases on a runtime. */
+static bool
+run_cases(void)
+{
+	struct rt_env *rt;
+	struct rt_value val;
+
+	if (!rt_create(&rt))
+		return false;
+
+	/* Bind f in main. */
+	if (!rt_register_source(rt, "main.ls", src_main))
+		return false;
+	if (!rt_link(rt))
+		return false;
+	if (!check_call(rt, "main", 6))
+		return false;
+
+	/* A source registered after the link rebinds f. */
+	if (!rt_register_source(rt, "late.ls", src_late))
+		return false;
+	if (!check_call(rt, "main", 50))
+		return false;
+
+	/* Link again for the new source. */
+	if (!rt_link(rt))
+		return false;
+	if (!check_call(rt, "h", 110))
+		return false;
+
+	/* rt_set_global() after the link rebinds f. */
+	if (!rt_get_global(rt, "g", &val))
+		return false;
+	if (!rt_set_global(rt, "f", &val))
+		return false;
+	if (!check_call(rt, "main", 500))
+		return false;
+	if (!check_call(rt, "h", 200))
+		return false;
+
+	rt_destroy(rt);
+
+	return true;
+}
+
+int
+main(
+	int argc,
+	char *argv[])
+{
+	(void)argc;
+	(void)argv;
+
+	/* Interpreter. */
+	linguine_conf_use_jit = false;
+	if (!run_cases())
+		return 1;
+
+	/* JIT. */
+	linguine_conf_use_jit = true;
+	linguine_conf_jit_threshold = 0;
+	if (!run_cases())
+		return 1;
+
+	return 0;
+}
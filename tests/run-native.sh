@@ -10,8 +10,249 @@ for tc in syntax/*.ls; do
 done
 
 echo "JIT...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine --jit-threshold 0 $tc > out;
+    diff $tc.out out;
+done
+
+echo "Tiered JIT...";
 for tc in syntax/*.ls; do
     echo "$tc";
     ../linguine $tc > out;
     diff $tc.out out;
 done
+
+echo "Small JIT cache...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine --jit-threshold 2 --jit-cache-size 4 $tc > out;
+    diff $tc.out out;
+done
+
+echo "Background JIT...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine --jit-async --jit-threshold 1 $tc > out;
+    diff $tc.out out;
+done
+
+echo "Background JIT with a small cache...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine --jit-async --jit-threshold 2 --jit-cache-size 4 $tc > out;
+    diff $tc.out out;
+done
+
+echo "Deoptimization stress...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine --jit-threshold 2 --jit-deopt-stress $tc > out;
+    diff $tc.out out;
+done
+
+echo "Optimizer...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine -O --jit-threshold 2 $tc > out;
+    diff $tc.out out;
+done
+
+echo "Optimizer on the interpreter...";
+for tc in syntax/*.ls; do
+    echo "$tc";
+    ../linguine -O --disable-jit $tc > out;
+    diff $tc.out out;
+done
+
+echo "Constant folding...";
+../linguine --dump-lir syntax/23-fold.ls > out;
+grep -q "MUL" out;
+../linguine -O --dump-lir syntax/23-fold.ls > out;
+grep -q "ICONST(dst:[0-9]*, val:86400)" out;
+grep -q "SCONST(dst:[0-9]*, val:prefix_name)" out;
+if grep -q "MUL\|DIV\|MOD" out; then
+    exit 1;
+fi
+
+echo "Inlining with a rebound callee...";
+printf 'func twice(x) {\n    return x * 2;\n}\n\nfunc main() {\n    print(twice(5));\n    rebind();\n    print(twice(5));\n}\n' > out-inline-a.ls;
+printf 'func thrice(x) {\n    return x * 3;\n}\n\nfunc rebind() {\n    twice = thrice;\n}\n' > out-inline-b.ls;
+../linguine -O --dump-lir out-inline-a.ls out-inline-b.ls > out;
+grep -q ": CHKFUNC(dst:[0-9]*, symbol:twice)" out;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    ../linguine -O $opt out-inline-a.ls out-inline-b.ls > out;
+    test "$(cat out)" = "$(printf '10\n15')";
+done
+rm -f out-inline-a.ls out-inline-b.ls;
+
+echo "Loop-invariant code motion...";
+../linguine -O --dump-lir syntax/25-licm.ls > out;
+grep -A1 "LOADDOT(dst:[0-9]*, obj:[0-9]*, field:scale)" out | head -2 | grep -q "EQI";
+printf 'func find(n) {\n    for (j in 0..10) {\n        for (i in 0..n) {\n            return 99;\n        }\n        if (j == 6) {\n            return j;\n        }\n    }\n    return 0;\n}\n\nfunc main() {\n    print(find(0));\n}\n' > out-licm-a.ls;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    ../linguine -O $opt out-licm-a.ls > out;
+    grep -q "^6$" out;
+done
+printf 'func pick(x) {\n    y = x + 1;\n    return y;\n}\n\nfunc main() {\n    for (i in 0..3) {\n        print(pick(i));\n        rebind();\n    }\n}\n' > out-licm-a.ls;
+printf 'func other(x) {\n    y = x * 2;\n    return y;\n}\n\nfunc rebind() {\n    pick = other;\n}\n' > out-licm-b.ls;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    ../linguine -O $opt out-licm-a.ls out-licm-b.ls > out;
+    test "$(cat out)" = "$(printf '1\n2\n4')";
+done
+rm -f out-licm-a.ls out-licm-b.ls;
+
+echo "Copy propagation...";
+../linguine -O --dump-lir syntax/24-copy-prop.ls | sed -n '/^func pick/,/^func mix/p' > out;
+grep -q "STORESYMBOL(symbol:r, src:0)" out;
+if grep -q "ASSIGN\|JMP(" out; then
+    exit 1;
+fi
+
+echo "Type inference...";
+../linguine --dump-lir syntax/26-types.ls > out;
+if grep -qE ": [IF](ADD|SUB|MUL|DIV|LT|LTE|GT|GTE|EQ|NEQ)\(" out; then
+    exit 1;
+fi
+../linguine -O --dump-lir syntax/26-types.ls > out;
+grep -q ": IMUL(" out;
+grep -q ": FADD(" out;
+grep -q ": FDIV(" out;
+grep -q ": ADD(" out;
+printf 'func main() {\n    foo = 5;\n    other();\n    x = foo + 1;\n    print(x);\n}\n' > out-types-a.ls;
+printf 'func foo() {\n    return 0;\n}\n\nfunc other() {\n    foo = "s";\n}\n' > out-types-b.ls;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    ../linguine -O $opt out-types-a.ls out-types-b.ls > out;
+    test "$(cat out)" = "s1";
+done
+rm -f out-types-a.ls out-types-b.ls;
+
+echo "Tmpvar coalescing...";
+../linguine --dump-frame-size syntax/27-coalesce.ls > out;
+grep -q "^frame depth: 17 -> 17 tmpvars" out;
+../linguine -O --dump-frame-size syntax/27-coalesce.ls > out;
+grep -q "^frame main: 18 -> 9 tmpvars" out;
+grep -q "^frame depth: 17 -> 10 tmpvars" out;
+grep -q "^frame twice: 5 -> 3 tmpvars" out;
+
+echo "Escape analysis...";
+../linguine --dump-lir syntax/28-escape.ls > out;
+if grep -q "L[AD]CONST" out; then
+    exit 1;
+fi
+../linguine -O --dump-lir syntax/28-escape.ls | sed -n '/^func scratch/,/^func make/p' > out;
+grep -q ": LACONST(" out;
+grep -q ": LDCONST(" out;
+../linguine -O --dump-lir syntax/28-escape.ls | sed -n '/^func make/,/^func alias/p' > out;
+grep -q ": ACONST(" out;
+../linguine -O --disable-jit --alloc-stats syntax/28-escape.ls > out;
+grep -q "^Containers: 207 made in frames, 201 freed with their frames" out;
+
+echo "Bounds check elimination...";
+../linguine --dump-lir syntax/29-bce.ls > out;
+if grep -q "ULOADARRAY\|UGETDICTVALBYINDEX" out; then
+    exit 1;
+fi
+../linguine -O --dump-lir syntax/29-bce.ls > out;
+test "$(grep -c ": ULOADARRAY(" out)" = "4";
+test "$(grep -c ": LOADARRAY(" out)" = "2";
+grep -q ": UGETDICTVALBYINDEX(" out;
+
+echo "Tail calls...";
+../linguine --dump-lir syntax/30-tailcall.ls > out;
+test "$(grep -c ": TAILCALL(" out)" = "5";
+printf 'func main() {\n    print(count(10000000, 0));\n}\nfunc count(n, acc) {\n    if (n == 0) {\n        return acc;\n    }\n    return count(n - 1, acc + 1);\n}\n' > out.ls;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    (ulimit -s 1024; ../linguine $opt out.ls > out);
+    grep -q "^10000000$" out;
+done
+rm -f out.ls;
+
+echo "Switch...";
+../linguine --dump-lir syntax/31-switch.ls > out;
+if grep -q ": SWITCH(" out; then
+    exit 1;
+fi
+../linguine -O --dump-lir syntax/31-switch.ls > out;
+test "$(grep -c ": SWITCH(" out)" = "4";
+grep -q "table:string, count:4" out;
+grep -q "table:int, count:5" out;
+grep -q "table:dense, count:11" out;
+for opt in "--disable-jit" "--jit-threshold 0"; do
+    ../linguine -O $opt syntax/31-switch.ls > out;
+    diff syntax/31-switch.ls.out out;
+done
+
+echo "Link...";
+printf 'func main() {\n    print("ran");\n}\n\nfunc unused() {\n    no_such_func();\n}\n' > out-link.ls;
+if ../linguine out-link.ls > out; then
+    exit 1;
+fi
+test "$(cat out)" = 'out-link.ls:6: error: Symbol "no_such_func" not found.';
+printf 'func main() {\n    print("ran");\n}\n\nfunc unused() {\n    no_such_func(twice(1), [1, 2]);\n}\n\nfunc twice(x) {\n    return x * 2;\n}\n' > out-link.ls;
+if ../linguine -O out-link.ls > out; then
+    exit 1;
+fi
+test "$(cat out)" = 'out-link.ls:0: error: Symbol "no_such_func" not found in unused(). (The line is unknown with -O.)';
+printf 'func main() {\n    print("ran");\n    if (0) {\n        print(no_such_var);\n    }\n}\n' > out-link.ls;
+for opt in "" "-O"; do
+    ../linguine $opt out-link.ls > out;
+    test "$(cat out)" = "ran";
+done
+for opt in "--disable-jit" "--jit-threshold 0" "--jit-async --jit-threshold 1"; do
+    ../linguine -O $opt syntax/32-link.ls > out;
+    diff syntax/32-link.ls.out out;
+done
+rm -f out-link.ls;
+${CC:-cc} -std=gnu11 -I../include -o out-embed-link embed-link.c \
+    $(ls ../obj/*.o | grep -v "/command.o\|/cback.o") -lm -pthread;
+./out-embed-link;
+rm -f out-embed-link;
+
+echo "Negation in JIT code...";
+printf 'func main() {\n    x = 3;\n    print(-x);\n    print(-3);\n    print(-(x + 4));\n}\n' > out-neg.ls;
+../linguine --disable-jit out-neg.ls > out-neg.out;
+for opt in "--jit-threshold 0" "-O --jit-threshold 0"; do
+    ../linguine $opt out-neg.ls > out;
+    diff out-neg.out out;
+done
+rm -f out-neg.ls out-neg.out;
+
+if [ "$(uname -m)" = "x86_64" ]; then
+    echo "JIT disk cache...";
+    rm -rf out-jit-cache;
+    for tc in syntax/*.ls; do
+        echo "$tc";
+        ../linguine --jit-threshold 0 --jit-disk-cache out-jit-cache $tc > out;
+        diff $tc.out out;
+        ../linguine --jit-threshold 0 --jit-disk-cache out-jit-cache $tc > out;
+        diff $tc.out out;
+    done
+    ../linguine --jit-threshold 0 --jit-disk-cache out-jit-cache --jit-stats syntax/02-call.ls > out;
+    grep -q "^JIT disk cache: 2 loaded, 0 stored$" out;
+
+    echo "JIT disk cache with broken files...";
+    for f in out-jit-cache/*.jit; do
+        printf 'XXXX' | dd of=$f bs=1 seek=80 conv=notrunc 2>/dev/null;
+    done
+    for tc in syntax/*.ls; do
+        echo "$tc";
+        ../linguine --jit-disk-cache out-jit-cache $tc > out;
+        diff $tc.out out;
+    done
+    for f in out-jit-cache/*.jit; do
+        head -c 40 $f > out;
+        mv out $f;
+    done
+    ../linguine --jit-threshold 0 --jit-disk-cache out-jit-cache --jit-stats syntax/02-call.ls > out;
+    grep -q "^JIT disk cache: 0 loaded, 2 stored$" out;
+    rm -rf out-jit-cache;
+fi
+
+echo "JIT profile...";
+../linguine --jit-profile --jit-threshold 0 syntax/02-call.ls > out &
+pid=$!;
+wait $pid;
+diff syntax/02-call.ls.out out;
+grep -q " main (syntax/02-call.ls)$" /tmp/perf-$pid.map;
+rm -f /tmp/perf-$pid.map;